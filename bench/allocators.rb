@@ -0,0 +1,30 @@
+# Object churn and per-enclave footprint for each allocator backend.
+#
+#   bundle exec rake compile && ruby -Ilib bench/allocators.rb
+
+require "benchmark"
+require "enclave"
+
+RUNS = Integer(ENV.fetch("RUNS", 10))
+ENCLAVES = Integer(ENV.fetch("ENCLAVES", 50))
+CHURN = <<~RUBY
+  200_000.times.map { |i| { id: i, name: "row \#{i}" } }.select { |h| h[:id].even? }.size
+RUBY
+
+def rss_kb
+  File.read("/proc/self/status")[/VmRSS:\s+(\d+)/, 1].to_i
+end
+
+%i[system slab].each do |allocator|
+  enclave = Enclave.new(allocator: allocator, timeout: nil)
+  churn = Array.new(RUNS) { Benchmark.realtime { enclave.eval(CHURN) } }.min
+  enclave.close
+
+  GC.start
+  before = rss_kb
+  enclaves = Array.new(ENCLAVES) { Enclave.new(allocator: allocator).tap { |e| e.eval("x = (1..1000).map(&:to_s)") } }
+  per_enclave = (rss_kb - before) / ENCLAVES.to_f
+  enclaves.each(&:close)
+
+  printf "%-8s churn %8.2f ms   RSS/enclave %8.1f KB\n", allocator, churn * 1000, per_enclave
+end
@@ -0,0 +1,30 @@
+# Cost of binding large nested params to a prepared script. The values are
+# converted into the enclave's arena, which is reset after each run.
+#
+#   bundle exec rake compile && ruby -Ilib bench/arena_params.rb
+#   THREADS=8 ruby -Ilib bench/arena_params.rb   # allocator contention
+
+require "benchmark"
+require "enclave"
+
+ROWS = Integer(ENV.fetch("ROWS", 10_000))
+RUNS = Integer(ENV.fetch("RUNS", 10))
+THREADS = Integer(ENV.fetch("THREADS", 1))
+
+rows = Array.new(ROWS) do |i|
+  { "id" => i, "name" => "customer #{i}", "total" => i * 1.5, "tags" => ["a", "b"] }
+end
+
+enclaves = Array.new(THREADS) { Enclave.new(timeout: nil) }
+script = enclaves.first.prepare("rows.length", params: [:rows])
+
+best = Array.new(RUNS) do
+  Benchmark.realtime do
+    enclaves.map { |e| Thread.new { e.run(script, rows: rows) } }.each(&:join)
+  end
+end.min
+
+puts "#{ROWS} rows x #{THREADS} thread(s), best of #{RUNS}"
+printf "  run              %8.2f ms\n", best * 1000
+printf "  peak RSS         %8d KB\n", File.read("/proc/self/status")[/VmHWM:\s+(\d+)/, 1].to_i if File.exist?("/proc/self/status")
+enclaves.each(&:close)
@@ -0,0 +1,33 @@
+# Repeated-snippet eval with and without the process-wide bytecode cache.
+#
+#   bundle exec rake compile && ruby -Ilib bench/bytecode_cache.rb
+
+require "benchmark"
+require "enclave"
+
+N = Integer(ENV.fetch("N", 20_000))
+
+SNIPPET = <<~RUBY
+  orders = [{ "total" => 10 }, { "total" => 20 }, { "total" => 30 }]
+  orders.select { |o| o["total"] > 15 }.sum { |o| o["total"] }
+RUBY
+
+def run(limit)
+  Enclave.bytecode_cache_limit = limit
+  Enclave.clear_bytecode_cache
+  enclave = Enclave.new(timeout: nil)
+  time = Benchmark.realtime { N.times { enclave.eval(SNIPPET) } }
+  [time, Enclave.bytecode_cache_stats]
+ensure
+  enclave&.close
+end
+
+original = Enclave.bytecode_cache_limit
+uncached, = run(0)
+cached, stats = run(original)
+Enclave.bytecode_cache_limit = original
+
+printf "%d evals\n", N
+printf "  no cache  %8.1f ms  (%.1f us/eval)\n", uncached * 1000, uncached / N * 1e6
+printf "  cache     %8.1f ms  (%.1f us/eval)  hits=%d misses=%d\n",
+       cached * 1000, cached / N * 1e6, stats[:hits], stats[:misses]
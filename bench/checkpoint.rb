@@ -0,0 +1,38 @@
+# Recovering from a failed snippet: rollback to a checkpoint vs reset! and
+# replaying the session's history.
+#
+#   bundle exec rake compile && ruby -Ilib bench/checkpoint.rb
+
+require "benchmark"
+require "enclave"
+
+RUNS = Integer(ENV.fetch("RUNS", 50))
+HISTORY = Array.new(Integer(ENV.fetch("EVALS", 20))) do |i|
+  "rows_#{i} = (1..500).map { |n| { id: n, total: n * #{i} } }; nil"
+end
+FAILING = "rows_0.clear; raise 'halfway'"
+
+enclave = Enclave.new(allocator: :slab, timeout: nil)
+HISTORY.each { |code| enclave.eval(code) }
+
+checkpoint = enclave.checkpoint
+take = Array.new(RUNS) { Benchmark.realtime { enclave.discard(enclave.checkpoint) } }.min
+rollback = Array.new(RUNS) do
+  enclave.eval(FAILING)
+  Benchmark.realtime { enclave.rollback(checkpoint) }
+end.min
+enclave.discard(checkpoint)
+
+replay = Array.new([RUNS / 10, 1].max) do
+  enclave.eval(FAILING)
+  Benchmark.realtime do
+    enclave.reset!
+    HISTORY.each { |code| enclave.eval(code) }
+  end
+end.min
+enclave.close
+
+puts "#{HISTORY.size} evals of history, best of #{RUNS}"
+printf "  checkpoint        %10.1f us\n", take * 1e6
+printf "  rollback          %10.1f us\n", rollback * 1e6
+printf "  reset! + replay   %10.1f us\n", replay * 1e6
@@ -0,0 +1,34 @@
+# Cost of exposing a fresh instance of a large tool class, as done once
+# per request. The first expose builds the class's Enclave::Toolset;
+# later ones only bind the receiver.
+#
+#   bundle exec rake compile && ruby -Ilib bench/expose.rb
+
+require "benchmark"
+require "enclave"
+
+METHODS = Integer(ENV.fetch("METHODS", 120))
+ROUNDS = Integer(ENV.fetch("ROUNDS", 1_000))
+
+class WideTools
+  METHODS.times do |i|
+    define_method(:"tool_#{i}") { |arg = nil| i }
+  end
+end
+
+enclave = Enclave.new(timeout: nil)
+first = Benchmark.realtime { enclave.expose(WideTools.new) }
+rebind = Benchmark.realtime { ROUNDS.times { enclave.expose(WideTools.new) } }
+enclave.close
+
+fresh = Benchmark.realtime do
+  ROUNDS.times { Enclave.new(tools: WideTools.new, timeout: nil).close }
+end
+bare = Benchmark.realtime do
+  ROUNDS.times { Enclave.new(timeout: nil).close }
+end
+
+puts "#{METHODS} tool methods, #{ROUNDS} rounds"
+printf "  %-24s %8.1f us\n", "first expose", first * 1e6
+printf "  %-24s %8.1f us\n", "expose another instance", rebind * 1e6 / ROUNDS
+printf "  %-24s %8.1f us\n", "tools on a new enclave", (fresh - bare) * 1e6 / ROUNDS
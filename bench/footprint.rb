@@ -0,0 +1,35 @@
+# Bytes per idle enclave for each build profile: process memory grown per
+# live enclave, right after boot and after each has run a small snippet
+# and gone quiet. Linux only (reads /proc/self/statm).
+#
+#   bundle exec rake compile && ruby -Ilib bench/footprint.rb
+
+require "enclave"
+
+LIVE = Integer(ENV.fetch("LIVE", 1000))
+PAGE = 4096
+WARM = 'orders = (1..20).map { |i| { id: i, total: i * 10 } }; orders.sum { |o| o[:total] }'
+
+def rss
+  File.read("/proc/self/statm").split[1].to_i * PAGE
+end
+
+def per_enclave(**options)
+  GC.start
+  before = rss
+  live = Array.new(LIVE) { Enclave.new(**options) }
+  booted = (rss - before) / LIVE
+  live.each { |e| e.eval(WARM) }
+  idle = (rss - before) / LIVE
+  live.each(&:close)
+  [booted, idle]
+end
+
+puts "profiles: #{Enclave.profiles.join(", ")}   #{LIVE} enclaves each"
+Enclave.profiles.each do |profile|
+  %i[system slab].each do |allocator|
+    booted, idle = per_enclave(profile: profile, allocator: allocator)
+    printf "%-9s %-7s %9d bytes booted   %9d bytes idle after a snippet\n",
+           profile, allocator, booted, idle
+  end
+end
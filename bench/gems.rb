@@ -0,0 +1,45 @@
+# What lazy gem loading saves: time to build an enclave and memory per live
+# enclave with gems: :lazy versus :eager, plus the one-off cost of the first
+# reference to a lazy gem. Linux only for the memory part (reads
+# /proc/self/statm).
+#
+#   bundle exec rake compile && ruby -Ilib bench/gems.rb
+
+require "benchmark"
+require "enclave"
+
+RUNS = Integer(ENV.fetch("RUNS", 500))
+LIVE = Integer(ENV.fetch("LIVE", 200))
+PAGE = 4096
+
+def rss
+  File.read("/proc/self/statm").split[1].to_i * PAGE
+end
+
+puts "optional gems: #{Enclave.optional_gems.join(", ")}"
+
+[:lazy, :eager, []].each do |gems|
+  build = Array.new(RUNS) do
+    e = nil
+    t = Benchmark.realtime { e = Enclave.new(gems: gems) }
+    e.close
+    t
+  end.min
+
+  GC.start
+  before = rss
+  live = Array.new(LIVE) { Enclave.new(gems: gems) }
+  per_enclave = (rss - before) / LIVE
+  live.each(&:close)
+
+  printf "%-8s new %8.1f us   %8.1f KB per live enclave\n",
+         gems.inspect, build * 1e6, per_enclave / 1024.0
+end
+
+first = Array.new(RUNS) do
+  e = Enclave.new(gems: :lazy)
+  t = Benchmark.realtime { e.eval("Math.sqrt(2)") }
+  e.close
+  t
+end.min
+printf "first Math reference under :lazy %8.1f us\n", first * 1e6
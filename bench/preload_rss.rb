@@ -0,0 +1,65 @@
+# Memory of 16 forked workers that each hold one enclave, with and without
+# a prototype preloaded in the master. Pss splits shared pages between the
+# processes mapping them, so it drops when workers share the prototype.
+# Linux only (reads /proc/self/smaps_rollup).
+#
+#   bundle exec rake compile && ruby -Ilib bench/preload_rss.rb
+
+require "enclave"
+
+WORKERS = Integer(ENV.fetch("WORKERS", 16))
+PRELUDE = <<~RUBY
+  def summarize(rows)
+    rows.sum { |r| r["total"] }
+  end
+
+  TAXES = {}
+  2_000.times { |i| TAXES["region-\#{i}"] = i / 100.0 }
+RUBY
+
+module BenchTools
+  def orders
+    [{ "total" => 10 }, { "total" => 32 }]
+  end
+end
+
+def smaps
+  File.read("/proc/self/smaps_rollup").scan(/^(Pss|Private_Dirty):\s+(\d+)/).to_h { |k, v| [k, v.to_i] }
+end
+
+def run(preload)
+  reader, writer = IO.pipe
+  master = fork do
+    reader.close
+    Enclave.preload!(tools_class: BenchTools, prelude: PRELUDE) if preload
+    workers = Array.new(WORKERS) do
+      r, w = IO.pipe
+      pid = fork do
+        r.close
+        enclave = Enclave.new(tools: BenchTools)
+        enclave.eval(PRELUDE) unless preload
+        enclave.eval("summarize(orders)")
+        w.write(Marshal.dump(smaps))
+        w.close
+        sleep 1 # stay alive until every sibling has measured
+        exit!(0)
+      end
+      w.close
+      [pid, r]
+    end
+    samples = workers.map { |pid, r| Marshal.load(r.read).tap { Process.wait(pid) } }
+    writer.write(Marshal.dump(samples))
+    exit!(0)
+  end
+  writer.close
+  samples = Marshal.load(reader.read)
+  Process.wait(master)
+  samples
+end
+
+{ "cold" => false, "preload!" => true }.each do |name, preload|
+  samples = run(preload)
+  pss = samples.sum { |s| s["Pss"] } / samples.size
+  dirty = samples.sum { |s| s["Private_Dirty"] } / samples.size
+  printf "%-9s %2d workers   Pss/worker %7d KB   Private_Dirty/worker %7d KB\n", name, WORKERS, pss, dirty
+end
@@ -0,0 +1,54 @@
+# Wiping an enclave between tenants: #scrub! strips what the snippets
+# added from the live VM, #reset! closes and reopens it.
+#
+#   bundle exec rake compile && ruby -Ilib bench/scrub.rb
+
+require "benchmark"
+require "enclave"
+
+RUNS = Integer(ENV.fetch("RUNS", 200))
+TENANTS = {
+  "small" => <<~RUBY,
+    class Ticket
+      attr_reader :id
+      def initialize(id); @id = id; end
+      def label; "T-\#{id}"; end
+    end
+    tickets = (1..20).map { |i| Ticket.new(i) }
+    $last = tickets.last
+    tickets.map(&:label).join(",")
+  RUBY
+  "large" => <<~RUBY
+    module Reports
+      LIMIT = 100
+      class Row; attr_accessor :name, :total; end
+      def self.build(n); Array.new(n) { |i| r = Row.new; r.name = "row \#{i}"; r.total = i; r }; end
+    end
+    rows = Reports.build(20_000)
+    summary = rows.group_by { |r| r.total % 10 }.transform_values(&:size)
+    nil
+  RUBY
+}
+
+%i[system slab].each do |allocator|
+  TENANTS.each do |size, code|
+    enclave = Enclave.new(allocator: allocator, timeout: nil)
+    reset = Array.new(RUNS) do
+      enclave.eval(code)
+      Benchmark.realtime { enclave.reset! }
+    end.min
+
+    in_place = 0
+    scrub = Array.new(RUNS) do
+      enclave.eval(code)
+      scrubbed = nil
+      t = Benchmark.realtime { scrubbed = enclave.scrub! }
+      in_place += 1 if scrubbed
+      t
+    end.min
+    enclave.close
+
+    printf "%-8s %-6s reset! %8.1f us   scrub! %8.1f us   (%d/%d in place)\n",
+           allocator, size, reset * 1e6, scrub * 1e6, in_place, RUNS
+  end
+end
@@ -0,0 +1,48 @@
+# Restoring a session in a new enclave: load_session of a dumped blob vs
+# replaying the session's history.
+#
+#   bundle exec rake compile && ruby -Ilib bench/session.rb
+
+require "benchmark"
+require "enclave"
+
+RUNS = Integer(ENV.fetch("RUNS", 50))
+HISTORY = [<<~RUBY] + Array.new(Integer(ENV.fetch("EVALS", 20))) do |i|
+  class Order
+    attr_reader :id, :total
+    def initialize(id, total); @id = id; @total = total; end
+    def discounted(rate); total * (1 - rate); end
+  end
+RUBY
+  "orders_#{i} = (1..200).map { |n| Order.new(n, n * #{i}) }; nil"
+end
+
+enclave = Enclave.new(timeout: nil)
+HISTORY.each { |code| enclave.eval(code) }
+blob = enclave.dump_session
+enclave.close
+
+dump = Array.new(RUNS) do
+  e = Enclave.load_session(blob, timeout: nil)
+  t = Benchmark.realtime { e.dump_session }
+  e.close
+  t
+end.min
+load = Array.new(RUNS) do
+  e = nil
+  t = Benchmark.realtime { e = Enclave.load_session(blob, timeout: nil) }
+  e.close
+  t
+end.min
+replay = Array.new(RUNS) do
+  Benchmark.realtime do
+    e = Enclave.new(timeout: nil)
+    HISTORY.each { |code| e.eval(code) }
+    e.close
+  end
+end.min
+
+puts "#{HISTORY.size} evals of history, blob #{blob.bytesize} bytes, best of #{RUNS}"
+printf "  dump_session      %10.1f us\n", dump * 1e6
+printf "  load_session      %10.1f us\n", load * 1e6
+printf "  new + replay      %10.1f us\n", replay * 1e6
@@ -0,0 +1,24 @@
+# Churn: build enclaves, fill their heaps and drop them without #close,
+# as a leaky caller would. Only CRuby's GC frees them, so process memory
+# only levels off if the GC is told how big each mruby heap is. Prints RSS
+# every ROUND enclaves; the numbers should stop climbing after the first
+# few rounds. Linux only (reads /proc/self/statm).
+#
+#   bundle exec rake compile && ruby -Ilib bench/soak.rb
+
+require "enclave"
+
+ROUNDS = Integer(ENV.fetch("ROUNDS", 20))
+ROUND = Integer(ENV.fetch("ROUND", 500))
+PAGE = 4096
+FILL = 'rows = Array.new(20_000) { |i| "row #{i}" * 4 }; rows.size'
+
+def rss_mb
+  File.read("/proc/self/statm").split[1].to_i * PAGE / 1024.0 / 1024.0
+end
+
+printf "%6s %10s %10s\n", "round", "RSS MB", "GC runs"
+ROUNDS.times do |round|
+  ROUND.times { Enclave.new.eval(FILL) }
+  printf "%6d %10.1f %10d\n", round + 1, rss_mb, GC.count
+end
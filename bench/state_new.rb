@@ -0,0 +1,40 @@
+# What a new enclave costs: time to build one (and close it), and process
+# memory per live enclave. Linux only for the memory part (reads
+# /proc/self/statm).
+#
+#   bundle exec rake compile && ruby -Ilib bench/state_new.rb
+
+require "benchmark"
+require "enclave"
+
+RUNS = Integer(ENV.fetch("RUNS", 500))
+LIVE = Integer(ENV.fetch("LIVE", 200))
+PAGE = 4096
+
+module BenchTools
+  def lookup(id) = { "id" => id }
+end
+
+def rss
+  File.read("/proc/self/statm").split[1].to_i * PAGE
+end
+
+%i[system slab].each do |allocator|
+  [nil, BenchTools].each do |tools|
+    build = Array.new(RUNS) do
+      e = nil
+      t = Benchmark.realtime { e = Enclave.new(allocator: allocator, tools: tools) }
+      e.close
+      t
+    end.min
+
+    GC.start
+    before = rss
+    live = Array.new(LIVE) { Enclave.new(allocator: allocator, tools: tools) }
+    per_enclave = (rss - before) / LIVE
+    live.each(&:close)
+
+    printf "%-8s %-10s new %8.1f us   %8.1f KB per live enclave\n",
+           allocator, tools ? "tools" : "no tools", build * 1e6, per_enclave / 1024.0
+  end
+end
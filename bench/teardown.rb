@@ -0,0 +1,29 @@
+# Cost of Enclave#close and #reset! after a snippet leaves many live
+# objects behind. :slab drops its regions wholesale; :system has mruby
+# free every object.
+#
+#   bundle exec rake compile && ruby -Ilib bench/teardown.rb
+
+require "benchmark"
+require "enclave"
+
+RUNS = Integer(ENV.fetch("RUNS", 20))
+OBJECTS = Integer(ENV.fetch("OBJECTS", 200_000))
+FILL = "data = Array.new(#{OBJECTS}) { |i| { id: i, name: \"row \#{i}\" } }; nil"
+
+%i[system slab].each do |allocator|
+  close = Array.new(RUNS) do
+    enclave = Enclave.new(allocator: allocator, timeout: nil)
+    enclave.eval(FILL)
+    Benchmark.realtime { enclave.close }
+  end.min
+
+  enclave = Enclave.new(allocator: allocator, timeout: nil)
+  reset = Array.new(RUNS) do
+    enclave.eval(FILL)
+    Benchmark.realtime { enclave.reset! }
+  end.min
+  enclave.close
+
+  printf "%-8s close %8.2f ms   reset! %8.2f ms\n", allocator, close * 1000, reset * 1000
+end
@@ -0,0 +1,42 @@
+# Measures what limit enforcement costs per VM instruction.
+#
+#   bundle exec rake compile && ruby -Ilib bench/timeout_overhead.rb
+#
+# Runs the same CPU-bound loops with and without timeout:, so the
+# difference is the code fetch hook plus the deadline service.
+
+require "benchmark"
+require "enclave"
+
+ITERATIONS = Integer(ENV.fetch("ITERATIONS", 2_000_000))
+RUNS = Integer(ENV.fetch("RUNS", 5))
+
+WORKLOADS = {
+  "while loop" => "i = 0; while i < #{ITERATIONS}; i += 1; end; i",
+  "block loop" => "s = 0; #{ITERATIONS}.times { |i| s += i }; s",
+  "range sum" => "(1..#{ITERATIONS * 5}).sum",
+  "method calls" => "def f(x) = x + 1; i = 0; i = f(i) while i < #{ITERATIONS}; i",
+  "short eval" => "[1, 2, 3].map { |x| x * 2 }.sum"
+}
+
+def best_of(runs)
+  Array.new(runs) { Benchmark.realtime { yield } }.min
+end
+
+puts "iterations: #{ITERATIONS}, best of #{RUNS}"
+puts
+
+WORKLOADS.each do |name, code|
+  plain = Enclave.new(timeout: nil)
+  timed = Enclave.new(timeout: 60)
+  n = name == "short eval" ? 10_000 : 1
+
+  base = best_of(RUNS) { n.times { plain.eval(code) } }
+  limited = best_of(RUNS) { n.times { timed.eval(code) } }
+
+  printf "%-12s  no timeout %8.2f ms   timeout %8.2f ms   overhead %+6.1f%%\n",
+         name, base * 1000, limited * 1000, (limited / base - 1) * 100
+ensure
+  plain&.close
+  timed&.close
+end
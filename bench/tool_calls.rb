@@ -0,0 +1,47 @@
+# Per-call overhead of a trivial tool called in a tight loop: module and
+# instance tools, with and without a signature, against a plain mruby
+# method as the baseline.
+#
+#   bundle exec rake compile && ruby -Ilib bench/tool_calls.rb
+
+require "benchmark"
+require "enclave"
+
+CALLS = Integer(ENV.fetch("CALLS", 100_000))
+RUNS = Integer(ENV.fetch("RUNS", 5))
+
+module LoopTools
+  def inc(n)
+    n + 1
+  end
+end
+
+class LoopToolsInstance
+  def inc(n)
+    n + 1
+  end
+end
+
+def best(enclave, code)
+  Array.new(RUNS) { Benchmark.realtime { enclave.eval(code) } }.min
+end
+
+loop_code = "i = 0; n = 0; while i < #{CALLS}; n = inc(n); i += 1; end; n"
+
+baseline = Enclave.new(timeout: nil)
+baseline.eval("def inc(n); n + 1; end")
+base = best(baseline, loop_code)
+baseline.close
+
+puts "#{CALLS} calls, best of #{RUNS}"
+printf "  %-16s %8.0f ns/call\n", "mruby method", base * 1e9 / CALLS
+{
+  "module tool" => [LoopTools, {}],
+  "instance tool" => [LoopToolsInstance.new, {}],
+  "with signature" => [LoopToolsInstance.new, { inc: [:integer] }]
+}.each do |name, (tools, signatures)|
+  enclave = Enclave.new(timeout: nil).expose(tools, signatures: signatures)
+  t = best(enclave, loop_code)
+  printf "  %-16s %8.0f ns/call (%.0f over baseline)\n", name, t * 1e9 / CALLS, (t - base) * 1e9 / CALLS
+  enclave.close
+end
@@ -0,0 +1,36 @@
+# Tool-call conversion cost for large nested payloads, in both directions.
+#
+#   bundle exec rake compile && ruby -Ilib bench/tool_marshaling.rb
+
+require "benchmark"
+require "enclave"
+
+ROWS = Integer(ENV.fetch("ROWS", 10_000))
+RUNS = Integer(ENV.fetch("RUNS", 10))
+
+module PayloadTools
+  def rows
+    @rows ||= Array.new(ROWS) do |i|
+      { "id" => i, "name" => "customer #{i}", "total" => i * 1.5, "tags" => ["a", "b"] }
+    end
+  end
+
+  def accept(rows)
+    rows.length
+  end
+end
+
+enclave = Enclave.new(tools: PayloadTools, timeout: nil)
+enclave.eval("rows") # warm the memoized payload
+
+results = {
+  "host -> sandbox" => "rows; nil",
+  "sandbox -> host" => "data ||= rows; accept(data)"
+}.to_h do |name, code|
+  [name, Array.new(RUNS) { Benchmark.realtime { enclave.eval(code) } }.min]
+end
+
+puts "#{ROWS} rows, best of #{RUNS}"
+results.each { |name, t| printf "  %-16s %8.2f ms\n", name, t * 1000 }
+printf "  peak RSS         %8d KB\n", File.read("/proc/self/status")[/VmHWM:\s+(\d+)/, 1].to_i if File.exist?("/proc/self/status")
+enclave.close
@@ -6,12 +6,15 @@
  */
 
 #include <ruby.h>
+#include <ruby/thread.h>
 #include "sandbox_core.h"
 
 /* Error class statics */
 static VALUE cEnclaveError;
 static VALUE cEnclaveTimeoutError;
 static VALUE cEnclaveMemoryLimitError;
+static VALUE cEnclaveScript;
+static VALUE cEnclave;
 
 /* ------------------------------------------------------------------ */
 /* sandbox_value_t <-> CRuby VALUE conversion                          */
@@ -54,9 +57,19 @@ sandbox_value_to_rb(const sandbox_value_t *val)
     return Qnil;
 }
 
-/* Convert CRuby VALUE -> sandbox_value_t. Returns 0 on success, -1 on bad type. */
+static void *
+arena_alloc(const sandbox_profile_t *profile, sandbox_arena_t *arena, size_t size)
+{
+    void *p = profile->arena_alloc(arena, size);
+    if (!p) rb_memerror();
+    return p;
+}
+
+/* Convert CRuby VALUE -> sandbox_value_t, allocating from arena (released
+ * by the profile's arena_reset). Returns 0 on success, -1 on bad type. */
 static int
-rb_to_sandbox_value(VALUE v, sandbox_value_t *out, char *errbuf, size_t errbuf_size)
+rb_to_sandbox_value(const sandbox_profile_t *profile, VALUE v, sandbox_value_t *out,
+                    sandbox_arena_t *arena, char *errbuf, size_t errbuf_size)
 {
     memset(out, 0, sizeof(*out));
 
@@ -82,37 +95,26 @@ rb_to_sandbox_value(VALUE v, sandbox_value_t *out, char *errbuf, size_t errbuf_s
         out->as.f = NUM2DBL(v);
         return 0;
     }
+    if (RB_TYPE_P(v, T_SYMBOL)) {
+        /* Symbol -> String */
+        v = rb_sym2str(v);
+    }
     if (RB_TYPE_P(v, T_STRING)) {
         out->type = SANDBOX_VALUE_STRING;
         out->as.str.len = (size_t)RSTRING_LEN(v);
-        out->as.str.ptr = malloc(out->as.str.len + 1);
+        out->as.str.ptr = arena_alloc(profile, arena, out->as.str.len + 1);
         memcpy(out->as.str.ptr, RSTRING_PTR(v), out->as.str.len);
         out->as.str.ptr[out->as.str.len] = '\0';
         return 0;
     }
-    if (RB_TYPE_P(v, T_SYMBOL)) {
-        /* Symbol -> String */
-        VALUE s = rb_sym2str(v);
-        out->type = SANDBOX_VALUE_STRING;
-        out->as.str.len = (size_t)RSTRING_LEN(s);
-        out->as.str.ptr = malloc(out->as.str.len + 1);
-        memcpy(out->as.str.ptr, RSTRING_PTR(s), out->as.str.len);
-        out->as.str.ptr[out->as.str.len] = '\0';
-        return 0;
-    }
     if (RB_TYPE_P(v, T_ARRAY)) {
         long alen = RARRAY_LEN(v);
         out->type = SANDBOX_VALUE_ARRAY;
         out->as.arr.len = (size_t)alen;
-        out->as.arr.items = calloc((size_t)alen, sizeof(sandbox_value_t));
+        out->as.arr.items = arena_alloc(profile, arena, (size_t)alen * sizeof(sandbox_value_t));
         for (long i = 0; i < alen; i++) {
-            if (rb_to_sandbox_value(rb_ary_entry(v, i), &out->as.arr.items[i],
+            if (rb_to_sandbox_value(profile, rb_ary_entry(v, i), &out->as.arr.items[i], arena,
                                     errbuf, errbuf_size) != 0) {
-                for (long j = 0; j < i; j++) {
-                    sandbox_value_free(&out->as.arr.items[j]);
-                }
-                free(out->as.arr.items);
-                out->as.arr.items = NULL;
                 return -1;
             }
         }
@@ -123,21 +125,15 @@ rb_to_sandbox_value(VALUE v, sandbox_value_t *out, char *errbuf, size_t errbuf_s
         long hlen = RARRAY_LEN(keys);
         out->type = SANDBOX_VALUE_HASH;
         out->as.hash.len = (size_t)hlen;
-        out->as.hash.keys = calloc((size_t)hlen, sizeof(sandbox_value_t));
-        out->as.hash.vals = calloc((size_t)hlen, sizeof(sandbox_value_t));
+        out->as.hash.keys = arena_alloc(profile, arena, (size_t)hlen * sizeof(sandbox_value_t));
+        out->as.hash.vals = arena_alloc(profile, arena, (size_t)hlen * sizeof(sandbox_value_t));
         for (long i = 0; i < hlen; i++) {
             VALUE k = rb_ary_entry(keys, i);
             VALUE val = rb_hash_aref(v, k);
-            if (rb_to_sandbox_value(k, &out->as.hash.keys[i], errbuf, errbuf_size) != 0 ||
-                rb_to_sandbox_value(val, &out->as.hash.vals[i], errbuf, errbuf_size) != 0) {
-                for (long j = 0; j <= i; j++) {
-                    sandbox_value_free(&out->as.hash.keys[j]);
-                    sandbox_value_free(&out->as.hash.vals[j]);
-                }
-                free(out->as.hash.keys);
-                free(out->as.hash.vals);
-                out->as.hash.keys = NULL;
-                out->as.hash.vals = NULL;
+            if (rb_to_sandbox_value(profile, k, &out->as.hash.keys[i], arena,
+                                    errbuf, errbuf_size) != 0 ||
+                rb_to_sandbox_value(profile, val, &out->as.hash.vals[i], arena,
+                                    errbuf, errbuf_size) != 0) {
                 return -1;
             }
         }
@@ -152,95 +148,67 @@ rb_to_sandbox_value(VALUE v, sandbox_value_t *out, char *errbuf, size_t errbuf_s
 }
 
 /* ------------------------------------------------------------------ */
-/* CRuby callback: dispatches tool calls to @tool_context              */
+/* TypedData for Enclave                                               */
 /* ------------------------------------------------------------------ */
 
+/* What a tool slot dispatches to, filled in by _bind_toolset */
 typedef struct {
-    VALUE tool_context;  /* @tool_context object */
-    VALUE method_name;   /* Symbol for the method */
-    int   argc;
-    VALUE *argv;
-} cruby_call_args_t;
+    VALUE receiver;
+    ID    mid;                           /* 0 for a slot not bound yet */
+    int   arity;                         /* Method#arity */
+    int   scalar;                        /* signature takes scalars only */
+    ID    batch;                         /* batch method, or 0 */
+} tool_slot_t;
 
-static VALUE
-cruby_protected_call(VALUE arg)
-{
-    cruby_call_args_t *ca = (cruby_call_args_t *)arg;
-    return rb_funcallv(ca->tool_context, SYM2ID(ca->method_name), ca->argc, ca->argv);
-}
+typedef struct {
+    const sandbox_profile_t *profile;    /* the copy of sandbox_core that owns state */
+    sandbox_state_t *state;
+    int              closed;
+    int              busy;               /* inside an eval (GVL released) */
+    VALUE            pending_exception;  /* host interrupt caught in a tool call */
+    size_t           reported;           /* mruby heap bytes CRuby's GC knows about */
+    tool_slot_t     *tools;              /* indexed by sandbox tool slot */
+    int              tools_capa;
+    VALUE            jobs;               /* Dispatcher jobs of this eval, by ticket */
+    VALUE            batches;            /* open Dispatcher::Batch by tool slot */
+} rb_enclave_t;
 
-static sandbox_callback_result_t
-sandbox_cruby_callback(const char *method_name,
-                       const sandbox_value_t *args,
-                       int argc,
-                       void *userdata)
+/* Pass the change in mruby heap size since the last call on to CRuby's
+ * GC, so it counts like malloc'd memory and an abandoned enclave's heap
+ * brings its collection forward. Never triggers a GC itself. */
+static void
+enclave_report_memory(rb_enclave_t *sb)
 {
-    sandbox_callback_result_t result;
-    memset(&result, 0, sizeof(result));
-
-    VALUE self = (VALUE)userdata;
-
-    /* Convert sandbox args -> CRuby VALUEs */
-    VALUE *rb_args = NULL;
-    if (argc > 0) {
-        rb_args = ALLOCA_N(VALUE, argc);
-        for (int i = 0; i < argc; i++) {
-            rb_args[i] = sandbox_value_to_rb(&args[i]);
-        }
-    }
-
-    /* Call @tool_context.send(method_name, *args) via rb_protect */
-    VALUE tool_context = rb_ivar_get(self, rb_intern("@tool_context"));
-    VALUE method_sym = ID2SYM(rb_intern(method_name));
-
-    cruby_call_args_t ca;
-    ca.tool_context = tool_context;
-    ca.method_name = method_sym;
-    ca.argc = argc;
-    ca.argv = rb_args;
-
-    int state = 0;
-    VALUE ret = rb_protect(cruby_protected_call, (VALUE)&ca, &state);
-
-    if (state) {
-        /* Exception was raised -- capture message */
-        VALUE exc = rb_errinfo();
-        rb_set_errinfo(Qnil);
-        VALUE exc_str = rb_funcall(exc, rb_intern("inspect"), 0);
-        const char *msg = StringValueCStr(exc_str);
-        result.error = strdup(msg);
-        return result;
+    size_t current = sb->state ? sb->profile->state_memory(sb->state) : 0;
+    if (current != sb->reported) {
+        rb_gc_adjust_memory_usage((ssize_t)current - (ssize_t)sb->reported);
+        sb->reported = current;
     }
+}
 
-    /* Convert CRuby return -> sandbox_value_t */
-    char errbuf[256];
-    errbuf[0] = '\0';
-    if (rb_to_sandbox_value(ret, &result.value, errbuf, sizeof(errbuf)) != 0) {
-        result.error = strdup(errbuf);
-        return result;
+static void
+rb_enclave_mark(void *ptr)
+{
+    rb_enclave_t *sb = (rb_enclave_t *)ptr;
+    rb_gc_mark(sb->pending_exception);
+    rb_gc_mark(sb->jobs);
+    rb_gc_mark(sb->batches);
+    for (int i = 0; i < sb->tools_capa; i++) {
+        rb_gc_mark(sb->tools[i].receiver);
     }
-
-    return result;
 }
 
-/* ------------------------------------------------------------------ */
-/* TypedData for Enclave                                               */
-/* ------------------------------------------------------------------ */
-
-typedef struct {
-    sandbox_state_t *state;
-    int              closed;
-} rb_enclave_t;
-
 static void
 rb_enclave_free(void *ptr)
 {
     rb_enclave_t *sb = (rb_enclave_t *)ptr;
     if (sb) {
         if (sb->state) {
-            sandbox_state_free(sb->state);
+            sb->profile->state_free(sb->state);
             sb->state = NULL;
         }
+        enclave_report_memory(sb);
+        free(sb->tools);
         free(sb);
     }
 }
@@ -248,12 +216,15 @@ rb_enclave_free(void *ptr)
 static size_t
 rb_enclave_memsize(const void *ptr)
 {
-    return sizeof(rb_enclave_t);
+    const rb_enclave_t *sb = (const rb_enclave_t *)ptr;
+    size_t tools = sb->tools_capa * sizeof(tool_slot_t);
+    size_t state = sb->state ? sb->profile->state_memory(sb->state) : 0;
+    return sizeof(rb_enclave_t) + tools + state;
 }
 
 static const rb_data_type_t enclave_data_type = {
     "Enclave",
-    { NULL, rb_enclave_free, rb_enclave_memsize },
+    { rb_enclave_mark, rb_enclave_free, rb_enclave_memsize },
     NULL, NULL,
     RUBY_TYPED_FREE_IMMEDIATELY
 };
@@ -266,9 +237,465 @@ get_enclave(VALUE self)
     if (sb->closed) {
         rb_raise(rb_eRuntimeError, "enclave is closed");
     }
+    if (sb->busy) {
+        rb_raise(rb_eRuntimeError, "enclave is busy (already evaluating)");
+    }
     return sb;
 }
 
+/* ------------------------------------------------------------------ */
+/* Running mruby without the GVL                                       */
+/* ------------------------------------------------------------------ */
+
+/* mruby never touches CRuby objects, so the VM runs with the GVL
+ * released and other Ruby threads keep going. Pending interrupts are
+ * handled before func starts, never after it finished, so results
+ * (and the malloc'd memory inside them) are never dropped. func must
+ * set *done. sb (optional) is marked busy only while func runs, and its
+ * heap size is reported to the GC afterwards. */
+static void
+enclave_call_without_gvl(rb_enclave_t *sb, void *(*func)(void *), void *data,
+                         const int *done, rb_unblock_function_t *ubf, void *ubf_data)
+{
+    while (!*done) {
+        rb_thread_check_ints();
+        if (sb) sb->busy = 1;
+        rb_thread_call_without_gvl2(func, data, ubf, ubf_data);
+        if (sb) sb->busy = 0;
+    }
+    if (sb) enclave_report_memory(sb);
+}
+
+static void
+enclave_unblock(void *ptr)
+{
+    rb_enclave_t *sb = (rb_enclave_t *)ptr;
+    sb->profile->state_interrupt(sb->state);
+}
+
+/* ------------------------------------------------------------------ */
+/* Streaming conversion for tool calls                                 */
+/* ------------------------------------------------------------------ */
+
+/* Open containers while visiting an argument, as (container, slot)
+ * pairs in a Ruby array so everything built so far stays marked. */
+typedef struct {
+    VALUE stack;
+    VALUE result;
+} rb_visit_t;
+
+static VALUE visit_no_key;  /* hash slot without a pending key */
+
+static void
+rb_visit_add(rb_visit_t *st, VALUE v)
+{
+    long n = RARRAY_LEN(st->stack);
+    if (n == 0) {
+        st->result = v;
+        return;
+    }
+
+    VALUE container = RARRAY_AREF(st->stack, n - 2);
+    if (RB_TYPE_P(container, T_ARRAY)) {
+        rb_ary_push(container, v);
+        return;
+    }
+
+    VALUE key = RARRAY_AREF(st->stack, n - 1);
+    if (key == visit_no_key) {
+        rb_ary_store(st->stack, n - 1, v);
+    } else {
+        rb_hash_aset(container, key, v);
+        rb_ary_store(st->stack, n - 1, visit_no_key);
+    }
+}
+
+static void
+rb_visit_scalar(void *ud, const sandbox_value_t *value)
+{
+    rb_visit_add((rb_visit_t *)ud, sandbox_value_to_rb(value));
+}
+
+static void
+rb_visit_begin_array(void *ud, size_t len)
+{
+    rb_visit_t *st = (rb_visit_t *)ud;
+    rb_ary_push(st->stack, rb_ary_new_capa((long)len));
+    rb_ary_push(st->stack, Qfalse);
+}
+
+static void
+rb_visit_begin_hash(void *ud, size_t len)
+{
+    rb_visit_t *st = (rb_visit_t *)ud;
+    rb_ary_push(st->stack, rb_hash_new());
+    rb_ary_push(st->stack, visit_no_key);
+}
+
+static void
+rb_visit_end(void *ud)
+{
+    rb_visit_t *st = (rb_visit_t *)ud;
+    rb_ary_pop(st->stack);
+    rb_visit_add(st, rb_ary_pop(st->stack));
+}
+
+static const sandbox_visitor_t rb_visitor = {
+    rb_visit_scalar,
+    rb_visit_begin_array,
+    rb_visit_begin_hash,
+    rb_visit_end
+};
+
+/* Convert tool argument index straight from mruby to a CRuby VALUE */
+static VALUE
+sandbox_arg_to_rb(const sandbox_profile_t *profile, const sandbox_args_t *args, int index)
+{
+    rb_visit_t st;
+    st.stack = rb_ary_new();
+    st.result = Qnil;
+    profile->args_visit(args, index, &rb_visitor, &st);
+    RB_GC_GUARD(st.stack);
+    return st.result;
+}
+
+/* Fast path for a tool whose signature only takes scalars: no visit
+ * stack, the one scalar goes straight to a VALUE */
+static void
+rb_visit_scalar_only(void *ud, const sandbox_value_t *value)
+{
+    *(VALUE *)ud = sandbox_value_to_rb(value);
+}
+
+static const sandbox_visitor_t rb_scalar_visitor = { rb_visit_scalar_only, NULL, NULL, NULL };
+
+static VALUE
+sandbox_scalar_arg_to_rb(const sandbox_profile_t *profile, const sandbox_args_t *args, int index)
+{
+    VALUE v = Qnil;
+    profile->args_visit(args, index, &rb_scalar_visitor, &v);
+    return v;
+}
+
+static int rb_build_value(const sandbox_profile_t *profile, VALUE v, sandbox_builder_t *b,
+                          char *errbuf, size_t errbuf_size);
+
+typedef struct {
+    const sandbox_profile_t *profile;
+    sandbox_builder_t *builder;
+    char              *errbuf;
+    size_t             errbuf_size;
+    int                failed;
+} rb_build_ctx_t;
+
+static int
+rb_build_pair(VALUE key, VALUE val, VALUE arg)
+{
+    rb_build_ctx_t *ctx = (rb_build_ctx_t *)arg;
+    if (rb_build_value(ctx->profile, key, ctx->builder, ctx->errbuf, ctx->errbuf_size) != 0 ||
+        rb_build_value(ctx->profile, val, ctx->builder, ctx->errbuf, ctx->errbuf_size) != 0) {
+        ctx->failed = 1;
+        return ST_STOP;
+    }
+    return ST_CONTINUE;
+}
+
+/* Build a CRuby VALUE straight into the sandbox. Returns 0 on success,
+ * -1 on bad type (the partial value is discarded by the sandbox). */
+static int
+rb_build_value(const sandbox_profile_t *profile, VALUE v, sandbox_builder_t *b,
+               char *errbuf, size_t errbuf_size)
+{
+    sandbox_value_t sv;
+    memset(&sv, 0, sizeof(sv));
+
+    if (NIL_P(v)) {
+        sv.type = SANDBOX_VALUE_NIL;
+    }
+    else if (v == Qtrue) {
+        sv.type = SANDBOX_VALUE_TRUE;
+    }
+    else if (v == Qfalse) {
+        sv.type = SANDBOX_VALUE_FALSE;
+    }
+    else if (FIXNUM_P(v) || RB_TYPE_P(v, T_BIGNUM)) {
+        sv.type = SANDBOX_VALUE_INTEGER;
+        sv.as.i = (int64_t)NUM2LL(v);
+    }
+    else if (RB_FLOAT_TYPE_P(v)) {
+        sv.type = SANDBOX_VALUE_FLOAT;
+        sv.as.f = NUM2DBL(v);
+    }
+    else if (RB_TYPE_P(v, T_STRING)) {
+        /* Borrowed: the builder copies */
+        sv.type = SANDBOX_VALUE_STRING;
+        sv.as.str.ptr = RSTRING_PTR(v);
+        sv.as.str.len = (size_t)RSTRING_LEN(v);
+    }
+    else if (RB_TYPE_P(v, T_SYMBOL)) {
+        /* Symbol -> String */
+        VALUE str = rb_sym2str(v);
+        sv.type = SANDBOX_VALUE_STRING;
+        sv.as.str.ptr = RSTRING_PTR(str);
+        sv.as.str.len = (size_t)RSTRING_LEN(str);
+        profile->builder_scalar(b, &sv);
+        RB_GC_GUARD(str);
+        return 0;
+    }
+    else if (RB_TYPE_P(v, T_ARRAY)) {
+        long alen = RARRAY_LEN(v);
+        profile->builder_begin_array(b, (size_t)alen);
+        for (long i = 0; i < RARRAY_LEN(v); i++) {
+            if (rb_build_value(profile, RARRAY_AREF(v, i), b, errbuf, errbuf_size) != 0) return -1;
+        }
+        profile->builder_end(b);
+        return 0;
+    }
+    else if (RB_TYPE_P(v, T_HASH)) {
+        rb_build_ctx_t ctx = { profile, b, errbuf, errbuf_size, 0 };
+        profile->builder_begin_hash(b, (size_t)RHASH_SIZE(v));
+        rb_hash_foreach(v, rb_build_pair, (VALUE)&ctx);
+        if (ctx.failed) return -1;
+        profile->builder_end(b);
+        return 0;
+    }
+    else {
+        /* Unsupported type */
+        VALUE cls = rb_class_name(rb_obj_class(v));
+        snprintf(errbuf, errbuf_size, "TypeError: unsupported type for sandbox: %s",
+                 StringValueCStr(cls));
+        return -1;
+    }
+
+    profile->builder_scalar(b, &sv);
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* CRuby callback: dispatches tool calls through sb->tools            */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    VALUE                 self;
+    const sandbox_profile_t *profile;
+    VALUE               (*body)(VALUE);  /* runs under rb_protect */
+    const tool_slot_t    *tool;
+    const sandbox_args_t *args;
+    sandbox_builder_t    *builder;
+    int                   ticket;        /* parallel { }: submit sets, await reads */
+    double                timeout;       /* await: seconds, negative for no limit */
+    int                   failed;        /* result had an unsupported type */
+    char                  errbuf[256];
+    char                 *error;
+} cruby_callback_t;
+
+/* Convert sandbox args -> CRuby VALUEs into rb_args (argc of them) */
+static void
+cruby_tool_args(cruby_callback_t *cb, int argc, VALUE *rb_args)
+{
+    const tool_slot_t *tool = cb->tool;
+    if (tool->arity >= 0 && argc != tool->arity) {
+        rb_raise(rb_eArgError, "wrong number of arguments (given %d, expected %d)",
+                 argc, tool->arity);
+    }
+    for (int i = 0; i < argc; i++) {
+        rb_args[i] = tool->scalar ? sandbox_scalar_arg_to_rb(cb->profile, cb->args, i)
+                                  : sandbox_arg_to_rb(cb->profile, cb->args, i);
+    }
+}
+
+/* Convert CRuby return -> mruby value */
+static void
+cruby_tool_result(cruby_callback_t *cb, VALUE ret)
+{
+    if (rb_build_value(cb->profile, ret, cb->builder, cb->errbuf, sizeof(cb->errbuf)) != 0) {
+        cb->failed = 1;
+    }
+}
+
+/* Convert args, call the tool, build the result. Conversion errors raise
+ * here too, never through mruby frames. */
+static VALUE
+cruby_protected_call(VALUE arg)
+{
+    cruby_callback_t *cb = (cruby_callback_t *)arg;
+    int argc = cb->profile->args_count(cb->args);
+    VALUE *rb_args = argc > 0 ? ALLOCA_N(VALUE, argc) : NULL;
+    cruby_tool_args(cb, argc, rb_args);
+
+    cruby_tool_result(cb, rb_funcallv(cb->tool->receiver, cb->tool->mid, argc, rb_args));
+    return Qnil;
+}
+
+/* parallel { }: hand the call to Enclave.dispatcher and keep the job.
+ * Calls to a tool with a batch method join the tool's open batch. */
+static VALUE
+cruby_protected_submit(VALUE arg)
+{
+    cruby_callback_t *cb = (cruby_callback_t *)arg;
+    const tool_slot_t *tool = cb->tool;
+    int argc = cb->profile->args_count(cb->args);
+    VALUE *rb_args = argc > 0 ? ALLOCA_N(VALUE, argc) : NULL;
+    cruby_tool_args(cb, argc, rb_args);
+
+    rb_enclave_t *sb = (rb_enclave_t *)RTYPEDDATA_DATA(cb->self);
+    VALUE dispatcher = rb_funcall(cEnclave, rb_intern("dispatcher"), 0);
+    VALUE args = rb_ary_new_from_values(argc, rb_args);
+    VALUE job;
+    if (tool->batch) {
+        VALUE slot = INT2FIX(tool - sb->tools);
+        if (NIL_P(sb->batches)) sb->batches = rb_hash_new();
+        VALUE batch = rb_hash_aref(sb->batches, slot);
+        if (NIL_P(batch)) {
+            batch = rb_funcall(dispatcher, rb_intern("batch"), 3, tool->receiver,
+                               ID2SYM(tool->batch), tool->arity == 1 ? Qtrue : Qfalse);
+            rb_hash_aset(sb->batches, slot, batch);
+        }
+        job = rb_funcall(batch, rb_intern("add"), 1, args);
+    }
+    else {
+        job = rb_funcall(dispatcher, rb_intern("submit"), 3, tool->receiver,
+                         ID2SYM(tool->mid), args);
+    }
+
+    if (NIL_P(sb->jobs)) sb->jobs = rb_ary_new();
+    cb->ticket = (int)RARRAY_LEN(sb->jobs);
+    rb_ary_push(sb->jobs, job);
+    return Qnil;
+}
+
+static int
+cruby_dispatch_batch(VALUE slot, VALUE batch, VALUE arg)
+{
+    rb_funcall(batch, rb_intern("dispatch!"), 0);
+    return ST_CONTINUE;
+}
+
+/* parallel { }: wait for a job, then build its value like a call's. The
+ * first wait sends every open batch off, so calls made before it are
+ * coalesced and later ones start new batches. */
+static VALUE
+cruby_protected_await(VALUE arg)
+{
+    cruby_callback_t *cb = (cruby_callback_t *)arg;
+    rb_enclave_t *sb = (rb_enclave_t *)RTYPEDDATA_DATA(cb->self);
+    if (NIL_P(sb->jobs) || cb->ticket < 0 || cb->ticket >= RARRAY_LEN(sb->jobs)) {
+        rb_raise(rb_eArgError, "unknown future");
+    }
+    if (!NIL_P(sb->batches)) {
+        VALUE batches = sb->batches;
+        sb->batches = Qnil;
+        rb_hash_foreach(batches, cruby_dispatch_batch, Qnil);
+    }
+
+    VALUE job = RARRAY_AREF(sb->jobs, cb->ticket);
+    VALUE timeout = cb->timeout < 0 ? Qnil : DBL2NUM(cb->timeout);
+    if (!RTEST(rb_funcall(job, rb_intern("wait"), 1, timeout))) {
+        snprintf(cb->errbuf, sizeof(cb->errbuf), "execution timeout exceeded");
+        cb->failed = 1;
+        return Qnil;
+    }
+    cruby_tool_result(cb, rb_funcall(job, rb_intern("value"), 0));
+    return Qnil;
+}
+
+static void *
+sandbox_cruby_callback_with_gvl(void *ptr)
+{
+    cruby_callback_t *cb = (cruby_callback_t *)ptr;
+
+    int state = 0;
+    rb_protect(cb->body, (VALUE)cb, &state);
+
+    if (state) {
+        /* Exception was raised -- capture message */
+        VALUE exc = rb_errinfo();
+        rb_set_errinfo(Qnil);
+
+        /* Interrupt, Timeout, SystemExit etc. are meant for the host thread,
+         * not the sandbox: stop the eval and re-raise once it has unwound. */
+        if (rb_obj_is_kind_of(exc, rb_eException) &&
+            !rb_obj_is_kind_of(exc, rb_eStandardError) &&
+            !rb_obj_is_kind_of(exc, rb_eScriptError)) {
+            rb_enclave_t *sb;
+            TypedData_Get_Struct(cb->self, rb_enclave_t, &enclave_data_type, sb);
+            sb->pending_exception = exc;
+            sb->profile->state_interrupt(sb->state);
+        }
+
+        VALUE exc_str = rb_funcall(exc, rb_intern("inspect"), 0);
+        const char *msg = StringValueCStr(exc_str);
+        cb->error = strdup(msg);
+    }
+    else if (cb->failed) {
+        cb->error = strdup(cb->errbuf);
+    }
+    return NULL;
+}
+
+/* Set up cb for a call to the tool in slot; returns an error message if
+ * the slot has no tool bound */
+static char *
+sandbox_cruby_prepare(cruby_callback_t *cb, void *userdata, int slot)
+{
+    memset(cb, 0, sizeof(*cb));
+    cb->self = (VALUE)userdata;
+    rb_enclave_t *sb = (rb_enclave_t *)RTYPEDDATA_DATA(cb->self);
+    cb->profile = sb->profile;
+    if (slot < 0) return NULL;
+    if (slot >= sb->tools_capa || !sb->tools[slot].mid) {
+        return strdup("tool is not bound in this enclave");
+    }
+    cb->tool = &sb->tools[slot];
+    return NULL;
+}
+
+/* Called by the trampoline while mruby runs without the GVL */
+static char *
+sandbox_cruby_callback(int slot,
+                       const sandbox_args_t *args,
+                       sandbox_builder_t *result,
+                       void *userdata)
+{
+    cruby_callback_t cb;
+    char *error = sandbox_cruby_prepare(&cb, userdata, slot);
+    if (error) return error;
+    cb.body = cruby_protected_call;
+    cb.args = args;
+    cb.builder = result;
+
+    rb_thread_call_with_gvl(sandbox_cruby_callback_with_gvl, &cb);
+    return cb.error;
+}
+
+static char *
+sandbox_cruby_submit(int slot, const sandbox_args_t *args, int *ticket, void *userdata)
+{
+    cruby_callback_t cb;
+    char *error = sandbox_cruby_prepare(&cb, userdata, slot);
+    if (error) return error;
+    cb.body = cruby_protected_submit;
+    cb.args = args;
+
+    rb_thread_call_with_gvl(sandbox_cruby_callback_with_gvl, &cb);
+    *ticket = cb.ticket;
+    return cb.error;
+}
+
+static char *
+sandbox_cruby_await(int ticket, double timeout, sandbox_builder_t *result, void *userdata)
+{
+    cruby_callback_t cb;
+    sandbox_cruby_prepare(&cb, userdata, -1);
+    cb.body = cruby_protected_await;
+    cb.ticket = ticket;
+    cb.timeout = timeout;
+    cb.builder = result;
+
+    rb_thread_call_with_gvl(sandbox_cruby_callback_with_gvl, &cb);
+    return cb.error;
+}
+
 /* ------------------------------------------------------------------ */
 /* Enclave#initialize                                                  */
 /* ------------------------------------------------------------------ */
@@ -277,70 +704,262 @@ static VALUE
 enclave_alloc(VALUE klass)
 {
     rb_enclave_t *sb = calloc(1, sizeof(rb_enclave_t));
+    sb->pending_exception = Qnil;
+    sb->jobs = Qnil;
+    sb->batches = Qnil;
     return TypedData_Wrap_Struct(klass, &enclave_data_type, sb);
 }
 
+/* Profiles linked into this build, standard first */
+static const sandbox_profile_t *const enclave_profiles[] = {
+    &sandbox_profile_standard,
+#ifdef SANDBOX_HAVE_LEAN
+    &sandbox_profile_lean,
+#endif
+};
+
+#define ENCLAVE_PROFILE_COUNT ((int)(sizeof(enclave_profiles) / sizeof(enclave_profiles[0])))
+
+/* profile: option to the profile table with that name */
+static const sandbox_profile_t *
+enclave_profile(VALUE rb_profile)
+{
+    const char *name = rb_id2name(SYM2ID(rb_to_symbol(rb_profile)));
+    for (int i = 0; i < ENCLAVE_PROFILE_COUNT; i++) {
+        if (strcmp(enclave_profiles[i]->name, name) == 0) return enclave_profiles[i];
+    }
+    if (strcmp(name, "lean") == 0) {
+        rb_raise(rb_eArgError, "profile :lean was not built (needs objcopy at install time)");
+    }
+    rb_raise(rb_eArgError, "unknown profile: %+"PRIsVALUE, rb_profile);
+    return NULL;
+}
+
+/* gems: option to a sandbox gem set: :lazy (every optional gem, loaded
+ * on first use), :eager (every one, loaded up front), or an Array of
+ * gem names (only those, loaded on first use) */
+static uint32_t
+enclave_gem_set(VALUE rb_gems)
+{
+    if (RB_TYPE_P(rb_gems, T_ARRAY)) {
+        uint32_t gems = 0;
+        for (long i = 0; i < RARRAY_LEN(rb_gems); i++) {
+            VALUE name = rb_ary_entry(rb_gems, i);
+            int index = sandbox_gem_lookup(rb_id2name(SYM2ID(rb_to_symbol(name))));
+            if (index < 0) {
+                rb_raise(rb_eArgError, "unknown gem: %+"PRIsVALUE, name);
+            }
+            gems |= 1u << index;
+        }
+        return gems;
+    }
+
+    ID id = SYM2ID(rb_to_symbol(rb_gems));
+    if (id == rb_intern("lazy")) return SANDBOX_GEMS_ALL;
+    if (id == rb_intern("eager")) return SANDBOX_GEMS_ALL | SANDBOX_GEMS_EAGER;
+    rb_raise(rb_eArgError, "gems must be :lazy, :eager or an Array of names, not %+"PRIsVALUE,
+             rb_gems);
+    return 0;
+}
+
+typedef struct {
+    const sandbox_profile_t *profile;
+    double              timeout;
+    size_t              memory_limit;
+    sandbox_allocator_t allocator;
+    uint32_t            gems;
+    int                 adopt;
+    sandbox_state_t    *state;
+    int                 done;
+} state_new_call_t;
+
+static void *
+enclave_state_new_without_gvl(void *ptr)
+{
+    state_new_call_t *call = (state_new_call_t *)ptr;
+    if (call->adopt) {
+        call->state = call->profile->prototype_take(call->timeout, call->memory_limit);
+    }
+    if (!call->state) {
+        call->state = call->profile->state_new(call->timeout, call->memory_limit,
+                                               call->allocator, call->gems);
+    }
+    call->done = 1;
+    return NULL;
+}
+
 static VALUE
-enclave_initialize(VALUE self, VALUE rb_timeout, VALUE rb_memory_limit)
+enclave_initialize(VALUE self, VALUE rb_timeout, VALUE rb_memory_limit, VALUE rb_allocator,
+                   VALUE rb_gems, VALUE rb_profile, VALUE rb_adopt)
 {
     rb_enclave_t *sb;
     TypedData_Get_Struct(self, rb_enclave_t, &enclave_data_type, sb);
 
-    double timeout = NIL_P(rb_timeout) ? 0.0 : NUM2DBL(rb_timeout);
-    size_t memory_limit = NIL_P(rb_memory_limit) ? 0 : (size_t)NUM2ULL(rb_memory_limit);
+    state_new_call_t call;
+    memset(&call, 0, sizeof(call));
+    call.profile = enclave_profile(rb_profile);
+    call.timeout = NIL_P(rb_timeout) ? 0.0 : NUM2DBL(rb_timeout);
+    call.memory_limit = NIL_P(rb_memory_limit) ? 0 : (size_t)NUM2ULL(rb_memory_limit);
+
+    int allocator = sandbox_allocator_lookup(rb_id2name(SYM2ID(rb_to_symbol(rb_allocator))));
+    if (allocator < 0) {
+        rb_raise(rb_eArgError, "unknown allocator: %+"PRIsVALUE, rb_allocator);
+    }
+    call.allocator = (sandbox_allocator_t)allocator;
+    call.gems = enclave_gem_set(rb_gems);
+    call.adopt = RTEST(rb_adopt);
+
+    enclave_call_without_gvl(NULL, enclave_state_new_without_gvl, &call, &call.done, NULL, NULL);
 
-    sb->state = sandbox_state_new(timeout, memory_limit);
+    sb->profile = call.profile;
+    sb->state = call.state;
     if (!sb->state) {
         rb_raise(rb_eRuntimeError, "failed to initialize mruby enclave");
     }
     sb->closed = 0;
+    enclave_report_memory(sb);
 
     /* Set up the callback so CRuby can handle tool calls */
-    sandbox_state_set_callback(sb->state, sandbox_cruby_callback, (void *)self);
+    sb->profile->state_set_callback(sb->state, sandbox_cruby_callback, (void *)self);
+    sb->profile->state_set_dispatch(sb->state, sandbox_cruby_submit, sandbox_cruby_await);
 
     return self;
 }
 
 /* ------------------------------------------------------------------ */
-/* Enclave#_define_function                                            */
+/* Enclave#_bind_toolset                                               */
 /* ------------------------------------------------------------------ */
 
+static void
+enclave_reserve_tools(rb_enclave_t *sb, int slot)
+{
+    if (slot < sb->tools_capa) return;
+
+    int capa = sb->tools_capa ? sb->tools_capa * 2 : 8;
+    while (capa <= slot) capa *= 2;
+    tool_slot_t *tools = realloc(sb->tools, capa * sizeof(tool_slot_t));
+    if (!tools) rb_raise(rb_eNoMemError, "failed to allocate tool table");
+    for (int i = sb->tools_capa; i < capa; i++) {
+        tools[i].receiver = Qnil;
+        tools[i].mid = 0;
+        tools[i].arity = -1;
+        tools[i].scalar = 0;
+        tools[i].batch = 0;
+    }
+    sb->tools = tools;
+    sb->tools_capa = capa;
+}
+
+/* Registers each function of an Enclave::Toolset in the sandbox and binds
+ * its slot to receiver, so a tool call is an index into sb->tools and one
+ * rb_funcallv. The toolset already holds the names, arities and
+ * signatures, so nothing here reflects on receiver. */
 static VALUE
-enclave_define_function(VALUE self, VALUE rb_name)
+enclave_bind_toolset(VALUE self, VALUE toolset, VALUE receiver)
 {
     rb_enclave_t *sb = get_enclave(self);
-    const char *name = StringValueCStr(rb_name);
+    VALUE names = rb_ivar_get(toolset, rb_intern("@names"));
+    VALUE arities = rb_ivar_get(toolset, rb_intern("@arities"));
+    VALUE types = rb_ivar_get(toolset, rb_intern("@types"));
+    VALUE batches = rb_ivar_get(toolset, rb_intern("@batches"));
+    Check_Type(names, T_ARRAY);
+    Check_Type(arities, T_ARRAY);
+    Check_Type(types, T_ARRAY);
+    Check_Type(batches, T_ARRAY);
+
+    for (long i = 0; i < RARRAY_LEN(names); i++) {
+        ID mid = SYM2ID(RARRAY_AREF(names, i));
+        const char *name = rb_id2name(mid);
+        VALUE rb_types = RARRAY_AREF(types, i);
+        const char *sig = NIL_P(rb_types) ? NULL : StringValueCStr(rb_types);
+
+        int slot = sb->profile->state_define_function(sb->state, name);
+        if (slot < 0) {
+            rb_raise(rb_eNoMemError, "failed to register tool function %s", name);
+        }
+        if (sb->profile->state_set_signature(sb->state, slot, sig) != 0) {
+            rb_raise(rb_eArgError, "invalid signature for %s: %s", name, sig);
+        }
 
-    if (sandbox_state_define_function(sb->state, name) != 0) {
-        rb_raise(rb_eRuntimeError, "too many tool functions (max %d)", 64);
+        enclave_reserve_tools(sb, slot);
+        sb->tools[slot].receiver = receiver;
+        sb->tools[slot].mid = mid;
+        sb->tools[slot].arity = NUM2INT(RARRAY_AREF(arities, i));
+        sb->tools[slot].scalar = sig && !strchr(sig, '*');
+        VALUE batch = RARRAY_AREF(batches, i);
+        sb->tools[slot].batch = NIL_P(batch) ? 0 : SYM2ID(batch);
+        sb->profile->state_set_batched(sb->state, slot, !NIL_P(batch));
     }
 
     return self;
 }
 
 /* ------------------------------------------------------------------ */
-/* Enclave#_eval                                                       */
+/* Enclave#_clear_functions                                            */
 /* ------------------------------------------------------------------ */
 
 static VALUE
-enclave_eval(VALUE self, VALUE rb_code)
+enclave_clear_functions(VALUE self)
 {
     rb_enclave_t *sb = get_enclave(self);
-    const char *code = StringValueCStr(rb_code);
+    sb->profile->state_clear_functions(sb->state);
+    for (int i = 0; i < sb->tools_capa; i++) {
+        sb->tools[i].receiver = Qnil;
+        sb->tools[i].mid = 0;
+    }
+    return self;
+}
+
+/* ------------------------------------------------------------------ */
+/* Enclave#_eval                                                       */
+/* ------------------------------------------------------------------ */
+
+static VALUE
+enclave_stats_to_rb(const sandbox_stats_t *stats)
+{
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("parse_time")),   DBL2NUM(stats->parse_seconds));
+    rb_hash_aset(hash, ID2SYM(rb_intern("codegen_time")), DBL2NUM(stats->codegen_seconds));
+    rb_hash_aset(hash, ID2SYM(rb_intern("vm_time")),      DBL2NUM(stats->vm_seconds));
+    rb_hash_aset(hash, ID2SYM(rb_intern("tool_time")),    DBL2NUM(stats->tool_seconds));
+    rb_hash_aset(hash, ID2SYM(rb_intern("tool_calls")),   ULL2NUM(stats->tool_calls));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_in")),     ULL2NUM(stats->bytes_in));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_out")),    ULL2NUM(stats->bytes_out));
+    rb_hash_aset(hash, ID2SYM(rb_intern("memory")),       SIZET2NUM(stats->memory));
+    rb_hash_aset(hash, ID2SYM(rb_intern("peak_memory")),  SIZET2NUM(stats->peak_memory));
+    rb_hash_aset(hash, ID2SYM(rb_intern("cached")),       stats->cached ? Qtrue : Qfalse);
+    return hash;
+}
 
-    sandbox_result_t result = sandbox_state_eval(sb->state, code);
+/* Turn a finished eval/run into [value, output, error, stats], raising
+ * for limit errors and host interrupts. Frees result. */
+static VALUE
+enclave_result_to_rb(rb_enclave_t *sb, sandbox_result_t result)
+{
+    /* Interrupted by the host (Thread#raise, Timeout, signal): free the
+     * result and let the host exception propagate. */
+    if (result.error_kind == SANDBOX_ERROR_INTERRUPTED) {
+        VALUE pending = sb->pending_exception;
+        sb->profile->result_free(&result);
+        sb->pending_exception = Qnil;
+        if (!NIL_P(pending)) {
+            rb_exc_raise(pending);
+        }
+        rb_thread_check_ints();
+        rb_raise(cEnclaveError, "execution interrupted");
+    }
 
     /* Check for resource limit errors — raise instead of returning in Result */
     if (result.error_kind == SANDBOX_ERROR_TIMEOUT) {
         const char *msg = result.error ? result.error : "execution timeout exceeded";
         VALUE exc_msg = rb_str_new_cstr(msg);
-        sandbox_result_free(&result);
+        sb->profile->result_free(&result);
         rb_exc_raise(rb_exc_new_str(cEnclaveTimeoutError, exc_msg));
     }
     if (result.error_kind == SANDBOX_ERROR_MEMORY_LIMIT) {
         const char *msg = result.error ? result.error : "memory limit exceeded";
         VALUE exc_msg = rb_str_new_cstr(msg);
-        sandbox_result_free(&result);
+        sb->profile->result_free(&result);
         rb_exc_raise(rb_exc_new_str(cEnclaveMemoryLimitError, exc_msg));
     }
 
@@ -348,20 +967,431 @@ enclave_eval(VALUE self, VALUE rb_code)
     VALUE output = result.output ? rb_str_new_cstr(result.output) : rb_str_new_cstr("");
     VALUE error = result.error ? rb_str_new_cstr(result.error) : Qnil;
 
-    sandbox_result_free(&result);
+    sb->profile->result_free(&result);
+
+    return rb_ary_new_from_args(4, value, output, error, enclave_stats_to_rb(&result.stats));
+}
+
+typedef struct {
+    rb_enclave_t     *sb;
+    const char       *code;
+    sandbox_result_t  result;
+    int               done;
+} eval_call_t;
+
+static void *
+enclave_eval_without_gvl(void *ptr)
+{
+    eval_call_t *call = (eval_call_t *)ptr;
+    call->result = call->sb->profile->state_eval(call->sb->state, call->code);
+    call->done = 1;
+    return NULL;
+}
+
+static VALUE
+enclave_eval(VALUE self, VALUE rb_code)
+{
+    rb_enclave_t *sb = get_enclave(self);
+    StringValueCStr(rb_code);
+
+    /* Frozen copy: other threads can't mutate the buffer while we run */
+    VALUE code = rb_str_new_frozen(rb_code);
+
+    eval_call_t call;
+    memset(&call, 0, sizeof(call));
+    call.sb = sb;
+    call.code = RSTRING_PTR(code);
+
+    sb->pending_exception = Qnil;
+    sb->jobs = Qnil;
+    sb->batches = Qnil;
+    enclave_call_without_gvl(sb, enclave_eval_without_gvl, &call, &call.done,
+                             enclave_unblock, sb);
+    RB_GC_GUARD(code);
+
+    return enclave_result_to_rb(sb, call.result);
+}
+
+/* ------------------------------------------------------------------ */
+/* Enclave::Script                                                     */
+/* ------------------------------------------------------------------ */
+
+/* A script runs only on states of the profile that compiled it */
+typedef struct {
+    const sandbox_profile_t *profile;
+    sandbox_script_t        *script;
+} rb_script_t;
+
+static void
+rb_script_free(void *ptr)
+{
+    rb_script_t *sc = (rb_script_t *)ptr;
+    sc->profile->script_free(sc->script);
+    free(sc);
+}
+
+static size_t
+rb_script_memsize(const void *ptr)
+{
+    const rb_script_t *sc = (const rb_script_t *)ptr;
+    return sizeof(*sc) + sc->profile->script_size(sc->script);
+}
+
+static const rb_data_type_t script_data_type = {
+    "Enclave::Script",
+    { NULL, rb_script_free, rb_script_memsize },
+    NULL, NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+typedef struct {
+    rb_enclave_t      *sb;
+    const char        *code;
+    const char *const *params;
+    int                nparams;
+    sandbox_script_t  *script;
+    char              *error;
+    int                done;
+} compile_call_t;
+
+static void *
+enclave_compile_without_gvl(void *ptr)
+{
+    compile_call_t *call = (compile_call_t *)ptr;
+    call->script = call->sb->profile->script_compile(call->sb->state, call->code,
+                                                     call->params, call->nparams,
+                                                     &call->error);
+    call->done = 1;
+    return NULL;
+}
+
+/* Enclave#_prepare(code, param_names) -> Enclave::Script */
+static VALUE
+enclave_prepare(VALUE self, VALUE rb_code, VALUE rb_params)
+{
+    rb_enclave_t *sb = get_enclave(self);
+    StringValueCStr(rb_code);
+    Check_Type(rb_params, T_ARRAY);
+
+    VALUE code = rb_str_new_frozen(rb_code);
+    VALUE params = rb_ary_new_capa(RARRAY_LEN(rb_params));
+    int nparams = (int)RARRAY_LEN(rb_params);
+    const char **names = ALLOCA_N(const char *, nparams > 0 ? nparams : 1);
+    for (int i = 0; i < nparams; i++) {
+        VALUE name = rb_str_new_frozen(rb_ary_entry(rb_params, i));
+        names[i] = StringValueCStr(name);
+        rb_ary_push(params, name);
+    }
+
+    compile_call_t call;
+    memset(&call, 0, sizeof(call));
+    call.sb = sb;
+    call.code = RSTRING_PTR(code);
+    call.params = names;
+    call.nparams = nparams;
+
+    enclave_call_without_gvl(sb, enclave_compile_without_gvl, &call, &call.done, NULL, NULL);
+    RB_GC_GUARD(code);
+    RB_GC_GUARD(params);
+
+    if (!call.script) {
+        VALUE msg = rb_str_new_cstr(call.error ? call.error : "compile failed");
+        free(call.error);
+        rb_exc_raise(rb_exc_new_str(cEnclaveError, msg));
+    }
+
+    rb_script_t *sc = malloc(sizeof(*sc));
+    if (!sc) {
+        sb->profile->script_free(call.script);
+        rb_memerror();
+    }
+    sc->profile = sb->profile;
+    sc->script = call.script;
+    VALUE script = TypedData_Wrap_Struct(cEnclaveScript, &script_data_type, sc);
+    rb_ivar_set(script, rb_intern("@source"), code);
+    return script;
+}
+
+typedef struct {
+    rb_enclave_t           *sb;
+    const sandbox_script_t *script;
+    const sandbox_value_t  *args;
+    int                     argc;
+    sandbox_result_t        result;
+    int                     done;
+} run_call_t;
 
-    return rb_ary_new_from_args(3, value, output, error);
+static void *
+enclave_run_without_gvl(void *ptr)
+{
+    run_call_t *call = (run_call_t *)ptr;
+    call->result = call->sb->profile->state_run(call->sb->state, call->script,
+                                                call->args, call->argc);
+    call->done = 1;
+    return NULL;
+}
+
+/* Enclave#_run(script, values) -> [value, output, error] */
+static VALUE
+enclave_run(VALUE self, VALUE rb_script, VALUE rb_values)
+{
+    rb_enclave_t *sb = get_enclave(self);
+    const sandbox_profile_t *profile = sb->profile;
+    rb_script_t *sc;
+    TypedData_Get_Struct(rb_script, rb_script_t, &script_data_type, sc);
+    Check_Type(rb_values, T_ARRAY);
+
+    if (sc->profile != profile) {
+        rb_raise(rb_eArgError, "script was prepared by a :%s enclave, this one is :%s",
+                 sc->profile->name, profile->name);
+    }
+    int argc = (int)RARRAY_LEN(rb_values);
+    if (argc != profile->script_arity(sc->script)) {
+        rb_raise(rb_eArgError, "wrong number of params (given %d, expected %d)",
+                 argc, profile->script_arity(sc->script));
+    }
+
+    /* Bound values cross the boundary like tool results, in the state's
+     * arena (reset up front too, in case a conversion raised last time) */
+    sandbox_arena_t *arena = profile->state_arena(sb->state);
+    profile->arena_reset(arena);
+    sandbox_value_t *args = arena_alloc(profile, arena, (size_t)argc * sizeof(sandbox_value_t));
+    char errbuf[256];
+    errbuf[0] = '\0';
+    for (int i = 0; i < argc; i++) {
+        if (rb_to_sandbox_value(profile, rb_ary_entry(rb_values, i), &args[i], arena,
+                                errbuf, sizeof(errbuf)) != 0) {
+            profile->arena_reset(arena);
+            rb_raise(rb_eTypeError, "%s", errbuf);
+        }
+    }
+
+    run_call_t call;
+    memset(&call, 0, sizeof(call));
+    call.sb = sb;
+    call.script = sc->script;
+    call.args = args;
+    call.argc = argc;
+
+    sb->pending_exception = Qnil;
+    sb->jobs = Qnil;
+    sb->batches = Qnil;
+    enclave_call_without_gvl(sb, enclave_run_without_gvl, &call, &call.done,
+                             enclave_unblock, sb);
+    RB_GC_GUARD(rb_script);
+    profile->arena_reset(arena);
+
+    return enclave_result_to_rb(sb, call.result);
 }
 
 /* ------------------------------------------------------------------ */
 /* Enclave#reset!                                                      */
 /* ------------------------------------------------------------------ */
 
+typedef struct {
+    rb_enclave_t *sb;
+    int           done;
+} reset_call_t;
+
+static void *
+enclave_reset_without_gvl(void *ptr)
+{
+    reset_call_t *call = (reset_call_t *)ptr;
+    call->sb->profile->state_reset(call->sb->state);
+    call->done = 1;
+    return NULL;
+}
+
 static VALUE
 enclave_reset(VALUE self)
 {
     rb_enclave_t *sb = get_enclave(self);
-    sandbox_state_reset(sb->state);
+
+    reset_call_t call;
+    memset(&call, 0, sizeof(call));
+    call.sb = sb;
+
+    enclave_call_without_gvl(sb, enclave_reset_without_gvl, &call, &call.done, NULL, NULL);
+    return self;
+}
+
+/* ------------------------------------------------------------------ */
+/* Enclave#scrub!                                                      */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    rb_enclave_t *sb;
+    int           fell_back;
+    int           done;
+} scrub_call_t;
+
+static void *
+enclave_scrub_without_gvl(void *ptr)
+{
+    scrub_call_t *call = (scrub_call_t *)ptr;
+    call->fell_back = call->sb->profile->state_scrub(call->sb->state);
+    call->done = 1;
+    return NULL;
+}
+
+/* true if scrubbed in place, false if it fell back to a full reset */
+static VALUE
+enclave_scrub(VALUE self)
+{
+    rb_enclave_t *sb = get_enclave(self);
+
+    scrub_call_t call;
+    memset(&call, 0, sizeof(call));
+    call.sb = sb;
+
+    enclave_call_without_gvl(sb, enclave_scrub_without_gvl, &call, &call.done, NULL, NULL);
+    return call.fell_back ? Qfalse : Qtrue;
+}
+
+/* ------------------------------------------------------------------ */
+/* Enclave#_checkpoint / #_rollback / #_drop_checkpoint                */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    rb_enclave_t *sb;
+    uint64_t      id;
+    int           ret;
+    int           done;
+} checkpoint_call_t;
+
+static void *
+enclave_checkpoint_without_gvl(void *ptr)
+{
+    checkpoint_call_t *call = (checkpoint_call_t *)ptr;
+    call->id = call->sb->profile->state_checkpoint(call->sb->state);
+    call->done = 1;
+    return NULL;
+}
+
+static void *
+enclave_rollback_without_gvl(void *ptr)
+{
+    checkpoint_call_t *call = (checkpoint_call_t *)ptr;
+    call->ret = call->sb->profile->state_rollback(call->sb->state, call->id);
+    call->done = 1;
+    return NULL;
+}
+
+static VALUE
+enclave_checkpoint(VALUE self)
+{
+    rb_enclave_t *sb = get_enclave(self);
+    if (!sb->profile->state_can_checkpoint(sb->state)) {
+        rb_raise(cEnclaveError, "checkpoints need allocator: :slab");
+    }
+
+    checkpoint_call_t call;
+    memset(&call, 0, sizeof(call));
+    call.sb = sb;
+
+    enclave_call_without_gvl(sb, enclave_checkpoint_without_gvl, &call, &call.done, NULL, NULL);
+    if (call.id == 0) rb_memerror();
+    return ULL2NUM(call.id);
+}
+
+static VALUE
+enclave_rollback(VALUE self, VALUE rb_id)
+{
+    rb_enclave_t *sb = get_enclave(self);
+
+    checkpoint_call_t call;
+    memset(&call, 0, sizeof(call));
+    call.sb = sb;
+    call.id = NUM2ULL(rb_id);
+
+    enclave_call_without_gvl(sb, enclave_rollback_without_gvl, &call, &call.done, NULL, NULL);
+    return call.ret == 0 ? Qtrue : Qfalse;
+}
+
+static VALUE
+enclave_drop_checkpoint(VALUE self, VALUE rb_id)
+{
+    rb_enclave_t *sb = get_enclave(self);
+    sb->profile->state_release_checkpoint(sb->state, NUM2ULL(rb_id));
+    return Qnil;
+}
+
+/* ------------------------------------------------------------------ */
+/* Enclave#dump_session / #_load_session                               */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    rb_enclave_t *sb;
+    const char   *blob;
+    char         *dumped;
+    size_t        len;
+    char         *error;
+    int           ret;
+    int           done;
+} session_call_t;
+
+static void *
+enclave_dump_session_without_gvl(void *ptr)
+{
+    session_call_t *call = (session_call_t *)ptr;
+    call->dumped = call->sb->profile->state_dump_session(call->sb->state, &call->len,
+                                                         &call->error);
+    call->done = 1;
+    return NULL;
+}
+
+static void *
+enclave_load_session_without_gvl(void *ptr)
+{
+    session_call_t *call = (session_call_t *)ptr;
+    call->ret = call->sb->profile->state_load_session(call->sb->state, call->blob, call->len,
+                                                      &call->error);
+    call->done = 1;
+    return NULL;
+}
+
+static void
+raise_session_error(session_call_t *call, const char *fallback)
+{
+    VALUE msg = rb_str_new_cstr(call->error ? call->error : fallback);
+    free(call->error);
+    rb_exc_raise(rb_exc_new_str(cEnclaveError, msg));
+}
+
+/* Enclave#dump_session -> String (binary) */
+static VALUE
+enclave_dump_session(VALUE self)
+{
+    rb_enclave_t *sb = get_enclave(self);
+
+    session_call_t call;
+    memset(&call, 0, sizeof(call));
+    call.sb = sb;
+
+    enclave_call_without_gvl(sb, enclave_dump_session_without_gvl, &call, &call.done, NULL, NULL);
+    if (!call.dumped) raise_session_error(&call, "dump failed");
+
+    VALUE blob = rb_str_new(call.dumped, (long)call.len);
+    free(call.dumped);
+    return blob;
+}
+
+/* Enclave#_load_session(blob) */
+static VALUE
+enclave_load_session(VALUE self, VALUE rb_blob)
+{
+    rb_enclave_t *sb = get_enclave(self);
+    VALUE blob = rb_str_new_frozen(StringValue(rb_blob));
+
+    session_call_t call;
+    memset(&call, 0, sizeof(call));
+    call.sb = sb;
+    call.blob = RSTRING_PTR(blob);
+    call.len = (size_t)RSTRING_LEN(blob);
+
+    enclave_call_without_gvl(sb, enclave_load_session_without_gvl, &call, &call.done, NULL, NULL);
+    RB_GC_GUARD(blob);
+    if (call.ret != 0) raise_session_error(&call, "load failed");
     return self;
 }
 
@@ -375,11 +1405,15 @@ enclave_close(VALUE self)
     rb_enclave_t *sb;
     TypedData_Get_Struct(self, rb_enclave_t, &enclave_data_type, sb);
 
+    if (sb->busy) {
+        rb_raise(rb_eRuntimeError, "enclave is busy (already evaluating)");
+    }
     if (!sb->closed) {
         if (sb->state) {
-            sandbox_state_free(sb->state);
+            sb->profile->state_free(sb->state);
             sb->state = NULL;
         }
+        enclave_report_memory(sb);
         sb->closed = 1;
     }
     return Qnil;
@@ -393,6 +1427,162 @@ enclave_closed_p(VALUE self)
     return sb->closed ? Qtrue : Qfalse;
 }
 
+/* ------------------------------------------------------------------ */
+/* Enclave.bytecode_cache_*                                            */
+/*                                                                     */
+/* Each profile has its own cache; these act on all of them, and the   */
+/* stats are the totals.                                               */
+/* ------------------------------------------------------------------ */
+
+static VALUE
+enclave_s_bytecode_cache_stats(VALUE klass)
+{
+    sandbox_cache_stats_t stats;
+    enclave_profiles[0]->cache_stats(&stats);
+    for (int i = 1; i < ENCLAVE_PROFILE_COUNT; i++) {
+        sandbox_cache_stats_t more;
+        enclave_profiles[i]->cache_stats(&more);
+        stats.hits      += more.hits;
+        stats.misses    += more.misses;
+        stats.evictions += more.evictions;
+        stats.entries   += more.entries;
+        stats.bytes     += more.bytes;
+    }
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("hits")),      ULL2NUM(stats.hits));
+    rb_hash_aset(hash, ID2SYM(rb_intern("misses")),    ULL2NUM(stats.misses));
+    rb_hash_aset(hash, ID2SYM(rb_intern("evictions")), ULL2NUM(stats.evictions));
+    rb_hash_aset(hash, ID2SYM(rb_intern("entries")),   SIZET2NUM(stats.entries));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes")),     SIZET2NUM(stats.bytes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("limit")),     SIZET2NUM(stats.limit));
+    return hash;
+}
+
+static VALUE
+enclave_s_bytecode_cache_limit(VALUE klass)
+{
+    sandbox_cache_stats_t stats;
+    enclave_profiles[0]->cache_stats(&stats);
+    return SIZET2NUM(stats.limit);
+}
+
+static VALUE
+enclave_s_set_bytecode_cache_limit(VALUE klass, VALUE rb_bytes)
+{
+    size_t bytes = NIL_P(rb_bytes) ? 0 : NUM2SIZET(rb_bytes);
+    for (int i = 0; i < ENCLAVE_PROFILE_COUNT; i++) {
+        enclave_profiles[i]->cache_set_limit(bytes);
+    }
+    return rb_bytes;
+}
+
+static VALUE
+enclave_s_clear_bytecode_cache(VALUE klass)
+{
+    for (int i = 0; i < ENCLAVE_PROFILE_COUNT; i++) {
+        enclave_profiles[i]->cache_clear();
+    }
+    return Qnil;
+}
+
+/* ------------------------------------------------------------------ */
+/* Enclave.optional_gems                                               */
+/* ------------------------------------------------------------------ */
+
+static VALUE
+enclave_s_optional_gems(VALUE klass)
+{
+    VALUE names = rb_ary_new();
+    for (int i = 0; i < sandbox_gem_count(); i++) {
+        const char *name = sandbox_gem_name(i);
+        if (name) rb_ary_push(names, ID2SYM(rb_intern(name)));
+    }
+    return names;
+}
+
+/* ------------------------------------------------------------------ */
+/* Enclave.profiles                                                    */
+/* ------------------------------------------------------------------ */
+
+static VALUE
+enclave_s_profiles(VALUE klass)
+{
+    VALUE names = rb_ary_new_capa(ENCLAVE_PROFILE_COUNT);
+    for (int i = 0; i < ENCLAVE_PROFILE_COUNT; i++) {
+        rb_ary_push(names, ID2SYM(rb_intern(enclave_profiles[i]->name)));
+    }
+    return names;
+}
+
+/* ------------------------------------------------------------------ */
+/* Enclave._preload                                                    */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    const sandbox_profile_t *profile;
+    sandbox_allocator_t allocator;
+    uint32_t            gems;
+    const char        **functions;
+    int                 nfunctions;
+    const char         *prelude;
+    char               *error;
+    int                 ret;
+    int                 done;
+} preload_call_t;
+
+static void *
+enclave_preload_without_gvl(void *ptr)
+{
+    preload_call_t *call = (preload_call_t *)ptr;
+    call->ret = call->profile->prototype_build(call->allocator, call->gems,
+                                               call->functions, call->nfunctions,
+                                               call->prelude, &call->error);
+    call->done = 1;
+    return NULL;
+}
+
+/* Enclave._preload(function_names, prelude, allocator, gems, profile) */
+static VALUE
+enclave_s_preload(VALUE klass, VALUE rb_functions, VALUE rb_prelude, VALUE rb_allocator,
+                  VALUE rb_gems, VALUE rb_profile)
+{
+    Check_Type(rb_functions, T_ARRAY);
+    int allocator = sandbox_allocator_lookup(rb_id2name(SYM2ID(rb_to_symbol(rb_allocator))));
+    if (allocator < 0) {
+        rb_raise(rb_eArgError, "unknown allocator: %+"PRIsVALUE, rb_allocator);
+    }
+
+    long n = RARRAY_LEN(rb_functions);
+    VALUE names = rb_ary_new_capa(n);  /* keeps the C strings alive */
+    const char **functions = ALLOCA_N(const char *, n > 0 ? n : 1);
+    for (long i = 0; i < n; i++) {
+        VALUE name = rb_str_new_frozen(rb_String(rb_ary_entry(rb_functions, i)));
+        rb_ary_push(names, name);
+        functions[i] = StringValueCStr(name);
+    }
+
+    preload_call_t call;
+    memset(&call, 0, sizeof(call));
+    call.profile = enclave_profile(rb_profile);
+    call.allocator = (sandbox_allocator_t)allocator;
+    call.gems = enclave_gem_set(rb_gems);
+    call.functions = functions;
+    call.nfunctions = (int)n;
+    call.prelude = NIL_P(rb_prelude) ? NULL : StringValueCStr(rb_prelude);
+
+    enclave_call_without_gvl(NULL, enclave_preload_without_gvl, &call, &call.done, NULL, NULL);
+    RB_GC_GUARD(names);
+    RB_GC_GUARD(rb_prelude);
+
+    if (call.ret != 0) {
+        VALUE msg = rb_str_new_cstr(call.error ? call.error : "preload failed");
+        free(call.error);
+        rb_exc_raise(rb_exc_new_str(cEnclaveError, msg));
+    }
+    return Qnil;
+}
+
 /* ------------------------------------------------------------------ */
 /* Init                                                                */
 /* ------------------------------------------------------------------ */
@@ -400,7 +1590,7 @@ enclave_closed_p(VALUE self)
 void
 Init_enclave(void)
 {
-    VALUE cEnclave = rb_define_class("Enclave", rb_cObject);
+    cEnclave = rb_define_class("Enclave", rb_cObject);
 
     /* Error class hierarchy */
     cEnclaveError = rb_define_class_under(cEnclave, "Error", rb_eStandardError);
@@ -411,11 +1601,35 @@ Init_enclave(void)
     rb_gc_register_mark_object(cEnclaveTimeoutError);
     rb_gc_register_mark_object(cEnclaveMemoryLimitError);
 
+    visit_no_key = rb_obj_freeze(rb_obj_alloc(rb_cObject));
+    rb_gc_register_mark_object(visit_no_key);
+
+    cEnclaveScript = rb_define_class_under(cEnclave, "Script", rb_cObject);
+    rb_undef_alloc_func(cEnclaveScript);
+    rb_gc_register_mark_object(cEnclaveScript);
+
     rb_define_alloc_func(cEnclave, enclave_alloc);
-    rb_define_method(cEnclave, "_init",            enclave_initialize,      2);
+    rb_define_method(cEnclave, "_init",            enclave_initialize,      6);
     rb_define_method(cEnclave, "_eval",            enclave_eval,            1);
-    rb_define_method(cEnclave, "_define_function", enclave_define_function, 1);
+    rb_define_method(cEnclave, "_bind_toolset",    enclave_bind_toolset,    2);
+    rb_define_method(cEnclave, "_clear_functions", enclave_clear_functions, 0);
+    rb_define_method(cEnclave, "_prepare",         enclave_prepare,         2);
+    rb_define_method(cEnclave, "_run",             enclave_run,             2);
+    rb_define_method(cEnclave, "_checkpoint",      enclave_checkpoint,      0);
+    rb_define_method(cEnclave, "_rollback",        enclave_rollback,        1);
+    rb_define_method(cEnclave, "_drop_checkpoint", enclave_drop_checkpoint, 1);
+    rb_define_method(cEnclave, "dump_session",     enclave_dump_session,    0);
+    rb_define_method(cEnclave, "_load_session",    enclave_load_session,    1);
     rb_define_method(cEnclave, "reset!",           enclave_reset,           0);
+    rb_define_method(cEnclave, "scrub!",           enclave_scrub,           0);
     rb_define_method(cEnclave, "close",            enclave_close,           0);
     rb_define_method(cEnclave, "closed?",          enclave_closed_p,        0);
+
+    rb_define_singleton_method(cEnclave, "bytecode_cache_stats",  enclave_s_bytecode_cache_stats,     0);
+    rb_define_singleton_method(cEnclave, "bytecode_cache_limit",  enclave_s_bytecode_cache_limit,     0);
+    rb_define_singleton_method(cEnclave, "bytecode_cache_limit=", enclave_s_set_bytecode_cache_limit, 1);
+    rb_define_singleton_method(cEnclave, "clear_bytecode_cache",  enclave_s_clear_bytecode_cache,     0);
+    rb_define_singleton_method(cEnclave, "optional_gems",         enclave_s_optional_gems,            0);
+    rb_define_singleton_method(cEnclave, "profiles",              enclave_s_profiles,                 0);
+    rb_define_singleton_method(cEnclave, "_preload",              enclave_s_preload,                  5);
 }
@@ -5,6 +5,7 @@ ext_dir = File.expand_path(File.dirname(__FILE__))
 mruby_dir = File.join(ext_dir, "mruby")
 build_config = File.join(ext_dir, "sandbox_build_config.rb")
 mruby_build_dir = File.join(mruby_dir, "build", "host")
+lean_build_dir = File.join(mruby_dir, "build", "lean")
 
 # Check for mruby source (submodule may not be initialized after git clone)
 unless File.exist?(File.join(mruby_dir, "Rakefile"))
@@ -18,11 +19,34 @@ unless File.exist?(File.join(mruby_dir, "Rakefile"))
   MSG
 end
 
+# profile: :lean links a second copy of mruby and sandbox_core.c into the
+# extension. Both copies define the same symbols, so the lean one is
+# merged into a single object and everything in it but its profile table
+# is made local, which takes objcopy (GNU binutils or llvm-objcopy).
+# ENCLAVE_LEAN=0 skips it.
+objcopy = ENV["ENCLAVE_LEAN"] != "0" && (find_executable("objcopy") || find_executable("llvm-objcopy"))
+lean_lib = File.join(lean_build_dir, "lib", "libmruby.a")
+
 # Build mruby from source
-unless File.exist?(File.join(mruby_build_dir, "lib", "libmruby.a"))
+unless File.exist?(File.join(mruby_build_dir, "lib", "libmruby.a")) && (!objcopy || File.exist?(lean_lib))
   puts "Building mruby..."
-  system("cd #{mruby_dir} && MRUBY_CONFIG=#{build_config} rake -f #{mruby_dir}/Rakefile -j1") || abort("mruby build failed")
+  system("cd #{mruby_dir} && ENCLAVE_LEAN=#{objcopy ? 1 : 0} MRUBY_CONFIG=#{build_config} " \
+         "rake -f #{mruby_dir}/Rakefile -j1") || abort("mruby build failed")
+end
+
+# Gems compiled into libmruby, in init order. sandbox_core.c runs their
+# inits itself instead of mrb_open, so optional ones can be left out or
+# loaded lazily.
+gem_init = File.join(mruby_build_dir, "mrbgems", "gem_init.c")
+unless File.exist?(gem_init)
+  abort("#{gem_init} not found, so the sandbox's gems can't be listed. " \
+        "Remove #{mruby_build_dir} and build again.")
 end
+gems = File.read(gem_init).scan(/GENERATED_TMP_mrb_(\w+?)_gem_init\b/).flatten.uniq
+File.write("sandbox_gems.h", <<~H)
+  /* Generated by extconf.rb from mruby's gem_init.c. Do not edit. */
+  #{gems.map { |gem| "SANDBOX_GEM(#{gem})" }.join("\n")}
+H
 
 # mruby headers (only used by sandbox_core.c, not enclave.c)
 $INCFLAGS << " -I#{File.join(mruby_dir, 'include')}"
@@ -34,6 +58,10 @@ $INCFLAGS << " -I#{ext_dir}"
 # Must match the defines used when building mruby
 $CFLAGS << " -DMRB_USE_DEBUG_HOOK"
 
+# ENCLAVE_POLL_HOOK=1 keeps the code fetch hook installed for the whole
+# eval instead of having other threads install it (see sandbox_arm_hook)
+$defs << "-DSANDBOX_POLL_HOOK" if ENV["ENCLAVE_POLL_HOOK"] == "1"
+
 # Both .c files in the extension directory
 $srcs = [
   File.join(ext_dir, "enclave.c"),
@@ -45,4 +73,31 @@ $LDFLAGS << " -L#{File.join(mruby_build_dir, 'lib')}"
 $libs << " #{File.join(mruby_build_dir, 'lib', 'libmruby.a')}"
 $libs << " -lm"
 
+if objcopy
+  # The lean build's defines, as mruby recorded them
+  flags = File.read(File.join(lean_build_dir, "lib", "libmruby.flags.mak"))
+  lean_defines = flags[/^MRUBY_CFLAGS\s*=(.*)$/, 1].to_s.scan(/-D\S+/)
+
+  $defs << "-DSANDBOX_HAVE_LEAN"
+  $objs = %w[enclave.o sandbox_core.o sandbox_lean.o]
+end
+
 create_makefile("enclave/enclave")
+
+if objcopy
+  # Same flags as sandbox_core.o, but the lean build's headers come first
+  lean_cflags = [
+    "-I#{File.join(lean_build_dir, 'include')} $(INCFLAGS) $(CPPFLAGS) $(CFLAGS)",
+    *lean_defines, "-DSANDBOX_PROFILE=lean"
+  ].join(" ")
+
+  File.open("Makefile", "a") do |mk|
+    mk.puts <<~MAKE
+
+      sandbox_lean.o: #{File.join(ext_dir, 'sandbox_core.c')} #{File.join(ext_dir, 'sandbox_core.h')} #{lean_lib}
+      \t$(CC) #{lean_cflags} -c #{File.join(ext_dir, 'sandbox_core.c')} -o sandbox_core_lean.o
+      \t$(CC) -r -nostdlib -o $@ sandbox_core_lean.o #{lean_lib}
+      \t#{objcopy} --keep-global-symbol=sandbox_profile_lean $@
+    MAKE
+  end
+end
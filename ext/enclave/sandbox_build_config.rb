@@ -1,4 +1,4 @@
-MRuby::Build.new do |conf|
+sandbox_build = lambda do |conf|
   conf.toolchain :clang
 
   # Safe standard library — no IO, no sockets, no filesystem
@@ -10,9 +10,31 @@ MRuby::Build.new do |conf|
   # print gem gives us Kernel#print and Kernel#p (we override __printstr__ equivalent)
   # NOT included: mruby-io (File, Socket, Dir), mruby-bin-* (executables)
 
-  # Enable debug hook for code_fetch_hook (used for timeout)
+  # Enable debug hook for code_fetch_hook (used for timeout and interrupts).
+  # The hook is only installed once an eval has to stop; until then the VM
+  # just tests a NULL pointer per instruction.
   conf.cc.defines << "MRB_USE_DEBUG_HOOK"
 
   # Build as static library only — we link into the Ruby C extension
   conf.cc.flags << "-fPIC"
 end
+
+MRuby::Build.new do |conf|
+  sandbox_build.call(conf)
+end
+
+# profile: :lean — same gems, tuned for many idle states rather than
+# throughput. extconf.rb asks for it with ENCLAVE_LEAN=1 and reads the
+# defines back from build/lean/lib/libmruby.flags.mak, so this is the only
+# place they are listed.
+if ENV["ENCLAVE_LEAN"] == "1"
+  MRuby::Build.new("lean") do |conf|
+    sandbox_build.call(conf)
+
+    conf.cc.defines << "MRB_WORD_BOXING"          # one word per value (the 64-bit default, made explicit)
+    conf.cc.defines << "MRB_HEAP_PAGE_SIZE=128"   # objects per GC page (default 1024)
+    conf.cc.defines << "MRB_GC_ARENA_SIZE=32"     # (default 100)
+    conf.cc.defines << "MRB_METHOD_CACHE_SIZE=64" # entries, power of 2 (default 256)
+    # The initial VM stack (128 slots, 32 frames) is fixed in vm.c.
+  end
+end
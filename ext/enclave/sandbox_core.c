@@ -17,939 +17,5768 @@
 #include <mruby/irep.h>
 #include <mruby/internal.h>
 #include <mruby/class.h>
+#include <mruby/dump.h>
+#include <mruby/variable.h>
+#include <mruby/range.h>
+#include <mruby/object.h>
+#include <mruby/opcode.h>
 
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 /* ------------------------------------------------------------------ */
-/* Memory tracking allocator                                           */
+/* Per-state heaps                                                     */
+/*                                                                     */
+/* Each state owns a heap: memory_limit accounting plus the backend    */
+/* that serves its mruby allocations. mruby has no per-state allocf,   */
+/* so mrb_basic_alloc_func finds the heap through a thread-local that  */
+/* heap_enter sets around every call into the state's mrb.             */
 /* ------------------------------------------------------------------ */
 
-/* Header prepended to every allocation for size tracking.
- * Aligned to max_align_t so the payload stays properly aligned. */
-#define MEM_HEADER_SIZE \
-    ((sizeof(size_t) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+typedef struct sandbox_heap sandbox_heap_t;
 
+/* Backends see only the raw requests; limits and accounting are applied
+ * once in mrb_basic_alloc_func. init and destroy may be NULL. A backend
+ * with release holds every block of the heap, so an mrb_state on it can
+ * be discarded without mrb_close; one with checkpoint can put all of
+ * its blocks back as they were later, at the same addresses. The
+ * pinned span passed to checkpoint may be written by other threads. */
 typedef struct {
+    const char *name;
+    int    (*init)(sandbox_heap_t *heap);       /* 0 on success */
+    void   (*destroy)(sandbox_heap_t *heap);    /* after mrb_close or release */
+    void   (*release)(sandbox_heap_t *heap);    /* drop every block at once, or NULL */
+    void  *(*malloc)(sandbox_heap_t *heap, size_t size);
+    void  *(*realloc)(sandbox_heap_t *heap, void *ptr, size_t old_size, size_t size);
+    void   (*free)(sandbox_heap_t *heap, void *ptr, size_t size);
+    size_t (*size_of)(sandbox_heap_t *heap, const void *ptr);  /* bytes charged */
+    void  *(*checkpoint)(sandbox_heap_t *heap, const void *pinned, size_t pinned_len);  /* NULL on OOM */
+    void   (*rollback)(sandbox_heap_t *heap, void *snapshot); /* newer ones dropped first */
+    void   (*discard)(sandbox_heap_t *heap, void *snapshot);
+} heap_backend_t;
+
+struct sandbox_heap {
     size_t current;    /* current total bytes allocated */
     size_t limit;      /* 0 = unlimited */
     int    exceeded;   /* flag: set when limit was hit */
-} mem_tracker_t;
+    const heap_backend_t *backend;
+    void  *impl;       /* backend data */
+    size_t peak;       /* most bytes held since sandbox_limits_begin */
+};
+
+static __thread sandbox_heap_t *tl_heap = NULL;
+
+/* ---- system: malloc with a size header ---- */
+
+/* Header prepended to every allocation for size tracking.
+ * Aligned to max_align_t so the payload stays properly aligned. */
+#define MEM_HEADER_SIZE \
+    ((sizeof(size_t) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
 
-static __thread mem_tracker_t *tl_mem_tracker = NULL;
+static void *
+system_heap_malloc(sandbox_heap_t *heap, size_t size)
+{
+    char *block = malloc(MEM_HEADER_SIZE + size);
+    if (!block) return NULL;
+    *(size_t *)block = size;
+    return block + MEM_HEADER_SIZE;
+}
 
-static mem_tracker_t *
-mem_tracker_activate(mem_tracker_t *tracker)
+static void *
+system_heap_realloc(sandbox_heap_t *heap, void *ptr, size_t old_size, size_t size)
 {
-    mem_tracker_t *prev = tl_mem_tracker;
-    tl_mem_tracker = tracker;
-    return prev;
+    char *block = realloc((char *)ptr - MEM_HEADER_SIZE, MEM_HEADER_SIZE + size);
+    if (!block) return NULL;
+    *(size_t *)block = size;
+    return block + MEM_HEADER_SIZE;
 }
 
 static void
-mem_tracker_restore(mem_tracker_t *prev)
+system_heap_free(sandbox_heap_t *heap, void *ptr, size_t size)
 {
-    tl_mem_tracker = prev;
+    free((char *)ptr - MEM_HEADER_SIZE);
 }
 
-/* Override mrb_basic_alloc_func from mruby's allocf.c.
- * Our object file is linked before libmruby.a, so this definition wins.
- * ALWAYS prepends a size_t header for tracking. The tracker (when active)
- * provides limit enforcement; headers are prepended regardless. */
-void *
-mrb_basic_alloc_func(void *ptr, size_t size)
+static size_t
+system_heap_size_of(sandbox_heap_t *heap, const void *ptr)
 {
-    mem_tracker_t *tracker = tl_mem_tracker;
+    return *(const size_t *)((const char *)ptr - MEM_HEADER_SIZE);
+}
 
-    /* Free */
-    if (size == 0) {
-        if (ptr) {
-            char *hdr = (char *)ptr - MEM_HEADER_SIZE;
-            size_t old_size = *(size_t *)hdr;
-            if (tracker) tracker->current -= old_size;
-            free(hdr);
-        }
-        return NULL;
+static const heap_backend_t system_heap_backend = {
+    .name    = "system",
+    .malloc  = system_heap_malloc,
+    .realloc = system_heap_realloc,
+    .free    = system_heap_free,
+    .size_of = system_heap_size_of,
+};
+
+/* ---- slab: size classes in aligned pages, no per-block header ---- */
+
+/* Pages are SLAB_PAGE_SIZE-aligned and start with a slab_page_t, so the
+ * owning page (and with it the block size) is found by masking the
+ * pointer. Requests above the largest class get a page of their own, or
+ * a mapping of their own when they don't fit in one.
+ *
+ * Pages are carved from mmap'd region chunks owned by the heap, so the
+ * whole heap can be dropped with one munmap per chunk (see release)
+ * instead of mrb_close freeing it object by object. */
+#define SLAB_PAGE_SIZE    (64 * 1024)
+#define SLAB_MAX_SIZE     4096
+#define SLAB_LARGE        0xffff
+#define SLAB_SPARE_PAGES  4              /* empty pages kept resident */
+#define REGION_CHUNK_SIZE (1024 * 1024)  /* 16 pages */
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+static const uint16_t slab_class_size[] = {
+      16,   32,   48,   64,   80,   96,  112,  128,
+     160,  192,  224,  256,  320,  384,  448,  512,
+     640,  768,  896, 1024, 1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096
+};
+
+#define SLAB_CLASS_COUNT ((int)(sizeof(slab_class_size) / sizeof(slab_class_size[0])))
+
+typedef struct slab_page {
+    struct slab_page *next;
+    struct slab_page *prev;
+    void    *free;          /* freed blocks, linked through their first word */
+    char    *bump;          /* start of the never-used tail */
+    size_t   size;          /* large pages: bytes requested */
+    uint32_t nfree;         /* blocks available (free list + tail);
+                               mapped large blocks: epoch they were made in */
+    uint16_t cls;           /* index into slab_class_size, or SLAB_LARGE */
+} slab_page_t;
+
+#define SLAB_PAGE_HEADER \
+    ((sizeof(slab_page_t) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+#define SLAB_PAGE_OF(ptr) ((slab_page_t *)((uintptr_t)(ptr) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1)))
+
+/* Chunk bookkeeping lives outside the mapping */
+typedef struct region_chunk {
+    struct region_chunk *next;
+    char   *base;
+    size_t  used;           /* bytes handed out as pages */
+} region_chunk_t;
+
+/* A mapped large block freed while snapshots exist. It stays mapped so a
+ * rollback can bring it back at the same address. */
+typedef struct {
+    void    *base;
+    uint32_t epoch;
+} slab_retired_t;
+
+typedef struct {
+    slab_page_t    *partial[SLAB_CLASS_COUNT];  /* pages with free blocks */
+    slab_page_t    *full[SLAB_CLASS_COUNT];
+    slab_page_t    *large;
+    slab_page_t    *spare;
+    int             nspare;
+    region_chunk_t *chunks;   /* head is the one being carved */
+    size_t          nchunks;
+
+    /* Snapshots. The epoch advances at every checkpoint, so blocks mapped
+     * after a snapshot are the ones with a later epoch. */
+    uint32_t        epoch;
+    int             nsnapshots;
+    struct slab_snapshot *snapshots;  /* newest first */
+    slab_retired_t *retired;
+    size_t          nretired;
+    size_t          retired_cap;
+} slab_heap_t;
+
+/* Size class by (size + 15) / 16, filled once */
+static uint8_t slab_class_index[SLAB_MAX_SIZE / 16 + 1];
+static size_t  region_os_page;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+static void
+slab_once_init(void)
+{
+    int cls = 0;
+    for (int i = 0; i <= SLAB_MAX_SIZE / 16; i++) {
+        while (slab_class_size[cls] < i * 16) cls++;
+        slab_class_index[i] = (uint8_t)cls;
     }
+    region_os_page = (size_t)sysconf(_SC_PAGESIZE);
+}
 
-    /* Malloc */
-    if (ptr == NULL) {
-        if (tracker && tracker->limit > 0 &&
-            (tracker->current + size) > tracker->limit) {
-            tracker->exceeded = 1;
-            return NULL; /* mruby will GC and retry, then raise NoMemoryError */
-        }
-        size_t total = MEM_HEADER_SIZE + size;
-        char *block = (char *)malloc(total);
-        if (!block) return NULL;
-        *(size_t *)block = size;
-        if (tracker) tracker->current += size;
-        return block + MEM_HEADER_SIZE;
-    }
-
-    /* Realloc */
-    {
-        char *old_hdr = (char *)ptr - MEM_HEADER_SIZE;
-        size_t old_size = *(size_t *)old_hdr;
-        if (tracker && tracker->limit > 0 &&
-            (tracker->current - old_size + size) > tracker->limit) {
-            tracker->exceeded = 1;
-            return NULL;
+/* Map len bytes aligned to SLAB_PAGE_SIZE */
+static void *
+region_map(size_t len)
+{
+    size_t span = len + SLAB_PAGE_SIZE;
+    char *p = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    char *base = (char *)(((uintptr_t)p + SLAB_PAGE_SIZE - 1) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    if (base > p) munmap(p, (size_t)(base - p));
+    munmap(base + len, (size_t)((p + span) - (base + len)));
+    return base;
+}
+
+/* Mapping length for a large block that doesn't fit in one page */
+static size_t
+region_large_len(size_t size)
+{
+    return (SLAB_PAGE_HEADER + size + region_os_page - 1) & ~(region_os_page - 1);
+}
+
+static uint32_t
+slab_capacity(int cls)
+{
+    return (SLAB_PAGE_SIZE - SLAB_PAGE_HEADER) / slab_class_size[cls];
+}
+
+static void
+slab_unlink(slab_page_t **list, slab_page_t *page)
+{
+    if (page->prev) page->prev->next = page->next;
+    else *list = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->next = page->prev = NULL;
+}
+
+static void
+slab_push(slab_page_t **list, slab_page_t *page)
+{
+    page->prev = NULL;
+    page->next = *list;
+    if (*list) (*list)->prev = page;
+    *list = page;
+}
+
+/* A blank page: a spare, or the next one from the current chunk */
+static slab_page_t *
+slab_page_get(slab_heap_t *slab)
+{
+    slab_page_t *page = slab->spare;
+    if (page) {
+        slab->spare = page->next;
+        slab->nspare--;
+    } else {
+        region_chunk_t *chunk = slab->chunks;
+        if (!chunk || chunk->used == REGION_CHUNK_SIZE) {
+            chunk = malloc(sizeof(region_chunk_t));
+            if (!chunk) return NULL;
+            chunk->base = region_map(REGION_CHUNK_SIZE);
+            if (!chunk->base) {
+                free(chunk);
+                return NULL;
+            }
+            chunk->used = 0;
+            chunk->next = slab->chunks;
+            slab->chunks = chunk;
+            slab->nchunks++;
         }
-        size_t total = MEM_HEADER_SIZE + size;
-        char *new_block = (char *)realloc(old_hdr, total);
-        if (!new_block) return NULL;
-        if (tracker) tracker->current = tracker->current - old_size + size;
-        *(size_t *)new_block = size;
-        return new_block + MEM_HEADER_SIZE;
+        page = (slab_page_t *)(chunk->base + chunk->used);
+        chunk->used += SLAB_PAGE_SIZE;
     }
+    memset(page, 0, sizeof(*page));
+    return page;
 }
 
-/* ------------------------------------------------------------------ */
-/* Timeout state                                                       */
-/* ------------------------------------------------------------------ */
+/* Return an empty page. Past SLAB_SPARE_PAGES its body goes back to the
+ * OS; the first OS page stays, since it holds the spare link. Not while
+ * snapshots exist: they only save the pages that are written. */
+static void
+slab_page_put(slab_heap_t *slab, slab_page_t *page)
+{
+    page->next = slab->spare;
+    slab->spare = page;
+    if (++slab->nspare > SLAB_SPARE_PAGES && slab->nsnapshots == 0) {
+        madvise((char *)page + region_os_page, SLAB_PAGE_SIZE - region_os_page, MADV_DONTNEED);
+    }
+}
 
-typedef struct {
-    struct timespec deadline;
-    int             expired;
-    unsigned int    check_counter;
-} timeout_state_t;
+static slab_page_t *
+slab_page_new(slab_heap_t *slab, int cls)
+{
+    slab_page_t *page = slab_page_get(slab);
+    if (!page) return NULL;
+    page->cls = (uint16_t)cls;
+    page->bump = (char *)page + SLAB_PAGE_HEADER;
+    page->nfree = slab_capacity(cls);
+    slab_push(&slab->partial[cls], page);
+    return page;
+}
 
-/* ------------------------------------------------------------------ */
-/* Output capture buffer                                               */
-/* ------------------------------------------------------------------ */
+static int
+slab_heap_init(sandbox_heap_t *heap)
+{
+    pthread_once(&slab_once, slab_once_init);
+    heap->impl = calloc(1, sizeof(slab_heap_t));
+    return heap->impl ? 0 : -1;
+}
 
-typedef struct {
-    char  *buf;
-    size_t len;
-    size_t cap;
-} output_buf_t;
+static int
+slab_is_mapped(const slab_page_t *page)
+{
+    return SLAB_PAGE_HEADER + page->size > SLAB_PAGE_SIZE;
+}
 
 static void
-output_buf_init(output_buf_t *ob)
+slab_unmap(slab_page_t *page)
 {
-    ob->buf = NULL;
-    ob->len = 0;
-    ob->cap = 0;
+    munmap(page, region_large_len(page->size));
 }
 
 static void
-output_buf_free(output_buf_t *ob)
+slab_unmap_large(slab_heap_t *slab)
 {
-    if (ob->buf) {
-        free(ob->buf);
-        ob->buf = NULL;
+    for (slab_page_t *page = slab->large, *next; page; page = next) {
+        next = page->next;
+        if (slab_is_mapped(page)) slab_unmap(page);
     }
-    ob->len = 0;
-    ob->cap = 0;
+    slab->large = NULL;
+
+    for (size_t i = 0; i < slab->nretired; i++) {
+        slab_unmap(slab->retired[i].base);
+    }
+    free(slab->retired);
+    slab->retired = NULL;
+    slab->nretired = slab->retired_cap = 0;
 }
 
+/* Forget every block. The current chunk is kept for the next mrb_open;
+ * the others are unmapped. */
 static void
-output_buf_reset(output_buf_t *ob)
+slab_heap_release(sandbox_heap_t *heap)
 {
-    ob->len = 0;
-    if (ob->buf) ob->buf[0] = '\0';
+    slab_heap_t *slab = heap->impl;
+    slab_unmap_large(slab);
+
+    region_chunk_t *keep = slab->chunks;
+    if (keep) {
+        for (region_chunk_t *chunk = keep->next, *next; chunk; chunk = next) {
+            next = chunk->next;
+            munmap(chunk->base, REGION_CHUNK_SIZE);
+            free(chunk);
+        }
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    uint32_t epoch = slab->epoch;
+    memset(slab, 0, sizeof(*slab));
+    slab->chunks = keep;
+    slab->nchunks = keep ? 1 : 0;
+    slab->epoch = epoch;
 }
 
 static void
-output_buf_append(output_buf_t *ob, const char *str, size_t slen)
+slab_heap_destroy(sandbox_heap_t *heap)
 {
-    if (slen == 0) return;
-    size_t needed = ob->len + slen + 1;
-    if (needed > ob->cap) {
-        ob->cap = needed * 2;
-        if (ob->cap < 256) ob->cap = 256;
-        ob->buf = realloc(ob->buf, ob->cap);
+    slab_heap_t *slab = heap->impl;
+    slab_unmap_large(slab);
+    for (region_chunk_t *chunk = slab->chunks, *next; chunk; chunk = next) {
+        next = chunk->next;
+        munmap(chunk->base, REGION_CHUNK_SIZE);
+        free(chunk);
     }
-    memcpy(ob->buf + ob->len, str, slen);
-    ob->len += slen;
-    ob->buf[ob->len] = '\0';
+    free(slab);
+    heap->impl = NULL;
 }
 
-/* ------------------------------------------------------------------ */
-/* Sandbox internal state                                              */
-/* ------------------------------------------------------------------ */
+static void *
+slab_heap_malloc(sandbox_heap_t *heap, size_t size)
+{
+    slab_heap_t *slab = heap->impl;
+
+    if (size > SLAB_MAX_SIZE) {
+        slab_page_t *page;
+        if (SLAB_PAGE_HEADER + size <= SLAB_PAGE_SIZE) {
+            page = slab_page_get(slab);
+        } else {
+            if (size > SIZE_MAX / 2) return NULL;
+            page = region_map(region_large_len(size));
+        }
+        if (!page) return NULL;
+        page->cls = SLAB_LARGE;
+        page->size = size;
+        page->nfree = slab->epoch;
+        slab_push(&slab->large, page);
+        return (char *)page + SLAB_PAGE_HEADER;
+    }
 
-#define SANDBOX_MAX_FUNCTIONS 64
+    int cls = slab_class_index[(size + 15) / 16];
+    slab_page_t *page = slab->partial[cls];
+    if (!page) {
+        page = slab_page_new(slab, cls);
+        if (!page) return NULL;
+    }
 
-struct sandbox_state {
-    mrb_state    *mrb;
-    mrb_ccontext *cxt;
-    unsigned int  stack_keep;
-    int           arena_idx;
-    output_buf_t  output;
+    void *p;
+    if (page->free) {
+        p = page->free;
+        page->free = *(void **)p;
+    } else {
+        p = page->bump;
+        page->bump += slab_class_size[cls];
+    }
+    if (--page->nfree == 0) {
+        slab_unlink(&slab->partial[cls], page);
+        slab_push(&slab->full[cls], page);
+    }
+    return p;
+}
 
-    /* Tool callback */
-    sandbox_callback_func_t callback;
-    void                   *callback_userdata;
+static void
+slab_heap_free(sandbox_heap_t *heap, void *ptr, size_t size)
+{
+    slab_heap_t *slab = heap->impl;
+    slab_page_t *page = SLAB_PAGE_OF(ptr);
+
+    if (page->cls == SLAB_LARGE) {
+        slab_unlink(&slab->large, page);
+        if (!slab_is_mapped(page)) {
+            slab_page_put(slab, page);
+        } else if (slab->nsnapshots == 0) {
+            slab_unmap(page);
+        } else {
+            if (slab->nretired == slab->retired_cap) {
+                size_t cap = slab->retired_cap ? slab->retired_cap * 2 : 16;
+                slab_retired_t *retired = realloc(slab->retired, cap * sizeof(*retired));
+                if (!retired) return;  /* stays mapped until the heap goes */
+                slab->retired = retired;
+                slab->retired_cap = cap;
+            }
+            slab->retired[slab->nretired].base = page;
+            slab->retired[slab->nretired].epoch = page->nfree;
+            slab->nretired++;
+        }
+        return;
+    }
 
-    /* Registered function names (survive reset) */
-    char *func_names[SANDBOX_MAX_FUNCTIONS];
-    int   func_count;
+    int cls = page->cls;
+    *(void **)ptr = page->free;
+    page->free = ptr;
+    page->nfree++;
+
+    if (page->nfree == 1) {
+        slab_unlink(&slab->full[cls], page);
+        slab_push(&slab->partial[cls], page);
+    } else if (page->nfree == slab_capacity(cls)) {
+        slab_unlink(&slab->partial[cls], page);
+        slab_page_put(slab, page);
+    }
+}
 
-    /* Resource limits */
-    double          timeout_seconds;   /* 0 = unlimited */
-    size_t          memory_limit;      /* 0 = unlimited */
-    mem_tracker_t   mem_tracker;
-    timeout_state_t timeout_state;
-};
+static size_t
+slab_heap_size_of(sandbox_heap_t *heap, const void *ptr)
+{
+    const slab_page_t *page = SLAB_PAGE_OF(ptr);
+    return page->cls == SLAB_LARGE ? page->size : slab_class_size[page->cls];
+}
 
-/* ------------------------------------------------------------------ */
-/* Code fetch hook for timeout                                         */
-/* ------------------------------------------------------------------ */
+static void *
+slab_heap_realloc(sandbox_heap_t *heap, void *ptr, size_t old_size, size_t size)
+{
+    slab_page_t *page = SLAB_PAGE_OF(ptr);
+    if (page->cls != SLAB_LARGE && size <= SLAB_MAX_SIZE &&
+        slab_class_index[(size + 15) / 16] == page->cls) {
+        return ptr;  /* same class */
+    }
 
-#define TIMEOUT_CHECK_INTERVAL 1024
+    void *p = slab_heap_malloc(heap, size);
+    if (!p) return NULL;
+    memcpy(p, ptr, old_size < size ? old_size : size);
+    slab_heap_free(heap, ptr, old_size);
+    return p;
+}
+
+/* Snapshots don't copy the heap. A checkpoint write-protects every page
+ * the heap has handed out (the used part of each chunk and each mapped
+ * large block); the first write to a page after that faults into
+ * slab_fault, which saves the page's bytes in the newest snapshot and
+ * makes it writable again. Rollback copies back only those pages, so
+ * both cost what was written since rather than the size of the heap.
+ *
+ * Only the thread that entered a heap writes to it, so the fault handler
+ * finds the heap through tl_heap. The pinned span (mrb_state, whose code
+ * fetch hook other threads arm) is the exception: it is saved up front
+ * and never protected. */
+typedef struct {
+    char   *base;
+    size_t  len;
+    size_t  first;          /* index of its first OS page in the snapshot */
+} slab_range_t;
+
+typedef struct slab_snapshot {
+    struct slab_snapshot *older;
+    slab_heap_t   meta;     /* where things were */
+    size_t        head_used;
+    slab_range_t *ranges;   /* by base */
+    size_t        nranges;
+    size_t        npages;   /* OS pages in ranges */
+    char         *pin_lo;   /* pinned OS pages */
+    char         *pin_hi;
+    uint8_t      *saved_bits;
+    char        **saved;    /* pages saved, in the order they were written */
+    char         *data;     /* their bytes, one OS page each */
+    size_t        nsaved;
+} slab_snapshot_t;
+
+static pthread_once_t   slab_fault_once = PTHREAD_ONCE_INIT;
+static int              slab_fault_ready;
+static struct sigaction slab_prev_segv;
+static struct sigaction slab_prev_bus;
+
+static const slab_range_t *
+slab_range_find(const slab_snapshot_t *snap, const char *addr)
+{
+    size_t lo = 0, hi = snap->nranges;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const slab_range_t *r = &snap->ranges[mid];
+        if (addr < r->base) hi = mid;
+        else if (addr >= r->base + r->len) lo = mid + 1;
+        else return r;
+    }
+    return NULL;
+}
+
+static size_t
+slab_page_index(const slab_range_t *r, const char *page)
+{
+    return r->first + (size_t)(page - r->base) / region_os_page;
+}
+
+static int
+slab_is_saved(const slab_snapshot_t *snap, size_t index)
+{
+    return snap->saved_bits[index / 8] & (1u << (index % 8));
+}
 
 static void
-sandbox_code_fetch_hook(struct mrb_state *mrb, const struct mrb_irep *irep,
-                        const mrb_code *pc, mrb_value *regs)
+slab_save(slab_snapshot_t *snap, size_t index, char *page, const char *bytes)
 {
-    sandbox_state_t *state = (sandbox_state_t *)mrb->ud;
-    if (!state) return;
+    memcpy(snap->data + snap->nsaved * region_os_page, bytes, region_os_page);
+    snap->saved[snap->nsaved++] = page;
+    snap->saved_bits[index / 8] |= (uint8_t)(1u << (index % 8));
+}
 
-    timeout_state_t *ts = &state->timeout_state;
-    if (ts->expired) return; /* already raised, avoid re-entry */
+/* Save the pinned pages as they are now */
+static void
+slab_save_pinned(slab_snapshot_t *snap)
+{
+    for (char *page = snap->pin_lo; page < snap->pin_hi; page += region_os_page) {
+        const slab_range_t *r = slab_range_find(snap, page);
+        if (r && !slab_is_saved(snap, slab_page_index(r, page))) {
+            slab_save(snap, slab_page_index(r, page), page, page);
+        }
+    }
+}
+
+/* Write-protect the pages snap still has to save */
+static int
+slab_protect_unsaved(slab_snapshot_t *snap)
+{
+    for (size_t i = 0; i < snap->nranges; i++) {
+        const slab_range_t *r = &snap->ranges[i];
+        size_t npages = r->len / region_os_page, run = 0;
+        for (size_t p = 0; p <= npages; p++) {
+            if (p < npages && !slab_is_saved(snap, r->first + p)) {
+                run++;
+                continue;
+            }
+            if (run && mprotect(r->base + (p - run) * region_os_page,
+                                run * region_os_page, PROT_READ) != 0) {
+                return -1;
+            }
+            run = 0;
+        }
+    }
+    return 0;
+}
 
-    /* Only check clock every N instructions */
-    ts->check_counter++;
-    if (ts->check_counter < TIMEOUT_CHECK_INTERVAL) return;
-    ts->check_counter = 0;
+static void
+slab_unprotect(const slab_snapshot_t *snap)
+{
+    for (size_t i = 0; i < snap->nranges; i++) {
+        mprotect(snap->ranges[i].base, snap->ranges[i].len, PROT_READ | PROT_WRITE);
+    }
+}
 
-    /* Check if deadline is set (zero means no timeout) */
-    if (ts->deadline.tv_sec == 0 && ts->deadline.tv_nsec == 0) return;
+static void
+slab_snapshot_free(slab_snapshot_t *snap)
+{
+    if (snap->data) munmap(snap->data, snap->npages * region_os_page);
+    free(snap->saved);
+    free(snap->saved_bits);
+    free(snap->ranges);
+    free(snap);
+}
 
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
+/* A write to a protected page: save it in the newest snapshot, or just
+ * lift the protection an older one left behind. 0 if it isn't ours. */
+static int
+slab_fault_take(slab_heap_t *slab, char *page)
+{
+    slab_snapshot_t *snap = slab->snapshots;
+    if (!snap) return 0;
 
-    if (now.tv_sec > ts->deadline.tv_sec ||
-        (now.tv_sec == ts->deadline.tv_sec && now.tv_nsec >= ts->deadline.tv_nsec)) {
-        ts->expired = 1;
-        mrb_raise(mrb, mrb_class_get(mrb, "RuntimeError"), "execution timeout exceeded");
+    const slab_range_t *r = slab_range_find(snap, page);
+    if (r) {
+        size_t index = slab_page_index(r, page);
+        if (!slab_is_saved(snap, index)) slab_save(snap, index, page, page);
+    } else {
+        while ((snap = snap->older) && !slab_range_find(snap, page)) {}
+        if (!snap) return 0;
     }
+    return mprotect(page, region_os_page, PROT_READ | PROT_WRITE) == 0;
 }
 
-/* ------------------------------------------------------------------ */
-/* sandbox_value_t helpers                                             */
-/* ------------------------------------------------------------------ */
+static int slab_owns(const sandbox_heap_t *heap);
 
-void
-sandbox_value_free(sandbox_value_t *val)
+static void
+slab_fault(int sig, siginfo_t *info, void *ctx)
 {
-    if (!val) return;
-    switch (val->type) {
-    case SANDBOX_VALUE_STRING:
-        if (val->as.str.ptr) { free(val->as.str.ptr); val->as.str.ptr = NULL; }
-        break;
-    case SANDBOX_VALUE_ARRAY:
-        for (size_t i = 0; i < val->as.arr.len; i++) {
-            sandbox_value_free(&val->as.arr.items[i]);
-        }
-        free(val->as.arr.items);
-        val->as.arr.items = NULL;
-        break;
-    case SANDBOX_VALUE_HASH:
-        for (size_t i = 0; i < val->as.hash.len; i++) {
-            sandbox_value_free(&val->as.hash.keys[i]);
-            sandbox_value_free(&val->as.hash.vals[i]);
-        }
-        free(val->as.hash.keys);
-        free(val->as.hash.vals);
-        val->as.hash.keys = NULL;
-        val->as.hash.vals = NULL;
-        break;
-    default:
-        break;
+    sandbox_heap_t *heap = tl_heap;
+    if (heap && slab_owns(heap)) {
+        char *page = (char *)((uintptr_t)info->si_addr & ~(uintptr_t)(region_os_page - 1));
+        if (slab_fault_take(heap->impl, page)) return;
+    }
+
+    /* Not a snapshot page: whatever handled the signal before us does */
+    struct sigaction *prev = sig == SIGBUS ? &slab_prev_bus : &slab_prev_segv;
+    if (prev->sa_flags & SA_SIGINFO) {
+        prev->sa_sigaction(sig, info, ctx);
+    } else if (prev->sa_handler != SIG_DFL && prev->sa_handler != SIG_IGN) {
+        prev->sa_handler(sig);
+    } else {
+        struct sigaction dfl;
+        memset(&dfl, 0, sizeof(dfl));
+        dfl.sa_handler = SIG_DFL;
+        sigaction(sig, &dfl, NULL);  /* the fault repeats and gets the default */
     }
 }
 
-/* ------------------------------------------------------------------ */
-/* mruby → sandbox_value_t conversion                                 */
-/* ------------------------------------------------------------------ */
+static void
+slab_fault_install(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = slab_fault;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    slab_fault_ready = sigaction(SIGSEGV, &sa, &slab_prev_segv) == 0 &&
+                       sigaction(SIGBUS, &sa, &slab_prev_bus) == 0;
+}
 
-/* Returns 0 on success, -1 on unsupported type (sets errbuf) */
 static int
-mrb_to_sandbox_value(mrb_state *mrb, mrb_value v, sandbox_value_t *out, char *errbuf, size_t errbuf_size)
+slab_range_cmp(const void *a, const void *b)
+{
+    const char *x = ((const slab_range_t *)a)->base, *y = ((const slab_range_t *)b)->base;
+    return x < y ? -1 : x > y;
+}
+
+static void *
+slab_heap_checkpoint(sandbox_heap_t *heap, const void *pinned, size_t pinned_len)
 {
-    memset(out, 0, sizeof(*out));
+    pthread_once(&slab_fault_once, slab_fault_install);
+    if (!slab_fault_ready) return NULL;
+    slab_heap_t *slab = heap->impl;
 
-    if (mrb_nil_p(v)) {
-        out->type = SANDBOX_VALUE_NIL;
-        return 0;
+    size_t nranges = 0;
+    for (region_chunk_t *chunk = slab->chunks; chunk; chunk = chunk->next) {
+        if (chunk->used) nranges++;
     }
-    if (mrb_true_p(v)) {
-        out->type = SANDBOX_VALUE_TRUE;
-        return 0;
+    for (slab_page_t *page = slab->large; page; page = page->next) {
+        if (slab_is_mapped(page)) nranges++;
     }
-    if (mrb_false_p(v)) {
-        out->type = SANDBOX_VALUE_FALSE;
-        return 0;
+
+    slab_snapshot_t *snap = calloc(1, sizeof(*snap));
+    if (!snap) return NULL;
+    snap->ranges = malloc((nranges ? nranges : 1) * sizeof(*snap->ranges));
+    if (!snap->ranges) {
+        slab_snapshot_free(snap);
+        return NULL;
     }
-    if (mrb_integer_p(v)) {
-        out->type = SANDBOX_VALUE_INTEGER;
-        out->as.i = (int64_t)mrb_integer(v);
-        return 0;
+    for (region_chunk_t *chunk = slab->chunks; chunk; chunk = chunk->next) {
+        if (!chunk->used) continue;
+        snap->ranges[snap->nranges].base = chunk->base;
+        snap->ranges[snap->nranges++].len = chunk->used;
     }
-    if (mrb_float_p(v)) {
-        out->type = SANDBOX_VALUE_FLOAT;
-        out->as.f = mrb_float(v);
-        return 0;
+    for (slab_page_t *page = slab->large; page; page = page->next) {
+        if (!slab_is_mapped(page)) continue;
+        snap->ranges[snap->nranges].base = (char *)page;
+        snap->ranges[snap->nranges++].len = region_large_len(page->size);
     }
-    if (mrb_string_p(v)) {
-        out->type = SANDBOX_VALUE_STRING;
-        out->as.str.len = (size_t)RSTRING_LEN(v);
-        out->as.str.ptr = malloc(out->as.str.len + 1);
-        memcpy(out->as.str.ptr, RSTRING_PTR(v), out->as.str.len);
-        out->as.str.ptr[out->as.str.len] = '\0';
-        return 0;
+    qsort(snap->ranges, snap->nranges, sizeof(*snap->ranges), slab_range_cmp);
+    for (size_t i = 0; i < snap->nranges; i++) {
+        snap->ranges[i].first = snap->npages;
+        snap->npages += snap->ranges[i].len / region_os_page;
     }
-    if (mrb_symbol_p(v)) {
-        /* Symbol → String */
-        out->type = SANDBOX_VALUE_STRING;
-        mrb_int slen;
-        const char *sname = mrb_sym_name_len(mrb, mrb_symbol(v), &slen);
-        out->as.str.len = (size_t)slen;
-        out->as.str.ptr = malloc(out->as.str.len + 1);
-        memcpy(out->as.str.ptr, sname, out->as.str.len);
-        out->as.str.ptr[out->as.str.len] = '\0';
-        return 0;
+
+    /* The log is mapped for every page but only touched as pages are saved */
+    size_t npages = snap->npages ? snap->npages : 1;
+    snap->saved_bits = calloc((npages + 7) / 8, 1);
+    snap->saved = malloc(npages * sizeof(*snap->saved));
+    snap->data = mmap(NULL, npages * region_os_page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (snap->data == MAP_FAILED) snap->data = NULL;
+    snap->npages = npages;
+    if (!snap->saved_bits || !snap->saved || !snap->data) {
+        slab_snapshot_free(snap);
+        return NULL;
     }
-    if (mrb_array_p(v)) {
-        mrb_int alen = RARRAY_LEN(v);
-        out->type = SANDBOX_VALUE_ARRAY;
-        out->as.arr.len = (size_t)alen;
-        out->as.arr.items = calloc((size_t)alen, sizeof(sandbox_value_t));
-        for (mrb_int i = 0; i < alen; i++) {
-            if (mrb_to_sandbox_value(mrb, mrb_ary_entry(v, i),
-                                     &out->as.arr.items[i], errbuf, errbuf_size) != 0) {
-                /* Clean up already-converted items */
-                for (mrb_int j = 0; j < i; j++) {
-                    sandbox_value_free(&out->as.arr.items[j]);
-                }
-                free(out->as.arr.items);
-                out->as.arr.items = NULL;
-                return -1;
-            }
+
+    if (pinned_len) {
+        uintptr_t mask = ~(uintptr_t)(region_os_page - 1);
+        snap->pin_lo = (char *)((uintptr_t)pinned & mask);
+        snap->pin_hi = (char *)(((uintptr_t)pinned + pinned_len + region_os_page - 1) & mask);
+    }
+    slab_save_pinned(snap);
+    if (slab_protect_unsaved(snap) != 0) {
+        slab_unprotect(snap);
+        if (slab->snapshots) slab_protect_unsaved(slab->snapshots);
+        slab_snapshot_free(snap);
+        return NULL;
+    }
+
+    snap->meta = *slab;
+    snap->head_used = slab->chunks ? slab->chunks->used : 0;
+    snap->older = slab->snapshots;
+    slab->snapshots = snap;
+    slab->epoch++;
+    slab->nsnapshots++;
+    return snap;
+}
+
+static void
+slab_heap_rollback(sandbox_heap_t *heap, void *ptr)
+{
+    slab_heap_t *slab = heap->impl;
+    slab_snapshot_t *snap = ptr;
+    uint32_t epoch = snap->meta.epoch;
+
+    /* Large blocks mapped since the snapshot go; the ones it had that
+     * were freed since come back to life (their bytes are copied below) */
+    for (slab_page_t *page = slab->large, *next; page; page = next) {
+        next = page->next;
+        if (slab_is_mapped(page) && page->nfree > epoch) slab_unmap(page);
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < slab->nretired; i++) {
+        slab_retired_t r = slab->retired[i];
+        if (r.epoch > epoch) {
+            slab_unmap(r.base);
+        } else if (!slab_range_find(snap, r.base)) {
+            slab->retired[kept++] = r;  /* an older snapshot may want it */
         }
-        return 0;
     }
-    if (mrb_hash_p(v)) {
-        mrb_value keys = mrb_hash_keys(mrb, v);
-        mrb_int hlen = RARRAY_LEN(keys);
-        out->type = SANDBOX_VALUE_HASH;
-        out->as.hash.len = (size_t)hlen;
-        out->as.hash.keys = calloc((size_t)hlen, sizeof(sandbox_value_t));
-        out->as.hash.vals = calloc((size_t)hlen, sizeof(sandbox_value_t));
-        for (mrb_int i = 0; i < hlen; i++) {
-            mrb_value k = mrb_ary_entry(keys, i);
-            mrb_value val = mrb_hash_get(mrb, v, k);
-            if (mrb_to_sandbox_value(mrb, k, &out->as.hash.keys[i], errbuf, errbuf_size) != 0 ||
-                mrb_to_sandbox_value(mrb, val, &out->as.hash.vals[i], errbuf, errbuf_size) != 0) {
-                for (mrb_int j = 0; j <= i; j++) {
-                    sandbox_value_free(&out->as.hash.keys[j]);
-                    sandbox_value_free(&out->as.hash.vals[j]);
-                }
-                free(out->as.hash.keys);
-                free(out->as.hash.vals);
-                out->as.hash.keys = NULL;
-                out->as.hash.vals = NULL;
-                return -1;
+    slab->nretired = kept;
+
+    /* Chunks mapped since the snapshot hold nothing it knows about */
+    while (slab->nchunks > snap->meta.nchunks) {
+        region_chunk_t *chunk = slab->chunks;
+        slab->chunks = chunk->next;
+        slab->nchunks--;
+        munmap(chunk->base, REGION_CHUNK_SIZE);
+        free(chunk);
+    }
+    for (region_chunk_t *chunk = slab->chunks; chunk; chunk = chunk->next) {
+        chunk->used = chunk == slab->chunks ? snap->head_used : REGION_CHUNK_SIZE;
+    }
+
+    /* Pages written since get their bytes back; the rest never changed */
+    for (size_t i = 0; i < snap->nsaved; i++) {
+        memcpy(snap->saved[i], snap->data + i * region_os_page, region_os_page);
+    }
+
+    /* Page lists as they were; snapshot bookkeeping stays current */
+    slab_heap_t now = *slab;
+    *slab = snap->meta;
+    slab->epoch = now.epoch;
+    slab->nsnapshots = now.nsnapshots;
+    slab->retired = now.retired;
+    slab->nretired = now.nretired;
+    slab->retired_cap = now.retired_cap;
+    slab->snapshots = now.snapshots;
+
+    /* Track writes afresh: the heap is back where the snapshot started */
+    madvise(snap->data, snap->nsaved * region_os_page, MADV_DONTNEED);
+    memset(snap->saved_bits, 0, (snap->npages + 7) / 8);
+    snap->nsaved = 0;
+    slab_save_pinned(snap);
+    slab_protect_unsaved(snap);
+}
+
+static void
+slab_heap_discard(sandbox_heap_t *heap, void *ptr)
+{
+    slab_heap_t *slab = heap->impl;
+    slab_snapshot_t *snap = ptr;
+
+    slab_snapshot_t **link = &slab->snapshots;
+    while (*link != snap) link = &(*link)->older;
+    *link = snap->older;
+    int newest = link == &slab->snapshots;
+
+    /* A page first written after snap still held, at that point, what the
+     * next older snapshot needs, unless that one saved it already */
+    slab_snapshot_t *older = snap->older;
+    for (size_t i = 0; older && i < snap->nsaved; i++) {
+        const slab_range_t *r = slab_range_find(older, snap->saved[i]);
+        if (r && !slab_is_saved(older, slab_page_index(r, snap->saved[i]))) {
+            slab_save(older, slab_page_index(r, snap->saved[i]), snap->saved[i],
+                      snap->data + i * region_os_page);
+        }
+    }
+
+    if (newest) {
+        /* Tracking passes to the older snapshot */
+        slab_unprotect(snap);
+        if (older) slab_protect_unsaved(older);
+    } else {
+        /* Blocks only snap knew about are retired; nothing writes them */
+        for (size_t i = 0; i < snap->nranges; i++) {
+            if (!slab_range_find(slab->snapshots, snap->ranges[i].base)) {
+                mprotect(snap->ranges[i].base, snap->ranges[i].len, PROT_READ | PROT_WRITE);
             }
         }
-        return 0;
     }
+    slab_snapshot_free(snap);
 
-    /* Unsupported type */
-    mrb_value cls_name = mrb_obj_as_string(mrb, mrb_funcall_argv(mrb, mrb_obj_value(mrb_obj_class(mrb, v)),
-                           mrb_intern_lit(mrb, "name"), 0, NULL));
-    snprintf(errbuf, errbuf_size, "TypeError: unsupported type for sandbox: %s",
-             mrb_string_p(cls_name) ? RSTRING_PTR(cls_name) : "unknown");
+    if (--slab->nsnapshots == 0) {
+        for (size_t i = 0; i < slab->nretired; i++) {
+            slab_unmap(slab->retired[i].base);
+        }
+        slab->nretired = 0;
+    }
+}
+
+static const heap_backend_t slab_heap_backend = {
+    .name       = "slab",
+    .init       = slab_heap_init,
+    .destroy    = slab_heap_destroy,
+    .release    = slab_heap_release,
+    .malloc     = slab_heap_malloc,
+    .realloc    = slab_heap_realloc,
+    .free       = slab_heap_free,
+    .size_of    = slab_heap_size_of,
+    .checkpoint = slab_heap_checkpoint,
+    .rollback   = slab_heap_rollback,
+    .discard    = slab_heap_discard,
+};
+
+static int
+slab_owns(const sandbox_heap_t *heap)
+{
+    return heap->backend == &slab_heap_backend && heap->impl;
+}
+
+/* Indexed by sandbox_allocator_t */
+static const heap_backend_t *const heap_backends[] = {
+    &system_heap_backend,
+    &slab_heap_backend,
+};
+
+#define HEAP_BACKEND_COUNT ((int)(sizeof(heap_backends) / sizeof(heap_backends[0])))
+
+int
+sandbox_allocator_lookup(const char *name)
+{
+    for (int i = 0; i < HEAP_BACKEND_COUNT; i++) {
+        if (strcmp(heap_backends[i]->name, name) == 0) return i;
+    }
     return -1;
 }
 
+static int
+heap_init(sandbox_heap_t *heap, sandbox_allocator_t allocator)
+{
+    memset(heap, 0, sizeof(*heap));
+    if ((int)allocator < 0 || (int)allocator >= HEAP_BACKEND_COUNT) return -1;
+    heap->backend = heap_backends[allocator];
+    return heap->backend->init ? heap->backend->init(heap) : 0;
+}
+
+static void
+heap_destroy(sandbox_heap_t *heap)
+{
+    if (heap->backend && heap->backend->destroy) heap->backend->destroy(heap);
+}
+
+/* mruby calls outside any state (none today) get an untracked system heap */
+static __thread sandbox_heap_t tl_unowned_heap = { 0, 0, 0, &system_heap_backend, NULL };
+
+static sandbox_heap_t *
+heap_enter(sandbox_heap_t *heap)
+{
+    sandbox_heap_t *prev = tl_heap;
+    tl_heap = heap;
+    return prev;
+}
+
+static void
+heap_leave(sandbox_heap_t *prev)
+{
+    tl_heap = prev;
+}
+
+/* Override mrb_basic_alloc_func from mruby's allocf.c.
+ * Our object file is linked before libmruby.a, so this definition wins.
+ * Dispatches to the active heap's backend and enforces its limit. */
+void *
+mrb_basic_alloc_func(void *ptr, size_t size)
+{
+    sandbox_heap_t *heap = tl_heap ? tl_heap : &tl_unowned_heap;
+    const heap_backend_t *backend = heap->backend;
+
+    /* Free */
+    if (size == 0) {
+        if (ptr) {
+            size_t old_size = backend->size_of(heap, ptr);
+            heap->current -= old_size;
+            backend->free(heap, ptr, old_size);
+        }
+        return NULL;
+    }
+
+    /* Malloc / realloc */
+    size_t old_size = ptr ? backend->size_of(heap, ptr) : 0;
+    if (heap->limit > 0 && (heap->current - old_size + size) > heap->limit) {
+        heap->exceeded = 1;
+        return NULL; /* mruby will GC and retry, then raise NoMemoryError */
+    }
+    void *p = ptr ? backend->realloc(heap, ptr, old_size, size)
+                  : backend->malloc(heap, size);
+    if (!p) return NULL;
+    heap->current = heap->current - old_size + backend->size_of(heap, p);
+    if (heap->current > heap->peak) heap->peak = heap->current;
+    return p;
+}
+
 /* ------------------------------------------------------------------ */
-/* sandbox_value_t → mruby conversion                                 */
+/* Timeout state                                                       */
 /* ------------------------------------------------------------------ */
 
-static mrb_value
-sandbox_value_to_mrb(mrb_state *mrb, const sandbox_value_t *val)
+typedef struct {
+    struct timespec deadline;
+    int             expired;
+    int             polling;        /* deadline service unavailable: check the clock */
+    unsigned int    check_counter;
+    size_t          heap_index;     /* slot in the deadline heap, or DEADLINE_NONE */
+} timeout_state_t;
+
+#define DEADLINE_NONE ((size_t)-1)
+
+/* Reasons stored in sandbox_state.interrupted */
+#define SANDBOX_INTERRUPT_HOST    1   /* sandbox_state_interrupt */
+#define SANDBOX_INTERRUPT_TIMEOUT 2   /* deadline passed */
+
+/* ------------------------------------------------------------------ */
+/* Output capture buffer                                               */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    char  *buf;
+    size_t len;
+    size_t cap;
+} output_buf_t;
+
+static void
+output_buf_init(output_buf_t *ob)
 {
-    switch (val->type) {
-    case SANDBOX_VALUE_NIL:
-        return mrb_nil_value();
-    case SANDBOX_VALUE_TRUE:
-        return mrb_true_value();
-    case SANDBOX_VALUE_FALSE:
-        return mrb_false_value();
-    case SANDBOX_VALUE_INTEGER:
-        return mrb_int_value(mrb, (mrb_int)val->as.i);
-    case SANDBOX_VALUE_FLOAT:
-        return mrb_float_value(mrb, (mrb_float)val->as.f);
-    case SANDBOX_VALUE_STRING:
-        return mrb_str_new(mrb, val->as.str.ptr, (mrb_int)val->as.str.len);
-    case SANDBOX_VALUE_ARRAY: {
-        mrb_value ary = mrb_ary_new_capa(mrb, (mrb_int)val->as.arr.len);
-        for (size_t i = 0; i < val->as.arr.len; i++) {
-            mrb_ary_push(mrb, ary, sandbox_value_to_mrb(mrb, &val->as.arr.items[i]));
+    ob->buf = NULL;
+    ob->len = 0;
+    ob->cap = 0;
+}
+
+static void
+output_buf_free(output_buf_t *ob)
+{
+    if (ob->buf) {
+        free(ob->buf);
+        ob->buf = NULL;
+    }
+    ob->len = 0;
+    ob->cap = 0;
+}
+
+static void
+output_buf_reset(output_buf_t *ob)
+{
+    ob->len = 0;
+    if (ob->buf) ob->buf[0] = '\0';
+}
+
+static void
+output_buf_append(output_buf_t *ob, const char *str, size_t slen)
+{
+    if (slen == 0) return;
+    size_t needed = ob->len + slen + 1;
+    if (needed > ob->cap) {
+        ob->cap = needed * 2;
+        if (ob->cap < 256) ob->cap = 256;
+        ob->buf = realloc(ob->buf, ob->cap);
+    }
+    memcpy(ob->buf + ob->len, str, slen);
+    ob->len += slen;
+    ob->buf[ob->len] = '\0';
+}
+
+/* ------------------------------------------------------------------ */
+/* Bump arena for sandbox_value_t trees                                */
+/* ------------------------------------------------------------------ */
+
+#define ARENA_CHUNK_SIZE   (64 * 1024)
+#define ARENA_RETAIN_LIMIT (1024 * 1024)  /* kept across resets */
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t              size;
+    size_t              used;
+    max_align_t         data[];
+} arena_chunk_t;
+
+struct sandbox_arena {
+    arena_chunk_t *head;   /* chunks in fill order */
+    arena_chunk_t *cur;    /* chunk being bumped; later chunks are empty */
+};
+
+void *
+sandbox_arena_alloc(sandbox_arena_t *arena, size_t size)
+{
+    size_t align = _Alignof(max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+    if (size == 0) size = align;
+
+    arena_chunk_t *chunk = arena->cur;
+    while (chunk && chunk->used + size > chunk->size) {
+        chunk = chunk->next;
+    }
+    if (!chunk) {
+        size_t csize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(arena_chunk_t) + csize);
+        if (!chunk) return NULL;
+        chunk->size = csize;
+        chunk->used = 0;
+        if (arena->cur) {
+            chunk->next = arena->cur->next;
+            arena->cur->next = chunk;
+        } else {
+            chunk->next = arena->head;
+            arena->head = chunk;
         }
-        return ary;
     }
-    case SANDBOX_VALUE_HASH: {
-        mrb_value hash = mrb_hash_new_capa(mrb, (mrb_int)val->as.hash.len);
-        for (size_t i = 0; i < val->as.hash.len; i++) {
-            mrb_hash_set(mrb, hash,
-                sandbox_value_to_mrb(mrb, &val->as.hash.keys[i]),
-                sandbox_value_to_mrb(mrb, &val->as.hash.vals[i]));
+    arena->cur = chunk;
+
+    void *p = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+/* Release everything at once. Up to ARENA_RETAIN_LIMIT of chunks stay
+ * allocated for the next call on this state. */
+void
+sandbox_arena_reset(sandbox_arena_t *arena)
+{
+    size_t kept = 0;
+    arena_chunk_t **link = &arena->head;
+    while (*link) {
+        arena_chunk_t *chunk = *link;
+        if (kept + chunk->size <= ARENA_RETAIN_LIMIT) {
+            chunk->used = 0;
+            kept += chunk->size;
+            link = &chunk->next;
+        } else {
+            *link = chunk->next;
+            free(chunk);
         }
-        return hash;
     }
+    arena->cur = arena->head;
+}
+
+static void
+sandbox_arena_free(sandbox_arena_t *arena)
+{
+    while (arena->head) {
+        arena_chunk_t *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
     }
-    return mrb_nil_value();
+    arena->cur = NULL;
 }
 
 /* ------------------------------------------------------------------ */
-/* Trampoline: single C function for all registered tool functions     */
+/* Sandbox internal state                                              */
 /* ------------------------------------------------------------------ */
 
-static sandbox_state_t *
-get_sandbox_state(mrb_state *mrb)
+#define SANDBOX_SCRIPT_CACHE  16
+
+struct sandbox_state {
+    mrb_state    *mrb;
+    mrb_ccontext *cxt;
+    unsigned int  stack_keep;
+    int           arena_idx;
+    output_buf_t  output;
+    sandbox_arena_t arena;   /* boundary values, reset after each call */
+
+    /* Tool callback */
+    sandbox_callback_func_t callback;
+    void                   *callback_userdata;
+
+    /* Tool calls inside parallel { } (sandbox_state_set_dispatch) */
+    sandbox_submit_func_t submit;
+    sandbox_await_func_t  await;
+    mrb_value             parallel;   /* futures of the innermost block, or nil */
+    struct RClass        *future_class;   /* unnamed, see sandbox_setup_mrb */
+    struct RProc         *collect_block;  /* map's block when it, not parallel, opened the frame */
+
+    /* Registered functions by slot (survive reset), and an open-addressing
+     * index from name to slot + 1 */
+    char    **func_names;
+    char    **func_sigs;        /* declared types, NULL if untyped */
+    unsigned char *func_batched;   /* sandbox_state_set_batched */
+    int       nbatched;
+    int       func_count;
+    int       func_capa;
+    uint32_t *func_index;
+    size_t    func_index_cap;   /* power of two */
+
+    /* Optional gems (SANDBOX_GEMS_*, survive reset) */
+    uint32_t gems;
+    int      gem_loading;   /* in sandbox_gem_load: limits stand down */
+
+    /* Resource limits */
+    double          timeout_seconds;   /* 0 = unlimited */
+    size_t          memory_limit;      /* 0 = unlimited */
+    sandbox_heap_t  heap;
+    timeout_state_t timeout_state;
+
+    /* Cross-thread interruption (see sandbox_state_interrupt).
+     * interrupt_lock guards running and the hook pointer, so another
+     * thread never touches mrb outside of an eval. */
+    pthread_mutex_t interrupt_lock;
+    int             running;
+    atomic_int      interrupted;   /* SANDBOX_INTERRUPT_* bits */
+
+    /* Procs loaded from compiled scripts, by script id (cleared on reset) */
+    struct {
+        uint64_t  id;
+        mrb_value proc;
+    } scripts[SANDBOX_SCRIPT_CACHE];
+    int script_next;
+
+    /* Live checkpoints, newest first (dropped on reset) */
+    struct sandbox_checkpoint *checkpoints;
+    uint64_t                   checkpoint_seq;
+
+    /* The state as set up, recorded just before the first snippet runs
+     * (see sandbox_state_scrub; cleared on reset) */
+    struct {
+        int          taken;
+        int          valid;        /* fingerprint could be computed */
+        uint64_t     fingerprint;
+        unsigned int stack_keep;
+        int          nsyms;
+    } fresh;
+
+    /* Counters for the eval or run in progress (reset by sandbox_limits_begin) */
+    sandbox_stats_t stats;
+};
+
+/* ------------------------------------------------------------------ */
+/* Code fetch hook for timeout                                         */
+/* ------------------------------------------------------------------ */
+
+#define TIMEOUT_CHECK_INTERVAL 1024
+
+static int
+timespec_reached(const struct timespec *now, const struct timespec *at)
 {
-    return (sandbox_state_t *)mrb->ud;
+    return now->tv_sec > at->tv_sec ||
+           (now->tv_sec == at->tv_sec && now->tv_nsec >= at->tv_nsec);
 }
 
-static mrb_value
-sandbox_function_trampoline(mrb_state *mrb, mrb_value self)
+/* Runs before every instruction once armed (see sandbox_arm_hook). Only
+ * the polling fallback and SANDBOX_POLL_HOOK builds install it before an
+ * interrupt is pending. */
+static void
+sandbox_code_fetch_hook(struct mrb_state *mrb, const struct mrb_irep *irep,
+                        const mrb_code *pc, mrb_value *regs)
 {
-    sandbox_state_t *state = get_sandbox_state(mrb);
-    if (!state || !state->callback) {
-        mrb_raise(mrb, mrb_class_get(mrb, "RuntimeError"), "no tool callback registered");
-        return mrb_nil_value();
+    sandbox_state_t *state = (sandbox_state_t *)mrb->ud;
+    if (!state || state->gem_loading) return;
+
+    timeout_state_t *ts = &state->timeout_state;
+    int reason = atomic_load_explicit(&state->interrupted, memory_order_relaxed);
+
+    if (reason == 0) {
+        /* Fallback when the deadline service could not be started */
+        if (!ts->polling) return;
+        if (++ts->check_counter < TIMEOUT_CHECK_INTERVAL) return;
+        ts->check_counter = 0;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!timespec_reached(&now, &ts->deadline)) return;
+        reason = SANDBOX_INTERRUPT_TIMEOUT;
+        atomic_fetch_or(&state->interrupted, reason);
+    }
+
+    /* Host interrupts keep raising so sandbox code cannot rescue its way
+     * back into a loop; the eval unwinds at the next instruction. */
+    if (reason & SANDBOX_INTERRUPT_HOST) {
+        mrb_raise(mrb, mrb_class_get(mrb, "RuntimeError"), "execution interrupted");
+    }
+
+    if (ts->expired) return; /* already raised, avoid re-entry */
+    ts->expired = 1;
+    mrb_raise(mrb, mrb_class_get(mrb, "RuntimeError"), "execution timeout exceeded");
+}
+
+/* The VM reads mrb->code_fetch_hook with a plain load before every
+ * instruction (vm.c, which we don't patch), while sandbox_arm_hook stores
+ * it from other threads. Our stores are atomic, and an aligned pointer
+ * load doesn't tear on any target mruby builds for, but the VM side is
+ * still not an atomic access. Builds with SANDBOX_POLL_HOOK
+ * (ENCLAVE_POLL_HOOK=1) install the hook for the whole eval instead, so
+ * other threads only ever touch state->interrupted, at the cost of a
+ * hook call per instruction. */
+#ifdef SANDBOX_POLL_HOOK
+#define SANDBOX_HOOK_ALWAYS 1
+#else
+#define SANDBOX_HOOK_ALWAYS 0
+#endif
+
+static void
+sandbox_set_hook(mrb_state *mrb, int on)
+{
+    __atomic_store_n(&mrb->code_fetch_hook, on ? sandbox_code_fetch_hook : NULL,
+                     __ATOMIC_RELEASE);
+}
+
+/* Install the hook on a running eval and record why. The hook stays
+ * unset until something needs the eval to stop, so an eval that finishes
+ * in time never pays for a hook call. Safe from any thread. */
+static void
+sandbox_arm_hook(sandbox_state_t *state, int reason)
+{
+    pthread_mutex_lock(&state->interrupt_lock);
+    if (state->running) {
+        if (reason) atomic_fetch_or(&state->interrupted, reason);
+        if (!SANDBOX_HOOK_ALWAYS) sandbox_set_hook(state->mrb, 1);
+    }
+    pthread_mutex_unlock(&state->interrupt_lock);
+}
+
+/* ------------------------------------------------------------------ */
+/* Deadline service                                                    */
+/* ------------------------------------------------------------------ */
+
+/* One timer thread for the whole process. Evals with a timeout push their
+ * deadline onto a min-heap; the thread sleeps until the earliest one and
+ * arms that state's hook when it passes. Entries are removed under the
+ * lock when the eval ends, so the thread never touches an idle or freed
+ * state. Lock order: deadline_service.lock, then interrupt_lock. */
+
+static struct {
+    pthread_mutex_t   lock;
+    pthread_cond_t    wake;
+    int               started;   /* 1 = running, -1 = could not start */
+    sandbox_state_t **heap;      /* ordered by timeout_state.deadline */
+    size_t            len;
+    size_t            cap;
+} deadline_service = { PTHREAD_MUTEX_INITIALIZER };
+
+/* fork() keeps only the calling thread: the child starts its own timer
+ * thread on its first timed eval, with none of the parent's entries. */
+static void
+deadline_service_atfork_child(void)
+{
+    pthread_mutex_init(&deadline_service.lock, NULL);
+    deadline_service.started = 0;
+    deadline_service.len = 0;
+}
+
+static int
+deadline_before(size_t a, size_t b)
+{
+    const struct timespec *x = &deadline_service.heap[a]->timeout_state.deadline;
+    const struct timespec *y = &deadline_service.heap[b]->timeout_state.deadline;
+    return x->tv_sec < y->tv_sec || (x->tv_sec == y->tv_sec && x->tv_nsec < y->tv_nsec);
+}
+
+static void
+deadline_swap(size_t a, size_t b)
+{
+    sandbox_state_t **heap = deadline_service.heap;
+    sandbox_state_t *tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    heap[a]->timeout_state.heap_index = a;
+    heap[b]->timeout_state.heap_index = b;
+}
+
+static void
+deadline_sift_up(size_t i)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!deadline_before(i, parent)) break;
+        deadline_swap(i, parent);
+        i = parent;
+    }
+}
+
+static void
+deadline_sift_down(size_t i)
+{
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, min = i;
+        if (l < deadline_service.len && deadline_before(l, min)) min = l;
+        if (r < deadline_service.len && deadline_before(r, min)) min = r;
+        if (min == i) break;
+        deadline_swap(i, min);
+        i = min;
+    }
+}
+
+static void
+deadline_remove_at(size_t i)
+{
+    sandbox_state_t **heap = deadline_service.heap;
+    heap[i]->timeout_state.heap_index = DEADLINE_NONE;
+    deadline_service.len--;
+    if (i == deadline_service.len) return;
+
+    heap[i] = heap[deadline_service.len];
+    heap[i]->timeout_state.heap_index = i;
+    deadline_sift_down(i);
+    deadline_sift_up(i);
+}
+
+/* Sleep until *at (CLOCK_MONOTONIC) or until signalled. Lock held. */
+static void
+deadline_wait_until(const struct timespec *at)
+{
+#ifdef __APPLE__
+    struct timespec now, rel;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rel.tv_sec = at->tv_sec - now.tv_sec;
+    rel.tv_nsec = at->tv_nsec - now.tv_nsec;
+    if (rel.tv_nsec < 0) {
+        rel.tv_sec--;
+        rel.tv_nsec += 1000000000L;
+    }
+    if (rel.tv_sec < 0) return;
+    pthread_cond_timedwait_relative_np(&deadline_service.wake, &deadline_service.lock, &rel);
+#else
+    pthread_cond_timedwait(&deadline_service.wake, &deadline_service.lock, at);
+#endif
+}
+
+static void *
+deadline_service_main(void *arg)
+{
+    pthread_mutex_lock(&deadline_service.lock);
+    for (;;) {
+        if (deadline_service.len == 0) {
+            pthread_cond_wait(&deadline_service.wake, &deadline_service.lock);
+            continue;
+        }
+
+        sandbox_state_t *first = deadline_service.heap[0];
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (timespec_reached(&now, &first->timeout_state.deadline)) {
+            deadline_remove_at(0);
+            sandbox_arm_hook(first, SANDBOX_INTERRUPT_TIMEOUT);
+            continue;
+        }
+        deadline_wait_until(&first->timeout_state.deadline);
+    }
+    return NULL;
+}
+
+/* Lock held. Returns 0 when the timer thread is running. */
+static int
+deadline_service_start(void)
+{
+    if (deadline_service.started) return deadline_service.started > 0 ? 0 : -1;
+
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&deadline_service.wake, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int err = pthread_create(&thread, &attr, deadline_service_main, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (err != 0) {
+        pthread_cond_destroy(&deadline_service.wake);
+        deadline_service.started = -1;
+        return -1;
+    }
+    deadline_service.started = 1;
+
+    static int atfork_registered;
+    if (!atfork_registered) {
+        pthread_atfork(NULL, NULL, deadline_service_atfork_child);
+        atfork_registered = 1;
+    }
+    return 0;
+}
+
+/* Schedule state->timeout_state.deadline. Returns -1 if the service is
+ * unavailable; the caller then falls back to polling. */
+static int
+deadline_add(sandbox_state_t *state)
+{
+    int ret = -1;
+    pthread_mutex_lock(&deadline_service.lock);
+
+    if (deadline_service_start() != 0) goto done;
+
+    if (deadline_service.len == deadline_service.cap) {
+        size_t cap = deadline_service.cap ? deadline_service.cap * 2 : 16;
+        sandbox_state_t **heap = realloc(deadline_service.heap, cap * sizeof(*heap));
+        if (!heap) goto done;
+        deadline_service.heap = heap;
+        deadline_service.cap = cap;
+    }
+
+    size_t i = deadline_service.len++;
+    deadline_service.heap[i] = state;
+    state->timeout_state.heap_index = i;
+    deadline_sift_up(i);
+
+    /* New earliest deadline: wake the thread so it re-arms its sleep */
+    if (state->timeout_state.heap_index == 0) {
+        pthread_cond_signal(&deadline_service.wake);
+    }
+    ret = 0;
+
+done:
+    pthread_mutex_unlock(&deadline_service.lock);
+    return ret;
+}
+
+static void
+deadline_cancel(sandbox_state_t *state)
+{
+    pthread_mutex_lock(&deadline_service.lock);
+    if (state->timeout_state.heap_index != DEADLINE_NONE) {
+        deadline_remove_at(state->timeout_state.heap_index);
+    }
+    pthread_mutex_unlock(&deadline_service.lock);
+}
+
+/* ------------------------------------------------------------------ */
+/* sandbox_value_t helpers                                             */
+/* ------------------------------------------------------------------ */
+
+void
+sandbox_value_free(sandbox_value_t *val)
+{
+    if (!val) return;
+    switch (val->type) {
+    case SANDBOX_VALUE_STRING:
+        if (val->as.str.ptr) { free(val->as.str.ptr); val->as.str.ptr = NULL; }
+        break;
+    case SANDBOX_VALUE_ARRAY:
+        for (size_t i = 0; i < val->as.arr.len; i++) {
+            sandbox_value_free(&val->as.arr.items[i]);
+        }
+        free(val->as.arr.items);
+        val->as.arr.items = NULL;
+        break;
+    case SANDBOX_VALUE_HASH:
+        for (size_t i = 0; i < val->as.hash.len; i++) {
+            sandbox_value_free(&val->as.hash.keys[i]);
+            sandbox_value_free(&val->as.hash.vals[i]);
+        }
+        free(val->as.hash.keys);
+        free(val->as.hash.vals);
+        val->as.hash.keys = NULL;
+        val->as.hash.vals = NULL;
+        break;
+    default:
+        break;
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* mruby → CRuby: validating and visiting tool arguments               */
+/* ------------------------------------------------------------------ */
+
+struct sandbox_args {
+    mrb_state       *mrb;
+    const mrb_value *argv;
+    int              argc;
+};
+
+typedef struct {
+    char  *errbuf;
+    size_t errbuf_size;
+    int    failed;
+} check_ctx_t;
+
+static int sandbox_check_value(mrb_state *mrb, mrb_value v, char *errbuf, size_t errbuf_size);
+
+static int
+sandbox_check_pair(mrb_state *mrb, mrb_value key, mrb_value val, void *data)
+{
+    check_ctx_t *ctx = (check_ctx_t *)data;
+    if (sandbox_check_value(mrb, key, ctx->errbuf, ctx->errbuf_size) != 0 ||
+        sandbox_check_value(mrb, val, ctx->errbuf, ctx->errbuf_size) != 0) {
+        ctx->failed = 1;
+        return 1; /* stop iterating */
+    }
+    return 0;
+}
+
+/* Reject values that can't cross the boundary. Runs inside mruby, so it
+ * may allocate and raise; the visit that follows must do neither. */
+static int
+sandbox_check_value(mrb_state *mrb, mrb_value v, char *errbuf, size_t errbuf_size)
+{
+    if (mrb_nil_p(v) || mrb_true_p(v) || mrb_false_p(v) || mrb_integer_p(v) ||
+        mrb_float_p(v) || mrb_string_p(v) || mrb_symbol_p(v)) {
+        return 0;
+    }
+    if (mrb_array_p(v)) {
+        mrb_int alen = RARRAY_LEN(v);
+        for (mrb_int i = 0; i < alen; i++) {
+            if (sandbox_check_value(mrb, mrb_ary_entry(v, i), errbuf, errbuf_size) != 0) return -1;
+        }
+        return 0;
+    }
+    if (mrb_hash_p(v)) {
+        check_ctx_t ctx = { errbuf, errbuf_size, 0 };
+        mrb_hash_foreach(mrb, mrb_hash_ptr(v), sandbox_check_pair, &ctx);
+        return ctx.failed ? -1 : 0;
+    }
+
+    /* Unsupported type */
+    mrb_value cls_name = mrb_obj_as_string(mrb, mrb_funcall_argv(mrb, mrb_obj_value(mrb_obj_class(mrb, v)),
+                           mrb_intern_lit(mrb, "name"), 0, NULL));
+    snprintf(errbuf, errbuf_size, "TypeError: unsupported type for sandbox: %s",
+             mrb_string_p(cls_name) ? RSTRING_PTR(cls_name) : "unknown");
+    return -1;
+}
+
+/* Bytes a value counts for in sandbox_stats_t */
+static uint64_t
+sandbox_value_bytes(const sandbox_value_t *val)
+{
+    switch (val->type) {
+    case SANDBOX_VALUE_INTEGER:
+    case SANDBOX_VALUE_FLOAT:
+        return 8;
+    case SANDBOX_VALUE_STRING:
+        return val->as.str.len;
+    case SANDBOX_VALUE_ARRAY: {
+        uint64_t n = 0;
+        for (size_t i = 0; i < val->as.arr.len; i++) n += sandbox_value_bytes(&val->as.arr.items[i]);
+        return n;
+    }
+    case SANDBOX_VALUE_HASH: {
+        uint64_t n = 0;
+        for (size_t i = 0; i < val->as.hash.len; i++) {
+            n += sandbox_value_bytes(&val->as.hash.keys[i]) +
+                 sandbox_value_bytes(&val->as.hash.vals[i]);
+        }
+        return n;
+    }
+    default:
+        return 0;
+    }
+}
+
+typedef struct {
+    const sandbox_visitor_t *visitor;
+    void                    *ud;
+} visit_ctx_t;
+
+static void sandbox_visit_value(mrb_state *mrb, mrb_value v, const sandbox_visitor_t *visitor, void *ud);
+
+static int
+sandbox_visit_pair(mrb_state *mrb, mrb_value key, mrb_value val, void *data)
+{
+    visit_ctx_t *ctx = (visit_ctx_t *)data;
+    sandbox_visit_value(mrb, key, ctx->visitor, ctx->ud);
+    sandbox_visit_value(mrb, val, ctx->visitor, ctx->ud);
+    return 0;
+}
+
+/* Walk an already-checked value. Allocates nothing in mruby and holds no
+ * resources, so visitor callbacks may longjmp out of it. */
+static void
+sandbox_visit_value(mrb_state *mrb, mrb_value v, const sandbox_visitor_t *visitor, void *ud)
+{
+    sandbox_value_t sv;
+    memset(&sv, 0, sizeof(sv));
+
+    if (mrb_nil_p(v)) {
+        sv.type = SANDBOX_VALUE_NIL;
+    }
+    else if (mrb_true_p(v)) {
+        sv.type = SANDBOX_VALUE_TRUE;
+    }
+    else if (mrb_false_p(v)) {
+        sv.type = SANDBOX_VALUE_FALSE;
+    }
+    else if (mrb_integer_p(v)) {
+        sv.type = SANDBOX_VALUE_INTEGER;
+        sv.as.i = (int64_t)mrb_integer(v);
+    }
+    else if (mrb_float_p(v)) {
+        sv.type = SANDBOX_VALUE_FLOAT;
+        sv.as.f = mrb_float(v);
+    }
+    else if (mrb_string_p(v)) {
+        sv.type = SANDBOX_VALUE_STRING;
+        sv.as.str.ptr = RSTRING_PTR(v);
+        sv.as.str.len = (size_t)RSTRING_LEN(v);
+    }
+    else if (mrb_symbol_p(v)) {
+        /* Symbol → String */
+        mrb_int slen;
+        sv.type = SANDBOX_VALUE_STRING;
+        sv.as.str.ptr = (char *)mrb_sym_name_len(mrb, mrb_symbol(v), &slen);
+        sv.as.str.len = (size_t)slen;
+    }
+    else if (mrb_array_p(v)) {
+        mrb_int alen = RARRAY_LEN(v);
+        visitor->begin_array(ud, (size_t)alen);
+        for (mrb_int i = 0; i < alen; i++) {
+            sandbox_visit_value(mrb, mrb_ary_entry(v, i), visitor, ud);
+        }
+        visitor->end(ud);
+        return;
+    }
+    else if (mrb_hash_p(v)) {
+        visit_ctx_t ctx = { visitor, ud };
+        visitor->begin_hash(ud, (size_t)mrb_hash_size(mrb, v));
+        mrb_hash_foreach(mrb, mrb_hash_ptr(v), sandbox_visit_pair, &ctx);
+        visitor->end(ud);
+        return;
+    }
+
+    ((sandbox_state_t *)mrb->ud)->stats.bytes_out += sandbox_value_bytes(&sv);
+    visitor->scalar(ud, &sv);
+}
+
+int
+sandbox_args_count(const sandbox_args_t *args)
+{
+    return args->argc;
+}
+
+void
+sandbox_args_visit(const sandbox_args_t *args, int index,
+                   const sandbox_visitor_t *visitor, void *ud)
+{
+    sandbox_visit_value(args->mrb, args->argv[index], visitor, ud);
+}
+
+/* ------------------------------------------------------------------ */
+/* sandbox_value_t → mruby conversion                                 */
+/* ------------------------------------------------------------------ */
+
+static mrb_value
+sandbox_value_to_mrb(mrb_state *mrb, const sandbox_value_t *val)
+{
+    switch (val->type) {
+    case SANDBOX_VALUE_NIL:
+        return mrb_nil_value();
+    case SANDBOX_VALUE_TRUE:
+        return mrb_true_value();
+    case SANDBOX_VALUE_FALSE:
+        return mrb_false_value();
+    case SANDBOX_VALUE_INTEGER:
+        return mrb_int_value(mrb, (mrb_int)val->as.i);
+    case SANDBOX_VALUE_FLOAT:
+        return mrb_float_value(mrb, (mrb_float)val->as.f);
+    case SANDBOX_VALUE_STRING:
+        return mrb_str_new(mrb, val->as.str.ptr, (mrb_int)val->as.str.len);
+    case SANDBOX_VALUE_ARRAY: {
+        mrb_value ary = mrb_ary_new_capa(mrb, (mrb_int)val->as.arr.len);
+        for (size_t i = 0; i < val->as.arr.len; i++) {
+            mrb_ary_push(mrb, ary, sandbox_value_to_mrb(mrb, &val->as.arr.items[i]));
+        }
+        return ary;
+    }
+    case SANDBOX_VALUE_HASH: {
+        mrb_value hash = mrb_hash_new_capa(mrb, (mrb_int)val->as.hash.len);
+        for (size_t i = 0; i < val->as.hash.len; i++) {
+            mrb_hash_set(mrb, hash,
+                sandbox_value_to_mrb(mrb, &val->as.hash.keys[i]),
+                sandbox_value_to_mrb(mrb, &val->as.hash.vals[i]));
+        }
+        return hash;
+    }
+    }
+    return mrb_nil_value();
+}
+
+/* ------------------------------------------------------------------ */
+/* CRuby → mruby: building tool results                                */
+/* ------------------------------------------------------------------ */
+
+/* Runs under the GVL, called from CRuby frames, so nothing here may
+ * raise: the memory limit is lifted while building and enforced by the
+ * trampoline afterwards, and each step runs under mrb_protect_error so
+ * that a failed allocation can't longjmp through the CRuby frames. After
+ * one fails, the rest are skipped and finish reports it. */
+struct sandbox_builder {
+    sandbox_state_t *state;
+    mrb_value        stack;   /* open containers as (container, slot) pairs */
+    mrb_value        result;
+    size_t           saved_limit;
+    int              failed;
+};
+
+static void
+sandbox_builder_init(sandbox_builder_t *b, sandbox_state_t *state)
+{
+    b->state = state;
+    b->saved_limit = state->heap.limit;
+    state->heap.limit = 0;
+    b->stack = mrb_nil_value();   /* created by the first container */
+    b->result = mrb_nil_value();
+    b->failed = 0;
+}
+
+/* Returns the built value, or nil if building was abandoned midway.
+ * Sets *over_limit when the state ended up above its memory limit or
+ * ran out of memory while building. */
+static mrb_value
+sandbox_builder_finish(sandbox_builder_t *b, int *over_limit)
+{
+    sandbox_heap_t *heap = &b->state->heap;
+    heap->limit = b->saved_limit;
+    *over_limit = b->failed || (heap->limit > 0 && heap->current > heap->limit);
+    if (*over_limit) heap->exceeded = 1;
+    if (b->failed) return mrb_nil_value();
+    return mrb_nil_p(b->stack) || RARRAY_LEN(b->stack) == 0 ? b->result : mrb_nil_value();
+}
+
+/* Returns v if it became the result (and so needs protecting), else nil */
+static mrb_value
+sandbox_builder_add(sandbox_builder_t *b, mrb_value v)
+{
+    mrb_state *mrb = b->state->mrb;
+    mrb_int n = mrb_nil_p(b->stack) ? 0 : RARRAY_LEN(b->stack);
+    if (n == 0) {
+        b->result = v;
+        return v;
+    }
+
+    mrb_value container = mrb_ary_entry(b->stack, n - 2);
+    if (mrb_array_p(container)) {
+        mrb_ary_push(mrb, container, v);
+        return mrb_nil_value();
+    }
+
+    /* Hash: the slot holds a pending key, or undef */
+    mrb_value key = mrb_ary_entry(b->stack, n - 1);
+    if (mrb_undef_p(key)) {
+        mrb_ary_set(mrb, b->stack, n - 1, v);
+    } else {
+        mrb_hash_set(mrb, container, key, v);
+        mrb_ary_set(mrb, b->stack, n - 1, mrb_undef_value());
+    }
+    return mrb_nil_value();
+}
+
+enum { BUILDER_SCALAR, BUILDER_ARRAY, BUILDER_HASH, BUILDER_END };
+
+typedef struct {
+    sandbox_builder_t      *b;
+    int                     op;
+    size_t                  len;
+    const sandbox_value_t  *value;
+} builder_step_t;
+
+/* mrb_protect_error body. Objects made here are kept alive by the stack
+ * or the result; whichever of those is new is returned for protecting,
+ * since the arena is restored afterwards. */
+static mrb_value
+builder_step(mrb_state *mrb, void *ud)
+{
+    builder_step_t *step = ud;
+    sandbox_builder_t *b = step->b;
+
+    if (step->op == BUILDER_SCALAR) {
+        return sandbox_builder_add(b, sandbox_value_to_mrb(mrb, step->value));
+    }
+    if (step->op == BUILDER_END) {
+        mrb_ary_pop(mrb, b->stack);
+        return sandbox_builder_add(b, mrb_ary_pop(mrb, b->stack));
+    }
+
+    /* Scalar results never need the stack, so it is only allocated here */
+    mrb_value created = mrb_nil_value();
+    if (mrb_nil_p(b->stack)) created = b->stack = mrb_ary_new(mrb);
+    if (step->op == BUILDER_ARRAY) {
+        mrb_ary_push(mrb, b->stack, mrb_ary_new_capa(mrb, (mrb_int)step->len));
+        mrb_ary_push(mrb, b->stack, mrb_false_value());
+    } else {
+        mrb_ary_push(mrb, b->stack, mrb_hash_new_capa(mrb, (mrb_int)step->len));
+        mrb_ary_push(mrb, b->stack, mrb_undef_value());
+    }
+    return created;
+}
+
+static void
+sandbox_builder_run(sandbox_builder_t *b, int op, size_t len, const sandbox_value_t *value)
+{
+    if (b->failed) return;
+    builder_step_t step = { b, op, len, value };
+    mrb_bool failed = FALSE;
+    mrb_protect_error(b->state->mrb, builder_step, &step, &failed);
+    if (failed) b->failed = 1;
+}
+
+void
+sandbox_builder_scalar(sandbox_builder_t *b, const sandbox_value_t *value)
+{
+    b->state->stats.bytes_in += sandbox_value_bytes(value);
+    sandbox_builder_run(b, BUILDER_SCALAR, 0, value);
+}
+
+void
+sandbox_builder_begin_array(sandbox_builder_t *b, size_t len)
+{
+    sandbox_builder_run(b, BUILDER_ARRAY, len, NULL);
+}
+
+void
+sandbox_builder_begin_hash(sandbox_builder_t *b, size_t len)
+{
+    sandbox_builder_run(b, BUILDER_HASH, len, NULL);
+}
+
+void
+sandbox_builder_end(sandbox_builder_t *b)
+{
+    sandbox_builder_run(b, BUILDER_END, 0, NULL);
+}
+
+/* ------------------------------------------------------------------ */
+/* Per-eval statistics                                                 */
+/*                                                                     */
+/* Plain counters and a monotonic clock read around each phase, cheap  */
+/* enough to keep on for every eval.                                   */
+/* ------------------------------------------------------------------ */
+
+static double
+stats_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static void
+sandbox_stats_finish(sandbox_state_t *state, sandbox_result_t *result)
+{
+    state->stats.memory = state->heap.current;
+    state->stats.peak_memory = state->heap.peak;
+    result->stats = state->stats;
+}
+
+/* ------------------------------------------------------------------ */
+/* Trampoline: single C function for all registered tool functions     */
+/* ------------------------------------------------------------------ */
+
+static sandbox_state_t *
+get_sandbox_state(mrb_state *mrb)
+{
+    return (sandbox_state_t *)mrb->ud;
+}
+
+/* Check a call against the tool's declared types (sandbox_state_set_signature).
+ * Scalars are a tag test each; a mismatch raises here, before the host is
+ * called back. */
+static void
+sandbox_check_signature(mrb_state *mrb, sandbox_state_t *state, int slot,
+                        const mrb_value *argv, mrb_int argc)
+{
+    const char *types = state->func_sigs[slot];
+    mrb_int arity = (mrb_int)strlen(types);
+    if (argc != arity) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong number of arguments (given %i, expected %i)",
+                   argc, arity);
+    }
+
+    for (mrb_int i = 0; i < argc; i++) {
+        mrb_value v = argv[i];
+        const char *expected;
+        switch (types[i]) {
+        case 'i':
+            if (mrb_integer_p(v)) continue;
+            expected = "Integer";
+            break;
+        case 'f':
+            if (mrb_float_p(v)) continue;
+            expected = "Float";
+            break;
+        case 's':
+            if (mrb_string_p(v) || mrb_symbol_p(v)) continue;
+            expected = "String";
+            break;
+        case 'b':
+            if (mrb_true_p(v) || mrb_false_p(v)) continue;
+            expected = "true or false";
+            break;
+        default: {
+            char errbuf[256];
+            errbuf[0] = '\0';
+            if (sandbox_check_value(mrb, v, errbuf, sizeof(errbuf)) == 0) continue;
+            mrb_raise(mrb, E_TYPE_ERROR, errbuf);
+        }
+        }
+        mrb_raisef(mrb, E_TYPE_ERROR, "%s: argument %i must be %s, not %Y",
+                   state->func_names[slot], i + 1, expected, v);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* parallel { }: tool calls as futures                                 */
+/*                                                                     */
+/* Inside the block a tool call is handed to the host (state->submit)  */
+/* and returns a Future at once, so the host can run the calls side by */
+/* side. The block's futures are all joined before parallel returns.   */
+/* ------------------------------------------------------------------ */
+
+static mrb_value
+sandbox_submit_tool(mrb_state *mrb, sandbox_state_t *state, int slot, const sandbox_args_t *args)
+{
+    int ticket = -1;
+    double started = stats_clock();
+    char *error = state->submit(slot, args, &ticket, state->callback_userdata);
+    state->stats.tool_seconds += stats_clock() - started;
+    state->stats.tool_calls++;
+
+    if (error) {
+        mrb_value msg = mrb_str_new_cstr(mrb, error);
+        free(error);
+        mrb_exc_raise(mrb, mrb_exc_new_str(mrb, mrb_class_get(mrb, "RuntimeError"), msg));
+    }
+
+    mrb_value future = mrb_obj_new(mrb, state->future_class, 0, NULL);
+    mrb_iv_set(mrb, future, mrb_intern_lit(mrb, "__ticket__"), mrb_int_value(mrb, ticket));
+    mrb_ary_push(mrb, state->parallel, future);
+    return future;
+}
+
+/* After waiting outside the VM, stop the way the code fetch hook would */
+static void
+sandbox_check_stopped(mrb_state *mrb, sandbox_state_t *state)
+{
+    int reason = atomic_load(&state->interrupted);
+    if (reason & SANDBOX_INTERRUPT_HOST) {
+        mrb_raise(mrb, mrb_class_get(mrb, "RuntimeError"), "execution interrupted");
+    }
+
+    timeout_state_t *ts = &state->timeout_state;
+    if (state->timeout_seconds <= 0 || ts->expired) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((reason & SANDBOX_INTERRUPT_TIMEOUT) || timespec_reached(&now, &ts->deadline)) {
+        ts->expired = 1;
+        mrb_raise(mrb, mrb_class_get(mrb, "RuntimeError"), "execution timeout exceeded");
+    }
+}
+
+/* Wait for a pending future and store its value or error in it. Waits no
+ * longer than the eval's deadline, and not at all once it is stopping. */
+static void
+sandbox_future_resolve(mrb_state *mrb, sandbox_state_t *state, mrb_value future)
+{
+    mrb_value ticket = mrb_iv_get(mrb, future, mrb_intern_lit(mrb, "__ticket__"));
+    if (!mrb_integer_p(ticket)) return;   /* already resolved */
+
+    double wait = -1.0;
+    if (atomic_load(&state->interrupted)) {
+        wait = 0.0;
+    }
+    else if (state->timeout_seconds > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        wait = (double)(state->timeout_state.deadline.tv_sec - now.tv_sec) +
+               (double)(state->timeout_state.deadline.tv_nsec - now.tv_nsec) * 1e-9;
+        if (wait < 0) wait = 0.0;
+    }
+
+    sandbox_builder_t builder;
+    sandbox_builder_init(&builder, state);
+    double started = stats_clock();
+    char *error = state->await((int)mrb_integer(ticket), wait, &builder, state->callback_userdata);
+    state->stats.tool_seconds += stats_clock() - started;
+
+    int over_limit;
+    mrb_value ret = sandbox_builder_finish(&builder, &over_limit);
+
+    mrb_iv_set(mrb, future, mrb_intern_lit(mrb, "__ticket__"), mrb_nil_value());
+    if (error) {
+        mrb_iv_set(mrb, future, mrb_intern_lit(mrb, "__error__"), mrb_str_new_cstr(mrb, error));
+        free(error);
+    }
+    else {
+        mrb_iv_set(mrb, future, mrb_intern_lit(mrb, "__value__"), ret);
+    }
+    if (over_limit) {
+        mrb_raise_nomemory(mrb);
+    }
+}
+
+static void
+sandbox_future_raise(mrb_state *mrb, mrb_value future)
+{
+    mrb_value error = mrb_iv_get(mrb, future, mrb_intern_lit(mrb, "__error__"));
+    if (!mrb_nil_p(error)) {
+        mrb_exc_raise(mrb, mrb_exc_new_str(mrb, mrb_class_get(mrb, "RuntimeError"), error));
+    }
+}
+
+/* Future#value: wait for the call if it is still running */
+static mrb_value
+sandbox_mrb_future_value(mrb_state *mrb, mrb_value self)
+{
+    sandbox_state_t *state = get_sandbox_state(mrb);
+    if (mrb_integer_p(mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__ticket__")))) {
+        sandbox_future_resolve(mrb, state, self);
+        sandbox_check_stopped(mrb, state);
+    }
+    sandbox_future_raise(mrb, self);
+    return mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__value__"));
+}
+
+static mrb_value
+sandbox_mrb_future_inspect(mrb_state *mrb, mrb_value self)
+{
+    if (mrb_integer_p(mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__ticket__")))) {
+        return mrb_str_new_lit(mrb, "#<Future pending>");
+    }
+    mrb_value error = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__error__"));
+    mrb_value shown = error;
+    if (mrb_nil_p(error)) {
+        shown = mrb_inspect(mrb, mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__value__")));
+    }
+    mrb_value str = mrb_str_new_lit(mrb, "#<Future ");
+    mrb_str_cat_str(mrb, str, shown);
+    mrb_str_cat_lit(mrb, str, ">");
+    return str;
+}
+
+/* Future#method_missing: a future used as if it were the result */
+static mrb_value
+sandbox_mrb_future_missing(mrb_state *mrb, mrb_value self)
+{
+    mrb_sym name;
+    mrb_int argc;
+    mrb_value *argv;
+    mrb_get_args(mrb, "n*!", &name, &argv, &argc);
+    mrb_raisef(mrb, E_NOMETHOD_ERROR,
+               "undefined method '%n' for a Future; call .value on it to wait for the tool's result",
+               name);
+    return mrb_nil_value();
+}
+
+static mrb_value
+sandbox_parallel_body(mrb_state *mrb, mrb_value blk)
+{
+    return mrb_yield_argv(mrb, blk, 0, NULL);
+}
+
+static mrb_value sandbox_parallel_join(mrb_state *mrb, mrb_value frame);
+static mrb_value sandbox_parallel_unwrap(mrb_state *mrb, struct RClass *future_class,
+                                         mrb_value v, int depth);
+
+/* Run body(arg) with a fresh list of futures, join them, and return its
+ * value with the futures replaced; raises the first call's error. With a
+ * block, only that block's batched tail calls become futures. */
+static mrb_value
+sandbox_parallel_run(mrb_state *mrb, sandbox_state_t *state, struct RProc *block,
+                     mrb_func_t body, mrb_value arg)
+{
+    mrb_value futures = mrb_ary_new(mrb);
+    mrb_value outer[3] = {
+        state->parallel, futures,
+        state->collect_block ? mrb_obj_value(state->collect_block) : mrb_nil_value()
+    };
+    mrb_value frame = mrb_ary_new_from_values(mrb, 3, outer);
+    state->parallel = futures;
+    state->collect_block = block;
+    mrb_value ret = mrb_ensure(mrb, body, arg, sandbox_parallel_join, frame);
+
+    sandbox_check_stopped(mrb, state);
+    for (mrb_int i = 0; i < RARRAY_LEN(futures); i++) {
+        sandbox_future_raise(mrb, mrb_ary_entry(futures, i));
+    }
+    return sandbox_parallel_unwrap(mrb, state->future_class, ret, 0);
+}
+
+/* ensure: pop the block's futures and join them, even if it raised.
+ * frame is [outer futures, futures, outer collect block]. */
+static mrb_value
+sandbox_parallel_join(mrb_state *mrb, mrb_value frame)
+{
+    sandbox_state_t *state = get_sandbox_state(mrb);
+    mrb_value futures = mrb_ary_entry(frame, 1);
+    mrb_value block = mrb_ary_entry(frame, 2);
+    state->parallel = mrb_ary_entry(frame, 0);
+    state->collect_block = mrb_nil_p(block) ? NULL : mrb_proc_ptr(block);
+    for (mrb_int i = 0; i < RARRAY_LEN(futures); i++) {
+        sandbox_future_resolve(mrb, state, mrb_ary_entry(futures, i));
+    }
+    return mrb_nil_value();
+}
+
+/* Replace futures in the block's value (and in arrays and hash values
+ * inside it) with their results */
+static mrb_value
+sandbox_parallel_unwrap(mrb_state *mrb, struct RClass *future_class, mrb_value v, int depth)
+{
+    if (depth > 64) return v;
+    if (mrb_obj_is_kind_of(mrb, v, future_class)) {
+        return mrb_iv_get(mrb, v, mrb_intern_lit(mrb, "__value__"));
+    }
+    if (mrb_array_p(v) && !MRB_FROZEN_P(mrb_obj_ptr(v))) {
+        for (mrb_int i = 0; i < RARRAY_LEN(v); i++) {
+            mrb_value item = mrb_ary_entry(v, i);
+            mrb_ary_set(mrb, v, i, sandbox_parallel_unwrap(mrb, future_class, item, depth + 1));
+        }
+    }
+    else if (mrb_hash_p(v) && !MRB_FROZEN_P(mrb_obj_ptr(v))) {
+        mrb_value keys = mrb_hash_keys(mrb, v);
+        for (mrb_int i = 0; i < RARRAY_LEN(keys); i++) {
+            mrb_value key = mrb_ary_entry(keys, i);
+            mrb_hash_set(mrb, v, key,
+                         sandbox_parallel_unwrap(mrb, future_class, mrb_hash_get(mrb, v, key), depth + 1));
+        }
+    }
+    return v;
+}
+
+/* Kernel#parallel { orders(); tickets() }: the block's tool calls run
+ * concurrently on the host; returns the block's value with its futures
+ * replaced by their results, or raises the first call's error */
+static mrb_value
+sandbox_mrb_parallel(mrb_state *mrb, mrb_value self)
+{
+    mrb_value blk;
+    mrb_get_args(mrb, "&!", &blk);
+
+    sandbox_state_t *state = get_sandbox_state(mrb);
+    return sandbox_parallel_run(mrb, state, NULL, sandbox_parallel_body, blk);
+}
+
+/* Array#map and Enumerable#map (and collect) once a tool is batched.
+ * Tool calls that are the value of the block are submitted, so that
+ * [1, 2].map { |id| find_order(id) } makes one batch call; map joins them
+ * before it returns, like parallel. Other calls in the block, and any
+ * call that is not the block's last expression, run directly. */
+static mrb_value
+sandbox_collect_body(mrb_state *mrb, mrb_value call)
+{
+    mrb_value self = mrb_ary_entry(call, 0);
+    mrb_value args = mrb_ary_entry(call, 1);
+    return mrb_funcall_with_block(mrb, self, mrb_intern_lit(mrb, "__enclave_map__"),
+                                  RARRAY_LEN(args), RARRAY_PTR(args), mrb_ary_entry(call, 2));
+}
+
+static mrb_value
+sandbox_mrb_collect(mrb_state *mrb, mrb_value self)
+{
+    mrb_value *argv;
+    mrb_int argc;
+    mrb_value blk;
+    mrb_get_args(mrb, "*&", &argv, &argc, &blk);
+
+    sandbox_state_t *state = get_sandbox_state(mrb);
+    if (mrb_nil_p(blk) || state->nbatched == 0 || !state->submit ||
+        (!mrb_nil_p(state->parallel) && !state->collect_block)) {
+        return mrb_funcall_with_block(mrb, self, mrb_intern_lit(mrb, "__enclave_map__"),
+                                      argc, argv, blk);
+    }
+
+    mrb_value call[3] = { self, mrb_ary_new_from_values(mrb, argc, argv), blk };
+    return sandbox_parallel_run(mrb, state, mrb_proc_ptr(blk), sandbox_collect_body,
+                                mrb_ary_new_from_values(mrb, 3, call));
+}
+
+/* Whether the running tool call's value is what collect_block returns:
+ * the caller is that block and its next instruction returns the call's
+ * register. Anything else may use the value, so it can't be a future. */
+static int
+sandbox_collect_tail_p(mrb_state *mrb, sandbox_state_t *state)
+{
+    const mrb_callinfo *ci = mrb->c->ci;
+    if (ci == mrb->c->cibase) return 0;
+    const mrb_callinfo *caller = ci - 1;
+    if (caller->proc != state->collect_block || MRB_PROC_CFUNC_P(caller->proc)) return 0;
+
+    const mrb_irep *irep = caller->proc->body.irep;
+    const mrb_code *pc = caller->pc;
+    if (!pc || pc < irep->iseq || pc + 1 >= irep->iseq + irep->ilen) return 0;
+    return pc[0] == OP_RETURN && pc[1] == ci->stack - caller->stack;
+}
+
+/* Define the map wrappers; the originals stay under a hidden name */
+static void
+sandbox_define_collect(sandbox_state_t *state)
+{
+    mrb_state *mrb = state->mrb;
+    struct RClass *classes[] = { mrb->array_class, mrb_module_get(mrb, "Enumerable") };
+    mrb_sym original = mrb_intern_lit(mrb, "__enclave_map__");
+
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        struct RClass *c = classes[i];
+        if (mrb_obj_respond_to(mrb, c, original)) continue;
+        mrb_alias_method(mrb, c, original, mrb_intern_lit(mrb, "map"));
+        mrb_define_method(mrb, c, "map",     sandbox_mrb_collect, MRB_ARGS_ANY() | MRB_ARGS_BLOCK());
+        mrb_define_method(mrb, c, "collect", sandbox_mrb_collect, MRB_ARGS_ANY() | MRB_ARGS_BLOCK());
+    }
+}
+
+/* Each tool method is a cfunc proc around this trampoline whose env holds
+ * the tool's slot, so dispatch never goes through the method name (and
+ * aliases of a tool still reach it). */
+static mrb_value
+sandbox_function_trampoline(mrb_state *mrb, mrb_value self)
+{
+    sandbox_state_t *state = get_sandbox_state(mrb);
+    if (!state || !state->callback) {
+        mrb_raise(mrb, mrb_class_get(mrb, "RuntimeError"), "no tool callback registered");
+        return mrb_nil_value();
+    }
+
+    int slot = (int)mrb_integer(mrb_proc_cfunc_env_get(mrb, 0));
+
+    /* Get args */
+    mrb_int argc;
+    mrb_value *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+
+    /* Type errors are raised here, in mruby; the callback then reads the
+     * args straight into CRuby objects. */
+    if (state->func_sigs[slot]) {
+        sandbox_check_signature(mrb, state, slot, argv, argc);
+    }
+    else {
+        char errbuf[256];
+        errbuf[0] = '\0';
+        for (mrb_int i = 0; i < argc; i++) {
+            if (sandbox_check_value(mrb, argv[i], errbuf, sizeof(errbuf)) != 0) {
+                mrb_raise(mrb, mrb_class_get(mrb, "TypeError"), errbuf);
+                return mrb_nil_value();
+            }
+        }
+    }
+
+    sandbox_args_t args = { mrb, argv, (int)argc };
+    if (!mrb_nil_p(state->parallel) && state->submit &&
+        (!state->collect_block || (state->func_batched[slot] && sandbox_collect_tail_p(mrb, state)))) {
+        return sandbox_submit_tool(mrb, state, slot, &args);
+    }
+
+    /* Call the CRuby callback, which builds the result in place */
+    sandbox_builder_t builder;
+    sandbox_builder_init(&builder, state);
+
+    double started = stats_clock();
+    char *error = state->callback(slot, &args, &builder, state->callback_userdata);
+    state->stats.tool_seconds += stats_clock() - started;
+    state->stats.tool_calls++;
+
+    int over_limit;
+    mrb_value ret = sandbox_builder_finish(&builder, &over_limit);
+
+    /* Check for error from callback */
+    if (error) {
+        mrb_value msg = mrb_str_new_cstr(mrb, error);
+        free(error);
+        mrb_exc_raise(mrb, mrb_exc_new_str(mrb, mrb_class_get(mrb, "RuntimeError"), msg));
+        return mrb_nil_value();
+    }
+    if (over_limit) {
+        mrb_raise_nomemory(mrb);
+    }
+
+    return ret;
+}
+
+/* ------------------------------------------------------------------ */
+/* Register functions in mruby                                        */
+/* ------------------------------------------------------------------ */
+
+/* Define Kernel#<name of slot> as the trampoline bound to slot */
+static void
+sandbox_define_tool(sandbox_state_t *state, int slot)
+{
+    mrb_state *mrb = state->mrb;
+    int ai = mrb_gc_arena_save(mrb);
+    mrb_value env = mrb_int_value(mrb, slot);
+    struct RProc *p = mrb_proc_new_cfunc_with_env(mrb, sandbox_function_trampoline, 1, &env);
+    mrb_method_t m;
+    MRB_METHOD_FROM_PROC(m, p);
+    mrb_define_method_raw(mrb, mrb->kernel_module, mrb_intern_cstr(mrb, state->func_names[slot]), m);
+    mrb_gc_arena_restore(mrb, ai);
+}
+
+static int
+sandbox_tool_method_p(mrb_method_t m)
+{
+    if (MRB_METHOD_UNDEF_P(m) || !MRB_METHOD_PROC_P(m)) return 0;
+    struct RProc *p = MRB_METHOD_PROC(m);
+    return MRB_PROC_CFUNC_P(p) && MRB_PROC_CFUNC(p) == sandbox_function_trampoline;
+}
+
+static void
+register_functions_in_mrb(sandbox_state_t *state)
+{
+    for (int i = 0; i < state->func_count; i++) {
+        sandbox_define_tool(state, i);
+    }
+}
+
+static output_buf_t *
+get_output_buf(mrb_state *mrb)
+{
+    sandbox_state_t *state = (sandbox_state_t *)mrb->ud;
+    if (!state) return NULL;
+    return &state->output;
+}
+
+/* ------------------------------------------------------------------ */
+/* mruby Kernel overrides for output capture                          */
+/* ------------------------------------------------------------------ */
+
+static mrb_value
+sandbox_mrb_print(mrb_state *mrb, mrb_value self)
+{
+    mrb_int argc;
+    mrb_value *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+
+    output_buf_t *ob = get_output_buf(mrb);
+    if (!ob) return mrb_nil_value();
+
+    for (mrb_int i = 0; i < argc; i++) {
+        mrb_value s = mrb_obj_as_string(mrb, argv[i]);
+        output_buf_append(ob, RSTRING_PTR(s), RSTRING_LEN(s));
+    }
+    return mrb_nil_value();
+}
+
+static mrb_value
+sandbox_mrb_puts(mrb_state *mrb, mrb_value self)
+{
+    mrb_int argc;
+    mrb_value *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+
+    output_buf_t *ob = get_output_buf(mrb);
+    if (!ob) return mrb_nil_value();
+
+    if (argc == 0) {
+        output_buf_append(ob, "\n", 1);
+    }
+    else {
+        for (mrb_int i = 0; i < argc; i++) {
+            if (mrb_array_p(argv[i])) {
+                mrb_int alen = RARRAY_LEN(argv[i]);
+                mrb_value *aptr = RARRAY_PTR(argv[i]);
+                for (mrb_int j = 0; j < alen; j++) {
+                    mrb_value s = mrb_obj_as_string(mrb, aptr[j]);
+                    output_buf_append(ob, RSTRING_PTR(s), RSTRING_LEN(s));
+                    if (RSTRING_LEN(s) == 0 || RSTRING_PTR(s)[RSTRING_LEN(s)-1] != '\n') {
+                        output_buf_append(ob, "\n", 1);
+                    }
+                }
+            }
+            else {
+                mrb_value s = mrb_obj_as_string(mrb, argv[i]);
+                output_buf_append(ob, RSTRING_PTR(s), RSTRING_LEN(s));
+                if (RSTRING_LEN(s) == 0 || RSTRING_PTR(s)[RSTRING_LEN(s)-1] != '\n') {
+                    output_buf_append(ob, "\n", 1);
+                }
+            }
+        }
+    }
+    return mrb_nil_value();
+}
+
+static mrb_value
+sandbox_mrb_p(mrb_state *mrb, mrb_value self)
+{
+    mrb_int argc;
+    mrb_value *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+
+    output_buf_t *ob = get_output_buf(mrb);
+    if (!ob) return mrb_nil_value();
+
+    for (mrb_int i = 0; i < argc; i++) {
+        mrb_value s = mrb_funcall_argv(mrb, argv[i],
+                        mrb_intern_lit(mrb, "inspect"), 0, NULL);
+        if (mrb_string_p(s)) {
+            output_buf_append(ob, RSTRING_PTR(s), RSTRING_LEN(s));
+        }
+        output_buf_append(ob, "\n", 1);
+    }
+
+    if (argc == 0) return mrb_nil_value();
+    if (argc == 1) return argv[0];
+    return mrb_ary_new_from_values(mrb, argc, argv);
+}
+
+/* ------------------------------------------------------------------ */
+/* Gems                                                                */
+/*                                                                     */
+/* mrb_open initializes every gem compiled in. States instead open the */
+/* core and run the gem inits themselves (in the same order, listed by */
+/* extconf.rb in sandbox_gems.h), so the optional gems below can be    */
+/* left out, or loaded the first time a snippet references one of      */
+/* their constants or methods.                                         */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    const char *id;
+    void (*init)(mrb_state *mrb);
+    void (*final)(mrb_state *mrb);
+} sandbox_gem_t;
+
+#define SANDBOX_GEM(id) \
+    void GENERATED_TMP_mrb_##id##_gem_init(mrb_state *mrb); \
+    void GENERATED_TMP_mrb_##id##_gem_final(mrb_state *mrb);
+#include "sandbox_gems.h"
+#undef SANDBOX_GEM
+
+static const sandbox_gem_t sandbox_gems[] = {
+#define SANDBOX_GEM(id) \
+    { #id, GENERATED_TMP_mrb_##id##_gem_init, GENERATED_TMP_mrb_##id##_gem_final },
+#include "sandbox_gems.h"
+#undef SANDBOX_GEM
+    { NULL, NULL, NULL }
+};
+
+#define SANDBOX_GEM_COUNT ((int)(sizeof(sandbox_gems) / sizeof(sandbox_gems[0])) - 1)
+
+/* Optional gems. Each one's eager dependencies are core or always-on
+ * gems; it is triggered by the top-level constants it defines and by
+ * stubs for the methods it adds to classes that exist without it. */
+typedef struct {
+    const char *name;             /* as in sandbox_gem_lookup */
+    const char *id;               /* in sandbox_gems.h */
+    const char *constants[2];
+    struct { const char *module, *method; } methods[5];
+} sandbox_optional_gem_t;
+
+static const sandbox_optional_gem_t sandbox_optional_gems[] = {
+    { "math",        "mruby_math",        { "Math" },        { { NULL } } },
+    { "objectspace", "mruby_objectspace", { "ObjectSpace" }, { { NULL } } },
+    { "random",      "mruby_random",      { "Random" },
+      { { "Kernel", "rand" }, { "Kernel", "srand" }, { "Array", "shuffle" },
+        { "Array", "shuffle!" }, { "Array", "sample" } } },
+    { "set",         "mruby_set",         { "Set" },         { { "Enumerable", "to_set" } } },
+    { "struct",      "mruby_struct",      { "Struct" },      { { NULL } } },
+    { "data",        "mruby_data",        { "Data" },        { { NULL } } },
+};
+
+#define SANDBOX_OPTIONAL_GEMS \
+    ((int)(sizeof(sandbox_optional_gems) / sizeof(sandbox_optional_gems[0])))
+
+/* Index in sandbox_gems of each optional gem (-1 if not compiled in),
+ * and the other way around */
+static int gem_of_optional[SANDBOX_OPTIONAL_GEMS];
+static int optional_of_gem[SANDBOX_GEM_COUNT + 1];
+static pthread_once_t gems_once = PTHREAD_ONCE_INIT;
+
+static void
+gems_index_init(void)
+{
+    for (int i = 0; i < SANDBOX_GEM_COUNT; i++) optional_of_gem[i] = -1;
+    for (int o = 0; o < SANDBOX_OPTIONAL_GEMS; o++) {
+        gem_of_optional[o] = -1;
+        for (int i = 0; i < SANDBOX_GEM_COUNT; i++) {
+            if (strcmp(sandbox_gems[i].id, sandbox_optional_gems[o].id) == 0) {
+                gem_of_optional[o] = i;
+                optional_of_gem[i] = o;
+            }
+        }
+    }
+}
+
+int
+sandbox_gem_lookup(const char *name)
+{
+    pthread_once(&gems_once, gems_index_init);
+    for (int o = 0; o < SANDBOX_OPTIONAL_GEMS; o++) {
+        if (gem_of_optional[o] >= 0 && strcmp(sandbox_optional_gems[o].name, name) == 0) return o;
+    }
+    return -1;
+}
+
+int
+sandbox_gem_count(void)
+{
+    return SANDBOX_OPTIONAL_GEMS;
+}
+
+const char *
+sandbox_gem_name(int index)
+{
+    pthread_once(&gems_once, gems_index_init);
+    if (index < 0 || index >= SANDBOX_OPTIONAL_GEMS || gem_of_optional[index] < 0) return NULL;
+    return sandbox_optional_gems[index].name;
+}
+
+/* Optional gems loaded so far, kept under a name snippets can't see on
+ * Kernel so that checkpoints and sessions carry it with the heap */
+static mrb_int
+sandbox_gems_loaded(mrb_state *mrb)
+{
+    mrb_value v = mrb_iv_get(mrb, mrb_obj_value(mrb->kernel_module),
+                             mrb_intern_lit(mrb, "__enclave_gems__"));
+    return mrb_integer_p(v) ? mrb_integer(v) : 0;
+}
+
+static void
+sandbox_gems_set_loaded(mrb_state *mrb, mrb_int loaded)
+{
+    mrb_iv_set(mrb, mrb_obj_value(mrb->kernel_module),
+               mrb_intern_lit(mrb, "__enclave_gems__"), mrb_int_value(mrb, loaded));
+}
+
+/* Registered with mrb_state_atexit in place of mrb_final_mrbgems */
+static void
+sandbox_gems_final(mrb_state *mrb)
+{
+    mrb_int loaded = sandbox_gems_loaded(mrb);
+    for (int i = SANDBOX_GEM_COUNT - 1; i >= 0; i--) {
+        int o = optional_of_gem[i];
+        if (o < 0 || (loaded & ((mrb_int)1 << o))) sandbox_gems[i].final(mrb);
+    }
+}
+
+static mrb_value
+sandbox_gem_init_body(mrb_state *mrb, void *userdata)
+{
+    sandbox_gems[*(int *)userdata].init(mrb);
+    return mrb_nil_value();
+}
+
+/* Initialize optional gem o in the middle of a snippet, with the limits
+ * out of the way: the generated gem init exits the process if its Ruby
+ * part raises, and an allocation failure or timeout would do that. */
+static void
+sandbox_gem_load(sandbox_state_t *state, int o)
+{
+    mrb_state *mrb = state->mrb;
+    mrb_int loaded = sandbox_gems_loaded(mrb);
+    if (loaded & ((mrb_int)1 << o)) return;
+    sandbox_gems_set_loaded(mrb, loaded | ((mrb_int)1 << o));
+
+    int index = gem_of_optional[o];
+    size_t limit = state->heap.limit;
+    state->heap.limit = 0;
+    state->gem_loading = 1;
+    mrb_bool failed = FALSE;
+    mrb_value exc = mrb_protect_error(mrb, sandbox_gem_init_body, &index, &failed);
+    state->gem_loading = 0;
+    state->heap.limit = limit;
+    if (failed) mrb_exc_raise(mrb, exc);
+}
+
+/* Optional gem of this state not loaded yet that defines top-level
+ * constant name (or method name when method is set), or -1 */
+static int
+sandbox_gem_pending(sandbox_state_t *state, mrb_sym name, int method)
+{
+    mrb_state *mrb = state->mrb;
+    const char *n = mrb_sym_name(mrb, name);
+    mrb_int loaded = sandbox_gems_loaded(mrb);
+    for (int o = 0; o < SANDBOX_OPTIONAL_GEMS; o++) {
+        const sandbox_optional_gem_t *g = &sandbox_optional_gems[o];
+        if (gem_of_optional[o] < 0 || !(state->gems & (1u << o)) ||
+            (loaded & ((mrb_int)1 << o))) {
+            continue;
+        }
+        if (method) {
+            for (int k = 0; k < 5 && g->methods[k].method; k++) {
+                if (strcmp(g->methods[k].method, n) == 0) return o;
+            }
+        } else {
+            for (int k = 0; k < 2 && g->constants[k]; k++) {
+                if (strcmp(g->constants[k], n) == 0) return o;
+            }
+        }
+    }
+    return -1;
+}
+
+/* Load the gem defining top-level constant name, if one is pending.
+ * Returns 1 if the constant exists now. */
+static int
+sandbox_gem_autoload(sandbox_state_t *state, mrb_sym name)
+{
+    int o = sandbox_gem_pending(state, name, 0);
+    if (o < 0) return 0;
+    sandbox_gem_load(state, o);
+    return mrb_const_defined_at(state->mrb, mrb_obj_value(state->mrb->object_class), name);
+}
+
+/* Module#const_missing while optional gems are pending */
+static mrb_value
+sandbox_gem_const_missing(mrb_state *mrb, mrb_value mod)
+{
+    mrb_sym name;
+    mrb_get_args(mrb, "n", &name);
+
+    if (sandbox_gem_autoload(get_sandbox_state(mrb), name)) {
+        return mrb_const_get(mrb, mrb_obj_value(mrb->object_class), name);
+    }
+    if (mrb_class_real(mrb_class_ptr(mod)) != mrb->object_class) {
+        mrb_name_error(mrb, name, "uninitialized constant %v::%n", mod, name);
+    }
+    mrb_name_error(mrb, name, "uninitialized constant %n", name);
+    return mrb_nil_value();
+}
+
+/* Stands in for a method of a pending gem: loads the gem, which defines
+ * the real method over this one, and calls it */
+static mrb_value
+sandbox_gem_method_stub(mrb_state *mrb, mrb_value self)
+{
+    mrb_sym mid = mrb->c->ci->mid;
+    mrb_value *argv;
+    mrb_int argc;
+    mrb_value blk;
+    mrb_get_args(mrb, "*&", &argv, &argc, &blk);
+
+    sandbox_state_t *state = get_sandbox_state(mrb);
+    int o = sandbox_gem_pending(state, mid, 1);
+    if (o >= 0) sandbox_gem_load(state, o);
+
+    struct RClass *c = mrb_class(mrb, self);
+    mrb_method_t m = mrb_method_search_vm(mrb, &c, mid);
+    if (!MRB_METHOD_UNDEF_P(m) && MRB_METHOD_FUNC_P(m) &&
+        MRB_METHOD_FUNC(m) == sandbox_gem_method_stub) {
+        /* The gem doesn't define it in this build after all */
+        mrb_remove_method(mrb, c, mid);
+        mrb_no_method_error(mrb, mid, mrb_ary_new_from_values(mrb, argc, argv),
+                            "undefined method '%n'", mid);
+    }
+    return mrb_funcall_with_block(mrb, self, mid, argc, argv, blk);
+}
+
+/* What mrb_open does after mrb_open_core, for the gems in state->gems */
+static mrb_value
+sandbox_gems_init(mrb_state *mrb, void *userdata)
+{
+    sandbox_state_t *state = (sandbox_state_t *)userdata;
+    int eager = (state->gems & SANDBOX_GEMS_EAGER) != 0;
+    mrb_int loaded = 0;
+
+    for (int i = 0; i < SANDBOX_GEM_COUNT; i++) {
+        int o = optional_of_gem[i];
+        if (o >= 0) {
+            if (!eager || !(state->gems & (1u << o))) continue;
+            loaded |= (mrb_int)1 << o;
+        }
+        sandbox_gems[i].init(mrb);
+    }
+    sandbox_gems_set_loaded(mrb, loaded);
+    mrb_state_atexit(mrb, sandbox_gems_final);
+
+    int pending = 0;
+    for (int o = 0; o < SANDBOX_OPTIONAL_GEMS; o++) {
+        const sandbox_optional_gem_t *g = &sandbox_optional_gems[o];
+        if (gem_of_optional[o] < 0 || !(state->gems & (1u << o)) ||
+            (loaded & ((mrb_int)1 << o))) {
+            continue;
+        }
+        pending = 1;
+        for (int k = 0; k < 5 && g->methods[k].method; k++) {
+            mrb_value mod = mrb_const_get(mrb, mrb_obj_value(mrb->object_class),
+                                          mrb_intern_cstr(mrb, g->methods[k].module));
+            mrb_define_method(mrb, mrb_class_ptr(mod), g->methods[k].method,
+                              sandbox_gem_method_stub, MRB_ARGS_ANY());
+        }
+    }
+    if (pending) {
+        mrb_define_method(mrb, mrb->module_class, "const_missing",
+                          sandbox_gem_const_missing, MRB_ARGS_REQ(1));
+    }
+    return mrb_nil_value();
+}
+
+/* mrb_open with state's gem set. NULL on failure. */
+static mrb_state *
+sandbox_open_mrb(sandbox_state_t *state)
+{
+    pthread_once(&gems_once, gems_index_init);
+
+    mrb_state *mrb = mrb_open_core();
+    if (!mrb) return NULL;
+    mrb->ud = state;
+
+    mrb_bool failed = FALSE;
+    mrb_protect_error(mrb, sandbox_gems_init, state, &failed);
+    if (failed || mrb->exc) {
+        mrb_close(mrb);
+        return NULL;
+    }
+    mrb_gc_arena_restore(mrb, 0);
+    return mrb;
+}
+
+/* ------------------------------------------------------------------ */
+/* Internal: initialize an mrb_state with sandbox settings            */
+/* ------------------------------------------------------------------ */
+
+static void
+sandbox_setup_mrb(sandbox_state_t *state)
+{
+    /* Override Kernel#print, define Kernel#puts, override Kernel#p */
+    struct RClass *kernel = state->mrb->kernel_module;
+    mrb_define_method(state->mrb, kernel, "print", sandbox_mrb_print, MRB_ARGS_ANY());
+    mrb_define_method(state->mrb, kernel, "puts",  sandbox_mrb_puts,  MRB_ARGS_ANY());
+    mrb_define_method(state->mrb, kernel, "p",     sandbox_mrb_p,     MRB_ARGS_ANY());
+
+    /* parallel { } and the futures its tool calls return */
+    mrb_define_method(state->mrb, kernel, "parallel", sandbox_mrb_parallel, MRB_ARGS_BLOCK());
+    /* Future has no constant and is frozen, so snippets can neither make
+     * nor reopen one; the Kernel ivar only keeps the class alive */
+    struct RClass *future = mrb_class_new(state->mrb, state->mrb->object_class);
+    mrb_undef_class_method(state->mrb, future, "new");
+    mrb_undef_class_method(state->mrb, future, "allocate");
+    mrb_define_method(state->mrb, future, "value",   sandbox_mrb_future_value,   MRB_ARGS_NONE());
+    mrb_define_method(state->mrb, future, "inspect", sandbox_mrb_future_inspect, MRB_ARGS_NONE());
+    mrb_define_method(state->mrb, future, "method_missing", sandbox_mrb_future_missing, MRB_ARGS_ANY());
+    mrb_obj_freeze(state->mrb, mrb_obj_value(future));
+    mrb_iv_set(state->mrb, mrb_obj_value(kernel), mrb_intern_lit(state->mrb, "__enclave_future__"),
+               mrb_obj_value(future));
+    state->future_class = future;
+    state->parallel = mrb_nil_value();
+    state->collect_block = NULL;
+
+    /* Re-register tool functions (survives reset) */
+    register_functions_in_mrb(state);
+    if (state->nbatched > 0) sandbox_define_collect(state);
+
+    /* Declare _ (like mirb's "_=nil") without parsing or running code:
+     * snippets are compiled against the local names in cxt, and its
+     * register after self is set here */
+    mrb_state *mrb = state->mrb;
+    state->cxt->syms = (mrb_sym *)mrb_malloc(mrb, sizeof(mrb_sym));
+    state->cxt->syms[0] = mrb_intern_lit(mrb, "_");
+    state->cxt->slen = 1;
+    mrb->c->ci->stack[1] = mrb_nil_value();
+    state->stack_keep = 2;  /* self and _ */
+}
+
+/* Everything after a successful mrb_open, shared by new and reset */
+static void
+sandbox_init_mrb(sandbox_state_t *state)
+{
+    /* Store sandbox_state in mrb->ud for the code_fetch_hook */
+    state->mrb->ud = state;
+
+    state->cxt = mrb_ccontext_new(state->mrb);
+    state->cxt->capture_errors = TRUE;
+    mrb_ccontext_filename(state->mrb, state->cxt, "(sandbox)");
+    state->cxt->lineno = 1; /* every snippet starts at line 1 */
+
+    state->stack_keep = 0;
+    state->arena_idx = mrb_gc_arena_save(state->mrb);
+
+    sandbox_setup_mrb(state);
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API                                                          */
+/* ------------------------------------------------------------------ */
+
+sandbox_state_t *
+sandbox_state_new(double timeout, size_t memory_limit, sandbox_allocator_t allocator,
+                  uint32_t gems)
+{
+    sandbox_state_t *state = calloc(1, sizeof(sandbox_state_t));
+    if (!state) return NULL;
+    if (heap_init(&state->heap, allocator) != 0) {
+        free(state);
+        return NULL;
+    }
+
+    state->timeout_seconds = timeout;
+    state->memory_limit = memory_limit;
+    state->gems = gems;
+    state->timeout_state.heap_index = DEADLINE_NONE;
+    pthread_mutex_init(&state->interrupt_lock, NULL);
+
+    /* Enter the heap with limit=0 (unlimited) during init so every
+     * allocation comes from this state's backend. */
+    sandbox_heap_t *prev = heap_enter(&state->heap);
+
+    state->mrb = sandbox_open_mrb(state);
+
+    if (!state->mrb || state->mrb->exc) {
+        heap_leave(prev);
+        heap_destroy(&state->heap);
+        pthread_mutex_destroy(&state->interrupt_lock);
+        free(state);
+        return NULL;
+    }
+
+    output_buf_init(&state->output);
+    sandbox_init_mrb(state);
+
+    heap_leave(prev);
+
+    return state;
+}
+
+static void sandbox_drop_checkpoints(sandbox_state_t *state, struct sandbox_checkpoint *until);
+
+/* Tear down the mrb_state. When the heap's backend can drop all of its
+ * blocks at once, nothing is freed object by object. */
+static void
+sandbox_close_mrb(sandbox_state_t *state)
+{
+    sandbox_drop_checkpoints(state, NULL);
+    if (state->mrb && state->heap.backend->release) {
+        state->heap.backend->release(&state->heap);
+    } else if (state->mrb) {
+        /* Enter the heap around mrb_close so frees reach its backend */
+        state->heap.limit = 0; /* unlimited during teardown */
+        sandbox_heap_t *prev = heap_enter(&state->heap);
+        if (state->cxt) {
+            mrb_ccontext_free(state->mrb, state->cxt);
+        }
+        mrb_close(state->mrb);
+        heap_leave(prev);
+    }
+    state->mrb = NULL;
+    state->cxt = NULL;
+    state->heap.current = 0;
+}
+
+void
+sandbox_state_free(sandbox_state_t *state)
+{
+    if (!state) return;
+
+    sandbox_close_mrb(state);
+    heap_destroy(&state->heap);
+
+    output_buf_free(&state->output);
+    sandbox_arena_free(&state->arena);
+    for (int i = 0; i < state->func_count; i++) {
+        free(state->func_names[i]);
+        free(state->func_sigs[i]);
+    }
+    free(state->func_names);
+    free(state->func_sigs);
+    free(state->func_batched);
+    free(state->func_index);
+    pthread_mutex_destroy(&state->interrupt_lock);
+    free(state);
+}
+
+/* ------------------------------------------------------------------ */
+/* Bytecode cache                                                      */
+/* ------------------------------------------------------------------ */
+
+/* Process-wide LRU of RITE bytecode for eval'd snippets, shared by all
+ * states. The key is the source plus the names of the top-level locals
+ * the parser knew about, since those decide how identifiers compile.
+ * Entries are reference counted so a state can read one outside the
+ * lock while another thread evicts it. */
+
+#define BYTECODE_CACHE_DEFAULT_LIMIT (8 * 1024 * 1024)
+
+typedef struct bytecode_entry {
+    struct bytecode_entry *bucket_next;
+    struct bytecode_entry *lru_prev;   /* towards most recently used */
+    struct bytecode_entry *lru_next;
+    uint64_t hash;
+    int      refs;                     /* 1 while cached, +1 per reader */
+    size_t   key_len;
+    size_t   bin_len;
+    char    *key;                      /* both point into this allocation */
+    uint8_t *bin;
+} bytecode_entry_t;
+
+static struct {
+    pthread_mutex_t    lock;
+    bytecode_entry_t **buckets;
+    size_t             nbuckets;
+    size_t             entries;
+    size_t             bytes;
+    size_t             limit;          /* 0 disables the cache */
+    bytecode_entry_t  *lru_head;       /* most recently used */
+    bytecode_entry_t  *lru_tail;
+    uint64_t           hits;
+    uint64_t           misses;
+    uint64_t           evictions;
+} bytecode_cache = { PTHREAD_MUTEX_INITIALIZER, .limit = BYTECODE_CACHE_DEFAULT_LIMIT };
+
+typedef struct {
+    char    *bytes;   /* source, then each known local name, NUL separated */
+    size_t   len;
+    uint64_t hash;
+} bytecode_key_t;
+
+static uint64_t
+fnv1a(const char *p, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Returns -1 (no caching) when the cache is disabled or out of memory */
+static int
+bytecode_key_init(sandbox_state_t *state, const char *code, bytecode_key_t *key)
+{
+    key->bytes = NULL;
+    if (bytecode_cache.limit == 0) return -1;
+
+    size_t code_len = strlen(code);
+    size_t len = code_len + 1;
+    for (int i = 0; i < state->cxt->slen; i++) {
+        mrb_int nlen;
+        mrb_sym_name_len(state->mrb, state->cxt->syms[i], &nlen);
+        len += (size_t)nlen + 1;
+    }
+
+    char *bytes = malloc(len);
+    if (!bytes) return -1;
+    memcpy(bytes, code, code_len + 1);
+    size_t n = code_len + 1;
+    for (int i = 0; i < state->cxt->slen; i++) {
+        mrb_int nlen;
+        const char *name = mrb_sym_name_len(state->mrb, state->cxt->syms[i], &nlen);
+        memcpy(bytes + n, name, (size_t)nlen);
+        n += (size_t)nlen;
+        bytes[n++] = '\0';
+    }
+
+    key->bytes = bytes;
+    key->len = len;
+    key->hash = fnv1a(bytes, len);
+    return 0;
+}
+
+static void
+bytecode_key_free(bytecode_key_t *key)
+{
+    free(key->bytes);
+    key->bytes = NULL;
+}
+
+/* Lock held for everything below up to bytecode_cache_acquire */
+
+static bytecode_entry_t **
+bytecode_cache_slot(uint64_t hash, const char *key, size_t key_len)
+{
+    if (!bytecode_cache.buckets) return NULL;
+    bytecode_entry_t **slot = &bytecode_cache.buckets[hash & (bytecode_cache.nbuckets - 1)];
+    while (*slot) {
+        bytecode_entry_t *e = *slot;
+        if (e->hash == hash && e->key_len == key_len && memcmp(e->key, key, key_len) == 0) {
+            return slot;
+        }
+        slot = &e->bucket_next;
+    }
+    return slot;
+}
+
+static void
+bytecode_lru_unlink(bytecode_entry_t *e)
+{
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else bytecode_cache.lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else bytecode_cache.lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void
+bytecode_lru_push(bytecode_entry_t *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = bytecode_cache.lru_head;
+    if (bytecode_cache.lru_head) bytecode_cache.lru_head->lru_prev = e;
+    bytecode_cache.lru_head = e;
+    if (!bytecode_cache.lru_tail) bytecode_cache.lru_tail = e;
+}
+
+static void
+bytecode_entry_unref(bytecode_entry_t *e)
+{
+    if (--e->refs == 0) free(e);
+}
+
+static void
+bytecode_cache_evict(bytecode_entry_t *e)
+{
+    bytecode_entry_t **slot = bytecode_cache_slot(e->hash, e->key, e->key_len);
+    *slot = e->bucket_next;
+    bytecode_lru_unlink(e);
+    bytecode_cache.entries--;
+    bytecode_cache.bytes -= e->key_len + e->bin_len;
+    bytecode_entry_unref(e);
+}
+
+static void
+bytecode_cache_trim(size_t limit)
+{
+    while (bytecode_cache.lru_tail && bytecode_cache.bytes > limit) {
+        bytecode_cache_evict(bytecode_cache.lru_tail);
+        bytecode_cache.evictions++;
+    }
+}
+
+static void
+bytecode_cache_grow(void)
+{
+    size_t nbuckets = bytecode_cache.nbuckets ? bytecode_cache.nbuckets * 2 : 256;
+    bytecode_entry_t **buckets = calloc(nbuckets, sizeof(*buckets));
+    if (!buckets) return;
+
+    for (size_t i = 0; i < bytecode_cache.nbuckets; i++) {
+        bytecode_entry_t *e = bytecode_cache.buckets[i];
+        while (e) {
+            bytecode_entry_t *next = e->bucket_next;
+            size_t b = e->hash & (nbuckets - 1);
+            e->bucket_next = buckets[b];
+            buckets[b] = e;
+            e = next;
+        }
+    }
+    free(bytecode_cache.buckets);
+    bytecode_cache.buckets = buckets;
+    bytecode_cache.nbuckets = nbuckets;
+}
+
+/* Find and pin an entry; the caller unpins with bytecode_cache_release */
+static bytecode_entry_t *
+bytecode_cache_acquire(const bytecode_key_t *key)
+{
+    pthread_mutex_lock(&bytecode_cache.lock);
+    bytecode_entry_t **slot = bytecode_cache_slot(key->hash, key->bytes, key->len);
+    bytecode_entry_t *e = slot ? *slot : NULL;
+    if (e) {
+        e->refs++;
+        bytecode_lru_unlink(e);
+        bytecode_lru_push(e);
+        bytecode_cache.hits++;
+    } else {
+        bytecode_cache.misses++;
+    }
+    pthread_mutex_unlock(&bytecode_cache.lock);
+    return e;
+}
+
+static void
+bytecode_cache_release(bytecode_entry_t *e)
+{
+    pthread_mutex_lock(&bytecode_cache.lock);
+    bytecode_entry_unref(e);
+    pthread_mutex_unlock(&bytecode_cache.lock);
+}
+
+/* Dump a freshly generated top-level irep and insert it */
+static void
+bytecode_cache_store(sandbox_state_t *state, const bytecode_key_t *key, const mrb_irep *irep)
+{
+    /* Cache bookkeeping is ours, not the sandbox's: don't charge the
+     * dump against the memory limit (it is freed right away). */
+    size_t limit = state->heap.limit;
+    state->heap.limit = 0;
+    uint8_t *bin = NULL;
+    size_t bin_len = 0;
+    int rc = mrb_dump_irep(state->mrb, irep, MRB_DUMP_DEBUG_INFO, &bin, &bin_len);
+    state->heap.limit = limit;
+    if (rc != MRB_DUMP_OK) return;
+
+    bytecode_entry_t *e = malloc(sizeof(*e) + key->len + bin_len);
+    if (e) {
+        e->hash = key->hash;
+        e->refs = 1;
+        e->key_len = key->len;
+        e->bin_len = bin_len;
+        e->key = (char *)(e + 1);
+        e->bin = (uint8_t *)e->key + key->len;
+        memcpy(e->key, key->bytes, key->len);
+        memcpy(e->bin, bin, bin_len);
+    }
+    mrb_free(state->mrb, bin);
+    if (!e) return;
+
+    pthread_mutex_lock(&bytecode_cache.lock);
+    size_t size = e->key_len + e->bin_len;
+    if (size > bytecode_cache.limit) {
+        free(e);
+    } else {
+        if (bytecode_cache.entries >= bytecode_cache.nbuckets) bytecode_cache_grow();
+        bytecode_entry_t **slot = bytecode_cache_slot(e->hash, e->key, e->key_len);
+        if (!slot || *slot) {
+            free(e); /* no table, or another state stored it first */
+        } else {
+            bytecode_cache_trim(bytecode_cache.limit - size);
+            slot = bytecode_cache_slot(e->hash, e->key, e->key_len);
+            e->bucket_next = NULL;
+            *slot = e;
+            bytecode_lru_push(e);
+            bytecode_cache.entries++;
+            bytecode_cache.bytes += size;
+        }
+    }
+    pthread_mutex_unlock(&bytecode_cache.lock);
+}
+
+typedef struct {
+    sandbox_state_t      *state;
+    const bytecode_key_t *key;
+    bytecode_entry_t     *entry;
+} bytecode_load_t;
+
+/* mrb_protect_error body: a cached top-level proc, or nil on a miss */
+static mrb_value
+bytecode_cache_load(mrb_state *mrb, void *userdata)
+{
+    bytecode_load_t *load = (bytecode_load_t *)userdata;
+    load->entry = bytecode_cache_acquire(load->key);
+    if (!load->entry) return mrb_nil_value();
+
+    mrb_irep *irep = mrb_read_irep_buf(mrb, load->entry->bin, load->entry->bin_len);
+    if (!irep) return mrb_nil_value();
+
+    /* Bring the parser context up to date as parsing would have: the
+     * top-level locals are the irep's local names, in register order. */
+    mrb_ccontext *cxt = load->state->cxt;
+    int nlv = irep->nlocals - 1;
+    if (irep->lv && nlv > cxt->slen) {
+        cxt->syms = mrb_realloc(mrb, cxt->syms, (size_t)nlv * sizeof(mrb_sym));
+        for (int i = 0; i < nlv; i++) {
+            cxt->syms[i] = irep->lv[i];
+        }
+        cxt->slen = nlv;
+    }
+
+    struct RProc *proc = mrb_proc_new(mrb, irep);
+    mrb_irep_decref(mrb, irep);
+    return mrb_obj_value(proc);
+}
+
+void
+sandbox_cache_stats(sandbox_cache_stats_t *stats)
+{
+    pthread_mutex_lock(&bytecode_cache.lock);
+    stats->hits = bytecode_cache.hits;
+    stats->misses = bytecode_cache.misses;
+    stats->evictions = bytecode_cache.evictions;
+    stats->entries = bytecode_cache.entries;
+    stats->bytes = bytecode_cache.bytes;
+    stats->limit = bytecode_cache.limit;
+    pthread_mutex_unlock(&bytecode_cache.lock);
+}
+
+void
+sandbox_cache_set_limit(size_t bytes)
+{
+    pthread_mutex_lock(&bytecode_cache.lock);
+    bytecode_cache.limit = bytes;
+    bytecode_cache_trim(bytes);
+    pthread_mutex_unlock(&bytecode_cache.lock);
+}
+
+void
+sandbox_cache_clear(void)
+{
+    pthread_mutex_lock(&bytecode_cache.lock);
+    while (bytecode_cache.lru_tail) {
+        bytecode_cache_evict(bytecode_cache.lru_tail);
+    }
+    bytecode_cache.hits = 0;
+    bytecode_cache.misses = 0;
+    bytecode_cache.evictions = 0;
+    pthread_mutex_unlock(&bytecode_cache.lock);
+}
+
+/* ------------------------------------------------------------------ */
+/* Limit orchestration helpers                                         */
+/* ------------------------------------------------------------------ */
+
+static void sandbox_fresh_take(sandbox_state_t *state);
+
+/* Activate limits before eval. Returns prev heap for heap_leave. */
+static sandbox_heap_t *
+sandbox_limits_begin(sandbox_state_t *state)
+{
+    state->heap.exceeded = 0;
+    sandbox_heap_t *prev = heap_enter(&state->heap);
+    if (!state->fresh.taken) sandbox_fresh_take(state);
+    state->heap.limit = state->memory_limit;
+    state->heap.peak = state->heap.current;
+    memset(&state->stats, 0, sizeof(state->stats));
+
+    pthread_mutex_lock(&state->interrupt_lock);
+    state->running = 1;
+    atomic_store(&state->interrupted, 0);
+
+    state->timeout_state.expired = 0;
+    state->timeout_state.polling = 0;
+    state->timeout_state.check_counter = 0;
+    if (state->timeout_seconds > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double int_part;
+        double frac = modf(state->timeout_seconds, &int_part);
+        state->timeout_state.deadline.tv_sec = now.tv_sec + (time_t)int_part;
+        state->timeout_state.deadline.tv_nsec = now.tv_nsec + (long)(frac * 1e9);
+        if (state->timeout_state.deadline.tv_nsec >= 1000000000L) {
+            state->timeout_state.deadline.tv_sec++;
+            state->timeout_state.deadline.tv_nsec -= 1000000000L;
+        }
+    } else {
+        state->timeout_state.deadline.tv_sec = 0;
+        state->timeout_state.deadline.tv_nsec = 0;
+    }
+    /* Unarmed: the VM only tests the hook pointer per instruction */
+    sandbox_set_hook(state->mrb, SANDBOX_HOOK_ALWAYS);
+    pthread_mutex_unlock(&state->interrupt_lock);
+
+    /* Outside interrupt_lock: the timer thread takes the service lock
+     * first and then interrupt_lock when it fires. */
+    if (state->timeout_seconds > 0 && deadline_add(state) != 0) {
+        state->timeout_state.polling = 1;
+        sandbox_arm_hook(state, 0);
+    }
+
+    return prev;
+}
+
+/* Stop enforcing limits but keep the heap entered for post-exec mruby calls. */
+static void
+sandbox_limits_end(sandbox_state_t *state)
+{
+    deadline_cancel(state);
+
+    pthread_mutex_lock(&state->interrupt_lock);
+    state->running = 0;
+    sandbox_set_hook(state->mrb, 0);
+    pthread_mutex_unlock(&state->interrupt_lock);
+
+    state->heap.limit = 0;
+}
+
+/* Classify error from flags, not string matching. */
+static sandbox_error_kind_t
+sandbox_classify_error(sandbox_state_t *state)
+{
+    if (atomic_load(&state->interrupted) & SANDBOX_INTERRUPT_HOST) {
+        return SANDBOX_ERROR_INTERRUPTED;
+    } else if (state->timeout_state.expired) {
+        return SANDBOX_ERROR_TIMEOUT;
+    } else if (state->heap.exceeded) {
+        return SANDBOX_ERROR_MEMORY_LIMIT;
+    }
+    return SANDBOX_ERROR_RUNTIME;
+}
+
+static char *
+strdup_safe(const char *s, size_t len)
+{
+    char *d = malloc(len + 1);
+    if (d) {
+        memcpy(d, s, len);
+        d[len] = '\0';
+    }
+    return d;
+}
+
+/* Build the result of a finished run: captured output plus either the
+ * pending exception or the inspected value, which is also stored in _. */
+static sandbox_result_t
+sandbox_collect_result(sandbox_state_t *state, mrb_value mrb_result)
+{
+    sandbox_result_t result = { NULL, NULL, NULL, SANDBOX_ERROR_NONE };
+
+    /* Collect output */
+    result.output = state->output.len > 0
+        ? strdup_safe(state->output.buf, state->output.len)
+        : strdup_safe("", 0);
+
+    /* Check for exception */
+    if (state->mrb->exc) {
+        mrb_value exc = mrb_obj_value(state->mrb->exc);
+        mrb_value exc_str = mrb_funcall_argv(state->mrb, exc,
+                              mrb_intern_lit(state->mrb, "inspect"), 0, NULL);
+        if (mrb_string_p(exc_str)) {
+            result.error = strdup_safe(RSTRING_PTR(exc_str), RSTRING_LEN(exc_str));
+        }
+        else {
+            result.error = strdup_safe("unknown error", 13);
+        }
+
+        result.error_kind = sandbox_classify_error(state);
+
+        state->mrb->exc = NULL;
+        mrb_gc_arena_restore(state->mrb, state->arena_idx);
+        return result;
+    }
+
+    /* Get inspect of result value */
+    mrb_value result_str = mrb_funcall_argv(state->mrb, mrb_result,
+                             mrb_intern_lit(state->mrb, "inspect"), 0, NULL);
+    if (mrb_string_p(result_str)) {
+        result.value = strdup_safe(RSTRING_PTR(result_str), RSTRING_LEN(result_str));
+    }
+    else {
+        result.value = strdup_safe("(unprintable)", 13);
+    }
+
+    /* Store result in _ (like mirb) */
+    if (state->mrb->c->ci->stack) {
+        *(state->mrb->c->ci->stack + 1) = mrb_result;
+    }
+
+    mrb_gc_arena_restore(state->mrb, state->arena_idx);
+    return result;
+}
+
+/* Parse and generate code for an eval. Returns NULL with *error set
+ * (caller frees) on a syntax or codegen error. */
+static struct RProc *
+sandbox_parse(sandbox_state_t *state, const char *code, char **error)
+{
+    struct mrb_parser_state *parser = mrb_parser_new(state->mrb);
+    if (!parser) {
+        *error = strdup_safe("parser allocation failed", 24);
+        return NULL;
+    }
+
+    parser->s = code;
+    parser->send = code + strlen(code);
+    parser->lineno = state->cxt->lineno;
+    double started = stats_clock();
+    mrb_parser_parse(parser, state->cxt);
+    double parsed = stats_clock();
+    state->stats.parse_seconds = parsed - started;
+
+    /* Syntax error? */
+    if (parser->nerr > 0) {
+        char errbuf[1024];
+        snprintf(errbuf, sizeof(errbuf), "SyntaxError: %s (line %d)",
+                 parser->error_buffer[0].message,
+                 parser->error_buffer[0].lineno - state->cxt->lineno + 1);
+        mrb_parser_free(parser);
+        *error = strdup_safe(errbuf, strlen(errbuf));
+        return NULL;
+    }
+
+    /* Generate bytecode */
+    struct RProc *proc = mrb_generate_code(state->mrb, parser);
+    mrb_parser_free(parser);
+    state->stats.codegen_seconds = stats_clock() - parsed;
+
+    if (!proc) {
+        *error = strdup_safe("code generation failed", 22);
+    }
+    return proc;
+}
+
+sandbox_result_t
+sandbox_state_eval(sandbox_state_t *state, const char *code)
+{
+    sandbox_result_t result = { NULL, NULL, NULL, SANDBOX_ERROR_NONE };
+
+    output_buf_reset(&state->output);
+
+    sandbox_heap_t *prev = sandbox_limits_begin(state);
+
+    /* Reuse bytecode compiled by any state for the same source and locals */
+    struct RProc *proc = NULL;
+    char *error = NULL;
+    bytecode_key_t key;
+    if (bytecode_key_init(state, code, &key) == 0) {
+        bytecode_load_t load = { state, &key, NULL };
+        mrb_bool failed = FALSE;
+        double started = stats_clock();
+        mrb_value cached = mrb_protect_error(state->mrb, bytecode_cache_load, &load, &failed);
+        if (load.entry) bytecode_cache_release(load.entry);
+        if (failed) {
+            state->mrb->exc = mrb_obj_ptr(cached);
+        } else if (!mrb_nil_p(cached)) {
+            proc = mrb_proc_ptr(cached);
+            state->stats.codegen_seconds = stats_clock() - started;
+            state->stats.cached = 1;
+        }
+    }
+
+    if (!proc && !state->mrb->exc) {
+        proc = sandbox_parse(state, code, &error);
+        if (proc && key.bytes) {
+            bytecode_cache_store(state, &key, proc->body.irep);
+        }
+    }
+    bytecode_key_free(&key);
+
+    if (!proc) {
+        sandbox_limits_end(state);
+        if (error) {
+            result.error = error;
+            result.error_kind = SANDBOX_ERROR_RUNTIME;
+            result.output = state->output.len > 0
+                ? strdup_safe(state->output.buf, state->output.len)
+                : strdup_safe("", 0);
+        } else {
+            /* Ran out of memory loading cached bytecode */
+            result = sandbox_collect_result(state, mrb_nil_value());
+        }
+        sandbox_stats_finish(state, &result);
+        heap_leave(prev);
+        return result;
+    }
+
+    /* Adjust environment stack for local variable persistence (mirb pattern) */
+    if (state->mrb->c->cibase->u.env) {
+        struct REnv *e = mrb_vm_ci_env(state->mrb->c->cibase);
+        if (e && MRB_ENV_LEN(e) < proc->body.irep->nlocals) {
+            MRB_ENV_SET_LEN(e, proc->body.irep->nlocals);
+        }
+    }
+
+    /* Execute */
+    double started = stats_clock();
+    mrb_value mrb_result = mrb_vm_run(state->mrb, proc,
+                                       mrb_top_self(state->mrb),
+                                       state->stack_keep);
+    state->stats.vm_seconds = stats_clock() - started;
+    state->stack_keep = proc->body.irep->nlocals;
+
+    sandbox_limits_end(state);
+
+    result = sandbox_collect_result(state, mrb_result);
+    sandbox_stats_finish(state, &result);
+    heap_leave(prev);
+
+    return result;
+}
+
+void
+sandbox_state_reset(sandbox_state_t *state)
+{
+    if (!state) return;
+
+    /* Tear down */
+    sandbox_close_mrb(state);
+    output_buf_reset(&state->output);
+    memset(state->scripts, 0, sizeof(state->scripts));
+    state->script_next = 0;
+    state->fresh.taken = 0;
+
+    /* Recreate in the same heap (limit=0 during init) */
+    state->heap.limit = 0;
+    state->heap.exceeded = 0;
+    sandbox_heap_t *prev = heap_enter(&state->heap);
+
+    state->mrb = sandbox_open_mrb(state);
+
+    if (!state->mrb) {
+        heap_leave(prev);
+        return;
+    }
+
+    sandbox_init_mrb(state);
+
+    heap_leave(prev);
+}
+
+void
+sandbox_result_free(sandbox_result_t *result)
+{
+    if (result->value) { free(result->value); result->value = NULL; }
+    if (result->output) { free(result->output); result->output = NULL; }
+    if (result->error) { free(result->error); result->error = NULL; }
+}
+
+/* ------------------------------------------------------------------ */
+/* Compiled scripts                                                    */
+/* ------------------------------------------------------------------ */
+
+/* A script is RITE bytecode for "->(params) do <code> end". The lambda
+ * body (the only child irep) is what runs; params arrive as arguments,
+ * so bound values never pass through the parser. */
+struct sandbox_script {
+    uint64_t id;       /* unique per compile, keys the per-state proc cache */
+    int      nparams;
+    size_t   len;
+    uint8_t  bin[];
+};
+
+static atomic_uint_fast64_t script_ids = 1;
+
+sandbox_script_t *
+sandbox_script_compile(sandbox_state_t *state, const char *code,
+                       const char *const *params, int nparams, char **error)
+{
+    *error = NULL;
+
+    /* Wrapper header on line 0 so the body keeps its own line numbers */
+    size_t code_len = strlen(code);
+    size_t src_cap = code_len + 16;
+    for (int i = 0; i < nparams; i++) src_cap += strlen(params[i]) + 1;
+    char *src = malloc(src_cap);
+    if (!src) {
+        *error = strdup_safe("script allocation failed", 24);
+        return NULL;
+    }
+    size_t n = 0;
+    memcpy(src + n, "->(", 3); n += 3;
+    for (int i = 0; i < nparams; i++) {
+        size_t plen = strlen(params[i]);
+        if (i > 0) src[n++] = ',';
+        memcpy(src + n, params[i], plen);
+        n += plen;
+    }
+    memcpy(src + n, ") do\n", 5); n += 5;
+    memcpy(src + n, code, code_len); n += code_len;
+    memcpy(src + n, "\nend", 4); n += 4;
+
+    sandbox_script_t *script = NULL;
+    sandbox_heap_t *prev = sandbox_limits_begin(state);
+
+    /* Fresh context: the session's top-level locals must not leak in */
+    mrb_ccontext *cxt = mrb_ccontext_new(state->mrb);
+    cxt->capture_errors = TRUE;
+    cxt->lineno = 0;
+    mrb_ccontext_filename(state->mrb, cxt, "(script)");
+
+    struct mrb_parser_state *parser = mrb_parse_nstring(state->mrb, src, n, cxt);
+    if (!parser) {
+        *error = strdup_safe("parser allocation failed", 24);
+        goto done;
+    }
+    if (parser->nerr > 0) {
+        char errbuf[1024];
+        snprintf(errbuf, sizeof(errbuf), "SyntaxError: %s (line %d)",
+                 parser->error_buffer[0].message, parser->error_buffer[0].lineno);
+        *error = strdup_safe(errbuf, strlen(errbuf));
+        mrb_parser_free(parser);
+        goto done;
+    }
+
+    struct RProc *proc = mrb_generate_code(state->mrb, parser);
+    mrb_parser_free(parser);
+    if (!proc) {
+        *error = strdup_safe("code generation failed", 22);
+        goto done;
+    }
+
+    /* Code that closes the wrapper early ("end; ...") compiles to more
+     * than one top-level expression. */
+    const mrb_irep *irep = proc->body.irep;
+    if (irep->rlen != 1) {
+        *error = strdup_safe("SyntaxError: script body is not a single block", 46);
+        goto done;
+    }
+
+    uint8_t *bin = NULL;
+    size_t bin_len = 0;
+    if (mrb_dump_irep(state->mrb, irep, MRB_DUMP_DEBUG_INFO, &bin, &bin_len) != MRB_DUMP_OK) {
+        *error = strdup_safe("bytecode dump failed", 20);
+        goto done;
+    }
+
+    script = malloc(sizeof(sandbox_script_t) + bin_len);
+    if (script) {
+        script->id = atomic_fetch_add(&script_ids, 1);
+        script->nparams = nparams;
+        script->len = bin_len;
+        memcpy(script->bin, bin, bin_len);
+    } else {
+        *error = strdup_safe("script allocation failed", 24);
+    }
+    mrb_free(state->mrb, bin);
+
+done:
+    sandbox_limits_end(state);
+    mrb_ccontext_free(state->mrb, cxt);
+    if (state->mrb->exc) {
+        /* Out of memory while compiling */
+        if (!*error) *error = strdup_safe("NoMemoryError: memory limit exceeded", 36);
+        state->mrb->exc = NULL;
+    }
+    mrb_gc_arena_restore(state->mrb, state->arena_idx);
+    heap_leave(prev);
+    free(src);
+    return script;
+}
+
+void
+sandbox_script_free(sandbox_script_t *script)
+{
+    free(script);
+}
+
+int
+sandbox_script_arity(const sandbox_script_t *script)
+{
+    return script->nparams;
+}
+
+size_t
+sandbox_script_size(const sandbox_script_t *script)
+{
+    return sizeof(sandbox_script_t) + script->len;
+}
+
+/* The script's lambda in this state, loading the bytecode on first use */
+static mrb_value
+sandbox_script_proc(sandbox_state_t *state, const sandbox_script_t *script)
+{
+    mrb_state *mrb = state->mrb;
+
+    for (int i = 0; i < SANDBOX_SCRIPT_CACHE; i++) {
+        if (state->scripts[i].id == script->id) return state->scripts[i].proc;
+    }
+
+    mrb_irep *irep = mrb_read_irep_buf(mrb, script->bin, script->len);
+    if (!irep) {
+        mrb_raise(mrb, mrb_class_get(mrb, "ScriptError"), "invalid script bytecode");
+    }
+    struct RProc *p = mrb_proc_new(mrb, irep->reps[0]);
+    p->flags |= MRB_PROC_STRICT;
+    mrb_irep_decref(mrb, irep); /* the proc holds the body */
+    mrb_value proc = mrb_obj_value(p);
+
+    /* Round-robin eviction: register the new proc before dropping the old */
+    int slot = state->script_next;
+    mrb_gc_register(mrb, proc);
+    if (state->scripts[slot].id) {
+        mrb_gc_unregister(mrb, state->scripts[slot].proc);
+    }
+    state->scripts[slot].id = script->id;
+    state->scripts[slot].proc = proc;
+    state->script_next = (slot + 1) % SANDBOX_SCRIPT_CACHE;
+
+    return proc;
+}
+
+typedef struct {
+    sandbox_state_t        *state;
+    const sandbox_script_t *script;
+    const sandbox_value_t  *args;
+    int                     argc;
+} script_call_t;
+
+static mrb_value
+sandbox_script_call(mrb_state *mrb, void *userdata)
+{
+    script_call_t *call = (script_call_t *)userdata;
+    mrb_value proc = sandbox_script_proc(call->state, call->script);
+
+    /* Keep converted args reachable while the lambda runs */
+    mrb_value argv = mrb_ary_new_capa(mrb, call->argc);
+    for (int i = 0; i < call->argc; i++) {
+        call->state->stats.bytes_in += sandbox_value_bytes(&call->args[i]);
+        mrb_ary_push(mrb, argv, sandbox_value_to_mrb(mrb, &call->args[i]));
+    }
+
+    return mrb_yield_with_class(mrb, proc, call->argc, RARRAY_PTR(argv),
+                                mrb_top_self(mrb), mrb->object_class);
+}
+
+sandbox_result_t
+sandbox_state_run(sandbox_state_t *state, const sandbox_script_t *script,
+                  const sandbox_value_t *args, int argc)
+{
+    output_buf_reset(&state->output);
+
+    sandbox_heap_t *prev = sandbox_limits_begin(state);
+
+    script_call_t call = { state, script, args, argc };
+    mrb_bool failed = FALSE;
+    double started = stats_clock();
+    mrb_value ret = mrb_protect_error(state->mrb, sandbox_script_call, &call, &failed);
+    state->stats.vm_seconds = stats_clock() - started;
+    if (failed) {
+        state->mrb->exc = mrb_obj_ptr(ret);
+    }
+
+    sandbox_limits_end(state);
+
+    sandbox_result_t result = sandbox_collect_result(state, ret);
+    sandbox_stats_finish(state, &result);
+    heap_leave(prev);
+
+    return result;
+}
+
+/* ------------------------------------------------------------------ */
+/* Tool callback API                                                   */
+/* ------------------------------------------------------------------ */
+
+sandbox_arena_t *
+sandbox_state_arena(sandbox_state_t *state)
+{
+    return &state->arena;
+}
+
+void
+sandbox_state_set_callback(sandbox_state_t *state,
+                           sandbox_callback_func_t callback,
+                           void *userdata)
+{
+    state->callback = callback;
+    state->callback_userdata = userdata;
+}
+
+/* Slot of the function registered as name, or -1 */
+static int
+func_lookup(const sandbox_state_t *state, const char *name)
+{
+    if (state->func_count == 0) return -1;
+    size_t mask = state->func_index_cap - 1;
+    for (size_t i = fnv1a(name, strlen(name)) & mask; state->func_index[i]; i = (i + 1) & mask) {
+        int slot = (int)state->func_index[i] - 1;
+        if (strcmp(state->func_names[slot], name) == 0) return slot;
+    }
+    return -1;
+}
+
+/* Make room for one more function. Returns -1 on OOM. */
+static int
+func_reserve(sandbox_state_t *state)
+{
+    if (state->func_count == state->func_capa) {
+        int capa = state->func_capa ? state->func_capa * 2 : 16;
+        char **names = realloc(state->func_names, capa * sizeof(*names));
+        if (!names) return -1;
+        state->func_names = names;
+        char **sigs = realloc(state->func_sigs, capa * sizeof(*sigs));
+        if (!sigs) return -1;
+        state->func_sigs = sigs;
+        unsigned char *batched = realloc(state->func_batched, capa);
+        if (!batched) return -1;
+        state->func_batched = batched;
+        state->func_capa = capa;
+    }
+
+    if ((size_t)(state->func_count + 1) * 2 > state->func_index_cap) {
+        size_t cap = state->func_index_cap ? state->func_index_cap * 2 : 32;
+        uint32_t *index = calloc(cap, sizeof(*index));
+        if (!index) return -1;
+        for (int slot = 0; slot < state->func_count; slot++) {
+            const char *name = state->func_names[slot];
+            size_t i = fnv1a(name, strlen(name)) & (cap - 1);
+            while (index[i]) i = (i + 1) & (cap - 1);
+            index[i] = (uint32_t)slot + 1;
+        }
+        free(state->func_index);
+        state->func_index = index;
+        state->func_index_cap = cap;
+    }
+    return 0;
+}
+
+int
+sandbox_state_define_function(sandbox_state_t *state, const char *name)
+{
+    int existing = func_lookup(state, name);
+    if (existing >= 0) return existing;
+    if (func_reserve(state) != 0) return -1;
+
+    char *copy = strdup(name);
+    if (!copy) return -1;
+    int slot = state->func_count;
+    state->func_names[slot] = copy;
+    state->func_sigs[slot] = NULL;
+    state->func_batched[slot] = 0;
+    state->func_count++;
+
+    size_t mask = state->func_index_cap - 1;
+    size_t i = fnv1a(name, strlen(name)) & mask;
+    while (state->func_index[i]) i = (i + 1) & mask;
+    state->func_index[i] = (uint32_t)slot + 1;
+
+    /* Register in the current mruby state */
+    sandbox_heap_t *prev = heap_enter(&state->heap);
+    sandbox_define_tool(state, slot);
+    heap_leave(prev);
+    return slot;
+}
+
+int
+sandbox_state_set_signature(sandbox_state_t *state, int slot, const char *types)
+{
+    if (slot < 0 || slot >= state->func_count) return -1;
+    if (types && types[strspn(types, "ifsb*")] != '\0') return -1;
+
+    char *copy = NULL;
+    if (types && !(copy = strdup(types))) return -1;
+    free(state->func_sigs[slot]);
+    state->func_sigs[slot] = copy;
+    return 0;
+}
+
+int
+sandbox_state_set_batched(sandbox_state_t *state, int slot, int batched)
+{
+    if (slot < 0 || slot >= state->func_count) return -1;
+    batched = batched != 0;
+    if (state->func_batched[slot] == batched) return 0;
+    state->func_batched[slot] = (unsigned char)batched;
+    state->nbatched += batched ? 1 : -1;
+
+    if (state->nbatched == 1) {
+        sandbox_heap_t *prev = heap_enter(&state->heap);
+        sandbox_define_collect(state);
+        heap_leave(prev);
+    }
+    return 0;
+}
+
+void
+sandbox_state_set_dispatch(sandbox_state_t *state, sandbox_submit_func_t submit,
+                           sandbox_await_func_t await)
+{
+    state->submit = submit;
+    state->await = await;
+}
+
+void
+sandbox_state_clear_functions(sandbox_state_t *state)
+{
+    sandbox_drop_checkpoints(state, NULL);
+    sandbox_heap_t *prev = heap_enter(&state->heap);
+
+    struct RClass *kernel = state->mrb->kernel_module;
+    for (int i = 0; i < state->func_count; i++) {
+        mrb_undef_method(state->mrb, kernel, state->func_names[i]);
+        free(state->func_names[i]);
+        free(state->func_sigs[i]);
+        state->func_names[i] = NULL;
+        state->func_sigs[i] = NULL;
+    }
+    state->func_count = 0;
+    state->nbatched = 0;
+    if (state->func_index) {
+        memset(state->func_index, 0, state->func_index_cap * sizeof(*state->func_index));
+    }
+
+    heap_leave(prev);
+}
+
+/* ------------------------------------------------------------------ */
+/* Cross-thread interruption                                           */
+/* ------------------------------------------------------------------ */
+
+void
+sandbox_state_interrupt(sandbox_state_t *state)
+{
+    sandbox_arm_hook(state, SANDBOX_INTERRUPT_HOST);
+}
+
+size_t
+sandbox_state_memory(const sandbox_state_t *state)
+{
+    return state->heap.current;
+}
+
+/* ------------------------------------------------------------------ */
+/* Checkpoints                                                         */
+/* ------------------------------------------------------------------ */
+
+/* The heap snapshot covers everything mruby owns, mrb_state included;
+ * the fields of sandbox_state that point into it, and the captured
+ * output, are saved here. Tools are not: detaching them (as a pool's
+ * checkin does) frees the names the heap's methods refer to, so it
+ * releases every checkpoint. */
+typedef struct sandbox_checkpoint {
+    struct sandbox_checkpoint *older;
+    uint64_t     id;
+    void        *snapshot;
+    char        *output;
+    size_t       output_len;
+    size_t       heap_current;
+    unsigned int stack_keep;
+    int          arena_idx;
+    int          func_count;
+    int          script_next;
+    struct {
+        uint64_t  id;
+        mrb_value proc;
+    } scripts[SANDBOX_SCRIPT_CACHE];
+} sandbox_checkpoint_t;
+
+/* Discard checkpoints newer than until (all of them when NULL) */
+static void
+sandbox_drop_checkpoints(sandbox_state_t *state, sandbox_checkpoint_t *until)
+{
+    while (state->checkpoints && state->checkpoints != until) {
+        sandbox_checkpoint_t *cp = state->checkpoints;
+        state->checkpoints = cp->older;
+        state->heap.backend->discard(&state->heap, cp->snapshot);
+        free(cp->output);
+        free(cp);
+    }
+}
+
+int
+sandbox_state_can_checkpoint(const sandbox_state_t *state)
+{
+    return state->heap.backend->checkpoint != NULL;
+}
+
+uint64_t
+sandbox_state_checkpoint(sandbox_state_t *state)
+{
+    if (!state->mrb || !sandbox_state_can_checkpoint(state)) return 0;
+
+    sandbox_checkpoint_t *cp = calloc(1, sizeof(*cp));
+    if (!cp) return 0;
+    cp->output_len = state->output.len;
+    cp->output = malloc(cp->output_len ? cp->output_len : 1);
+    if (!cp->output) {
+        free(cp);
+        return 0;
+    }
+    if (cp->output_len) memcpy(cp->output, state->output.buf, cp->output_len);
+
+    cp->snapshot = state->heap.backend->checkpoint(&state->heap, state->mrb, sizeof(*state->mrb));
+    if (!cp->snapshot) {
+        free(cp->output);
+        free(cp);
+        return 0;
+    }
+    cp->id = ++state->checkpoint_seq;
+    cp->heap_current = state->heap.current;
+    cp->stack_keep = state->stack_keep;
+    cp->arena_idx = state->arena_idx;
+    cp->func_count = state->func_count;
+    cp->script_next = state->script_next;
+    memcpy(cp->scripts, state->scripts, sizeof(cp->scripts));
+
+    cp->older = state->checkpoints;
+    state->checkpoints = cp;
+    return cp->id;
+}
+
+int
+sandbox_state_rollback(sandbox_state_t *state, uint64_t id)
+{
+    sandbox_checkpoint_t *cp = state->checkpoints;
+    while (cp && cp->id != id) cp = cp->older;
+    if (!cp) return -1;
+
+    sandbox_drop_checkpoints(state, cp);
+    state->heap.backend->rollback(&state->heap, cp->snapshot);
+    state->heap.current = cp->heap_current;
+    state->heap.exceeded = 0;
+    state->stack_keep = cp->stack_keep;
+    state->arena_idx = cp->arena_idx;
+    state->script_next = cp->script_next;
+    memcpy(state->scripts, cp->scripts, sizeof(state->scripts));
+    output_buf_reset(&state->output);
+    output_buf_append(&state->output, cp->output, cp->output_len);
+
+    /* Tools exposed after the checkpoint stay exposed */
+    sandbox_heap_t *prev = heap_enter(&state->heap);
+    for (int i = cp->func_count; i < state->func_count; i++) {
+        sandbox_define_tool(state, i);
+    }
+    heap_leave(prev);
+    return 0;
+}
+
+void
+sandbox_state_release_checkpoint(sandbox_state_t *state, uint64_t id)
+{
+    for (sandbox_checkpoint_t **link = &state->checkpoints; *link; link = &(*link)->older) {
+        sandbox_checkpoint_t *cp = *link;
+        if (cp->id == id) {
+            *link = cp->older;
+            state->heap.backend->discard(&state->heap, cp->snapshot);
+            free(cp->output);
+            free(cp);
+            return;
+        }
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* Prototype state                                                     */
+/*                                                                     */
+/* Built once, typically in a preforking server's master. The first    */
+/* state a forked child asks for is the prototype itself, so its heap  */
+/* starts out shared copy-on-write with the master and its siblings.   */
+/* ------------------------------------------------------------------ */
+
+static _Atomic(sandbox_state_t *) prototype_state;
+
+int
+sandbox_prototype_build(sandbox_allocator_t allocator, uint32_t gems,
+                        const char *const *functions, int nfunctions,
+                        const char *prelude, char **error)
+{
+    *error = NULL;
+    sandbox_state_t *state = sandbox_state_new(0, 0, allocator, gems);
+    if (!state) {
+        *error = strdup("failed to initialize mruby enclave");
+        return -1;
+    }
+
+    for (int i = 0; i < nfunctions; i++) {
+        if (sandbox_state_define_function(state, functions[i]) < 0) {
+            sandbox_state_free(state);
+            *error = strdup("failed to register tool functions");
+            return -1;
+        }
+    }
+
+    if (prelude) {
+        sandbox_result_t result = sandbox_state_eval(state, prelude);
+        if (result.error) {
+            *error = result.error;
+            result.error = NULL;
+            sandbox_result_free(&result);
+            sandbox_state_free(state);
+            return -1;
+        }
+        sandbox_result_free(&result);
+    }
+    output_buf_reset(&state->output);
+
+    /* Collect now, so children don't copy pages only to free garbage */
+    sandbox_heap_t *prev = heap_enter(&state->heap);
+    mrb_full_gc(state->mrb);
+    heap_leave(prev);
+
+    sandbox_state_free(atomic_exchange(&prototype_state, state));
+    return 0;
+}
+
+sandbox_state_t *
+sandbox_prototype_take(double timeout, size_t memory_limit)
+{
+    sandbox_state_t *state = atomic_exchange(&prototype_state, NULL);
+    if (state) {
+        state->timeout_seconds = timeout;
+        state->memory_limit = memory_limit;
+    }
+    return state;
+}
+
+/* ------------------------------------------------------------------ */
+/* Sessions                                                            */
+/*                                                                     */
+/* A session blob holds what the snippets built up: the classes and    */
+/* modules they defined, their methods as RITE bytecode, constants,    */
+/* instance and class variables, and the top-level locals with _.      */
+/* Anything a fresh state already has is left out, so a blob grows     */
+/* with the session's own data rather than with the VM.                */
+/*                                                                     */
+/*   "ENCS", version:u8, checksum:u64le (FNV-1a of the body), body     */
+/*                                                                     */
+/* The body is five sections, each a varint count of records: modules, */
+/* includes, methods, variables, then locals (all names, then values). */
+/* ------------------------------------------------------------------ */
+
+#define SESSION_MAGIC     "ENCS"
+#define SESSION_VERSION   1
+#define SESSION_HEADER    13
+#define SESSION_MAX_DEPTH 512
+
+/* Value tags. Strings, arrays, hashes, ranges and objects are numbered
+ * in the order they first appear; a later reference is SESSION_REF, so
+ * sharing and cycles survive the trip. */
+enum {
+    SESSION_NIL,
+    SESSION_TRUE,
+    SESSION_FALSE,
+    SESSION_INT,       /* zigzag varint */
+    SESSION_FLOAT,     /* u64le bits */
+    SESSION_SYMBOL,
+    SESSION_STRING,
+    SESSION_ARRAY,
+    SESSION_HASH,
+    SESSION_RANGE,     /* exclusive:u8, begin, end */
+    SESSION_OBJECT,    /* class path, ivar count, (name, value)... */
+    SESSION_MODULE,    /* path */
+    SESSION_REF        /* number of an earlier value */
+};
+#define SESSION_FROZEN 0x80  /* or'd into the tag of a numbered value */
+
+enum {
+    SESSION_METHOD_BYTECODE,
+    SESSION_METHOD_ATTR      /* attr_reader/attr_writer of an @name */
+};
+
+/* ---- writing ---- */
+
+typedef struct {
+    uint8_t *buf;
+    size_t   len;
+    size_t   cap;
+    uint64_t count;   /* records in the section */
+    int      oom;
+} session_buf_t;
+
+static void
+sbuf_put(session_buf_t *b, const void *p, size_t n)
+{
+    if (b->oom || n == 0) return;
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 256;
+        while (cap < b->len + n) cap *= 2;
+        uint8_t *buf = realloc(b->buf, cap);
+        if (!buf) {
+            b->oom = 1;
+            return;
+        }
+        b->buf = buf;
+        b->cap = cap;
+    }
+    memcpy(b->buf + b->len, p, n);
+    b->len += n;
+}
+
+static void
+sbuf_byte(session_buf_t *b, uint8_t c)
+{
+    sbuf_put(b, &c, 1);
+}
+
+/* LEB128 */
+static void
+sbuf_uint(session_buf_t *b, uint64_t v)
+{
+    uint8_t tmp[10];
+    size_t n = 0;
+    do {
+        uint8_t c = v & 0x7f;
+        v >>= 7;
+        tmp[n++] = c | (v ? 0x80 : 0);
+    } while (v);
+    sbuf_put(b, tmp, n);
+}
+
+static void
+sbuf_u64(session_buf_t *b, uint64_t v)
+{
+    uint8_t tmp[8];
+    for (int i = 0; i < 8; i++) tmp[i] = (uint8_t)(v >> (8 * i));
+    sbuf_put(b, tmp, 8);
+}
+
+static void
+sbuf_str(session_buf_t *b, const char *p, size_t n)
+{
+    sbuf_uint(b, n);
+    sbuf_put(b, p, n);
+}
+
+/* Open-addressing map from object pointer to number */
+typedef struct {
+    const void **keys;
+    uint32_t    *vals;
+    size_t       cap;    /* power of two */
+    size_t       len;
+} ptr_table_t;
+
+static size_t
+ptr_hash(const void *p)
+{
+    uint64_t x = (uint64_t)(uintptr_t)p >> 3;
+    x *= 0x9E3779B97F4A7C15ULL;
+    return (size_t)(x >> 32);
+}
+
+static int
+ptr_table_get(const ptr_table_t *t, const void *key, uint32_t *val)
+{
+    if (t->len == 0) return 0;
+    for (size_t i = ptr_hash(key) & (t->cap - 1); t->keys[i]; i = (i + 1) & (t->cap - 1)) {
+        if (t->keys[i] == key) {
+            if (val) *val = t->vals[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* key must not be present. Returns -1 on OOM. */
+static int
+ptr_table_put(ptr_table_t *t, const void *key, uint32_t val)
+{
+    if ((t->len + 1) * 2 > t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 64;
+        const void **keys = calloc(cap, sizeof(*keys));
+        uint32_t *vals = malloc(cap * sizeof(*vals));
+        if (!keys || !vals) {
+            free(keys);
+            free(vals);
+            return -1;
+        }
+        for (size_t i = 0; i < t->cap; i++) {
+            if (!t->keys[i]) continue;
+            size_t j = ptr_hash(t->keys[i]) & (cap - 1);
+            while (keys[j]) j = (j + 1) & (cap - 1);
+            keys[j] = t->keys[i];
+            vals[j] = t->vals[i];
+        }
+        free(t->keys);
+        free(t->vals);
+        t->keys = keys;
+        t->vals = vals;
+        t->cap = cap;
+    }
+    size_t i = ptr_hash(key) & (t->cap - 1);
+    while (t->keys[i]) i = (i + 1) & (t->cap - 1);
+    t->keys[i] = key;
+    t->vals[i] = val;
+    t->len++;
+    return 0;
+}
+
+static void
+ptr_table_free(ptr_table_t *t)
+{
+    free(t->keys);
+    free(t->vals);
+}
+
+/* ---- constant paths ---- */
+
+static int
+session_const_name_p(const char *name)
+{
+    return name[0] >= 'A' && name[0] <= 'Z';
+}
+
+/* Length of the outer part of "A::B::C" ("A::B"), 0 at top level */
+static size_t
+session_outer_len(const char *path, size_t len)
+{
+    for (size_t i = len; i > 2; i--) {
+        if (path[i - 2] == ':' && path[i - 1] == ':') return i - 2;
+    }
+    return 0;
+}
+
+/* The module at path, or NULL. "" is Object. Never runs const_missing,
+ * but loads a pending optional gem that defines the top-level name. */
+static struct RClass *
+session_resolve(mrb_state *mrb, const char *path, size_t len)
+{
+    struct RClass *c = mrb->object_class;
+    const char *p = path, *end = path + len;
+    while (p < end) {
+        const char *stop = p;
+        while (stop < end && !(stop + 1 < end && stop[0] == ':' && stop[1] == ':')) stop++;
+        mrb_sym name = mrb_intern(mrb, p, (size_t)(stop - p));
+        if (!mrb_const_defined_at(mrb, mrb_obj_value(c), name) &&
+            !(c == mrb->object_class && sandbox_gem_autoload(get_sandbox_state(mrb), name))) {
+            return NULL;
+        }
+        mrb_value v = mrb_const_get(mrb, mrb_obj_value(c), name);
+        if (!mrb_class_p(v) && !mrb_module_p(v)) return NULL;
+        c = mrb_class_ptr(v);
+        p = stop < end ? stop + 2 : end;
+    }
+    return c;
+}
+
+/* Path of constant name in c, which is at path */
+static mrb_value
+session_child_path(mrb_state *mrb, struct RClass *c, mrb_value path, mrb_sym name)
+{
+    mrb_int nlen;
+    const char *n = mrb_sym_name_len(mrb, name, &nlen);
+    if (c == mrb->object_class) return mrb_str_new(mrb, n, nlen);
+
+    mrb_value child = mrb_str_dup(mrb, path);
+    mrb_str_cat_lit(mrb, child, "::");
+    mrb_str_cat(mrb, child, n, (size_t)nlen);
+    return child;
+}
+
+/* v is the module defined at path, not an alias of one named elsewhere */
+static int
+session_owns_p(mrb_state *mrb, mrb_value v, mrb_value path)
+{
+    if (!mrb_class_p(v) && !mrb_module_p(v)) return 0;
+    if (mrb_class_ptr(v) == mrb->object_class) return 0;
+    mrb_value own = mrb_class_path(mrb, mrb_class_ptr(v));
+    return mrb_string_p(own) && mrb_str_equal(mrb, own, path);
+}
+
+static int
+session_collect_entry(mrb_state *mrb, mrb_sym name, mrb_value v, void *data)
+{
+    mrb_value list = *(mrb_value *)data;
+    mrb_ary_push(mrb, list, mrb_symbol_value(name));
+    mrb_ary_push(mrb, list, v);
+    return 0;
+}
+
+/* The iv table of obj (constants, @ivars, @@cvars) as [name, value, ...],
+ * copied so the walk may allocate and name classes as it goes */
+static mrb_value
+session_entries(mrb_state *mrb, mrb_value obj)
+{
+    mrb_value list = mrb_ary_new(mrb);
+    mrb_iv_foreach(mrb, obj, session_collect_entry, &list);
+    return list;
+}
+
+/* What a fresh state has, built once per process and sorted: constant
+ * paths ("Object", "Float::INFINITY"), module variables ("Object.@@x")
+ * and globals ("$x"). Sessions and scrub treat everything else as the
+ * snippets' own. */
+static struct {
+    char  **paths;
+    size_t  len;
+} baseline;
+
+static pthread_once_t baseline_once = PTHREAD_ONCE_INIT;
+
+typedef struct {
+    char  **paths;
+    size_t  len;
+    size_t  cap;
+} path_list_t;
+
+static void
+path_list_add(path_list_t *list, mrb_value path)
+{
+    if (list->len == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        char **paths = realloc(list->paths, cap * sizeof(char *));
+        if (!paths) return;
+        list->paths = paths;
+        list->cap = cap;
+    }
+    char *copy = strdup_safe(RSTRING_PTR(path), (size_t)RSTRING_LEN(path));
+    if (copy) list->paths[list->len++] = copy;
+}
+
+/* Baseline key of variable name (@x, @@x) of the module at path */
+static mrb_value
+baseline_var_key(mrb_state *mrb, mrb_value path, mrb_sym name)
+{
+    mrb_value key = mrb_str_dup(mrb, path);
+    mrb_str_cat_lit(mrb, key, ".");
+    mrb_str_cat_cstr(mrb, key, mrb_sym_name(mrb, name));
+    return key;
+}
+
+static void
+baseline_walk(mrb_state *mrb, struct RClass *c, mrb_value path, path_list_t *list)
+{
+    mrb_value entries = session_entries(mrb, mrb_obj_value(c));
+    for (mrb_int i = 0; i < RARRAY_LEN(entries); i += 2) {
+        mrb_sym name = mrb_symbol(mrb_ary_entry(entries, i));
+        mrb_value v = mrb_ary_entry(entries, i + 1);
+        const char *n = mrb_sym_name(mrb, name);
+        if (!session_const_name_p(n)) {
+            if (n[0] == '@') path_list_add(list, baseline_var_key(mrb, path, name));
+            continue;
+        }
+
+        mrb_value child = session_child_path(mrb, c, path, name);
+        path_list_add(list, child);
+        if (session_owns_p(mrb, v, child)) {
+            baseline_walk(mrb, mrb_class_ptr(v), child, list);
+        }
+    }
+}
+
+static mrb_value
+baseline_collect(mrb_state *mrb, void *userdata)
+{
+    path_list_t *list = (path_list_t *)userdata;
+    baseline_walk(mrb, mrb->object_class, mrb_str_new_lit(mrb, "Object"), list);
+
+    mrb_value globals = mrb_f_global_variables(mrb, mrb_nil_value());
+    for (mrb_int i = 0; i < RARRAY_LEN(globals); i++) {
+        path_list_add(list, mrb_sym_str(mrb, mrb_symbol(mrb_ary_entry(globals, i))));
+    }
+    return mrb_nil_value();
+}
+
+static int
+session_path_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void
+baseline_init(void)
+{
+    sandbox_state_t *state = sandbox_state_new(0, 0, SANDBOX_ALLOCATOR_SYSTEM,
+                                               SANDBOX_GEMS_ALL | SANDBOX_GEMS_EAGER);
+    if (!state) return;  /* no baseline: blobs just carry more */
+
+    path_list_t list = { NULL, 0, 0 };
+    sandbox_heap_t *prev = heap_enter(&state->heap);
+    mrb_bool failed = FALSE;
+    mrb_protect_error(state->mrb, baseline_collect, &list, &failed);
+    heap_leave(prev);
+    sandbox_state_free(state);
+
+    if (list.len > 0) qsort(list.paths, list.len, sizeof(char *), session_path_cmp);
+    baseline.paths = list.paths;
+    baseline.len = list.len;
+}
+
+static int
+baseline_has(mrb_value path)
+{
+    const char *key = RSTRING_PTR(path);
+    return baseline.len > 0 &&
+        bsearch(&key, baseline.paths, baseline.len,
+                sizeof(char *), session_path_cmp) != NULL;
+}
+
+/* ---- dump ---- */
+
+typedef struct {
+    sandbox_state_t *state;
+    session_buf_t    modules, includes, methods, vars, locals;
+    ptr_table_t      objects;      /* numbered values */
+    ptr_table_t      recorded;     /* modules already in the modules section */
+    uint32_t         nobjects;
+    int              oom;
+    const char      *unsupported;  /* class of a value written as nil */
+    char             error[256];
+} session_writer_t;
+
+static void
+session_fail(session_writer_t *w, const char *fmt, ...)
+{
+    if (w->error[0]) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(w->error, sizeof(w->error), fmt, ap);
+    va_end(ap);
+}
+
+typedef struct {
+    session_writer_t *w;
+    session_buf_t    *b;
+    int               depth;
+} session_value_ctx_t;
+
+static void session_write_value(session_writer_t *w, session_buf_t *b, mrb_value v, int depth);
+
+static int
+session_write_pair(mrb_state *mrb, mrb_value key, mrb_value val, void *data)
+{
+    session_value_ctx_t *ctx = (session_value_ctx_t *)data;
+    session_write_value(ctx->w, ctx->b, key, ctx->depth);
+    session_write_value(ctx->w, ctx->b, val, ctx->depth);
+    return 0;
+}
+
+static int
+session_count_ivar(mrb_state *mrb, mrb_sym name, mrb_value v, void *data)
+{
+    (*(uint64_t *)data)++;
+    return 0;
+}
+
+static int
+session_write_ivar(mrb_state *mrb, mrb_sym name, mrb_value v, void *data)
+{
+    session_value_ctx_t *ctx = (session_value_ctx_t *)data;
+    mrb_int nlen;
+    const char *n = mrb_sym_name_len(mrb, name, &nlen);
+    sbuf_str(ctx->b, n, (size_t)nlen);
+    session_write_value(ctx->w, ctx->b, v, ctx->depth);
+    return 0;
+}
+
+/* Values with no session form (procs, exceptions, instances of anonymous
+ * or built-in data classes) are written as nil and noted in unsupported. */
+static void
+session_write_value(session_writer_t *w, session_buf_t *b, mrb_value v, int depth)
+{
+    mrb_state *mrb = w->state->mrb;
+
+    if (mrb_nil_p(v)) {
+        sbuf_byte(b, SESSION_NIL);
+        return;
+    }
+    if (mrb_true_p(v)) {
+        sbuf_byte(b, SESSION_TRUE);
+        return;
+    }
+    if (mrb_false_p(v)) {
+        sbuf_byte(b, SESSION_FALSE);
+        return;
+    }
+    if (mrb_integer_p(v)) {
+        int64_t i = (int64_t)mrb_integer(v);
+        sbuf_byte(b, SESSION_INT);
+        sbuf_uint(b, ((uint64_t)i << 1) ^ (uint64_t)(i >> 63));
+        return;
     }
-
-    /* Get the method name from the call info */
-    const char *method_name = mrb_sym_name(mrb, mrb->c->ci->mid);
-
-    /* Get args */
-    mrb_int argc;
-    mrb_value *argv;
-    mrb_get_args(mrb, "*", &argv, &argc);
-
-    /* Convert mruby args → sandbox_value_t[] */
-    sandbox_value_t *sargs = NULL;
-    char errbuf[256];
-    errbuf[0] = '\0';
-
-    if (argc > 0) {
-        sargs = calloc((size_t)argc, sizeof(sandbox_value_t));
-        for (mrb_int i = 0; i < argc; i++) {
-            if (mrb_to_sandbox_value(mrb, argv[i], &sargs[i], errbuf, sizeof(errbuf)) != 0) {
-                /* Clean up already-converted args */
-                for (mrb_int j = 0; j < i; j++) {
-                    sandbox_value_free(&sargs[j]);
-                }
-                free(sargs);
-                mrb_raise(mrb, mrb_class_get(mrb, "TypeError"), errbuf);
-                return mrb_nil_value();
-            }
+    if (mrb_float_p(v)) {
+        double f = mrb_float(v);
+        uint64_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        sbuf_byte(b, SESSION_FLOAT);
+        sbuf_u64(b, bits);
+        return;
+    }
+    if (mrb_symbol_p(v)) {
+        mrb_int nlen;
+        const char *n = mrb_sym_name_len(mrb, mrb_symbol(v), &nlen);
+        sbuf_byte(b, SESSION_SYMBOL);
+        sbuf_str(b, n, (size_t)nlen);
+        return;
+    }
+    if (mrb_class_p(v) || mrb_module_p(v)) {
+        mrb_value path = mrb_class_path(mrb, mrb_class_ptr(v));
+        if (mrb_string_p(path)) {
+            sbuf_byte(b, SESSION_MODULE);
+            sbuf_str(b, RSTRING_PTR(path), (size_t)RSTRING_LEN(path));
+            return;
         }
+        goto unsupported;
     }
 
-    /* Call the CRuby callback */
-    sandbox_callback_result_t cb_result = state->callback(
-        method_name, sargs, (int)argc, state->callback_userdata);
-
-    /* Free the converted args */
-    for (mrb_int i = 0; i < argc; i++) {
-        sandbox_value_free(&sargs[i]);
+    uint32_t id;
+    if (ptr_table_get(&w->objects, mrb_ptr(v), &id)) {
+        sbuf_byte(b, SESSION_REF);
+        sbuf_uint(b, id);
+        return;
     }
-    free(sargs);
+    if (depth >= SESSION_MAX_DEPTH) goto unsupported;
+
+    uint8_t tag;
+    mrb_value class_path = mrb_nil_value();
+    if (mrb_string_p(v))      tag = SESSION_STRING;
+    else if (mrb_array_p(v))  tag = SESSION_ARRAY;
+    else if (mrb_hash_p(v))   tag = SESSION_HASH;
+    else if (mrb_range_p(v))  tag = SESSION_RANGE;
+    else if (mrb_type(v) == MRB_TT_OBJECT) {
+        class_path = mrb_class_path(mrb, mrb_obj_class(mrb, v));
+        if (!mrb_string_p(class_path)) goto unsupported;
+        tag = SESSION_OBJECT;
+    }
+    else goto unsupported;
 
-    /* Check for error from callback */
-    if (cb_result.error) {
-        char *err_copy = strdup(cb_result.error);
-        free(cb_result.error);
-        sandbox_value_free(&cb_result.value);
-        mrb_raise(mrb, mrb_class_get(mrb, "RuntimeError"), err_copy);
-        free(err_copy);
-        return mrb_nil_value();
+    if (ptr_table_put(&w->objects, mrb_ptr(v), w->nobjects++) != 0) {
+        w->oom = 1;
+        return;
     }
+    sbuf_byte(b, tag | (MRB_FROZEN_P(mrb_basic_ptr(v)) ? SESSION_FROZEN : 0));
 
-    /* Convert result back to mruby */
-    mrb_value ret = sandbox_value_to_mrb(mrb, &cb_result.value);
-    sandbox_value_free(&cb_result.value);
+    session_value_ctx_t ctx = { w, b, depth + 1 };
+    switch (tag) {
+    case SESSION_STRING:
+        sbuf_str(b, RSTRING_PTR(v), (size_t)RSTRING_LEN(v));
+        break;
+    case SESSION_ARRAY: {
+        mrb_int alen = RARRAY_LEN(v);
+        sbuf_uint(b, (uint64_t)alen);
+        for (mrb_int i = 0; i < alen; i++) {
+            session_write_value(w, b, mrb_ary_entry(v, i), depth + 1);
+        }
+        break;
+    }
+    case SESSION_HASH:
+        sbuf_uint(b, (uint64_t)mrb_hash_size(mrb, v));
+        mrb_hash_foreach(mrb, mrb_hash_ptr(v), session_write_pair, &ctx);
+        break;
+    case SESSION_RANGE:
+        sbuf_byte(b, mrb_range_excl_p(mrb, v) ? 1 : 0);
+        session_write_value(w, b, mrb_range_beg(mrb, v), depth + 1);
+        session_write_value(w, b, mrb_range_end(mrb, v), depth + 1);
+        break;
+    case SESSION_OBJECT: {
+        uint64_t nivars = 0;
+        mrb_iv_foreach(mrb, v, session_count_ivar, &nivars);
+        sbuf_str(b, RSTRING_PTR(class_path), (size_t)RSTRING_LEN(class_path));
+        sbuf_uint(b, nivars);
+        mrb_iv_foreach(mrb, v, session_write_ivar, &ctx);
+        break;
+    }
+    }
+    return;
 
-    return ret;
+unsupported:
+    if (!w->unsupported) w->unsupported = mrb_obj_classname(mrb, v);
+    sbuf_byte(b, SESSION_NIL);
 }
 
-/* ------------------------------------------------------------------ */
-/* Register functions in mruby                                        */
-/* ------------------------------------------------------------------ */
-
+/* One constant, @ivar or @@cvar of c at owner (NULL and "" for top self) */
 static void
-register_functions_in_mrb(sandbox_state_t *state)
+session_write_var(session_writer_t *w, struct RClass *c, mrb_value owner, mrb_sym name, mrb_value v)
 {
-    struct RClass *kernel = state->mrb->kernel_module;
-    for (int i = 0; i < state->func_count; i++) {
-        mrb_define_method(state->mrb, kernel, state->func_names[i],
-                          sandbox_function_trampoline, MRB_ARGS_ANY());
+    mrb_state *mrb = w->state->mrb;
+    mrb_int nlen;
+    const char *n = mrb_sym_name_len(mrb, name, &nlen);
+
+    sbuf_str(&w->vars, RSTRING_PTR(owner), (size_t)RSTRING_LEN(owner));
+    sbuf_str(&w->vars, n, (size_t)nlen);
+    w->unsupported = NULL;
+    session_write_value(w, &w->vars, v, 0);
+    w->vars.count++;
+
+    if (!w->unsupported) return;
+    if (!c) {
+        session_fail(w, "can't dump %s (%s)", n, w->unsupported);
+    } else if (session_const_name_p(n)) {
+        mrb_value path = session_child_path(mrb, c, owner, name);
+        session_fail(w, "can't dump %s (%s)", RSTRING_PTR(path), w->unsupported);
+    } else {
+        session_fail(w, "can't dump %s of %s (%s)", n, RSTRING_PTR(owner), w->unsupported);
     }
 }
 
-static output_buf_t *
-get_output_buf(mrb_state *mrb)
+/* Add a module the session created to the modules section, after the
+ * outer module and superclass it needs */
+static void
+session_record_module(session_writer_t *w, struct RClass *c, mrb_value path)
 {
-    sandbox_state_t *state = (sandbox_state_t *)mrb->ud;
-    if (!state) return NULL;
-    return &state->output;
-}
+    mrb_state *mrb = w->state->mrb;
+    if (baseline_has(path) || ptr_table_get(&w->recorded, c, NULL)) return;
+    if (ptr_table_put(&w->recorded, c, 0) != 0) {
+        w->oom = 1;
+        return;
+    }
 
-/* ------------------------------------------------------------------ */
-/* mruby Kernel overrides for output capture                          */
-/* ------------------------------------------------------------------ */
+    size_t outer_len = session_outer_len(RSTRING_PTR(path), (size_t)RSTRING_LEN(path));
+    if (outer_len > 0) {
+        struct RClass *outer = session_resolve(mrb, RSTRING_PTR(path), outer_len);
+        if (outer) session_record_module(w, outer, mrb_str_new(mrb, RSTRING_PTR(path), outer_len));
+    }
 
-static mrb_value
-sandbox_mrb_print(mrb_state *mrb, mrb_value self)
-{
-    mrb_int argc;
-    mrb_value *argv;
-    mrb_get_args(mrb, "*", &argv, &argc);
+    int is_class = c->tt == MRB_TT_CLASS;
+    mrb_value super_path = mrb_str_new_lit(mrb, "");
+    if (is_class && c->super) {
+        struct RClass *super = mrb_class_real(c->super);
+        super_path = mrb_class_path(mrb, super);
+        if (!mrb_string_p(super_path)) {
+            session_fail(w, "can't dump class %s (anonymous superclass)", RSTRING_PTR(path));
+            return;
+        }
+        session_record_module(w, super, super_path);
+    }
 
-    output_buf_t *ob = get_output_buf(mrb);
-    if (!ob) return mrb_nil_value();
+    sbuf_str(&w->modules, RSTRING_PTR(path), (size_t)RSTRING_LEN(path));
+    sbuf_byte(&w->modules, is_class ? 1 : 0);
+    sbuf_str(&w->modules, RSTRING_PTR(super_path), (size_t)RSTRING_LEN(super_path));
+    w->modules.count++;
+}
 
-    for (mrb_int i = 0; i < argc; i++) {
-        mrb_value s = mrb_obj_as_string(mrb, argv[i]);
-        output_buf_append(ob, RSTRING_PTR(s), RSTRING_LEN(s));
+/* Modules included into c, oldest first, walking its iclass chain */
+static void
+session_write_includes(session_writer_t *w, struct RClass *c, struct RClass *ic,
+                       mrb_value path, int created)
+{
+    mrb_state *mrb = w->state->mrb;
+    if (!ic || ic->tt != MRB_TT_ICLASS) return;
+    session_write_includes(w, c, ic->super, path, created);
+
+    struct RClass *m = ic->c;
+    if (m == c) return;  /* origin of a class with prepends */
+    mrb_value mpath = mrb_class_path(mrb, m);
+    if (!mrb_string_p(mpath)) {
+        session_fail(w, "can't dump %s (includes an anonymous module)", RSTRING_PTR(path));
+        return;
     }
-    return mrb_nil_value();
+    if (!created && baseline_has(mpath)) return;
+
+    session_record_module(w, m, mpath);
+    sbuf_str(&w->includes, RSTRING_PTR(path), (size_t)RSTRING_LEN(path));
+    sbuf_str(&w->includes, RSTRING_PTR(mpath), (size_t)RSTRING_LEN(mpath));
+    w->includes.count++;
 }
 
-static mrb_value
-sandbox_mrb_puts(mrb_state *mrb, mrb_value self)
+typedef struct {
+    session_writer_t *w;
+    mrb_value         path;
+    int               singleton;
+    int               created;    /* module made by the session */
+} session_methods_ctx_t;
+
+/* Methods the session wrote: bytecode procs (mrblib's are static ireps)
+ * and, on its own modules, attribute accessors */
+static int
+session_write_method(mrb_state *mrb, mrb_sym mid, mrb_method_t m, void *data)
 {
-    mrb_int argc;
-    mrb_value *argv;
-    mrb_get_args(mrb, "*", &argv, &argc);
+    session_methods_ctx_t *ctx = (session_methods_ctx_t *)data;
+    session_writer_t *w = ctx->w;
+    if (MRB_METHOD_UNDEF_P(m) || !MRB_METHOD_PROC_P(m)) return 0;
+
+    struct RProc *p = MRB_METHOD_PROC(m);
+    const char *ivar = NULL;
+    mrb_int ivar_len = 0;
+    if (MRB_PROC_CFUNC_P(p)) {
+        /* attr_reader and attr_writer close over the @name */
+        if (!ctx->created || !MRB_PROC_ENV_P(p) || MRB_ENV_LEN(p->e.env) != 1 ||
+            !mrb_symbol_p(p->e.env->stack[0])) {
+            return 0;
+        }
+        ivar = mrb_sym_name_len(mrb, mrb_symbol(p->e.env->stack[0]), &ivar_len);
+        if (ivar[0] != '@') return 0;
+    }
+    else if (p->body.irep->flags & MRB_IREP_NO_FREE) {
+        return 0;
+    }
 
-    output_buf_t *ob = get_output_buf(mrb);
-    if (!ob) return mrb_nil_value();
+    mrb_int nlen;
+    const char *name = mrb_sym_name_len(mrb, mid, &nlen);
+    if (!ivar && MRB_PROC_ENV_P(p)) {
+        session_fail(w, "can't dump %s%s%s (defined with a block)",
+                     RSTRING_PTR(ctx->path), ctx->singleton ? "." : "#", name);
+        return 1;
+    }
 
-    if (argc == 0) {
-        output_buf_append(ob, "\n", 1);
+    session_buf_t *b = &w->methods;
+    sbuf_str(b, RSTRING_PTR(ctx->path), (size_t)RSTRING_LEN(ctx->path));
+    sbuf_byte(b, ctx->singleton ? 1 : 0);
+    sbuf_byte(b, (uint8_t)MRB_METHOD_VISIBILITY(m));
+    sbuf_str(b, name, (size_t)nlen);
+    if (ivar) {
+        sbuf_byte(b, SESSION_METHOD_ATTR);
+        sbuf_str(b, ivar, (size_t)ivar_len);
     }
     else {
-        for (mrb_int i = 0; i < argc; i++) {
-            if (mrb_array_p(argv[i])) {
-                mrb_int alen = RARRAY_LEN(argv[i]);
-                mrb_value *aptr = RARRAY_PTR(argv[i]);
-                for (mrb_int j = 0; j < alen; j++) {
-                    mrb_value s = mrb_obj_as_string(mrb, aptr[j]);
-                    output_buf_append(ob, RSTRING_PTR(s), RSTRING_LEN(s));
-                    if (RSTRING_LEN(s) == 0 || RSTRING_PTR(s)[RSTRING_LEN(s)-1] != '\n') {
-                        output_buf_append(ob, "\n", 1);
-                    }
-                }
-            }
-            else {
-                mrb_value s = mrb_obj_as_string(mrb, argv[i]);
-                output_buf_append(ob, RSTRING_PTR(s), RSTRING_LEN(s));
-                if (RSTRING_LEN(s) == 0 || RSTRING_PTR(s)[RSTRING_LEN(s)-1] != '\n') {
-                    output_buf_append(ob, "\n", 1);
-                }
-            }
+        uint8_t *bin = NULL;
+        size_t bin_len = 0;
+        if (mrb_dump_irep(mrb, p->body.irep, 0, &bin, &bin_len) != MRB_DUMP_OK) {
+            w->oom = 1;
+            return 1;
         }
+        sbuf_byte(b, SESSION_METHOD_BYTECODE);
+        sbuf_str(b, (const char *)bin, bin_len);
+        mrb_free(mrb, bin);
     }
-    return mrb_nil_value();
+    b->count++;
+    return 0;
 }
 
-static mrb_value
-sandbox_mrb_p(mrb_state *mrb, mrb_value self)
+static void
+session_dump_module(session_writer_t *w, struct RClass *c, mrb_value path)
 {
-    mrb_int argc;
-    mrb_value *argv;
-    mrb_get_args(mrb, "*", &argv, &argc);
-
-    output_buf_t *ob = get_output_buf(mrb);
-    if (!ob) return mrb_nil_value();
+    mrb_state *mrb = w->state->mrb;
+    int ai = mrb_gc_arena_save(mrb);
+    int created = !baseline_has(path);
+
+    if (created) session_record_module(w, c, path);
+    session_write_includes(w, c, c->super, path, created);
+
+    session_methods_ctx_t ctx = { w, path, 0, created };
+    mrb_mt_foreach(mrb, c, session_write_method, &ctx);
+    if (c->c && c->c->tt == MRB_TT_SCLASS) {
+        ctx.singleton = 1;
+        mrb_mt_foreach(mrb, c->c, session_write_method, &ctx);
+    }
 
-    for (mrb_int i = 0; i < argc; i++) {
-        mrb_value s = mrb_funcall_argv(mrb, argv[i],
-                        mrb_intern_lit(mrb, "inspect"), 0, NULL);
-        if (mrb_string_p(s)) {
-            output_buf_append(ob, RSTRING_PTR(s), RSTRING_LEN(s));
+    mrb_value entries = session_entries(mrb, mrb_obj_value(c));
+    for (mrb_int i = 0; i < RARRAY_LEN(entries) && !w->error[0]; i += 2) {
+        mrb_sym name = mrb_symbol(mrb_ary_entry(entries, i));
+        mrb_value v = mrb_ary_entry(entries, i + 1);
+        const char *n = mrb_sym_name(mrb, name);
+
+        if (session_const_name_p(n)) {
+            mrb_value child = session_child_path(mrb, c, path, name);
+            if (session_owns_p(mrb, v, child)) {
+                session_dump_module(w, mrb_class_ptr(v), child);
+            } else if (!baseline_has(child)) {
+                session_write_var(w, c, path, name, v);
+            }
+        }
+        else if (n[0] == '@' && created) {
+            session_write_var(w, c, path, name, v);
         }
-        output_buf_append(ob, "\n", 1);
     }
 
-    if (argc == 0) return mrb_nil_value();
-    if (argc == 1) return argv[0];
-    return mrb_ary_new_from_values(mrb, argc, argv);
+    mrb_gc_arena_restore(mrb, ai);
 }
 
-/* ------------------------------------------------------------------ */
-/* Internal: initialize an mrb_state with sandbox settings            */
-/* ------------------------------------------------------------------ */
-
-static void
-sandbox_setup_mrb(sandbox_state_t *state)
+static mrb_value
+session_dump(mrb_state *mrb, void *userdata)
 {
-    /* Override Kernel#print, define Kernel#puts, override Kernel#p */
-    struct RClass *kernel = state->mrb->kernel_module;
-    mrb_define_method(state->mrb, kernel, "print", sandbox_mrb_print, MRB_ARGS_ANY());
-    mrb_define_method(state->mrb, kernel, "puts",  sandbox_mrb_puts,  MRB_ARGS_ANY());
-    mrb_define_method(state->mrb, kernel, "p",     sandbox_mrb_p,     MRB_ARGS_ANY());
+    session_writer_t *w = (session_writer_t *)userdata;
+    sandbox_state_t *state = w->state;
 
-    /* Re-register tool functions (survives reset) */
-    register_functions_in_mrb(state);
+    session_dump_module(w, mrb->object_class, mrb_str_new_lit(mrb, "Object"));
+
+    mrb_value top = mrb_top_self(mrb);
+    mrb_value entries = session_entries(mrb, top);
+    mrb_value none = mrb_str_new_lit(mrb, "");
+    for (mrb_int i = 0; i < RARRAY_LEN(entries) && !w->error[0]; i += 2) {
+        session_write_var(w, NULL, none, mrb_symbol(mrb_ary_entry(entries, i)),
+                          mrb_ary_entry(entries, i + 1));
+    }
 
-    /* Initialize _ variable (like mirb) */
-    struct mrb_parser_state *parser = mrb_parse_string(state->mrb, "_=nil", state->cxt);
-    if (parser) {
-        struct RProc *proc = mrb_generate_code(state->mrb, parser);
-        if (proc) {
-            mrb_vm_run(state->mrb, proc, mrb_top_self(state->mrb), 0);
-            state->stack_keep = proc->body.irep->nlocals;
+    /* Top-level locals live in the registers after self */
+    int nlocals = state->stack_keep > 0 ? (int)state->stack_keep - 1 : 0;
+    if (nlocals > state->cxt->slen) nlocals = state->cxt->slen;
+    w->locals.count = (uint64_t)nlocals;
+    for (int i = 0; i < nlocals; i++) {
+        mrb_int nlen;
+        const char *n = mrb_sym_name_len(mrb, state->cxt->syms[i], &nlen);
+        sbuf_str(&w->locals, n, (size_t)nlen);
+    }
+    for (int i = 0; i < nlocals && !w->error[0]; i++) {
+        w->unsupported = NULL;
+        session_write_value(w, &w->locals, mrb->c->ci->stack[i + 1], 0);
+        const char *n = mrb_sym_name(mrb, state->cxt->syms[i]);
+        if (w->unsupported && strcmp(n, "_") != 0) {  /* _ just comes back as nil */
+            session_fail(w, "can't dump local variable %s (%s)", n, w->unsupported);
         }
-        mrb_parser_free(parser);
     }
+    return mrb_nil_value();
 }
 
-/* ------------------------------------------------------------------ */
-/* Public API                                                          */
-/* ------------------------------------------------------------------ */
-
-sandbox_state_t *
-sandbox_state_new(double timeout, size_t memory_limit)
+/* The message of an exception raised while loading or dumping */
+static char *
+session_exception(sandbox_state_t *state, mrb_value exc)
 {
-    sandbox_state_t *state = calloc(1, sizeof(sandbox_state_t));
-    if (!state) return NULL;
-
-    state->timeout_seconds = timeout;
-    state->memory_limit = memory_limit;
-
-    /* Activate tracker with limit=0 (unlimited) during init so all
-     * allocations get the size header prepended. */
-    state->mem_tracker.current = 0;
-    state->mem_tracker.limit = 0;
-    state->mem_tracker.exceeded = 0;
-    mem_tracker_t *prev = mem_tracker_activate(&state->mem_tracker);
+    state->mrb->exc = mrb_obj_ptr(exc);
+    sandbox_result_t result = sandbox_collect_result(state, mrb_nil_value());
+    char *error = result.error;
+    result.error = NULL;
+    sandbox_result_free(&result);
+    return error;
+}
 
-    state->mrb = mrb_open();
+char *
+sandbox_state_dump_session(sandbox_state_t *state, size_t *len, char **error)
+{
+    *error = NULL;
+    pthread_once(&baseline_once, baseline_init);
+
+    session_writer_t w;
+    memset(&w, 0, sizeof(w));
+    w.state = state;
+
+    sandbox_heap_t *prev = heap_enter(&state->heap);
+    mrb_bool failed = FALSE;
+    mrb_value ret = mrb_protect_error(state->mrb, session_dump, &w, &failed);
+    if (failed) {
+        *error = session_exception(state, ret);
+    }
+    mrb_gc_arena_restore(state->mrb, state->arena_idx);
+    heap_leave(prev);
+
+    session_buf_t out = { NULL, 0, 0, 0, 0 };
+    if (!*error && !w.error[0]) {
+        session_buf_t *sections[] = { &w.modules, &w.includes, &w.methods, &w.vars, &w.locals };
+        sbuf_put(&out, SESSION_MAGIC, 4);
+        sbuf_byte(&out, SESSION_VERSION);
+        sbuf_u64(&out, 0);  /* checksum, filled in below */
+        for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+            sbuf_uint(&out, sections[i]->count);
+            sbuf_put(&out, sections[i]->buf, sections[i]->len);
+            w.oom |= sections[i]->oom;
+        }
+        w.oom |= out.oom;
+        if (!w.oom) {
+            uint64_t sum = fnv1a((const char *)out.buf + SESSION_HEADER, out.len - SESSION_HEADER);
+            for (int i = 0; i < 8; i++) out.buf[5 + i] = (uint8_t)(sum >> (8 * i));
+        }
+    }
 
-    if (!state->mrb || state->mrb->exc) {
-        mem_tracker_restore(prev);
-        free(state);
+    free(w.modules.buf);
+    free(w.includes.buf);
+    free(w.methods.buf);
+    free(w.vars.buf);
+    free(w.locals.buf);
+    ptr_table_free(&w.objects);
+    ptr_table_free(&w.recorded);
+
+    if (*error || w.error[0] || w.oom) {
+        free(out.buf);
+        if (!*error) {
+            *error = w.error[0] ? strdup_safe(w.error, strlen(w.error))
+                                : strdup_safe("out of memory", 13);
+        }
         return NULL;
     }
+    *len = out.len;
+    return (char *)out.buf;
+}
 
-    /* Store sandbox_state in mrb->ud for the code_fetch_hook */
-    state->mrb->ud = state;
-
-    state->cxt = mrb_ccontext_new(state->mrb);
-    state->cxt->capture_errors = TRUE;
-    mrb_ccontext_filename(state->mrb, state->cxt, "(sandbox)");
-
-    state->stack_keep = 0;
-    state->arena_idx = mrb_gc_arena_save(state->mrb);
+/* ---- load ---- */
 
-    output_buf_init(&state->output);
-    sandbox_setup_mrb(state);
+typedef struct {
+    sandbox_state_t *state;
+    const uint8_t   *p;
+    const uint8_t   *end;
+    mrb_value        objects;   /* numbered values, in order */
+} session_reader_t;
 
-    mem_tracker_restore(prev);
+static void
+session_corrupt(mrb_state *mrb)
+{
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "corrupt session");
+}
 
-    return state;
+static uint8_t
+rd_byte(mrb_state *mrb, session_reader_t *r)
+{
+    if (r->p >= r->end) session_corrupt(mrb);
+    return *r->p++;
 }
 
-void
-sandbox_state_free(sandbox_state_t *state)
+static uint64_t
+rd_uint(mrb_state *mrb, session_reader_t *r)
 {
-    if (!state) return;
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t c = rd_byte(mrb, r);
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return v;
+    }
+    session_corrupt(mrb);
+    return 0;
+}
 
-    /* Activate tracker around mrb_close so frees go through our allocator */
-    state->mem_tracker.limit = 0; /* unlimited during teardown */
-    mem_tracker_t *prev = mem_tracker_activate(&state->mem_tracker);
+/* A count of records, each at least one byte long */
+static uint64_t
+rd_count(mrb_state *mrb, session_reader_t *r)
+{
+    uint64_t n = rd_uint(mrb, r);
+    if (n > (uint64_t)(r->end - r->p)) session_corrupt(mrb);
+    return n;
+}
 
-    if (state->cxt && state->mrb) {
-        mrb_ccontext_free(state->mrb, state->cxt);
-    }
-    if (state->mrb) {
-        mrb_close(state->mrb);
-    }
+static const char *
+rd_str(mrb_state *mrb, session_reader_t *r, size_t *len)
+{
+    uint64_t n = rd_uint(mrb, r);
+    if (n > (uint64_t)(r->end - r->p)) session_corrupt(mrb);
+    const char *s = (const char *)r->p;
+    r->p += n;
+    *len = (size_t)n;
+    return s;
+}
 
-    mem_tracker_restore(prev);
+static mrb_sym
+rd_sym(mrb_state *mrb, session_reader_t *r)
+{
+    size_t len;
+    const char *s = rd_str(mrb, r, &len);
+    return mrb_intern(mrb, s, len);
+}
 
-    output_buf_free(&state->output);
-    for (int i = 0; i < state->func_count; i++) {
-        free(state->func_names[i]);
+static struct RClass *
+session_module_at(mrb_state *mrb, const char *path, size_t len)
+{
+    struct RClass *c = session_resolve(mrb, path, len);
+    if (!c) {
+        mrb_raisef(mrb, E_NAME_ERROR, "session refers to unknown constant %v",
+                   mrb_str_new(mrb, path, len));
     }
-    free(state);
+    return c;
 }
 
-/* ------------------------------------------------------------------ */
-/* Limit orchestration helpers                                         */
-/* ------------------------------------------------------------------ */
+static struct RClass *
+rd_module(mrb_state *mrb, session_reader_t *r)
+{
+    size_t len;
+    const char *path = rd_str(mrb, r, &len);
+    return session_module_at(mrb, path, len);
+}
 
-/* Activate limits before eval. Returns prev tracker for restore. */
-static mem_tracker_t *
-sandbox_limits_begin(sandbox_state_t *state)
+/* Number v, reserving its slot first so nested values keep their order */
+static mrb_int
+session_number(mrb_state *mrb, session_reader_t *r, mrb_value v)
 {
-    state->mem_tracker.exceeded = 0;
-    state->mem_tracker.limit = state->memory_limit;
-    mem_tracker_t *prev = mem_tracker_activate(&state->mem_tracker);
+    mrb_int id = RARRAY_LEN(r->objects);
+    mrb_ary_push(mrb, r->objects, v);
+    return id;
+}
 
-    state->timeout_state.expired = 0;
-    state->timeout_state.check_counter = 0;
-    if (state->timeout_seconds > 0) {
-        struct timespec now;
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        double int_part;
-        double frac = modf(state->timeout_seconds, &int_part);
-        state->timeout_state.deadline.tv_sec = now.tv_sec + (time_t)int_part;
-        state->timeout_state.deadline.tv_nsec = now.tv_nsec + (long)(frac * 1e9);
-        if (state->timeout_state.deadline.tv_nsec >= 1000000000L) {
-            state->timeout_state.deadline.tv_sec++;
-            state->timeout_state.deadline.tv_nsec -= 1000000000L;
+static mrb_value
+session_read_value(mrb_state *mrb, session_reader_t *r, int depth)
+{
+    if (depth > SESSION_MAX_DEPTH) session_corrupt(mrb);
+
+    uint8_t tag = rd_byte(mrb, r);
+    mrb_value v;
+    switch (tag & ~SESSION_FROZEN) {
+    case SESSION_NIL:    v = mrb_nil_value(); break;
+    case SESSION_TRUE:   v = mrb_true_value(); break;
+    case SESSION_FALSE:  v = mrb_false_value(); break;
+    case SESSION_INT: {
+        uint64_t u = rd_uint(mrb, r);
+        v = mrb_int_value(mrb, (mrb_int)((int64_t)(u >> 1) ^ -(int64_t)(u & 1)));
+        break;
+    }
+    case SESSION_FLOAT: {
+        if (r->end - r->p < 8) session_corrupt(mrb);
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; i++) bits |= (uint64_t)r->p[i] << (8 * i);
+        r->p += 8;
+        double f;
+        memcpy(&f, &bits, sizeof(f));
+        v = mrb_float_value(mrb, (mrb_float)f);
+        break;
+    }
+    case SESSION_SYMBOL:
+        v = mrb_symbol_value(rd_sym(mrb, r));
+        break;
+    case SESSION_MODULE:
+        v = mrb_obj_value(rd_module(mrb, r));
+        break;
+    case SESSION_REF: {
+        uint64_t id = rd_uint(mrb, r);
+        if (id >= (uint64_t)RARRAY_LEN(r->objects)) session_corrupt(mrb);
+        return mrb_ary_entry(r->objects, (mrb_int)id);
+    }
+    case SESSION_STRING: {
+        size_t len;
+        const char *s = rd_str(mrb, r, &len);
+        v = mrb_str_new(mrb, s, len);
+        session_number(mrb, r, v);
+        break;
+    }
+    case SESSION_ARRAY: {
+        uint64_t n = rd_count(mrb, r);
+        v = mrb_ary_new_capa(mrb, (mrb_int)n);
+        session_number(mrb, r, v);
+        for (uint64_t i = 0; i < n; i++) {
+            int ai = mrb_gc_arena_save(mrb);
+            mrb_ary_push(mrb, v, session_read_value(mrb, r, depth + 1));
+            mrb_gc_arena_restore(mrb, ai);
+        }
+        break;
+    }
+    case SESSION_HASH: {
+        uint64_t n = rd_count(mrb, r);
+        v = mrb_hash_new_capa(mrb, (mrb_int)n);
+        session_number(mrb, r, v);
+        for (uint64_t i = 0; i < n; i++) {
+            int ai = mrb_gc_arena_save(mrb);
+            mrb_value key = session_read_value(mrb, r, depth + 1);
+            mrb_value val = session_read_value(mrb, r, depth + 1);
+            mrb_hash_set(mrb, v, key, val);
+            mrb_gc_arena_restore(mrb, ai);
+        }
+        break;
+    }
+    case SESSION_RANGE: {
+        mrb_int id = session_number(mrb, r, mrb_nil_value());
+        mrb_bool excl = rd_byte(mrb, r) != 0;
+        mrb_value beg = session_read_value(mrb, r, depth + 1);
+        mrb_value end = session_read_value(mrb, r, depth + 1);
+        v = mrb_range_new(mrb, beg, end, excl);
+        mrb_ary_set(mrb, r->objects, id, v);
+        break;
+    }
+    case SESSION_OBJECT: {
+        struct RClass *c = rd_module(mrb, r);
+        if (c->tt != MRB_TT_CLASS || MRB_INSTANCE_TT(c) != MRB_TT_OBJECT) {
+            mrb_raisef(mrb, E_TYPE_ERROR, "can't restore an instance of %C", c);
+        }
+        v = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_OBJECT, c));
+        session_number(mrb, r, v);
+        for (uint64_t n = rd_count(mrb, r); n > 0; n--) {
+            int ai = mrb_gc_arena_save(mrb);
+            mrb_sym name = rd_sym(mrb, r);
+            mrb_iv_set(mrb, v, name, session_read_value(mrb, r, depth + 1));
+            mrb_gc_arena_restore(mrb, ai);
         }
-        state->mrb->code_fetch_hook = sandbox_code_fetch_hook;
-    } else {
-        state->timeout_state.deadline.tv_sec = 0;
-        state->timeout_state.deadline.tv_nsec = 0;
-        state->mrb->code_fetch_hook = NULL;
+        break;
+    }
+    default:
+        session_corrupt(mrb);
+        return mrb_nil_value();
     }
 
-    return prev;
+    if (tag & SESSION_FROZEN) {
+        int type = tag & ~SESSION_FROZEN;
+        if (type < SESSION_STRING || type > SESSION_OBJECT) session_corrupt(mrb);
+        MRB_SET_FROZEN_FLAG(mrb_basic_ptr(v));
+    }
+    return v;
 }
 
-/* Stop enforcing limits but keep tracker active for post-exec mruby calls. */
-static void
-sandbox_limits_end(sandbox_state_t *state)
+/* Accessors for restored attr_reader/attr_writer methods */
+static mrb_value
+session_attr_get(mrb_state *mrb, mrb_value self)
 {
-    state->mrb->code_fetch_hook = NULL;
-    state->mem_tracker.limit = 0;
+    return mrb_iv_get(mrb, self, mrb_symbol(mrb_proc_cfunc_env_get(mrb, 0)));
 }
 
-/* Classify error from flags, not string matching. */
-static sandbox_error_kind_t
-sandbox_classify_error(sandbox_state_t *state)
+static mrb_value
+session_attr_set(mrb_state *mrb, mrb_value self)
 {
-    if (state->timeout_state.expired) {
-        return SANDBOX_ERROR_TIMEOUT;
-    } else if (state->mem_tracker.exceeded) {
-        return SANDBOX_ERROR_MEMORY_LIMIT;
+    mrb_value val = mrb_get_arg1(mrb);
+    mrb_iv_set(mrb, self, mrb_symbol(mrb_proc_cfunc_env_get(mrb, 0)), val);
+    return val;
+}
+
+static int
+session_local_name_p(const char *n, size_t len)
+{
+    if (len == 0 || !((n[0] >= 'a' && n[0] <= 'z') || n[0] == '_' || (n[0] & 0x80))) return 0;
+    for (size_t i = 1; i < len; i++) {
+        char c = n[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+              (c >= '0' && c <= '9') || c == '_' || (c & 0x80))) return 0;
     }
-    return SANDBOX_ERROR_RUNTIME;
+    return 1;
 }
 
-static char *
-strdup_safe(const char *s, size_t len)
+static int
+session_local_index(sandbox_state_t *state, mrb_sym name)
 {
-    char *d = malloc(len + 1);
-    if (d) {
-        memcpy(d, s, len);
-        d[len] = '\0';
+    for (int i = 0; i < state->cxt->slen; i++) {
+        if (state->cxt->syms[i] == name) return i;
     }
-    return d;
+    return -1;
 }
 
-sandbox_result_t
-sandbox_state_eval(sandbox_state_t *state, const char *code)
+static mrb_value
+session_load(mrb_state *mrb, void *userdata)
 {
-    sandbox_result_t result = { NULL, NULL, NULL, SANDBOX_ERROR_NONE };
+    session_reader_t *r = (session_reader_t *)userdata;
+    sandbox_state_t *state = r->state;
+    r->objects = mrb_ary_new(mrb);
+    int ai = mrb_gc_arena_save(mrb);
+
+    /* Modules, each after its outer module and superclass */
+    for (uint64_t n = rd_count(mrb, r); n > 0; n--) {
+        size_t len, super_len;
+        const char *path = rd_str(mrb, r, &len);
+        int is_class = rd_byte(mrb, r);
+        const char *super_path = rd_str(mrb, r, &super_len);
+
+        size_t outer_len = session_outer_len(path, len);
+        struct RClass *outer = session_module_at(mrb, path, outer_len);
+        size_t skip = outer_len > 0 ? outer_len + 2 : 0;
+        mrb_sym name = mrb_intern(mrb, path + skip, len - skip);
+        if (!mrb_const_defined_at(mrb, mrb_obj_value(outer), name)) {
+            if (is_class) {
+                struct RClass *super = super_len > 0
+                    ? session_module_at(mrb, super_path, super_len) : mrb->object_class;
+                mrb_define_class_under_id(mrb, outer, name, super);
+            } else {
+                mrb_define_module_under_id(mrb, outer, name);
+            }
+        }
+        mrb_gc_arena_restore(mrb, ai);
+    }
 
-    output_buf_reset(&state->output);
+    for (uint64_t n = rd_count(mrb, r); n > 0; n--) {
+        struct RClass *c = rd_module(mrb, r);
+        struct RClass *m = rd_module(mrb, r);
+        if (m->tt != MRB_TT_MODULE) session_corrupt(mrb);
+        mrb_include_module(mrb, c, m);
+        mrb_gc_arena_restore(mrb, ai);
+    }
 
-    mem_tracker_t *prev = sandbox_limits_begin(state);
+    for (uint64_t n = rd_count(mrb, r); n > 0; n--) {
+        struct RClass *c = rd_module(mrb, r);
+        if (rd_byte(mrb, r)) c = mrb_singleton_class_ptr(mrb, mrb_obj_value(c));
+        int visibility = rd_byte(mrb, r) & MRB_METHOD_VISIBILITY_MASK;
+        mrb_sym mid = rd_sym(mrb, r);
+
+        struct RProc *p;
+        switch (rd_byte(mrb, r)) {
+        case SESSION_METHOD_BYTECODE: {
+            size_t len;
+            const char *bin = rd_str(mrb, r, &len);
+            mrb_irep *irep = mrb_read_irep_buf(mrb, bin, len);
+            if (!irep) session_corrupt(mrb);
+            p = mrb_proc_new(mrb, irep);
+            mrb_irep_decref(mrb, irep);
+            p->upper = NULL;
+            p->flags |= MRB_PROC_SCOPE | MRB_PROC_STRICT;  /* as def makes them */
+            break;
+        }
+        case SESSION_METHOD_ATTR: {
+            mrb_value ivar = mrb_symbol_value(rd_sym(mrb, r));
+            mrb_int nlen;
+            const char *name = mrb_sym_name_len(mrb, mid, &nlen);
+            p = mrb_proc_new_cfunc_with_env(mrb, name[nlen - 1] == '=' ? session_attr_set
+                                                                       : session_attr_get,
+                                            1, &ivar);
+            break;
+        }
+        default:
+            session_corrupt(mrb);
+            return mrb_nil_value();
+        }
 
-    /* Parse */
-    struct mrb_parser_state *parser = mrb_parser_new(state->mrb);
-    if (!parser) {
-        mem_tracker_restore(prev);
-        result.error = strdup_safe("parser allocation failed", 24);
-        result.error_kind = SANDBOX_ERROR_RUNTIME;
-        result.output = strdup_safe("", 0);
-        return result;
+        mrb_method_t m;
+        MRB_METHOD_FROM_PROC(m, p);
+        MRB_METHOD_SET_VISIBILITY(m, visibility);
+        mrb_define_method_raw(mrb, c, mid, m);
+        mrb_gc_arena_restore(mrb, ai);
     }
 
-    parser->s = code;
-    parser->send = code + strlen(code);
-    parser->lineno = state->cxt->lineno;
-    mrb_parser_parse(parser, state->cxt);
-
-    /* Syntax error? */
-    if (parser->nerr > 0) {
-        char errbuf[1024];
-        snprintf(errbuf, sizeof(errbuf), "SyntaxError: %s (line %d)",
-                 parser->error_buffer[0].message,
-                 parser->error_buffer[0].lineno - state->cxt->lineno + 1);
-        mrb_parser_free(parser);
-        mem_tracker_restore(prev);
+    /* Constants, @ivars and @@cvars; values may name any module above */
+    for (uint64_t n = rd_count(mrb, r); n > 0; n--) {
+        size_t owner_len;
+        const char *owner = rd_str(mrb, r, &owner_len);
+        mrb_sym name = rd_sym(mrb, r);
+        mrb_value v = session_read_value(mrb, r, 0);
+        const char *nm = mrb_sym_name(mrb, name);
+
+        if (owner_len == 0) {
+            if (nm[0] != '@') session_corrupt(mrb);
+            mrb_iv_set(mrb, mrb_top_self(mrb), name, v);
+        } else {
+            mrb_value mod = mrb_obj_value(session_module_at(mrb, owner, owner_len));
+            if (nm[0] == '@' && nm[1] == '@') mrb_cv_set(mrb, mod, name, v);
+            else if (nm[0] == '@') mrb_iv_set(mrb, mod, name, v);
+            else if (session_const_name_p(nm)) mrb_const_set(mrb, mod, name, v);
+            else session_corrupt(mrb);
+        }
+        mrb_gc_arena_restore(mrb, ai);
+    }
 
-        result.error = strdup_safe(errbuf, strlen(errbuf));
-        result.error_kind = SANDBOX_ERROR_RUNTIME;
-        result.output = state->output.len > 0
-            ? strdup_safe(state->output.buf, state->output.len)
-            : strdup_safe("", 0);
-        return result;
+    /* Top-level locals: declare the missing ones the way an eval would,
+     * then fill in the registers */
+    uint64_t nlocals = rd_count(mrb, r);
+    mrb_value names = mrb_ary_new_capa(mrb, (mrb_int)nlocals);
+    mrb_value decl = mrb_str_new_capa(mrb, 64);
+    for (uint64_t i = 0; i < nlocals; i++) {
+        size_t len;
+        const char *n = rd_str(mrb, r, &len);
+        if (!session_local_name_p(n, len)) session_corrupt(mrb);
+        mrb_sym name = mrb_intern(mrb, n, len);
+        mrb_ary_push(mrb, names, mrb_symbol_value(name));
+        if (session_local_index(state, name) < 0) {
+            mrb_str_cat(mrb, decl, n, len);
+            mrb_str_cat_lit(mrb, decl, "=nil;");
+        }
+    }
+    if (RSTRING_LEN(decl) > 0) {
+        char *error = NULL;
+        struct RProc *proc = sandbox_parse(state, RSTRING_PTR(decl), &error);
+        if (!proc) {
+            free(error);
+            session_corrupt(mrb);
+        }
+        if (mrb->c->cibase->u.env) {
+            struct REnv *e = mrb_vm_ci_env(mrb->c->cibase);
+            if (e && MRB_ENV_LEN(e) < proc->body.irep->nlocals) {
+                MRB_ENV_SET_LEN(e, proc->body.irep->nlocals);
+            }
+        }
+        mrb_vm_run(mrb, proc, mrb_top_self(mrb), state->stack_keep);
+        state->stack_keep = proc->body.irep->nlocals;
+    }
+    for (uint64_t i = 0; i < nlocals; i++) {
+        mrb_value v = session_read_value(mrb, r, 0);
+        int index = session_local_index(state, mrb_symbol(mrb_ary_entry(names, (mrb_int)i)));
+        mrb->c->ci->stack[index + 1] = v;
+        mrb_gc_arena_restore(mrb, ai);
     }
 
-    /* Generate bytecode */
-    struct RProc *proc = mrb_generate_code(state->mrb, parser);
-    mrb_parser_free(parser);
+    if (r->p != r->end) session_corrupt(mrb);
+    return mrb_nil_value();
+}
 
-    if (!proc) {
-        mem_tracker_restore(prev);
-        result.error = strdup_safe("code generation failed", 22);
-        result.error_kind = SANDBOX_ERROR_RUNTIME;
-        result.output = state->output.len > 0
-            ? strdup_safe(state->output.buf, state->output.len)
-            : strdup_safe("", 0);
-        return result;
+int
+sandbox_state_load_session(sandbox_state_t *state, const char *blob, size_t len, char **error)
+{
+    *error = NULL;
+    const uint8_t *p = (const uint8_t *)blob;
+    if (len < SESSION_HEADER || memcmp(p, SESSION_MAGIC, 4) != 0) {
+        *error = strdup_safe("not an enclave session", 22);
+        return -1;
+    }
+    if (p[4] != SESSION_VERSION) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "unsupported session version %d", p[4]);
+        *error = strdup_safe(buf, strlen(buf));
+        return -1;
+    }
+    uint64_t sum = 0;
+    for (int i = 0; i < 8; i++) sum |= (uint64_t)p[5 + i] << (8 * i);
+    if (sum != fnv1a(blob + SESSION_HEADER, len - SESSION_HEADER)) {
+        *error = strdup_safe("corrupt session (checksum mismatch)", 35);
+        return -1;
     }
 
-    /* Adjust environment stack for local variable persistence (mirb pattern) */
-    if (state->mrb->c->cibase->u.env) {
-        struct REnv *e = mrb_vm_ci_env(state->mrb->c->cibase);
-        if (e && MRB_ENV_LEN(e) < proc->body.irep->nlocals) {
-            MRB_ENV_SET_LEN(e, proc->body.irep->nlocals);
-        }
+    session_reader_t r = { state, p + SESSION_HEADER, p + len, mrb_nil_value() };
+    sandbox_heap_t *prev = sandbox_limits_begin(state);
+    mrb_bool failed = FALSE;
+    mrb_value ret = mrb_protect_error(state->mrb, session_load, &r, &failed);
+    sandbox_limits_end(state);
+    if (failed) {
+        *error = session_exception(state, ret);
     }
+    mrb_gc_arena_restore(state->mrb, state->arena_idx);
+    heap_leave(prev);
+    output_buf_reset(&state->output);
+    return failed ? -1 : 0;
+}
 
-    /* Execute */
-    mrb_value mrb_result = mrb_vm_run(state->mrb, proc,
-                                       mrb_top_self(state->mrb),
-                                       state->stack_keep);
-    state->stack_keep = proc->body.irep->nlocals;
+/* ------------------------------------------------------------------ */
+/* Scrub                                                               */
+/* ------------------------------------------------------------------ */
 
-    sandbox_limits_end(state);
+/* A fingerprint covers every module reachable through constants from
+ * Object, their singleton classes, main and the globals: method table
+ * entries, variables, ancestry and frozen flags, and the contents of the
+ * values those variables hold. Entries are summed, so table order does
+ * not matter. Tool functions are left out, since they come and go with
+ * the caller's tools. */
 
-    /* Collect output */
-    result.output = state->output.len > 0
-        ? strdup_safe(state->output.buf, state->output.len)
-        : strdup_safe("", 0);
+#define FINGERPRINT_MAX_DEPTH 64
 
-    /* Check for exception */
-    if (state->mrb->exc) {
-        mrb_value exc = mrb_obj_value(state->mrb->exc);
-        mrb_value exc_str = mrb_funcall_argv(state->mrb, exc,
-                              mrb_intern_lit(state->mrb, "inspect"), 0, NULL);
-        if (mrb_string_p(exc_str)) {
-            result.error = strdup_safe(RSTRING_PTR(exc_str), RSTRING_LEN(exc_str));
-        }
-        else {
-            result.error = strdup_safe("unknown error", 13);
-        }
+typedef struct {
+    sandbox_state_t *state;
+    ptr_table_t      seen;      /* modules and objects already summed */
+    const void      *owner;     /* object whose tables are being summed */
+    uint64_t         sum;
+    int              depth;
+    int              oom;       /* or nested too deep: no fingerprint */
+} fingerprint_t;
+
+static uint64_t
+mix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
 
-        result.error_kind = sandbox_classify_error(state);
+static void
+fingerprint_add(fingerprint_t *f, uint64_t a, uint64_t b)
+{
+    f->sum += mix64((uint64_t)(uintptr_t)f->owner ^ mix64(a) ^ mix64(b + 1));
+}
 
-        state->mrb->exc = NULL;
-        mrb_gc_arena_restore(state->mrb, state->arena_idx);
-        state->cxt->lineno++;
-        mem_tracker_restore(prev);
-        return result;
+static uint64_t fingerprint_value(fingerprint_t *f, mrb_value v);
+
+typedef struct {
+    fingerprint_t *f;
+    uint64_t       h;
+} fingerprint_acc_t;
+
+static int
+fingerprint_ivar(mrb_state *mrb, mrb_sym name, mrb_value v, void *data)
+{
+    fingerprint_acc_t *acc = (fingerprint_acc_t *)data;
+    acc->h += mix64(mix64(name) ^ fingerprint_value(acc->f, v));  /* table order */
+    return 0;
+}
+
+static int
+fingerprint_pair(mrb_state *mrb, mrb_value key, mrb_value val, void *data)
+{
+    fingerprint_acc_t *acc = (fingerprint_acc_t *)data;
+    acc->h = mix64(acc->h ^ fingerprint_value(acc->f, key));
+    acc->h = mix64(acc->h ^ fingerprint_value(acc->f, val));
+    return 0;
+}
+
+/* Identity of v. What a snippet could change in place (string bytes,
+ * array and hash entries, instance variables, the frozen flag) is added
+ * to the sum once per object, in terms of the identities it refers to,
+ * so the result doesn't depend on which path reached it first. */
+static uint64_t
+fingerprint_value(fingerprint_t *f, mrb_value v)
+{
+    uint64_t id = (uint64_t)mrb_obj_id(v) * 31 + (uint64_t)mrb_type(v);
+    if (mrb_immediate_p(v) || mrb_class_p(v) || mrb_module_p(v) || mrb_type(v) == MRB_TT_SCLASS) {
+        return id;  /* modules are summed by fingerprint_module */
     }
 
-    /* Get inspect of result value */
-    mrb_value result_str = mrb_funcall_argv(state->mrb, mrb_result,
-                             mrb_intern_lit(state->mrb, "inspect"), 0, NULL);
-    if (mrb_string_p(result_str)) {
-        result.value = strdup_safe(RSTRING_PTR(result_str), RSTRING_LEN(result_str));
+    struct RBasic *obj = mrb_basic_ptr(v);
+    if (ptr_table_get(&f->seen, obj, NULL)) return id;
+    if (ptr_table_put(&f->seen, obj, 0) != 0 || f->depth >= FINGERPRINT_MAX_DEPTH) {
+        f->oom = 1;
+        return id;
     }
-    else {
-        result.value = strdup_safe("(unprintable)", 13);
+    f->depth++;
+
+    mrb_state *mrb = f->state->mrb;
+    fingerprint_acc_t acc = { f, MRB_FROZEN_P(obj) ? 1 : 0 };
+    if (mrb_string_p(v)) {
+        const unsigned char *p = (const unsigned char *)RSTRING_PTR(v);
+        mrb_int len = RSTRING_LEN(v);
+        acc.h ^= 0xcbf29ce484222325ULL;
+        for (mrb_int i = 0; i < len; i++) acc.h = (acc.h ^ p[i]) * 0x100000001b3ULL;
+        acc.h = mix64(acc.h ^ (uint64_t)len);
+    }
+    else if (mrb_array_p(v)) {
+        for (mrb_int i = 0; i < RARRAY_LEN(v); i++) {
+            acc.h = mix64(acc.h ^ fingerprint_value(f, RARRAY_PTR(v)[i]));
+        }
+    }
+    else if (mrb_hash_p(v)) {
+        mrb_hash_foreach(mrb, mrb_hash_ptr(v), fingerprint_pair, &acc);
     }
+    mrb_iv_foreach(mrb, v, fingerprint_ivar, &acc);
+    f->depth--;
+
+    const void *owner = f->owner;
+    f->owner = NULL;
+    fingerprint_add(f, id, acc.h);
+    f->owner = owner;
+    return id;
+}
 
-    /* Store result in _ (like mirb) */
-    if (state->mrb->c->ci->stack) {
-        *(state->mrb->c->ci->stack + 1) = mrb_result;
+static int
+fingerprint_method(mrb_state *mrb, mrb_sym mid, mrb_method_t m, void *data)
+{
+    fingerprint_t *f = (fingerprint_t *)data;
+    uint64_t body = 0;
+    if (MRB_METHOD_UNDEF_P(m)) {
+        if (f->owner == mrb->kernel_module) return 0;  /* a cleared tool */
+    }
+    else if (sandbox_tool_method_p(m)) {
+        return 0;
     }
+    else if (MRB_METHOD_PROC_P(m)) {
+        body = (uint64_t)(uintptr_t)MRB_METHOD_PROC(m);
+    }
+    else {
+        body = (uint64_t)(uintptr_t)MRB_METHOD_FUNC(m);
+    }
+    fingerprint_add(f, (uint64_t)mid << 2 | (uint64_t)MRB_METHOD_VISIBILITY(m), body);
+    return 0;
+}
 
-    mrb_gc_arena_restore(state->mrb, state->arena_idx);
-    state->cxt->lineno++;
-    mem_tracker_restore(prev);
+static void fingerprint_module(fingerprint_t *f, struct RClass *c);
 
-    return result;
+static int
+fingerprint_var(mrb_state *mrb, mrb_sym name, mrb_value v, void *data)
+{
+    fingerprint_t *f = (fingerprint_t *)data;
+    fingerprint_add(f, name, fingerprint_value(f, v));
+    if (mrb_class_p(v) || mrb_module_p(v)) {
+        const void *owner = f->owner;
+        fingerprint_module(f, mrb_class_ptr(v));
+        f->owner = owner;
+    }
+    return 0;
 }
 
-void
-sandbox_state_reset(sandbox_state_t *state)
+/* Methods, ancestry up to the superclass, and frozen flag of c */
+static void
+fingerprint_table(fingerprint_t *f, struct RClass *c)
 {
-    if (!state) return;
-
-    /* Activate tracker (unlimited) during teardown and recreate */
-    state->mem_tracker.limit = 0;
-    mem_tracker_t *prev = mem_tracker_activate(&state->mem_tracker);
+    mrb_state *mrb = f->state->mrb;
+    f->owner = c;
+    fingerprint_add(f, 0, MRB_FROZEN_P(c) ? 1 : 0);
+    uint64_t depth = 1;
+    for (struct RClass *s = c->super; s; s = s->super, depth++) {
+        struct RClass *m = s->tt == MRB_TT_ICLASS ? s->c : s;
+        fingerprint_add(f, depth, (uint64_t)(uintptr_t)m);
+        if (s->tt != MRB_TT_ICLASS) break;
+    }
+    mrb_mt_foreach(mrb, c, fingerprint_method, f);
+}
 
-    /* Tear down */
-    if (state->cxt) {
-        mrb_ccontext_free(state->mrb, state->cxt);
-        state->cxt = NULL;
+static void
+fingerprint_module(fingerprint_t *f, struct RClass *c)
+{
+    if (ptr_table_get(&f->seen, c, NULL)) return;
+    if (ptr_table_put(&f->seen, c, 0) != 0) {
+        f->oom = 1;
+        return;
     }
-    if (state->mrb) {
-        mrb_close(state->mrb);
-        state->mrb = NULL;
+    if (c->c && c->c->tt == MRB_TT_SCLASS) fingerprint_table(f, c->c);
+    fingerprint_table(f, c);
+    mrb_iv_foreach(f->state->mrb, mrb_obj_value(c), fingerprint_var, f);
+}
+
+static mrb_value
+fingerprint_collect(mrb_state *mrb, void *userdata)
+{
+    fingerprint_t *f = (fingerprint_t *)userdata;
+    fingerprint_module(f, mrb->object_class);
+
+    mrb_value top = mrb_top_self(mrb);
+    struct RObject *main = mrb_obj_ptr(top);
+    if (main->c->tt == MRB_TT_SCLASS) fingerprint_table(f, main->c);
+    f->owner = main;
+    fingerprint_add(f, 0, MRB_FROZEN_P(main) ? 1 : 0);
+    mrb_iv_foreach(mrb, top, fingerprint_var, f);
+
+    f->owner = NULL;
+    mrb_value globals = mrb_f_global_variables(mrb, mrb_nil_value());
+    for (mrb_int i = 0; i < RARRAY_LEN(globals); i++) {
+        mrb_sym name = mrb_symbol(mrb_ary_entry(globals, i));
+        fingerprint_add(f, name, fingerprint_value(f, mrb_gv_get(mrb, name)));
     }
-    output_buf_reset(&state->output);
+    return mrb_nil_value();
+}
 
-    /* Recreate with tracked allocator (limit=0 during init) */
-    state->mem_tracker.current = 0;
-    state->mem_tracker.exceeded = 0;
+/* Returns -1 if the fingerprint couldn't be computed (out of memory) */
+static int
+sandbox_fingerprint(sandbox_state_t *state, uint64_t *sum)
+{
+    fingerprint_t f;
+    memset(&f, 0, sizeof(f));
+    f.state = state;
+
+    int ai = mrb_gc_arena_save(state->mrb);
+    mrb_bool failed = FALSE;
+    mrb_protect_error(state->mrb, fingerprint_collect, &f, &failed);
+    mrb_gc_arena_restore(state->mrb, ai);
+    ptr_table_free(&f.seen);
+
+    *sum = f.sum;
+    return failed || f.oom ? -1 : 0;
+}
 
-    state->mrb = mrb_open();
+/* Called with the heap entered and no limit, before the first snippet */
+static void
+sandbox_fresh_take(sandbox_state_t *state)
+{
+    state->fresh.taken = 1;
+    state->fresh.valid = sandbox_fingerprint(state, &state->fresh.fingerprint) == 0;
+    state->fresh.stack_keep = state->stack_keep;
+    state->fresh.nsyms = state->cxt->slen;
+}
 
-    if (!state->mrb) {
-        mem_tracker_restore(prev);
-        return;
-    }
+/* ---- removal ---- */
 
-    state->mrb->ud = state;
+typedef struct {
+    sandbox_state_t *state;
+    mrb_value        doomed;   /* method names, removed after the table walk */
+} scrub_t;
 
-    state->cxt = mrb_ccontext_new(state->mrb);
-    state->cxt->capture_errors = TRUE;
-    mrb_ccontext_filename(state->mrb, state->cxt, "(sandbox)");
-    state->stack_keep = 0;
-    state->arena_idx = mrb_gc_arena_save(state->mrb);
+static int
+scrub_tool_p(sandbox_state_t *state, mrb_state *mrb, mrb_sym mid)
+{
+    return func_lookup(state, mrb_sym_name(mrb, mid)) >= 0;
+}
 
-    sandbox_setup_mrb(state);
+/* Methods snippets wrote: bytecode procs (mrblib's are static ireps) and
+ * tool trampolines under names that aren't tools, e.g. aliases */
+static int
+scrub_method(mrb_state *mrb, mrb_sym mid, mrb_method_t m, void *data)
+{
+    scrub_t *s = (scrub_t *)data;
+    if (MRB_METHOD_UNDEF_P(m) || !MRB_METHOD_PROC_P(m)) return 0;
+    if (sandbox_tool_method_p(m)) {
+        if (scrub_tool_p(s->state, mrb, mid)) return 0;
+    }
+    else {
+        struct RProc *p = MRB_METHOD_PROC(m);
+        if (MRB_PROC_CFUNC_P(p) || (p->body.irep->flags & MRB_IREP_NO_FREE)) return 0;
+    }
+    mrb_ary_push(mrb, s->doomed, mrb_symbol_value(mid));
+    return 0;
+}
 
-    mem_tracker_restore(prev);
+static void
+scrub_methods(scrub_t *s, struct RClass *c)
+{
+    mrb_state *mrb = s->state->mrb;
+    mrb_ary_clear(mrb, s->doomed);
+    mrb_mt_foreach(mrb, c, scrub_method, s);
+    for (mrb_int i = 0; i < RARRAY_LEN(s->doomed); i++) {
+        mrb_remove_method(mrb, c, mrb_symbol(mrb_ary_entry(s->doomed, i)));
+    }
 }
 
-void
-sandbox_result_free(sandbox_result_t *result)
+/* Strip c, a module of a fresh state at path, back to what it had then.
+ * Constants that weren't there take whole module trees with them. */
+static void
+scrub_module(scrub_t *s, struct RClass *c, mrb_value path)
 {
-    if (result->value) { free(result->value); result->value = NULL; }
-    if (result->output) { free(result->output); result->output = NULL; }
-    if (result->error) { free(result->error); result->error = NULL; }
+    mrb_state *mrb = s->state->mrb;
+    int ai = mrb_gc_arena_save(mrb);
+
+    scrub_methods(s, c);
+    if (c->c && c->c->tt == MRB_TT_SCLASS) scrub_methods(s, c->c);
+
+    mrb_value entries = session_entries(mrb, mrb_obj_value(c));
+    for (mrb_int i = 0; i < RARRAY_LEN(entries); i += 2) {
+        mrb_sym name = mrb_symbol(mrb_ary_entry(entries, i));
+        mrb_value v = mrb_ary_entry(entries, i + 1);
+        const char *n = mrb_sym_name(mrb, name);
+
+        if (session_const_name_p(n)) {
+            mrb_value child = session_child_path(mrb, c, path, name);
+            if (!baseline_has(child)) {
+                mrb_const_remove(mrb, mrb_obj_value(c), name);
+            } else if (session_owns_p(mrb, v, child)) {
+                scrub_module(s, mrb_class_ptr(v), child);
+            }
+        }
+        else if (n[0] == '@' && !baseline_has(baseline_var_key(mrb, path, name))) {
+            mrb_iv_remove(mrb, mrb_obj_value(c), name);
+        }
+    }
+
+    mrb_gc_arena_restore(mrb, ai);
 }
 
-/* ------------------------------------------------------------------ */
-/* Tool callback API                                                   */
-/* ------------------------------------------------------------------ */
+static mrb_value
+scrub_collect(mrb_state *mrb, void *userdata)
+{
+    scrub_t *s = (scrub_t *)userdata;
+    s->doomed = mrb_ary_new(mrb);
+    scrub_module(s, mrb->object_class, mrb_str_new_lit(mrb, "Object"));
+
+    mrb_value top = mrb_top_self(mrb);
+    struct RObject *main = mrb_obj_ptr(top);
+    if (main->c->tt == MRB_TT_SCLASS) scrub_methods(s, main->c);
+    mrb_value entries = session_entries(mrb, top);
+    for (mrb_int i = 0; i < RARRAY_LEN(entries); i += 2) {
+        mrb_iv_remove(mrb, top, mrb_symbol(mrb_ary_entry(entries, i)));
+    }
 
-void
-sandbox_state_set_callback(sandbox_state_t *state,
-                           sandbox_callback_func_t callback,
-                           void *userdata)
+    mrb_value globals = mrb_f_global_variables(mrb, mrb_nil_value());
+    for (mrb_int i = 0; i < RARRAY_LEN(globals); i++) {
+        mrb_sym name = mrb_symbol(mrb_ary_entry(globals, i));
+        if (!baseline_has(mrb_sym_str(mrb, name))) mrb_gv_remove(mrb, name);
+    }
+    return mrb_nil_value();
+}
+
+/* Forget top-level locals and _, and anything the registers still hold */
+static void
+scrub_locals(sandbox_state_t *state)
 {
-    state->callback = callback;
-    state->callback_userdata = userdata;
+    struct mrb_context *c = state->mrb->c;
+    for (mrb_value *v = c->ci->stack + 1; v < c->stend; v++) *v = mrb_nil_value();
+    state->stack_keep = state->fresh.stack_keep;
+    state->cxt->slen = state->fresh.nsyms;
 }
 
 int
-sandbox_state_define_function(sandbox_state_t *state, const char *name)
+sandbox_state_scrub(sandbox_state_t *state)
 {
-    if (state->func_count >= SANDBOX_MAX_FUNCTIONS) return -1;
-
-    state->func_names[state->func_count] = strdup(name);
-    state->func_count++;
+    output_buf_reset(&state->output);
+    if (!state->fresh.taken) return 0;  /* no snippet has run */
+    pthread_once(&baseline_once, baseline_init);
+
+    mrb_state *mrb = state->mrb;
+    int scrubbed = state->fresh.valid && baseline.len > 0 &&
+                   mrb->c == mrb->root_c && mrb->c->ci == mrb->c->cibase;
+    if (scrubbed) {
+        sandbox_drop_checkpoints(state, NULL);
+        state->heap.limit = 0;
+        state->heap.exceeded = 0;
+        sandbox_heap_t *prev = heap_enter(&state->heap);
+
+        mrb->exc = NULL;
+        scrub_t s = { state, mrb_nil_value() };
+        mrb_bool failed = FALSE;
+        mrb_protect_error(mrb, scrub_collect, &s, &failed);
+        mrb_gc_arena_restore(mrb, state->arena_idx);
+        scrub_locals(state);
+        mrb_full_gc(mrb);
+
+        uint64_t sum;
+        scrubbed = !failed && sandbox_fingerprint(state, &sum) == 0 &&
+                   sum == state->fresh.fingerprint;
+        heap_leave(prev);
+    }
 
-    /* Register in the current mruby state */
-    struct RClass *kernel = state->mrb->kernel_module;
-    mrb_define_method(state->mrb, kernel, name,
-                      sandbox_function_trampoline, MRB_ARGS_ANY());
+    if (!scrubbed) {
+        sandbox_state_reset(state);
+        return 1;
+    }
     return 0;
 }
 
+/* ------------------------------------------------------------------ */
+/* Profile table                                                       */
+/*                                                                     */
+/* extconf.rb compiles this file once per mruby build; every copy but  */
+/* the standard one gets -DSANDBOX_PROFILE=<name> and is linked with   */
+/* all its other symbols made local.                                   */
+/* ------------------------------------------------------------------ */
+
+#ifndef SANDBOX_PROFILE
+#define SANDBOX_PROFILE standard
+#endif
+
+#define PROFILE_STR_(name)    #name
+#define PROFILE_STR(name)     PROFILE_STR_(name)
+#define PROFILE_TABLE_(name)  sandbox_profile_##name
+#define PROFILE_TABLE(name)   PROFILE_TABLE_(name)
+
+const sandbox_profile_t PROFILE_TABLE(SANDBOX_PROFILE) = {
+    PROFILE_STR(SANDBOX_PROFILE),
+
+    sandbox_state_new,
+    sandbox_state_free,
+    sandbox_state_eval,
+    sandbox_state_reset,
+    sandbox_state_scrub,
+    sandbox_state_interrupt,
+    sandbox_state_memory,
+    sandbox_result_free,
+
+    sandbox_state_set_callback,
+    sandbox_state_set_dispatch,
+    sandbox_state_define_function,
+    sandbox_state_set_signature,
+    sandbox_state_set_batched,
+    sandbox_state_clear_functions,
+
+    sandbox_state_arena,
+    sandbox_arena_alloc,
+    sandbox_arena_reset,
+
+    sandbox_args_count,
+    sandbox_args_visit,
+    sandbox_builder_scalar,
+    sandbox_builder_begin_array,
+    sandbox_builder_begin_hash,
+    sandbox_builder_end,
+
+    sandbox_state_can_checkpoint,
+    sandbox_state_checkpoint,
+    sandbox_state_rollback,
+    sandbox_state_release_checkpoint,
+
+    sandbox_state_dump_session,
+    sandbox_state_load_session,
+
+    sandbox_prototype_build,
+    sandbox_prototype_take,
+
+    sandbox_script_compile,
+    sandbox_script_free,
+    sandbox_script_arity,
+    sandbox_script_size,
+    sandbox_state_run,
+
+    sandbox_cache_stats,
+    sandbox_cache_set_limit,
+    sandbox_cache_clear
+};
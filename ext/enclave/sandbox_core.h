@@ -19,15 +19,52 @@ typedef enum {
     SANDBOX_ERROR_NONE,
     SANDBOX_ERROR_RUNTIME,
     SANDBOX_ERROR_TIMEOUT,
-    SANDBOX_ERROR_MEMORY_LIMIT
+    SANDBOX_ERROR_MEMORY_LIMIT,
+    SANDBOX_ERROR_INTERRUPTED
 } sandbox_error_kind_t;
 
+/* Backend serving a state's mruby allocations */
+typedef enum {
+    SANDBOX_ALLOCATOR_SYSTEM,     /* malloc with a size header */
+    SANDBOX_ALLOCATOR_SLAB        /* size classes in aligned pages, no header */
+} sandbox_allocator_t;
+
+/* Allocator for a name ("system", "slab"), or -1 if unknown */
+int sandbox_allocator_lookup(const char *name);
+
+/* Optional gems (math, random, set, ...) can be left out of a state or
+ * loaded the first time a snippet references one of their constants or
+ * methods. A gem set is a bit mask over these indexes. */
+#define SANDBOX_GEMS_ALL    0x7fffffffu
+#define SANDBOX_GEMS_EAGER  0x80000000u   /* load the set at creation */
+
+int         sandbox_gem_count(void);
+const char *sandbox_gem_name(int index);         /* NULL if not compiled in */
+int         sandbox_gem_lookup(const char *name); /* index, or -1 if unknown */
+
+/* Counters for one eval or run, kept whether or not anyone reads them.
+ * Bytes count string contents plus 8 per number; nil, booleans and
+ * containers themselves count nothing. */
+typedef struct {
+    double   parse_seconds;     /* 0 when the bytecode came from the cache */
+    double   codegen_seconds;   /* or loading cached bytecode */
+    double   vm_seconds;        /* running bytecode, tool calls included */
+    double   tool_seconds;      /* inside tool callbacks */
+    uint64_t tool_calls;
+    uint64_t bytes_in;          /* tool results and script params into mruby */
+    uint64_t bytes_out;         /* tool arguments out of mruby */
+    size_t   memory;            /* heap bytes when it finished */
+    size_t   peak_memory;       /* most heap bytes held while it ran */
+    int      cached;            /* bytecode came from the cache */
+} sandbox_stats_t;
+
 /* Result from an eval */
 typedef struct {
     char *value;                /* inspected return value (NULL on error) */
     char *output;               /* captured puts/print/p output */
     char *error;                /* error message (NULL on success) */
     sandbox_error_kind_t error_kind;  /* classification of the error */
+    sandbox_stats_t stats;
 } sandbox_result_t;
 
 /* ------------------------------------------------------------------ */
@@ -58,39 +95,312 @@ struct sandbox_value {
     } as;
 };
 
-/* Result from a tool callback */
+/* ------------------------------------------------------------------ */
+/* Streaming conversion for tool calls                                 */
+/*                                                                     */
+/* Tool arguments and results are converted in one pass, without an    */
+/* intermediate sandbox_value_t tree.                                  */
+/* ------------------------------------------------------------------ */
+
+/* Arguments of the tool call in progress (valid during the callback) */
+typedef struct sandbox_args sandbox_args_t;
+
+/* Receives a value depth-first. Scalars come as borrowed sandbox_value_t
+ * (strings point into mruby and are not NUL-terminated). Arrays are
+ * begin_array, items, end; hashes are begin_hash, key, value, ..., end. */
 typedef struct {
-    sandbox_value_t value;  /* return value (valid when error is NULL) */
-    char           *error;  /* error message (NULL on success, caller frees) */
-} sandbox_callback_result_t;
-
-/* Callback function pointer: called from mruby side, dispatches to CRuby */
-typedef sandbox_callback_result_t (*sandbox_callback_func_t)(
-    const char         *method_name,
-    const sandbox_value_t *args,
-    int                 argc,
-    void               *userdata
+    void (*scalar)(void *ud, const sandbox_value_t *value);
+    void (*begin_array)(void *ud, size_t len);
+    void (*begin_hash)(void *ud, size_t len);
+    void (*end)(void *ud);
+} sandbox_visitor_t;
+
+int  sandbox_args_count(const sandbox_args_t *args);
+
+/* Walk argument index. Visitor callbacks may longjmp out. */
+void sandbox_args_visit(const sandbox_args_t *args, int index,
+                        const sandbox_visitor_t *visitor, void *ud);
+
+/* Builds the tool's return value in the sandbox, in the same order as a
+ * visit. Scalars (including strings) are copied. Never raises; if the
+ * callback stops midway or fails, the partial value is discarded. */
+typedef struct sandbox_builder sandbox_builder_t;
+
+void sandbox_builder_scalar(sandbox_builder_t *b, const sandbox_value_t *value);
+void sandbox_builder_begin_array(sandbox_builder_t *b, size_t len);
+void sandbox_builder_begin_hash(sandbox_builder_t *b, size_t len);
+void sandbox_builder_end(sandbox_builder_t *b);
+
+/* Callback function pointer: called from mruby side, dispatches to CRuby.
+ * Runs on the thread that called sandbox_state_eval. slot identifies the
+ * tool, as returned by sandbox_state_define_function. Reads args, builds
+ * the return value into result, and returns NULL, or an error message
+ * (malloc'd, the sandbox frees it) to raise in the sandbox. */
+typedef char *(*sandbox_callback_func_t)(
+    int                   slot,
+    const sandbox_args_t *args,
+    sandbox_builder_t    *result,
+    void                 *userdata
 );
 
 /* Free a sandbox_value_t (recursive for arrays/hashes) */
 void sandbox_value_free(sandbox_value_t *val);
 
+/* Per-state bump arena for sandbox_value_t trees that cross the
+ * boundary. Allocations are released together by sandbox_arena_reset;
+ * never pass arena-backed values to sandbox_value_free. */
+typedef struct sandbox_arena sandbox_arena_t;
+
+sandbox_arena_t *sandbox_state_arena(sandbox_state_t *state);
+void            *sandbox_arena_alloc(sandbox_arena_t *arena, size_t size);  /* NULL on OOM */
+void             sandbox_arena_reset(sandbox_arena_t *arena);
+
 /* Set the callback used to dispatch tool calls */
 void sandbox_state_set_callback(sandbox_state_t *state,
                                 sandbox_callback_func_t callback,
                                 void *userdata);
 
-/* Register a function name in the mruby sandbox (uses the trampoline) */
+/* Tool calls made inside parallel { }. submit starts a call and sets
+ * *ticket; await waits at most timeout seconds (negative: no limit) for a
+ * ticket's result and builds it into result. Both return NULL or an
+ * error message, like the callback, and run on the eval's thread. Without
+ * them, calls inside parallel { } run one by one. */
+typedef char *(*sandbox_submit_func_t)(int slot, const sandbox_args_t *args, int *ticket,
+                                       void *userdata);
+typedef char *(*sandbox_await_func_t)(int ticket, double timeout, sandbox_builder_t *result,
+                                      void *userdata);
+
+/* Uses the callback's userdata */
+void sandbox_state_set_dispatch(sandbox_state_t *state, sandbox_submit_func_t submit,
+                                sandbox_await_func_t await);
+
+/* Register a function name in the mruby sandbox (uses the trampoline).
+ * Returns the tool's slot, a small index that stays fixed until
+ * sandbox_state_clear_functions (registering a name twice returns the
+ * same one), or -1 if out of memory. There is no limit on the number. */
 int sandbox_state_define_function(sandbox_state_t *state, const char *name);
 
+/* Declare the argument types of the tool in slot, one character per
+ * argument: 'i' Integer, 'f' Float, 's' String (or Symbol), 'b' true or
+ * false, '*' any value that can cross. Calls are then checked in the
+ * sandbox and a wrong count or type raises there, without calling back.
+ * NULL removes the signature. Returns 0, or -1 for a bad slot or type. */
+int sandbox_state_set_signature(sandbox_state_t *state, int slot, const char *types);
+
+/* Mark the tool in slot as one the host batches. A batched call made as
+ * the value of a map/collect block is then submitted like a call inside
+ * parallel { }, so the host can coalesce the block's calls; map waits for
+ * them before it returns. Returns 0, or -1 for a bad slot. */
+int sandbox_state_set_batched(sandbox_state_t *state, int slot, int batched);
+
+/* Undefine every registered function and forget the names */
+void sandbox_state_clear_functions(sandbox_state_t *state);
+
 /* ------------------------------------------------------------------ */
 /* Core API                                                            */
+/*                                                                     */
+/* A state may be used by one thread at a time. Only                   */
+/* sandbox_state_interrupt is safe to call from another thread.        */
 /* ------------------------------------------------------------------ */
 
-sandbox_state_t *sandbox_state_new(double timeout, size_t memory_limit);
+sandbox_state_t *sandbox_state_new(double timeout, size_t memory_limit,
+                                   sandbox_allocator_t allocator, uint32_t gems);
 void             sandbox_state_free(sandbox_state_t *state);
 sandbox_result_t sandbox_state_eval(sandbox_state_t *state, const char *code);
 void             sandbox_state_reset(sandbox_state_t *state);
 void             sandbox_result_free(sandbox_result_t *result);
 
+/* Cheaper reset: strip what snippets added (globals, main's ivars,
+ * constants, classes, methods, locals, checkpoints) from the live state
+ * and collect garbage. If the result doesn't match the state as set up,
+ * e.g. a builtin was redefined, falls back to sandbox_state_reset and
+ * returns 1; returns 0 when scrubbed. */
+int              sandbox_state_scrub(sandbox_state_t *state);
+
+/* Stop a running eval at its next instruction (SANDBOX_ERROR_INTERRUPTED).
+ * No-op when the state is idle. */
+void             sandbox_state_interrupt(sandbox_state_t *state);
+
+/* Bytes of mruby heap the state holds (what memory_limit is checked
+ * against). A plain read, so an approximation while an eval runs. */
+size_t           sandbox_state_memory(const sandbox_state_t *state);
+
+/* ------------------------------------------------------------------ */
+/* Checkpoints                                                         */
+/*                                                                     */
+/* A checkpoint write-protects the mruby heap and saves each page as   */
+/* it is first written; rolling back copies those pages back in place. */
+/* Needs an allocator that supports it (slab).                         */
+/* ------------------------------------------------------------------ */
+
+int      sandbox_state_can_checkpoint(const sandbox_state_t *state);
+
+/* Returns a checkpoint id, or 0 if unsupported or out of memory */
+uint64_t sandbox_state_checkpoint(sandbox_state_t *state);
+
+/* Restore the state as of checkpoint id. Checkpoints taken after it are
+ * released; id itself stays valid. Returns -1 if id is not live. */
+int      sandbox_state_rollback(sandbox_state_t *state, uint64_t id);
+
+/* Release a checkpoint (no-op if id is not live). reset releases all. */
+void     sandbox_state_release_checkpoint(sandbox_state_t *state, uint64_t id);
+
+/* ------------------------------------------------------------------ */
+/* Sessions                                                            */
+/*                                                                     */
+/* A session is what snippets have built up in a state: classes,       */
+/* modules and methods they defined, constants, instance and class     */
+/* variables, and top-level locals including _. Tool functions are not */
+/* part of it.                                                         */
+/* ------------------------------------------------------------------ */
+
+/* Serialize the session to a versioned blob (malloc'd, *len bytes). On
+ * failure, e.g. a local holding a Proc, returns NULL and sets *error
+ * (caller frees). */
+char *sandbox_state_dump_session(sandbox_state_t *state, size_t *len, char **error);
+
+/* Restore a blob into a fresh state, under its limits. On failure returns
+ * -1 and sets *error (caller frees); the state is then partly loaded. */
+int   sandbox_state_load_session(sandbox_state_t *state, const char *blob, size_t len,
+                                 char **error);
+
+/* ------------------------------------------------------------------ */
+/* Prototype state                                                     */
+/*                                                                     */
+/* A fully set-up state (tool functions registered, prelude run) built */
+/* before fork, so children start from copy-on-write memory.           */
+/* ------------------------------------------------------------------ */
+
+/* Build the prototype, replacing any previous one. On failure returns -1
+ * and sets *error (caller frees). */
+int              sandbox_prototype_build(sandbox_allocator_t allocator, uint32_t gems,
+                                         const char *const *functions, int nfunctions,
+                                         const char *prelude, char **error);
+
+/* Hand the prototype over as a new state with these limits, or NULL if
+ * there is none (it can be taken once per process). */
+sandbox_state_t *sandbox_prototype_take(double timeout, size_t memory_limit);
+
+/* ------------------------------------------------------------------ */
+/* Compiled scripts                                                    */
+/*                                                                     */
+/* A script is bytecode for a lambda taking params, compiled once and  */
+/* runnable on any state. It is immutable, so threads may share it.    */
+/* ------------------------------------------------------------------ */
+
+typedef struct sandbox_script sandbox_script_t;
+
+/* Compile code as the body of ->(params) do ... end. On failure returns NULL
+ * and sets *error (caller frees). Uses state only as a scratch compiler. */
+sandbox_script_t *sandbox_script_compile(sandbox_state_t *state, const char *code,
+                                         const char *const *params, int nparams,
+                                         char **error);
+void             sandbox_script_free(sandbox_script_t *script);
+int              sandbox_script_arity(const sandbox_script_t *script);
+size_t           sandbox_script_size(const sandbox_script_t *script);
+
+/* Run a script with argc == arity bound values. Like eval, the result
+ * value is stored in _; top-level locals are not visible to the script. */
+sandbox_result_t sandbox_state_run(sandbox_state_t *state,
+                                   const sandbox_script_t *script,
+                                   const sandbox_value_t *args, int argc);
+
+/* ------------------------------------------------------------------ */
+/* Bytecode cache                                                      */
+/*                                                                     */
+/* sandbox_state_eval reuses bytecode across all states in the process */
+/* for identical source compiled against the same top-level locals.    */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t   entries;
+    size_t   bytes;
+    size_t   limit;     /* max cached bytes, 0 = disabled */
+} sandbox_cache_stats_t;
+
+void sandbox_cache_stats(sandbox_cache_stats_t *stats);
+void sandbox_cache_set_limit(size_t bytes);
+void sandbox_cache_clear(void);  /* drop entries and zero the counters */
+
+/* ------------------------------------------------------------------ */
+/* Profiles                                                            */
+/*                                                                     */
+/* The extension can link several copies of this file, each compiled   */
+/* against its own libmruby build (e.g. a memory-lean one). A copy     */
+/* exports only its profile table; states, args, builders, arenas and  */
+/* scripts must go back through the table of the copy that made them.  */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    const char *name;
+
+    sandbox_state_t *(*state_new)(double timeout, size_t memory_limit,
+                                  sandbox_allocator_t allocator, uint32_t gems);
+    void             (*state_free)(sandbox_state_t *state);
+    sandbox_result_t (*state_eval)(sandbox_state_t *state, const char *code);
+    void             (*state_reset)(sandbox_state_t *state);
+    int              (*state_scrub)(sandbox_state_t *state);
+    void             (*state_interrupt)(sandbox_state_t *state);
+    size_t           (*state_memory)(const sandbox_state_t *state);
+    void             (*result_free)(sandbox_result_t *result);
+
+    void (*state_set_callback)(sandbox_state_t *state, sandbox_callback_func_t callback,
+                               void *userdata);
+    void (*state_set_dispatch)(sandbox_state_t *state, sandbox_submit_func_t submit,
+                               sandbox_await_func_t await);
+    int  (*state_define_function)(sandbox_state_t *state, const char *name);
+    int  (*state_set_signature)(sandbox_state_t *state, int slot, const char *types);
+    int  (*state_set_batched)(sandbox_state_t *state, int slot, int batched);
+    void (*state_clear_functions)(sandbox_state_t *state);
+
+    sandbox_arena_t *(*state_arena)(sandbox_state_t *state);
+    void            *(*arena_alloc)(sandbox_arena_t *arena, size_t size);
+    void             (*arena_reset)(sandbox_arena_t *arena);
+
+    int  (*args_count)(const sandbox_args_t *args);
+    void (*args_visit)(const sandbox_args_t *args, int index,
+                       const sandbox_visitor_t *visitor, void *ud);
+    void (*builder_scalar)(sandbox_builder_t *b, const sandbox_value_t *value);
+    void (*builder_begin_array)(sandbox_builder_t *b, size_t len);
+    void (*builder_begin_hash)(sandbox_builder_t *b, size_t len);
+    void (*builder_end)(sandbox_builder_t *b);
+
+    int      (*state_can_checkpoint)(const sandbox_state_t *state);
+    uint64_t (*state_checkpoint)(sandbox_state_t *state);
+    int      (*state_rollback)(sandbox_state_t *state, uint64_t id);
+    void     (*state_release_checkpoint)(sandbox_state_t *state, uint64_t id);
+
+    char *(*state_dump_session)(sandbox_state_t *state, size_t *len, char **error);
+    int   (*state_load_session)(sandbox_state_t *state, const char *blob, size_t len,
+                                char **error);
+
+    int              (*prototype_build)(sandbox_allocator_t allocator, uint32_t gems,
+                                        const char *const *functions, int nfunctions,
+                                        const char *prelude, char **error);
+    sandbox_state_t *(*prototype_take)(double timeout, size_t memory_limit);
+
+    sandbox_script_t *(*script_compile)(sandbox_state_t *state, const char *code,
+                                        const char *const *params, int nparams,
+                                        char **error);
+    void              (*script_free)(sandbox_script_t *script);
+    int               (*script_arity)(const sandbox_script_t *script);
+    size_t            (*script_size)(const sandbox_script_t *script);
+    sandbox_result_t  (*state_run)(sandbox_state_t *state, const sandbox_script_t *script,
+                                   const sandbox_value_t *args, int argc);
+
+    void (*cache_stats)(sandbox_cache_stats_t *stats);
+    void (*cache_set_limit)(size_t bytes);
+    void (*cache_clear)(void);
+} sandbox_profile_t;
+
+/* The default build. sandbox_profile_lean (smaller heap pages, GC
+ * arena and method cache) exists when SANDBOX_HAVE_LEAN. */
+extern const sandbox_profile_t sandbox_profile_standard;
+#ifdef SANDBOX_HAVE_LEAN
+extern const sandbox_profile_t sandbox_profile_lean;
+#endif
+
 #endif /* SANDBOX_CORE_H */
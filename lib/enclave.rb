@@ -1,30 +1,87 @@
 require_relative "enclave/version"
 require_relative "enclave/result"
 require_relative "enclave/tool"
+require_relative "enclave/script"
+require_relative "enclave/toolset"
+require_relative "enclave/dispatcher"
+require_relative "enclave/checkpoint"
 begin
   require_relative "enclave/enclave"
 rescue LoadError
   raise LoadError,
     "Enclave native extension not found. Run `rake compile` first (from a git clone, run `rake setup`)."
 end
+# Subclasses Enclave::Error, which the extension defines
+require_relative "enclave/pool"
 
 class Enclave
   class << self
-    attr_accessor :timeout, :memory_limit
+    attr_accessor :timeout, :memory_limit, :allocator, :gems, :profile
+    attr_writer :dispatcher
+
+    # Runs tool calls made inside parallel { } (see Enclave::Dispatcher)
+    def dispatcher
+      @dispatcher_lock.synchronize { @dispatcher ||= Dispatcher.new }
+    end
   end
 
-  attr_reader :timeout, :memory_limit
+  @dispatcher_lock = Mutex.new
+
+  self.allocator = :system
+  self.gems = :lazy
+  self.profile = :standard
 
-  def initialize(tools: nil, timeout: self.class.timeout, memory_limit: self.class.memory_limit)
+  attr_reader :timeout, :memory_limit, :allocator, :gems, :profile
+
+  # tools_class: names the class (or module) of tools that will be
+  # exposed later, as Enclave::Pool does, so the enclave can still adopt
+  # the prototype from preload!.
+  def initialize(tools: nil, timeout: self.class.timeout, memory_limit: self.class.memory_limit,
+                 allocator: self.class.allocator, gems: self.class.gems, profile: self.class.profile,
+                 tools_class: nil)
     @tool_context = Object.new
     @timeout = timeout
     @memory_limit = memory_limit
-    _init(@timeout, @memory_limit)
+    @allocator = allocator
+    @gems = gems
+    @profile = profile
+    _init(@timeout, @memory_limit, @allocator, @gems, @profile,
+          self.class.send(:adopt_prototype?, tools || tools_class, allocator, gems, profile))
     expose(tools) if tools
   end
 
-  def self.open(tools: nil, timeout: self.timeout, memory_limit: self.memory_limit)
-    sandbox = new(tools: tools, timeout: timeout, memory_limit: memory_limit)
+  # Build a fully set-up mruby state (tool functions registered, prelude
+  # run) to be inherited by forked workers, e.g. from Puma's preload_app!.
+  # The first enclave each worker creates with tools of that class (or
+  # that module), and the same allocator, gems and profile, starts from
+  # it instead of booting a new VM.
+  def self.preload!(tools_class: nil, prelude: nil, allocator: self.allocator, gems: self.gems,
+                    profile: self.profile)
+    toolset = tools_class && Toolset.for(tools_class)
+    _preload(toolset ? toolset.names.map(&:to_s) : [], prelude, allocator, gems, profile)
+    @preloaded = { toolset: toolset, allocator: allocator, gems: gems, profile: profile,
+                   pid: Process.pid }.freeze
+    nil
+  end
+
+  # Only forked children adopt the prototype; the preloading process keeps
+  # it for the next fork. Tools match when they have the same functions:
+  # a module or class and its instances, or two instances of one class.
+  def self.adopt_prototype?(tools, allocator, gems, profile)
+    preloaded = @preloaded
+    return false unless preloaded && preloaded[:pid] != Process.pid &&
+                        preloaded[:allocator] == allocator && preloaded[:gems] == gems &&
+                        preloaded[:profile] == profile
+
+    toolset = preloaded[:toolset]
+    tools ? !!toolset && Toolset.for(tools).names == toolset.names : toolset.nil?
+  end
+  private_class_method :adopt_prototype?
+
+  def self.open(tools: nil, timeout: self.timeout, memory_limit: self.memory_limit,
+                allocator: self.allocator, gems: self.gems, profile: self.profile)
+    sandbox = new(tools: tools, timeout: timeout, memory_limit: memory_limit, allocator: allocator,
+                  gems: gems, profile: profile)
     begin
       yield sandbox
     ensure
@@ -32,9 +89,67 @@ class Enclave
     end
   end
 
-  def eval(code)
-    value, output, error = _eval(code)
-    Result.new(value: value, output: output, error: error)
+  # Rebuild an enclave from a String made by #dump_session, possibly in
+  # another process. Tools aren't part of the blob: pass them again, along
+  # with any limits, as for Enclave.new.
+  def self.load_session(blob, tools: nil, timeout: self.timeout, memory_limit: self.memory_limit,
+                        allocator: self.allocator, gems: self.gems, profile: self.profile)
+    sandbox = new(tools: tools, timeout: timeout, memory_limit: memory_limit, allocator: allocator,
+                  gems: gems, profile: profile)
+    begin
+      sandbox._load_session(blob)
+    rescue Exception
+      sandbox.close
+      raise
+    end
+    sandbox
+  end
+
+  # With atomic: true, a snippet that errors (or hits a limit) leaves no
+  # trace: the enclave is rolled back to where it was before the eval.
+  def eval(code, atomic: false)
+    return atomically { eval(code) } if atomic
+
+    value, output, error, stats = _eval(code)
+    Result.new(value: value, output: output, error: error, stats: stats)
+  end
+
+  def checkpoint
+    Checkpoint.new(self, _checkpoint)
+  end
+
+  def rollback(checkpoint)
+    raise ArgumentError, "checkpoint belongs to another enclave" unless checkpoint.enclave.equal?(self)
+    raise ArgumentError, "checkpoint is no longer valid" unless _rollback(checkpoint.id)
+    self
+  end
+
+  def discard(checkpoint)
+    _drop_checkpoint(checkpoint.id) if checkpoint.enclave.equal?(self)
+    nil
+  end
+
+  PARAM_NAME = /\A[a-z_][a-zA-Z0-9_]*\z/
+
+  def prepare(code, params: [])
+    params = params.map(&:to_sym)
+    invalid = params.reject { |name| name.match?(PARAM_NAME) }
+    raise ArgumentError, "invalid param names: #{invalid.join(", ")}" unless invalid.empty?
+    raise ArgumentError, "duplicate param names" unless params.uniq.size == params.size
+
+    script = _prepare(code, params.map(&:to_s))
+    script.instance_variable_set(:@params, params.freeze)
+    script.freeze
+  end
+
+  def run(script, **values)
+    missing = script.params - values.keys
+    unknown = values.keys - script.params
+    raise ArgumentError, "missing params: #{missing.join(", ")}" unless missing.empty?
+    raise ArgumentError, "unknown params: #{unknown.join(", ")}" unless unknown.empty?
+
+    value, output, error, stats = _run(script, script.params.map { |name| values[name] })
+    Result.new(value: value, output: output, error: error, stats: stats)
   end
 
   def repl
@@ -67,20 +182,36 @@ class Enclave
     puts "\n" if line.nil? # clean newline on Ctrl-D
   end
 
-  def expose(obj)
-    case obj
-    when Module
+  def expose(obj, signatures: {}, batch: {})
+    toolset = Toolset.for(obj, signatures, batch)
+    if obj.is_a?(Module)
       @tool_context.extend(obj)
-      obj.instance_methods(false).each do |name|
-        _define_function(name.to_s)
-      end
+      _bind_toolset(toolset, @tool_context)
     else
-      obj.public_methods(false).each do |name|
-        target = obj
-        @tool_context.define_singleton_method(name) { |*args| target.public_send(name, *args) }
-        _define_function(name.to_s)
-      end
+      _bind_toolset(toolset, obj)
     end
     self
   end
+
+  private
+
+  def atomically
+    checkpoint = self.checkpoint
+    begin
+      result = yield
+      rollback(checkpoint) if result.error?
+      result
+    rescue Exception
+      rollback(checkpoint) unless closed?
+      raise
+    ensure
+      discard(checkpoint) unless closed?
+    end
+  end
+
+  def detach_tools
+    _clear_functions
+    @tool_context = Object.new
+    self
+  end
 end
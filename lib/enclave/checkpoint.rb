@@ -0,0 +1,27 @@
+class Enclave
+  # A snapshot of an enclave's mruby state, taken by Enclave#checkpoint.
+  # Rolling back restores locals, ivars, methods and classes exactly as
+  # they were. Needs allocator: :slab.
+  #
+  #   checkpoint = enclave.checkpoint
+  #   enclave.eval(risky_code)
+  #   enclave.rollback(checkpoint)   # as if risky_code never ran
+  #   enclave.discard(checkpoint)
+  #
+  # Each checkpoint holds a copy of every page written after it until it
+  # is discarded, the enclave is reset!, closed or has its tools
+  # detached, or an older checkpoint is rolled back to.
+  class Checkpoint
+    attr_reader :enclave, :id
+
+    def initialize(enclave, id)
+      @enclave = enclave
+      @id = id
+      freeze
+    end
+
+    def inspect
+      "#<#{self.class} id=#{@id}>"
+    end
+  end
+end
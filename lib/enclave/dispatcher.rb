@@ -0,0 +1,171 @@
+class Enclave
+  # Runs the tool calls made inside parallel { } on a fixed set of host
+  # threads, so independent calls (typically database queries) overlap
+  # instead of adding up. One dispatcher serves every enclave in the
+  # process; replace it to change the number of threads:
+  #
+  #   Enclave.dispatcher = Enclave::Dispatcher.new(size: 16)
+  #
+  # Threads are started on first use, and again in a forked child.
+  class Dispatcher
+    # One submitted tool call
+    class Job
+      def initialize(receiver, name, args)
+        @receiver = receiver
+        @name = name
+        @args = args
+        @done = false
+        @lock = Mutex.new
+        @finished = ConditionVariable.new
+      end
+
+      def run
+        finish(@receiver.__send__(@name, *@args), nil)
+      rescue Exception => e
+        finish(nil, e)
+      end
+
+      # Wait up to timeout seconds (nil: no limit). Returns whether the
+      # call has finished.
+      def wait(timeout = nil)
+        deadline = timeout && Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+        @lock.synchronize do
+          until @done
+            remaining = deadline && deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+            break if remaining && remaining <= 0
+            @finished.wait(@lock, remaining)
+          end
+          @done
+        end
+      end
+
+      # The tool's return value; re-raises what the tool raised
+      def value
+        wait
+        raise @error if @error
+        @value
+      end
+
+      private
+
+      def finish(value, error)
+        @lock.synchronize do
+          @value = value
+          @error = error
+          @done = true
+          @finished.broadcast
+        end
+      end
+    end
+
+    # Calls to a tool that has a batch method (expose(batch:)), collected
+    # until one of them is waited on and then made as one call to the
+    # batch method. It gets an Array with an entry per call (the argument
+    # for one-argument tools, otherwise the argument list) and returns an
+    # Array of results in the same order.
+    class Batch
+      # One call in a batch; waits like a Job
+      class Entry
+        def initialize(batch, index)
+          @batch = batch
+          @index = index
+        end
+
+        def wait(timeout = nil)
+          @batch.wait(timeout)
+        end
+
+        def value
+          @batch.value(@index)
+        end
+      end
+
+      def initialize(dispatcher, receiver, name, single)
+        @dispatcher = dispatcher
+        @receiver = receiver
+        @name = name
+        @single = single
+        @calls = []
+      end
+
+      def add(args)
+        raise Enclave::Error, "batch for #{@name} was already dispatched" if @job
+
+        @calls << (@single ? args.first : args)
+        Entry.new(self, @calls.size - 1)
+      end
+
+      def dispatch!
+        @job ||= @dispatcher.submit(@receiver, @name, [@calls])
+      end
+
+      def wait(timeout)
+        dispatch!.wait(timeout)
+      end
+
+      def value(index)
+        results = dispatch!.value
+        unless results.is_a?(Array) && results.size == @calls.size
+          raise TypeError, "#{@name} must return an Array of #{@calls.size} results"
+        end
+
+        results[index]
+      end
+    end
+
+    attr_reader :size
+
+    def initialize(size: 8)
+      raise ArgumentError, "size must be positive" unless size.positive?
+
+      @size = size
+      @lock = Mutex.new
+      @threads = []
+      @queue = Queue.new
+      @pid = Process.pid
+    end
+
+    def submit(receiver, name, args)
+      job = Job.new(receiver, name, args)
+      queue = start
+      queue << job
+      job
+    end
+
+    def batch(receiver, name, single)
+      Batch.new(self, receiver, name, single)
+    end
+
+    def shutdown
+      threads = @lock.synchronize do
+        @threads.each { @queue << nil }
+        @threads.dup.tap { @threads.clear }
+      end
+      threads.each(&:join)
+      nil
+    end
+
+    private
+
+    # Start the workers if they aren't running; returns their queue
+    def start
+      @lock.synchronize do
+        if @pid != Process.pid
+          @threads.clear
+          @queue = Queue.new
+          @pid = Process.pid
+        end
+        queue = @queue
+        while @threads.size < @size
+          @threads << Thread.new do
+            Thread.current.name = "enclave-dispatcher"
+            while (job = queue.pop)
+              job.run
+            end
+          end
+        end
+        queue
+      end
+    end
+  end
+end
@@ -0,0 +1,172 @@
+class Enclave
+  # A fixed-size set of warm enclaves for per-request checkout.
+  #
+  #   POOL = Enclave::Pool.new(size: 5, timeout: 5, memory_limit: 10_000_000)
+  #
+  #   POOL.with(tools: CustomerServiceTools.new(user)) do |enclave|
+  #     enclave.eval(code)
+  #   end
+  #
+  # Checked-in enclaves have their tools detached and their mruby state
+  # wiped before anyone else can check them out. With prewarm: true (the
+  # default) the initial fill and the wipe both happen on a background
+  # thread, so checkout only pays for binding the tools. Pass the tools'
+  # class as tools_class: to start from the prototype built by
+  # Enclave.preload! in a forked worker.
+  class Pool
+    class TimeoutError < Enclave::Error; end
+
+    attr_reader :size, :checkout_timeout
+
+    def initialize(size: 5, checkout_timeout: 5, prewarm: true,
+                   timeout: Enclave.timeout, memory_limit: Enclave.memory_limit,
+                   allocator: Enclave.allocator, gems: Enclave.gems, profile: Enclave.profile,
+                   tools_class: nil)
+      @size = size
+      @checkout_timeout = checkout_timeout
+      @enclave_options = { timeout: timeout, memory_limit: memory_limit, allocator: allocator,
+                           gems: gems, profile: profile, tools_class: tools_class }
+      @available = []
+      @created = 0
+      @shutdown = false
+      @mutex = Mutex.new
+      @ready = ConditionVariable.new
+      @dirty = Queue.new if prewarm
+      @warmer = Thread.new { warm } if prewarm
+    end
+
+    def checkout(tools: nil, timeout: @checkout_timeout)
+      enclave = acquire(timeout)
+      begin
+        enclave.expose(tools) if tools
+      rescue Exception
+        checkin(enclave)
+        raise
+      end
+      enclave
+    end
+
+    def checkin(enclave)
+      if @shutdown
+        enclave.close
+      elsif enclave.closed?
+        release
+      elsif @dirty
+        @dirty << enclave
+      else
+        recycle(enclave) and make_available(enclave)
+      end
+      nil
+    end
+
+    def with(tools: nil, timeout: @checkout_timeout)
+      enclave = checkout(tools: tools, timeout: timeout)
+      begin
+        yield enclave
+      ensure
+        checkin(enclave)
+      end
+    end
+
+    def available
+      @mutex.synchronize { @available.length }
+    end
+
+    def shutdown
+      @mutex.synchronize do
+        @shutdown = true
+        @available.each(&:close)
+        @available.clear
+        @ready.broadcast
+      end
+      if @warmer
+        @dirty << nil
+        @warmer.join
+      end
+      nil
+    end
+
+    private
+
+    def acquire(timeout)
+      deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout if timeout
+
+      @mutex.synchronize do
+        loop do
+          raise Enclave::Error, "pool is shut down" if @shutdown
+          return @available.pop unless @available.empty?
+
+          if @created < @size
+            @created += 1
+            break
+          end
+
+          remaining = deadline && deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+          if remaining && remaining <= 0
+            raise TimeoutError, "no enclave available after #{timeout} seconds (pool size #{@size})"
+          end
+          @ready.wait(@mutex, remaining)
+        end
+      end
+
+      build
+    end
+
+    def build
+      Enclave.new(**@enclave_options)
+    rescue Exception
+      release
+      raise
+    end
+
+    # Detach the previous caller's tools and wipe its mruby state.
+    # Returns false (and gives up the slot) if the enclave can't be reused.
+    def recycle(enclave)
+      enclave.send(:detach_tools)
+      enclave.scrub!
+      true
+    rescue StandardError
+      enclave.close
+      release
+      false
+    end
+
+    def make_available(enclave)
+      @mutex.synchronize do
+        if @shutdown
+          enclave.close
+        else
+          @available.push(enclave)
+          @ready.signal
+        end
+      end
+    end
+
+    def release
+      @mutex.synchronize do
+        @created -= 1
+        @ready.signal
+      end
+    end
+
+    def warm
+      fill
+      while (enclave = @dirty.pop)
+        recycle(enclave) and make_available(enclave)
+      end
+    end
+
+    def fill
+      loop do
+        reserved = @mutex.synchronize do
+          next false if @shutdown || @created >= @size
+          @created += 1
+        end
+        break unless reserved
+        make_available(build)
+      end
+    rescue StandardError
+      # A failed prewarm leaves the slot free; checkout builds on demand.
+    end
+  end
+end
@@ -2,10 +2,22 @@ class Enclave
   class Result
     attr_reader :value, :output, :error
 
-    def initialize(value:, output:, error:)
+    # Counters for the eval or run that produced this result. Times are in
+    # seconds; vm_time includes tool_time. bytes_in is what tools and
+    # script params sent into the sandbox; bytes_out is the tool arguments
+    # sent out (string contents plus 8 per number). memory and peak_memory
+    # are mruby heap bytes. cached is true when the bytecode came from the
+    # bytecode cache, in which case parse_time is 0 and codegen_time is the
+    # time taken to load it. Instructions executed and GC runs or pause
+    # time are not counted: mruby 3.3 has no GC counters, and counting
+    # instructions needs a hook on every one of them.
+    attr_reader :stats
+
+    def initialize(value:, output:, error:, stats: nil)
       @value = value
       @output = output
       @error = error
+      @stats = stats
     end
 
     def error?
@@ -0,0 +1,18 @@
+class Enclave
+  # Bytecode compiled once by Enclave#prepare. Run it on any enclave of the
+  # same profile with Enclave#run; bound values cross the boundary as data, the same way
+  # tool arguments do, so nothing is interpolated into source.
+  #
+  #   script = enclave.prepare(<<~RUBY, params: [:from, :to])
+  #     orders(from, to).sum { |o| o["total"] }
+  #   RUBY
+  #
+  #   enclave.run(script, from: "2024-01-01", to: "2024-01-31")
+  class Script
+    attr_reader :source, :params
+
+    def inspect
+      "#<#{self.class} params=#{@params.inspect}>"
+    end
+  end
+end
@@ -0,0 +1,120 @@
+class Enclave
+  # The tool functions of a tool class or module: names, arities,
+  # signatures and batch methods, worked out once and shared by every
+  # enclave that exposes it. Enclave#expose looks toolsets up here, so
+  # exposing another instance of the same class only binds the new
+  # receiver.
+  #
+  #   Enclave::Toolset.for(CustomerServiceTools)
+  #   #=> #<Enclave::Toolset CustomerServiceTools (12 functions)>
+  #
+  # The method set is captured the first time a class is exposed; methods
+  # added to it afterwards are not picked up.
+  class Toolset
+    # Argument types for signatures, as the codes the sandbox checks
+    TYPES = { integer: "i", float: "f", string: "s", boolean: "b", any: "*" }.freeze
+
+    # Keyed by class or module, then by signatures and batch methods.
+    # Without WeakKeyMap (Ruby < 3.3) only named ones are cached, so
+    # anonymous classes made per request don't pile up.
+    @cache = defined?(ObjectSpace::WeakKeyMap) ? ObjectSpace::WeakKeyMap.new : {}
+    @lock = Mutex.new
+
+    class << self
+      # The toolset for obj: a module of tool methods, or an instance of a
+      # tool class (instances with singleton methods get their own). A
+      # class stands for its instances, as in Enclave.preload!.
+      def for(obj, signatures = {}, batch = {})
+        if obj.is_a?(Class)
+          instances_of(obj, signatures, batch)
+        elsif obj.is_a?(Module)
+          cached(obj, signatures, batch) do
+            new(obj, obj.instance_methods(false), signatures, batch, &obj.method(:instance_method))
+          end
+        elsif obj.singleton_methods.empty?
+          instances_of(obj.class, signatures, batch)
+        else
+          new(obj.class, obj.public_methods(false), signatures, batch, &obj.method(:method))
+        end
+      end
+
+      private
+
+      def instances_of(klass, signatures, batch)
+        cached(klass, signatures, batch) do
+          new(klass, klass.public_instance_methods(false), signatures, batch, &klass.method(:instance_method))
+        end
+      end
+
+      def cached(key, signatures, batch)
+        return yield unless defined?(ObjectSpace::WeakKeyMap) || key.name
+
+        options = [signatures, batch]
+        @lock.synchronize do
+          by_options = (@cache[key] ||= {})
+          by_options.fetch(options) { by_options[options.map { |o| o.dup.freeze }.freeze] = yield }
+        end
+      end
+    end
+
+    attr_reader :names
+
+    # Yields each name for its Method or UnboundMethod, to read the arity
+    def initialize(source, names, signatures = {}, batch = {})
+      @label = source.name || source.inspect
+      @names = names.map(&:to_sym).freeze
+      @arities = @names.map { |name| yield(name).arity }.freeze
+      @types = types_for(signatures).freeze
+      @batches = batches_for(batch).freeze
+      freeze
+    end
+
+    def size
+      @names.size
+    end
+
+    def include?(name)
+      @names.include?(name.to_sym)
+    end
+
+    def inspect
+      "#<#{self.class} #{@label} (#{size} functions)>"
+    end
+
+    private
+
+    # Signature codes by position in @names, nil for untyped tools
+    def types_for(signatures)
+      types = Array.new(@names.size)
+      signatures.each do |name, declared|
+        index = @names.index(name.to_sym)
+        raise ArgumentError, "signature for unknown tool: #{name}" unless index
+
+        codes = Array(declared).map do |type|
+          TYPES.fetch(type) { raise ArgumentError, "unknown signature type: #{type.inspect}" }
+        end
+        arity = @arities[index]
+        if arity >= 0 && codes.size != arity
+          raise ArgumentError, "signature for #{name} has #{codes.size} types, but the method takes #{arity} arguments"
+        end
+        types[index] = codes.join.freeze
+      end
+      types
+    end
+
+    # Batch method names by position in @names, nil for tools without one
+    def batches_for(batch)
+      batches = Array.new(@names.size)
+      batch.each do |name, method|
+        index = @names.index(name.to_sym)
+        raise ArgumentError, "batch method for unknown tool: #{name}" unless index
+        unless @names.include?(method.to_sym)
+          raise ArgumentError, "batch method #{method} for #{name} is not one of the tool methods"
+        end
+
+        batches[index] = method.to_sym
+      end
+      batches
+    end
+  end
+end
@@ -326,6 +326,55 @@ RSpec.describe Enclave do
     end
   end
 
+  describe "#scrub!" do
+    it "clears what snippets added without reopening the VM" do
+      enclave.eval(<<~RUBY)
+        class Widget; LIMIT = 3; def size; 1; end; end
+        module Helpers; def self.go; 1; end; end
+        def helper; 1; end
+        $seen = 1
+        @note = "secret"
+        x = Widget.new
+      RUBY
+      expect(enclave.scrub!).to be true
+
+      expect(enclave.eval("_").value).to eq("nil")
+      %w[Widget Helpers helper $seen x].each do |expr|
+        expect(enclave.eval("defined?(#{expr})").value).to eq("nil")
+      end
+      expect(enclave.eval("@note").value).to eq("nil")
+      expect(enclave.eval("[1, 2].sum").value).to eq("3")
+    end
+
+    it "removes methods added to builtin classes" do
+      enclave.eval('class String; def shout; upcase + "!"; end; end')
+      expect(enclave.scrub!).to be true
+      expect(enclave.eval('"a".shout').error?).to be true
+      expect(enclave.eval('"a".upcase').value).to eq('"A"')
+    end
+
+    it "falls back to a full reset when a builtin was redefined" do
+      enclave.eval("class Integer; def +(other); 42; end; end")
+      expect(enclave.scrub!).to be false
+      expect(enclave.eval("1 + 1").value).to eq("2")
+    end
+
+    it "falls back to a full reset when a builtin value was changed in place" do
+      enclave.eval('RUBY_ENGINE << "!"')
+      expect(enclave.scrub!).to be false
+      expect(enclave.eval("RUBY_ENGINE").value).to eq('"mruby"')
+    end
+
+    it "keeps the tools" do
+      e = Enclave.new(tools: TestTools)
+      e.eval("y = double(2)")
+      e.scrub!
+      expect(e.eval("double(5)").value).to eq("10")
+      expect(e.eval("defined?(y)").value).to eq("nil")
+      e.close
+    end
+  end
+
   describe "#close" do
     it "marks enclave as closed" do
       enclave.close
@@ -386,6 +435,35 @@ RSpec.describe Enclave do
       result = enclave.eval('puts "hi"; 42')
       expect(result.to_s).to eq("hi\n=> 42")
     end
+
+    it "has per-eval stats" do
+      e = described_class.new(tools: TestTools)
+      stats = e.eval('greet("Ann") + greet("Bo")').stats
+      expect(stats[:tool_calls]).to eq(2)
+      expect(stats[:bytes_out]).to eq(5)
+      expect(stats[:bytes_in]).to eq("Hello, Ann!".size + "Hello, Bo!".size)
+      expect(stats[:vm_time]).to be >= stats[:tool_time]
+      expect(stats[:tool_time]).to be > 0
+      expect(stats[:peak_memory]).to be >= stats[:memory]
+      expect(stats[:cached]).to be false
+
+      stats = e.eval('a = Array.new(10_000) { |i| i.to_s }; nil').stats
+      expect(stats[:peak_memory]).to be > 100_000
+      expect(stats[:tool_calls]).to eq(0)
+      e.close
+    end
+
+    it "marks evals served from the bytecode cache" do
+      code = "[#{rand(1 << 30)}].sum"
+      first = described_class.new
+      second = described_class.new
+      expect(first.eval(code).stats[:cached]).to be false
+      stats = second.eval(code).stats
+      expect(stats[:cached]).to be true
+      expect(stats[:parse_time]).to eq(0)
+      first.close
+      second.close
+    end
   end
 
   describe "Tool" do
@@ -443,6 +521,18 @@ RSpec.describe Enclave do
       def bad_return
         Object.new
       end
+
+      def nested_bad_return
+        { "rows" => [1, 2, { "when" => Time.now }] }
+      end
+
+      def rows(n)
+        Array.new(n) { |i| { "id" => i, "name" => "row #{i}", "tags" => [:a, :b] } }
+      end
+
+      def count_rows(rows)
+        rows.sum { |r| r["id"] }
+      end
     end
 
     module MoreTools
@@ -512,6 +602,17 @@ RSpec.describe Enclave do
       expect(result.error).to include("something went wrong")
     end
 
+    it "reports a wrong argument count without calling the tool" do
+      result = enclave_with_tools.eval("double(1, 2)")
+      expect(result.error?).to be true
+      expect(result.error).to include("wrong number of arguments (given 2, expected 1)")
+    end
+
+    it "dispatches aliased tools" do
+      result = enclave_with_tools.eval("alias twice double; twice(4)")
+      expect(result.value).to eq("8")
+    end
+
     it "rejects unsupported return types with a TypeError" do
       result = enclave_with_tools.eval("bad_return()")
       expect(result.error?).to be true
@@ -519,6 +620,26 @@ RSpec.describe Enclave do
       expect(result.error).to include("Object")
     end
 
+    it "rejects unsupported types nested inside a return value" do
+      result = enclave_with_tools.eval("nested_bad_return()")
+      expect(result.error).to include("unsupported type")
+      expect(result.error).to include("Time")
+    end
+
+    it "rejects unsupported argument types before calling the tool" do
+      result = enclave_with_tools.eval("double(1..2)")
+      expect(result.error).to include("TypeError")
+      expect(result.error).to include("Range")
+    end
+
+    it "round-trips large nested payloads" do
+      result = enclave_with_tools.eval(<<~RUBY)
+        rows = rows(10_000)
+        [rows.length, rows.last["name"], rows.first["tags"], count_rows(rows)]
+      RUBY
+      expect(result.value).to eq('[10000, "row 9999", ["a", "b"], 49995000]')
+    end
+
     it "passes hash args from mruby to CRuby" do
       result = enclave_with_tools.eval('echo_all({"a" => 1}, [2, 3], nil)')
       expect(result.value).to eq('[{"a" => 1}, [2, 3], nil]')
@@ -685,6 +806,147 @@ RSpec.describe Enclave do
       expect(result.value).to eq("2")
       e.close
     end
+
+    it "reports the mruby heap in ObjectSpace.memsize_of" do
+      require "objspace"
+      e = described_class.new
+      booted = ObjectSpace.memsize_of(e)
+      e.eval('big = "x" * 5_000_000; nil')
+      expect(ObjectSpace.memsize_of(e)).to be > booted + 4_000_000
+      e.eval("big = nil")
+      e.reset!
+      expect(ObjectSpace.memsize_of(e)).to be < booted + 1_000_000
+      e.close
+    end
+  end
+
+  describe "allocator" do
+    it "defaults to :system" do
+      e = described_class.new
+      expect(e.allocator).to eq(:system)
+      e.close
+    end
+
+    it "rejects unknown allocators" do
+      expect { described_class.new(allocator: :bogus) }.to raise_error(ArgumentError, /unknown allocator/)
+    end
+
+    %i[system slab].each do |allocator|
+      context allocator.inspect do
+        it "runs code and tools" do
+          e = described_class.new(allocator: allocator, tools: TestTools)
+          expect(e.eval("double(3) + [1, 2, 3].sum").value).to eq("12")
+          e.close
+        end
+
+        it "grows blocks across size classes" do
+          e = described_class.new(allocator: allocator)
+          expect(e.eval('s = ""; 20_000.times { s << "abc" }; s.size').value).to eq("60000")
+          e.close
+        end
+
+        it "starts clean after reset! with a large heap" do
+          e = described_class.new(allocator: allocator)
+          e.eval("data = Array.new(50_000) { |i| { id: i, name: \"row \#{i}\" } }; nil")
+          e.reset!
+          expect(e.eval("defined?(data)").value).to eq("nil")
+          expect(e.eval("Array.new(1000) { |i| i.to_s }.size").value).to eq("1000")
+          e.close
+        end
+
+        it "enforces memory_limit and survives reset!" do
+          e = described_class.new(allocator: allocator, memory_limit: 1_000_000)
+          expect { e.eval('"x" * 10_000_000') }.to raise_error(Enclave::MemoryLimitError)
+          e.reset!
+          expect(e.eval("a = (1..1000).map(&:to_s); a.size").value).to eq("1000")
+          e.close
+        end
+      end
+    end
+  end
+
+  describe "gems" do
+    it "defaults to :lazy" do
+      e = described_class.new
+      expect(e.gems).to eq(:lazy)
+      e.close
+    end
+
+    it "loads a gem the first time its constant is used" do
+      e = described_class.new
+      expect(e.eval("Math.sqrt(16)").value).to eq("4.0")
+      expect(e.eval("Object.const_defined?(:Math)").value).to eq("true")
+      e.close
+    end
+
+    it "loads a gem the first time one of its methods is called" do
+      e = described_class.new
+      expect(e.eval("srand(1); rand(10).between?(0, 9)").value).to eq("true")
+      expect(e.eval("[1, 2, 3].shuffle.sort").value).to eq("[1, 2, 3]")
+      e.close
+    end
+
+    it "loads everything up front with :eager" do
+      e = described_class.new(gems: :eager)
+      expect(e.eval("Object.const_defined?(:Math)").value).to eq("true")
+      e.close
+    end
+
+    it "leaves out gems not in the list" do
+      e = described_class.new(gems: [:math])
+      expect(e.eval("Math::PI.floor").value).to eq("3")
+      result = e.eval("Random.new")
+      expect(result.error?).to be true
+      expect(result.error).to match(/NameError.*Random/)
+      e.close
+    end
+
+    it "lists the optional gems compiled in" do
+      expect(described_class.optional_gems).to include(:math)
+    end
+
+    it "rejects unknown gems" do
+      expect { described_class.new(gems: [:bogus]) }.to raise_error(ArgumentError, /unknown gem/)
+    end
+  end
+
+  describe "profile" do
+    it "defaults to :standard" do
+      e = described_class.new
+      expect(e.profile).to eq(:standard)
+      expect(described_class.profiles).to include(:standard)
+      e.close
+    end
+
+    it "rejects unknown profiles" do
+      expect { described_class.new(profile: :bogus) }.to raise_error(ArgumentError, /unknown profile/)
+    end
+
+    context ":lean" do
+      before { skip "lean profile not built" unless described_class.profiles.include?(:lean) }
+
+      it "runs code, tools and sessions" do
+        e = described_class.new(profile: :lean, tools: TestTools)
+        e.eval("class Counter; def initialize; @n = 0; end; def bump; @n += 1; end; end")
+        e.eval("c = Counter.new; 3.times { c.bump }")
+        expect(e.eval("c.bump + double(2) + 2.5").value).to eq("10.5")
+
+        copy = described_class.load_session(e.dump_session)
+        expect(copy.eval("c.bump").value).to eq("5")
+        copy.close
+        e.close
+      end
+
+      it "only runs scripts prepared by the same profile" do
+        lean = described_class.new(profile: :lean)
+        standard = described_class.new
+        script = lean.prepare("x * 2", params: [:x])
+        expect(lean.run(script, x: 21).value).to eq("42")
+        expect { standard.run(script, x: 21) }.to raise_error(ArgumentError, /:lean/)
+        lean.close
+        standard.close
+      end
+    end
   end
 
   describe "error classes" do
@@ -865,4 +1127,764 @@ RSpec.describe Enclave do
       end
     end
   end
+
+  describe "parallel" do
+    class ParallelTools
+      def initialize(delay)
+        @delay = delay
+      end
+
+      def orders
+        sleep @delay
+        [1, 2]
+      end
+
+      def tickets
+        sleep @delay
+        { "open" => 3 }
+      end
+
+      def invoices
+        sleep @delay
+        "none"
+      end
+
+      def fail_slowly
+        sleep @delay
+        raise "lookup failed"
+      end
+    end
+
+    let(:enclave) { described_class.new(tools: ParallelTools.new(0.2), timeout: 5) }
+
+    after { enclave.close unless enclave.closed? }
+
+    it "runs the block's tool calls concurrently" do
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      result = enclave.eval("parallel { [orders(), tickets(), invoices()] }")
+      elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+      expect(result.value).to eq('[[1, 2], {"open" => 3}, "none"]')
+      expect(elapsed).to be < 0.5
+      expect(result.stats[:tool_calls]).to eq(3)
+    end
+
+    it "resolves futures with value inside the block" do
+      result = enclave.eval("parallel { o = orders(); t = tickets(); o.value.size + t.value['open'] }")
+      expect(result.value).to eq("5")
+    end
+
+    it "points at value when a future is used as its result" do
+      result = enclave.eval("parallel { orders().size }")
+      expect(result.error).to include("NoMethodError")
+      expect(result.error).to include("call .value on it")
+    end
+
+    it "keeps the future class out of reach" do
+      expect(enclave.eval("defined?(Future)").value).to eq("nil")
+      expect(enclave.eval("parallel { f = orders(); f.class.new }").error).to include("NoMethodError")
+      expect(enclave.eval("parallel { f = orders(); f.class.class_eval { def size; 2; end } }").error)
+        .to include("FrozenError")
+    end
+
+    it "raises a tool's error after joining" do
+      result = enclave.eval("parallel { [orders(), fail_slowly()] }")
+      expect(result.error).to include("lookup failed")
+    end
+
+    it "calls tools directly outside the block" do
+      expect(enclave.eval("orders().size").value).to eq("2")
+    end
+
+    it "enforces the timeout while waiting" do
+      slow = described_class.new(tools: ParallelTools.new(3), timeout: 0.3)
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      expect { slow.eval("parallel { [orders(), tickets()] }") }.to raise_error(Enclave::TimeoutError)
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 2
+      slow.close
+    end
+  end
+
+  describe "batching" do
+    class BatchedOrderTools
+      attr_reader :single_calls, :batch_calls
+
+      def initialize
+        @single_calls = 0
+        @batch_calls = []
+      end
+
+      def find_order(id)
+        @single_calls += 1
+        { "id" => id }
+      end
+
+      def find_orders(ids)
+        @batch_calls << ids
+        ids.map { |id| { "id" => id } }
+      end
+
+      def find_none(ids)
+        []
+      end
+    end
+
+    let(:tools) { BatchedOrderTools.new }
+    let(:enclave) do
+      described_class.new(timeout: 5).tap { |e| e.expose(tools, batch: { find_order: :find_orders }) }
+    end
+
+    after { enclave.close unless enclave.closed? }
+
+    it "coalesces calls inside parallel into one batch call" do
+      result = enclave.eval("parallel { [1, 2, 3].map { |id| find_order(id) } }")
+      expect(result.value).to eq('[{"id" => 1}, {"id" => 2}, {"id" => 3}]')
+      expect(tools.batch_calls).to eq([[1, 2, 3]])
+      expect(tools.single_calls).to eq(0)
+    end
+
+    it "coalesces a plain map into one batch call" do
+      result = enclave.eval("[1, 2, 3].map { |id| find_order(id) }")
+      expect(result.value).to eq('[{"id" => 1}, {"id" => 2}, {"id" => 3}]')
+      expect(tools.batch_calls).to eq([[1, 2, 3]])
+      expect(tools.single_calls).to eq(0)
+    end
+
+    it "calls the tool itself when the block uses its result" do
+      expect(enclave.eval("[1, 2].map { |id| find_order(id)['id'] * 10 }").value).to eq("[10, 20]")
+      expect(tools.single_calls).to eq(2)
+      expect(tools.batch_calls).to be_empty
+    end
+
+    it "calls the tool itself outside parallel and map" do
+      expect(enclave.eval("find_order(7)['id']").value).to eq("7")
+      expect(tools.single_calls).to eq(1)
+      expect(tools.batch_calls).to be_empty
+    end
+
+    it "keeps break working in map blocks" do
+      expect(enclave.eval("[1, 2, 3].map { |id| break id * 5 if id == 2; find_order(id) }").value).to eq("10")
+    end
+
+    it "starts a new batch after a value is waited on" do
+      enclave.eval("parallel { a = find_order(1); a.value; [a, find_order(2), find_order(3)] }")
+      expect(tools.batch_calls).to eq([[1], [2, 3]])
+    end
+
+    it "reports a batch result of the wrong size" do
+      e = described_class.new(timeout: 5)
+      e.expose(tools, batch: { find_order: :find_none })
+      expect(e.eval("parallel { [find_order(1), find_order(2)] }").error).to include("must return an Array of 2 results")
+      e.close
+    end
+
+    it "rejects unknown tools and batch methods" do
+      e = described_class.new
+      expect { e.expose(tools, batch: { lookup: :find_orders }) }.to raise_error(ArgumentError, /unknown tool/)
+      expect { e.expose(tools, batch: { find_order: :missing }) }.to raise_error(ArgumentError, /not one of the tool methods/)
+      e.close
+    end
+  end
+
+  describe "tool signatures" do
+    class OrderLookupTools
+      attr_reader :calls
+
+      def initialize
+        @calls = 0
+      end
+
+      def find_order(id)
+        @calls += 1
+        { "id" => id }
+      end
+
+      def tag(name, urgent)
+        @calls += 1
+        "#{name}:#{urgent}"
+      end
+    end
+
+    let(:tools) { OrderLookupTools.new }
+    let(:enclave) do
+      described_class.new.expose(tools, signatures: { find_order: [:integer], tag: [:string, :boolean] })
+    end
+
+    after { enclave.close unless enclave.closed? }
+
+    it "calls tools with matching arguments" do
+      expect(enclave.eval("find_order(42)").value).to eq('{"id" => 42}')
+      expect(enclave.eval("tag(:vip, true)").value).to eq('"vip:true"')
+    end
+
+    it "rejects a wrong type in the sandbox without calling the tool" do
+      result = enclave.eval('find_order("42")')
+      expect(result.error).to include("TypeError")
+      expect(result.error).to include("find_order: argument 1 must be Integer, not String")
+      expect(tools.calls).to eq(0)
+      expect(result.stats[:tool_calls]).to eq(0)
+    end
+
+    it "rejects a wrong argument count in the sandbox" do
+      result = enclave.eval("find_order")
+      expect(result.error).to include("wrong number of arguments (given 0, expected 1)")
+      expect(tools.calls).to eq(0)
+    end
+
+    it "can be rescued inside the sandbox" do
+      result = enclave.eval("begin; tag(1, 2); rescue TypeError => e; e.message; end")
+      expect(result.value).to include("argument 1 must be String")
+    end
+
+    it "validates signatures on expose" do
+      expect { described_class.new.expose(tools, signatures: { nope: [] }) }
+        .to raise_error(ArgumentError, /unknown tool: nope/)
+      expect { described_class.new.expose(tools, signatures: { find_order: [:date] }) }
+        .to raise_error(ArgumentError, /unknown signature type/)
+      expect { described_class.new.expose(tools, signatures: { find_order: [:integer, :integer] }) }
+        .to raise_error(ArgumentError, /has 2 types, but the method takes 1/)
+    end
+  end
+
+  describe Enclave::Toolset do
+    class CatalogTools
+      150.times do |i|
+        define_method(:"item_#{i}") { i }
+      end
+
+      def lookup(sku, qty = 1)
+        "#{sku}x#{qty}"
+      end
+    end
+
+    it "is built once per tool class" do
+      toolset = Enclave::Toolset.for(CatalogTools.new)
+      expect(Enclave::Toolset.for(CatalogTools.new)).to equal(toolset)
+      expect(toolset.size).to eq(151)
+      expect(toolset).to include(:lookup)
+    end
+
+    it "keeps separate toolsets per signature" do
+      plain = Enclave::Toolset.for(CatalogTools.new)
+      typed = Enclave::Toolset.for(CatalogTools.new, { item_0: [] })
+      expect(typed).not_to equal(plain)
+      expect(Enclave::Toolset.for(CatalogTools.new, { item_0: [] })).to equal(typed)
+    end
+
+    it "gives instances with singleton methods their own toolset" do
+      tools = CatalogTools.new
+      tools.define_singleton_method(:extra) { "extra" }
+      expect(Enclave::Toolset.for(tools)).to include(:extra)
+      expect(Enclave::Toolset.for(CatalogTools.new)).not_to include(:extra)
+    end
+
+    it "exposes more than 64 tool functions" do
+      enclave = described_class.new(tools: CatalogTools.new)
+      expect(enclave.eval("item_0 + item_149").value).to eq("149")
+      expect(enclave.eval('lookup("a")').value).to eq('"ax1"')
+      enclave.close
+    end
+
+    it "binds each enclave to its own receiver" do
+      a = described_class.new(tools: AccountTools.new(FakeUser.new(name: "A", email: "a@x", plan: "basic")))
+      b = described_class.new(tools: AccountTools.new(FakeUser.new(name: "B", email: "b@x", plan: "basic")))
+      expect(a.eval("upcase_name").value).to eq('"A"')
+      expect(b.eval("upcase_name").value).to eq('"B"')
+      a.close
+      b.close
+    end
+  end
+
+  describe "#prepare" do
+    it "runs a compiled script with bound params" do
+      script = enclave.prepare("a + b", params: [:a, :b])
+      expect(enclave.run(script, a: 2, b: 3).value).to eq("5")
+      expect(enclave.run(script, a: 10, b: 20).value).to eq("30")
+    end
+
+    it "passes values as data, not source" do
+      script = enclave.prepare("name.length", params: [:name])
+      result = enclave.run(script, name: '"; raise "injected"; "')
+      expect(result.error?).to be false
+      expect(result.value).to eq("22")
+    end
+
+    it "converts arrays and hashes" do
+      script = enclave.prepare('rows.sum { |r| r["total"] }', params: [:rows])
+      result = enclave.run(script, rows: [{ "total" => 5 }, { "total" => 7 }])
+      expect(result.value).to eq("12")
+    end
+
+    it "runs on other enclaves" do
+      script = enclave.prepare("x * 2", params: [:x])
+      Enclave.open do |other|
+        expect(other.run(script, x: 21).value).to eq("42")
+      end
+    end
+
+    it "survives reset!" do
+      script = enclave.prepare("x + 1", params: [:x])
+      enclave.run(script, x: 1)
+      enclave.reset!
+      expect(enclave.run(script, x: 1).value).to eq("2")
+    end
+
+    it "does not see or leak top-level locals" do
+      enclave.eval("secret = 1")
+      script = enclave.prepare("leaked = 2; defined?(secret)")
+      expect(enclave.run(script).value).to eq("nil")
+      expect(enclave.eval("defined?(leaked)").value).to eq("nil")
+    end
+
+    it "stores the result in _" do
+      enclave.run(enclave.prepare("40 + 2"))
+      expect(enclave.eval("_").value).to eq("42")
+    end
+
+    it "supports return" do
+      script = enclave.prepare("return :early if x; :late", params: [:x])
+      expect(enclave.run(script, x: true).value).to eq(":early")
+    end
+
+    it "captures output and runtime errors" do
+      script = enclave.prepare('puts "hi"; raise "boom"')
+      result = enclave.run(script)
+      expect(result.output).to eq("hi\n")
+      expect(result.error).to include("boom")
+    end
+
+    it "raises on syntax errors at prepare time" do
+      expect { enclave.prepare("1 +") }.to raise_error(Enclave::Error, /SyntaxError/)
+    end
+
+    it "rejects code that escapes the script body" do
+      expect { enclave.prepare("1\nend; ->() do 2") }.to raise_error(Enclave::Error)
+    end
+
+    it "validates params" do
+      script = enclave.prepare("x", params: [:x])
+      expect { enclave.run(script) }.to raise_error(ArgumentError, /missing params: x/)
+      expect { enclave.run(script, x: 1, y: 2) }.to raise_error(ArgumentError, /unknown params: y/)
+      expect { enclave.prepare("1", params: ["x); evil(("]) }.to raise_error(ArgumentError)
+    end
+
+    it "rejects unsupported param values" do
+      script = enclave.prepare("x", params: [:x])
+      expect { enclave.run(script, x: Object.new) }.to raise_error(TypeError)
+    end
+
+    it "enforces timeout" do
+      sandbox = Enclave.new(timeout: 0.1)
+      script = sandbox.prepare("loop {}")
+      expect { sandbox.run(script) }.to raise_error(Enclave::TimeoutError)
+    ensure
+      sandbox&.close
+    end
+
+    it "can call tools" do
+      tools = Module.new { def double(n) = n * 2 }
+      sandbox = Enclave.new(tools: tools)
+      script = sandbox.prepare("double(n)", params: [:n])
+      expect(sandbox.run(script, n: 4).value).to eq("8")
+    ensure
+      sandbox&.close
+    end
+  end
+
+  describe "bytecode cache" do
+    before { Enclave.clear_bytecode_cache }
+
+    it "reuses bytecode for repeated snippets across enclaves" do
+      enclave.eval("[1, 2, 3].sum")
+      Enclave.open { |other| expect(other.eval("[1, 2, 3].sum").value).to eq("6") }
+      stats = Enclave.bytecode_cache_stats
+      expect(stats[:misses]).to eq(1)
+      expect(stats[:hits]).to eq(1)
+      expect(stats[:entries]).to eq(1)
+    end
+
+    it "keys on the known local variables" do
+      enclave.eval("x = 10")
+      expect(enclave.eval("x").value).to eq("10")
+      Enclave.open { |other| expect(other.eval("x").error).to match(/NameError|NoMethodError/) }
+    end
+
+    it "keeps locals defined by cached code" do
+      enclave.eval("y = 5")
+      Enclave.open do |other|
+        other.eval("y = 5")
+        expect(other.eval("y + 1").value).to eq("6")
+      end
+      expect(Enclave.bytecode_cache_stats[:hits]).to eq(1)
+    end
+
+    it "does not cache syntax errors" do
+      2.times { enclave.eval("1 +") }
+      expect(Enclave.bytecode_cache_stats[:entries]).to eq(0)
+    end
+
+    it "stays within the limit" do
+      original = Enclave.bytecode_cache_limit
+      Enclave.bytecode_cache_limit = 2_000
+      50.times { |i| enclave.eval("#{i} + 1") }
+      stats = Enclave.bytecode_cache_stats
+      expect(stats[:bytes]).to be <= 2_000
+      expect(stats[:evictions]).to be > 0
+    ensure
+      Enclave.bytecode_cache_limit = original
+    end
+
+    it "can be disabled" do
+      original = Enclave.bytecode_cache_limit
+      Enclave.bytecode_cache_limit = 0
+      2.times { enclave.eval("1 + 1") }
+      expect(Enclave.bytecode_cache_stats).to include(hits: 0, entries: 0)
+    ensure
+      Enclave.bytecode_cache_limit = original
+    end
+  end
+
+  describe "checkpoints" do
+    let(:enclave) { described_class.new(allocator: :slab, timeout: 1) }
+    after { enclave.close }
+
+    it "rolls back locals, ivars and methods" do
+      enclave.eval("x = 1; @y = 2; def z; 3; end")
+      checkpoint = enclave.checkpoint
+      enclave.eval("x = 10; @y = 20; def z; 30; end; w = 4; class Foo; end")
+      enclave.rollback(checkpoint)
+      expect(enclave.eval("[x, @y, z, defined?(w), defined?(Foo)]").value).to eq("[1, 2, 3, nil, nil]")
+    end
+
+    it "stays valid after a rollback, but newer checkpoints do not" do
+      older = enclave.checkpoint
+      enclave.eval("a = 1")
+      newer = enclave.checkpoint
+      enclave.rollback(older)
+      expect { enclave.rollback(newer) }.to raise_error(ArgumentError, /no longer valid/)
+      enclave.eval("a = 2")
+      enclave.rollback(older)
+      expect(enclave.eval("defined?(a)").value).to eq("nil")
+    end
+
+    it "is invalidated by reset!" do
+      checkpoint = enclave.checkpoint
+      enclave.reset!
+      expect { enclave.rollback(checkpoint) }.to raise_error(ArgumentError, /no longer valid/)
+    end
+
+    it "is invalidated by detach_tools" do
+      checkpoint = enclave.checkpoint
+      enclave.detach_tools
+      expect { enclave.rollback(checkpoint) }.to raise_error(ArgumentError, /no longer valid/)
+    end
+
+    it "rolls back through a discarded checkpoint, large blocks included" do
+      enclave.eval("big = 'a' * 200_000; list = [1]")
+      older = enclave.checkpoint
+      enclave.eval("big << 'b'; list << 2")
+      middle = enclave.checkpoint
+      enclave.eval("big = nil; list << 3; GC.start")
+      enclave.discard(middle)
+      enclave.rollback(older)
+      expect(enclave.eval("[big.size, list]").value).to eq("[200000, [1]]")
+    end
+
+    it "needs the slab allocator" do
+      e = described_class.new(allocator: :system)
+      expect { e.checkpoint }.to raise_error(Enclave::Error, /slab/)
+      e.close
+    end
+
+    describe "eval(atomic: true)" do
+      it "undoes a snippet that fails halfway" do
+        enclave.eval("items = [1, 2]")
+        result = enclave.eval("items << 3; @done = true; raise 'boom'", atomic: true)
+        expect(result.error).to include("boom")
+        expect(enclave.eval("[items, @done]").value).to eq("[[1, 2], nil]")
+      end
+
+      it "keeps the changes of a snippet that succeeds" do
+        enclave.eval("items = [1, 2]; items << 3", atomic: true)
+        expect(enclave.eval("items").value).to eq("[1, 2, 3]")
+      end
+
+      it "undoes a snippet that hits a limit" do
+        enclave.eval("n = 0")
+        expect { enclave.eval("n = 1; loop {}", atomic: true) }.to raise_error(Enclave::TimeoutError)
+        expect(enclave.eval("n").value).to eq("0")
+      end
+    end
+  end
+
+  describe "sessions" do
+    after { enclave.close }
+
+    it "restores locals, ivars, methods, classes and _ in a new enclave" do
+      enclave.eval(<<~RUBY)
+        class Account
+          attr_reader :balance
+          def initialize(balance); @balance = balance; end
+          def deposit(n); @balance += n; end
+        end
+        RATE = 0.05
+        def interest(account); account.balance * RATE; end
+        acct = Account.new(100)
+        @owner = "ada"
+        acct.deposit(20)
+      RUBY
+      restored = described_class.load_session(enclave.dump_session)
+      expect(restored.eval("[acct.balance, @owner, interest(acct), _]").value).to eq('[120, "ada", 6.0, 120]')
+      expect(restored.eval("acct.deposit(5); acct.balance").value).to eq("125")
+      restored.close
+    end
+
+    it "keeps shared references, cycles and frozen values" do
+      enclave.eval('a = [1]; a << a; h = { list: a, again: a }; s = "x".freeze')
+      restored = described_class.load_session(enclave.dump_session)
+      expect(restored.eval("[h[:list].equal?(h[:again]), a[1].equal?(a), s.frozen?]").value)
+        .to eq("[true, true, true]")
+      restored.close
+    end
+
+    it "leaves out what every enclave already has" do
+      expect(enclave.dump_session.bytesize).to be < 64
+    end
+
+    it "binds the tools given to load_session" do
+      enclave.eval("x = 2")
+      restored = described_class.load_session(enclave.dump_session, tools: TestTools)
+      expect(restored.eval("double(x)").value).to eq("4")
+      restored.close
+    end
+
+    it "raises Enclave::Error for values it can't dump" do
+      enclave.eval("f = -> { 1 }")
+      expect { enclave.dump_session }.to raise_error(Enclave::Error, /local variable f \(Proc\)/)
+    end
+
+    it "rejects corrupted blobs" do
+      enclave.eval("x = 1")
+      blob = enclave.dump_session
+      blob.setbyte(blob.bytesize - 1, blob.getbyte(blob.bytesize - 1) ^ 1)
+      expect { described_class.load_session(blob) }.to raise_error(Enclave::Error, /corrupt/)
+      expect { described_class.load_session("nope") }.to raise_error(Enclave::Error, /not an enclave session/)
+    end
+  end
+
+  describe ".preload!" do
+    module PreloadTools
+      def base
+        40
+      end
+    end
+
+    def in_fork
+      reader, writer = IO.pipe
+      pid = fork do
+        reader.close
+        writer.write(Marshal.dump(yield))
+        writer.close
+        exit!(0)
+      end
+      writer.close
+      result = Marshal.load(reader.read)
+      Process.wait(pid)
+      result
+    end
+
+    before do
+      skip "fork not available" unless Process.respond_to?(:fork)
+      Enclave.preload!(tools_class: PreloadTools, prelude: "def answer; base + 2; end")
+    end
+
+    it "hands the prototype to the first matching enclave in a forked child" do
+      values = in_fork do
+        first = Enclave.new(tools: PreloadTools, timeout: 0.5)
+        second = Enclave.new(tools: PreloadTools)
+        timed_out = begin
+          first.eval("loop {}")
+          false
+        rescue Enclave::TimeoutError
+          true
+        end
+        [first.eval("answer").value, second.eval("defined?(answer)").value, timed_out]
+      end
+      expect(values).to eq(["42", "nil", true])
+    end
+
+    it "keeps the prototype in the preloading process" do
+      e = described_class.new(tools: PreloadTools)
+      expect(e.eval("defined?(answer)").value).to eq("nil")
+      e.close
+    end
+
+    it "raises Enclave::Error when the prelude fails" do
+      expect { Enclave.preload!(prelude: "raise 'boom'") }.to raise_error(Enclave::Error, /boom/)
+    end
+
+    context "with a tool class" do
+      class PreloadToolClass
+        def initialize(base)
+          @base = base
+        end
+
+        def base
+          @base
+        end
+
+        protected
+
+        def secret
+          "hidden"
+        end
+      end
+
+      before { Enclave.preload!(tools_class: PreloadToolClass, prelude: "def answer; base + 2; end") }
+
+      it "hands the prototype to an enclave given an instance" do
+        values = in_fork do
+          e = Enclave.new(tools: PreloadToolClass.new(40))
+          [e.eval("answer").value, e.eval("defined?(secret)").value]
+        end
+        expect(values).to eq(["42", "nil"])
+      end
+
+      it "hands the prototype to a pool built for the class" do
+        value = in_fork do
+          pool = Enclave::Pool.new(size: 1, prewarm: false, tools_class: PreloadToolClass)
+          value = pool.with(tools: PreloadToolClass.new(1)) { |e| e.eval("answer").value }
+          pool.shutdown
+          value
+        end
+        expect(value).to eq("3")
+      end
+    end
+  end
+
+  describe "concurrency" do
+    module SlowTools
+      def nap(seconds)
+        sleep seconds
+        seconds
+      end
+    end
+
+    it "lets other Ruby threads run while mruby executes" do
+      e = described_class.new(timeout: 0.5)
+      ticks = 0
+      ticker = Thread.new { loop { ticks += 1; sleep 0.01 } }
+      expect { e.eval("loop {}") }.to raise_error(Enclave::TimeoutError)
+      ticker.kill
+      expect(ticks).to be > 5
+      e.close
+    end
+
+    it "runs separate enclaves on separate threads" do
+      results = 4.times.map do |i|
+        Thread.new do
+          described_class.open { |sb| sb.eval("(1..100_000).reduce(:+) + #{i}").value }
+        end
+      end.map(&:value)
+      expect(results).to eq(4.times.map { |i| (5_000_050_000 + i).to_s })
+    end
+
+    it "stops a running eval on Thread#raise" do
+      require "timeout"
+      e = described_class.new
+      expect { Timeout.timeout(0.2) { e.eval("loop {}") } }.to raise_error(Timeout::Error)
+      expect(e.eval("1 + 1").value).to eq("2")
+      e.close
+    end
+
+    it "re-raises host interrupts that arrive during a tool call" do
+      require "timeout"
+      e = described_class.new(tools: SlowTools)
+      expect { Timeout.timeout(0.2) { e.eval("nap(5); loop {}") } }.to raise_error(Timeout::Error)
+      expect(e.eval("1 + 1").value).to eq("2")
+      e.close
+    end
+
+    it "rejects use from another thread while evaluating" do
+      e = described_class.new(timeout: 1)
+      runner = Thread.new { e.eval("loop {}") rescue nil }
+      sleep 0.1
+      expect { e.eval("1") }.to raise_error(RuntimeError, /busy/)
+      expect { e.close }.to raise_error(RuntimeError, /busy/)
+      runner.join
+      e.close
+    end
+  end
+
+  describe Enclave::Pool do
+    let(:pool) { Enclave::Pool.new(size: 2, checkout_timeout: 0.2) }
+
+    after { pool.shutdown }
+
+    it "checks out a usable enclave" do
+      result = pool.with { |sb| sb.eval("1 + 1") }
+      expect(result.value).to eq("2")
+    end
+
+    it "binds tools per checkout" do
+      result = pool.with(tools: AccountTools.new(FakeUser.new(name: "Ann", email: "a@x", plan: "basic"))) do |sb|
+        sb.eval("user_info()")
+      end
+      expect(result.value).to include('"name" => "Ann"')
+    end
+
+    it "detaches tools on checkin" do
+      pool.with(tools: TestTools) { |sb| sb.eval("double(1)") }
+      2.times.map { pool.checkout }.each do |sb|
+        expect(sb.eval("double(1)").error?).to be true
+        pool.checkin(sb)
+      end
+    end
+
+    it "does not leak state between checkouts" do
+      pool.with { |sb| sb.eval("@secret = 'do_not_leak'; def leaked; 1; end") }
+      2.times.map { pool.checkout }.each do |sb|
+        expect(sb.eval("@secret").value).to eq("nil")
+        expect(sb.eval("leaked").error?).to be true
+        pool.checkin(sb)
+      end
+    end
+
+    it "raises Pool::TimeoutError when every enclave is checked out" do
+      held = 2.times.map { pool.checkout }
+      expect { pool.checkout }.to raise_error(Enclave::Pool::TimeoutError)
+      held.each { |sb| pool.checkin(sb) }
+    end
+
+    it "hands out an enclave once another is checked in" do
+      held = 2.times.map { pool.checkout }
+      Thread.new { sleep 0.05; pool.checkin(held.pop) }
+      sb = pool.checkout(timeout: 2)
+      expect(sb.eval("1 + 1").value).to eq("2")
+      pool.checkin(sb)
+      pool.checkin(held.pop)
+    end
+
+    it "replaces enclaves that were closed while checked out" do
+      pool.with(&:close)
+      2.times.map { pool.checkout }.each do |sb|
+        expect(sb.closed?).to be false
+        pool.checkin(sb)
+      end
+    end
+
+    it "passes limits through to pooled enclaves" do
+      limited = Enclave::Pool.new(size: 1, timeout: 0.5)
+      limited.with do |sb|
+        expect { sb.eval("loop {}") }.to raise_error(Enclave::TimeoutError)
+      end
+      limited.shutdown
+    end
+
+    it "works without prewarming" do
+      cold = Enclave::Pool.new(size: 1, prewarm: false)
+      cold.with { |sb| sb.eval("x = 1") }
+      expect(cold.with { |sb| sb.eval("defined?(x)") }.value).to eq("nil")
+      cold.shutdown
+    end
+  end
 end